@@ -3,17 +3,140 @@
  * block is a copy of the first for redunancy. Inodes are kept in the next portion of the
  * filesystem. Then the freeblocks bitvectors are stored after the inodes. Finally the root pointer
  * to the first directory that links to other directories, files, and data.
+ *
+ * Operations may come from any number of threads. Each takes volumeLock
+ * shared, and the lock of every inode it reads (shared) or changes
+ * (exclusive); every inode has its own, kept in its inode cache entry, and
+ * an operation that needs two takes them in inode order. Whatever changes
+ * the layout of the volume (format, mount, snapshots) takes volumeLock
+ * exclusive, and so does a journal commit, so commits only happen between
+ * operations and a transaction never holds part of one. Blocks freed since
+ * the last commit stay out of reach of the allocator until the next. The
+ * bit vector, heldBlocks, freedBlocks and the fingerprint table are covered
+ * by allocMutex, and so are the snapshot block maps, which every write of a
+ * metadata block consults first (preserveShared); allocMutex is therefore
+ * taken inside inodeTableMutex and inodeCacheMutex, never around them. The
+ * superblock counters are updated with atomics, and the inode table blocks,
+ * which hold many inodes each, are rewritten under inodeTableMutex. Inodes
+ * are read and written through an in-memory cache under inodeCacheMutex,
+ * which is let go of while a missed inode is read from the table; dirty
+ * ones reach the table in batches per block when evicted or flushed,
+ * before every commit. The same mutex covers the inode bitmap free inodes
+ * are found in. An open file descriptor is used by one thread at a time.
  */
 
+#define _GNU_SOURCE		//pthread_rwlockattr_setkind_np
 #include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include "FileSystem.h"
-
-extern int errno;
+#include "fsCache.h"
+#include "fsChecksum.h"
+#include "fsCompress.h"
+#include "fsDedup.h"
+#include "fsJournal.h"
 
 SuperBlock_p sb = NULL;
 uint8_t * bitVector = NULL;
+uint8_t * heldBlocks = NULL;	//Data blocks some snapshot holds, NULL while there are none
+static uint8_t * freedBlocks = NULL;	//Data blocks freed since the last journal commit, NULL while there are none
+static uint64_t bitVectorBuffer;	//Blocks allocated for bitVector, heldBlocks and freedBlocks, the layout may change under them
+static uint32_t * chunkFree = NULL;	//Available data blocks in each ALLOC_CHUNK_BLOCKS of the bit vector
+static bool * bitVectorDirty = NULL;	//Per bit vector block, changed since writeBitVector last wrote it
+static uint64_t * snapshotMaps[MAX_SNAPSHOTS];	//Block map of each snapshot, NULL for a free slot
+static uint64_t snapshotMapBuffer;	//Blocks allocated for each of snapshotMaps
+static uint32_t snapshotCount = 0;	//Block maps loaded, read without allocMutex before a metadata write
 WorkingDirectory_p wd = NULL;
+openFileEntry * openFileList = NULL;
+
+static pthread_rwlock_t volumeLock;
+static pthread_mutex_t allocMutex;			//Recursive, the allocator calls itself back
+static pthread_mutex_t inodeTableMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t openFileMutex = PTHREAD_MUTEX_INITIALIZER;	//Claiming and scanning openFileList
+static pthread_mutex_t inodeGroupMutex = PTHREAD_MUTEX_INITIALIZER;	//Initializing a group of the inode table
+static pthread_mutex_t inodeCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inodeCacheCond = PTHREAD_COND_INITIALIZER;	//An entry stopped being held, locked or loaded
+static pthread_once_t lockOnce = PTHREAD_ONCE_INIT;
+
+typedef struct InodeCacheStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writebacks;					//Dirty inodes written to the table
+	uint64_t tableWrites;					//Table writes they took, inodes sharing blocks go together
+} InodeCacheStats;
+
+/* Inode cache, with a hash chain per bucket and an LRU list through every entry */
+typedef struct InodeCacheEntry {
+	uint64_t inodeID;
+	Inode inode;
+	uint32_t refs;							//Holds taken by holdInode, a held entry is never evicted
+	uint32_t lockers;						//Threads holding or waiting for lock, which pin the entry too
+	pthread_rwlock_t lock;					//The inode's lock, see lockInode
+	bool dirty;								//Changed since it was last written to the table
+	bool loading;							//Being read from the table, without inodeCacheMutex
+	struct InodeCacheEntry* hashNext;
+	struct InodeCacheEntry* lruPrev;		//Towards the most recently used
+	struct InodeCacheEntry* lruNext;
+} InodeCacheEntry, *InodeCacheEntry_p;
+
+static InodeCacheEntry_p inodeCache = NULL;		//INODE_CACHE_ENTRIES entries, NULL until a volume is mounted
+static InodeCacheEntry_p* inodeCacheMap = NULL;	//INODE_CACHE_BUCKETS hash chains
+static InodeCacheEntry_p lruHead = NULL;
+static InodeCacheEntry_p lruTail = NULL;
+static uint64_t inodeCacheUsed = 0;				//Entries handed out, the rest are unused
+static uint64_t inodeCacheDirty = 0;			//Entries changed since they were last written to the table, read without inodeCacheMutex
+static InodeCacheStats inodeCacheStats;
+
+/* Inode allocation bitmap, a bit per inode set while it is used, under inodeCacheMutex */
+static uint64_t* inodeMap = NULL;
+static uint64_t* inodeMapFull = NULL;			//A bit per inodeMap word, set while every inode in it is used
+static uint64_t inodeMapWords = 0;
+
+static pthread_t inodeInitThread;
+static bool inodeInitRunning = false;
+static bool inodeInitStopping = false;
+
+static void initLocks() {
+	pthread_rwlockattr_t rwAttr;
+	pthread_rwlockattr_init(&rwAttr);
+	/* Commits wait for the volume to themselves, a steady stream of operations must not starve them */
+	pthread_rwlockattr_setkind_np(&rwAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&volumeLock, &rwAttr);
+	pthread_rwlockattr_destroy(&rwAttr);
+
+	pthread_mutexattr_t mutexAttr;
+	pthread_mutexattr_init(&mutexAttr);
+	pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&allocMutex, &mutexAttr);
+	pthread_mutexattr_destroy(&mutexAttr);
+}
+
+/** Takes volumeLock, exclusive for operations that change the layout or commit */
+static void lockVolume(bool exclusive) {
+	pthread_once(&lockOnce, initLocks);
+	if (exclusive)
+		pthread_rwlock_wrlock(&volumeLock);
+	else
+		pthread_rwlock_rdlock(&volumeLock);
+}
+
+static void unlockVolume() {
+	pthread_rwlock_unlock(&volumeLock);
+}
+
+/** Takes allocMutex, which may already be held by this thread */
+static void lockAllocator() {
+	pthread_once(&lockOnce, initLocks);
+	pthread_mutex_lock(&allocMutex);
+}
+
+static void unlockAllocator() {
+	pthread_mutex_unlock(&allocMutex);
+}
 
 
 /**
@@ -89,180 +212,2643 @@ uint64_t hashInode(char* name, uint64_t parentInode) {
 	return hash % sb->numInodes;
 }
 
+/** Writes the in memory superblock back to block 0 */
+static int writeSuperBlock() {
+	SuperBlock_p buffer = LBAallocBuffer(1);
+	memset(buffer, 0, partInfop->blocksize);
+	memcpy(buffer, sb, sizeof(SuperBlock));
+	buffer->usedInodes = __atomic_load_n(&sb->usedInodes, __ATOMIC_RELAXED);
+	buffer->freeBlocks = __atomic_load_n(&sb->freeBlocks, __ATOMIC_RELAXED);
+	buffer->usedBlocks = __atomic_load_n(&sb->usedBlocks, __ATOMIC_RELAXED);
+	uint64_t written = cacheWrite(buffer, 1, 0);
+	LBAfreeBuffer(buffer, 1);
+	return written == 1 ? 0 : -1;
+}
+
+/**
+ * Zeroes count blocks starting at lba, around the cache and the journal.
+ * Punches a hole where the host file system supports it, so nothing is
+ * written, and writes zeros otherwise: one ZERO_CHUNK_BLOCKS buffer backs
+ * ZERO_PIPELINE_SEGMENTS writes per LBAwritev, so memory stays fixed while
+ * the writes go out together.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int zeroBlocks(uint64_t count, uint64_t lba) {
+	cacheInvalidate(count, lba);
+	if (LBAdiscard(count, lba) == count)
+		return 0;
+
+	uint64_t chunk = count < ZERO_CHUNK_BLOCKS ? count : ZERO_CHUNK_BLOCKS;
+	char* zeros = LBAallocBuffer(chunk);
+	memset(zeros, 0, chunk * partInfop->blocksize);
+	lbaSegment_t segments[ZERO_PIPELINE_SEGMENTS];
+	int retVal = 0;
+	uint64_t done = 0;
+	while (done < count && retVal == 0) {
+		int numSegments = 0;
+		uint64_t blocks = 0;
+		while (numSegments < ZERO_PIPELINE_SEGMENTS && done + blocks < count) {
+			uint64_t left = count - done - blocks;
+			segments[numSegments].buffer = zeros;
+			segments[numSegments].lbaCount = left < chunk ? left : chunk;
+			segments[numSegments].lbaPosition = lba + done + blocks;
+			blocks += segments[numSegments].lbaCount;
+			numSegments++;
+		}
+		if (LBAwritev(segments, numSegments) != blocks)
+			retVal = -1;
+		done += blocks;
+	}
+	LBAfreeBuffer(zeros, chunk);
+	return retVal;
+}
+
+/** Returns the inode table blocks in each lazily initialized group, for a table of tableBlocks */
+static uint64_t inodeGroupBlocksFor(uint64_t tableBlocks) {
+	return (tableBlocks + INODE_GROUPS - 1) / INODE_GROUPS;
+}
+
+/** Returns true if the inode table block holds what was written there, false while its group still reads as zeros */
+static bool inodeBlockReady(uint64_t lba) {
+	if (sb->inodeGroupBlocks == 0 || lba < sb->inodeStart || lba >= sb->bitVectorStart)
+		return true;
+	uint64_t group = (lba - sb->inodeStart) / sb->inodeGroupBlocks;
+	return __atomic_load_n(&sb->inodeGroupsReady[group / 8], __ATOMIC_ACQUIRE) & (1 << (group % 8));
+}
+
+/**
+ * Reads count blocks from lba through the cache, with the inode table
+ * blocks of groups not initialized yet reading as zeros, as they would had
+ * format written them.
+ * Returns the number of blocks read
+ */
+static uint64_t readInodeBlocks(void* buffer, uint64_t count, uint64_t lba) {
+	uint64_t read = cacheRead(buffer, count, lba);
+	for (uint64_t i = 0; i < read; i++) {
+		if (!inodeBlockReady(lba + i))
+			memset((char*)buffer + i * partInfop->blocksize, 0, partInfop->blocksize);
+	}
+	return read;
+}
+
+/**
+ * Zeroes the inode table blocks of a group on its first use, and marks it
+ * initialized in the superblock.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int initInodeGroup(uint64_t group) {
+	int retVal = 0;
+	pthread_mutex_lock(&inodeGroupMutex);
+	uint64_t first = sb->inodeStart + group * sb->inodeGroupBlocks;
+	if (!inodeBlockReady(first)) {
+		uint64_t count = sb->bitVectorStart - first < sb->inodeGroupBlocks ? sb->bitVectorStart - first : sb->inodeGroupBlocks;
+		retVal = zeroBlocks(count, first);
+		/* A punched hole bypasses the journal, it must be durable before the marker commits */
+		if (retVal == 0 && journalEnabled())
+			retVal = LBAbarrier();
+		if (retVal == 0) {
+			__atomic_fetch_or(&sb->inodeGroupsReady[group / 8], 1 << (group % 8), __ATOMIC_RELEASE);
+			retVal = writeSuperBlock();
+		}
+	}
+	pthread_mutex_unlock(&inodeGroupMutex);
+	return retVal;
+}
+
+/**
+ * Initializes the groups of count inode table blocks from lba before they
+ * are written.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int initInodeBlocks(uint64_t count, uint64_t lba) {
+	for (uint64_t i = 0; i < count; i++) {
+		if (!inodeBlockReady(lba + i) && initInodeGroup((lba + i - sb->inodeStart) / sb->inodeGroupBlocks) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Background initialization of the inode table: zeroes the groups nobody
+ * has used yet one at a time, pausing between them so operations keep the
+ * volume.
+ */
+static void* inodeInitMain(void* arg) {
+	(void) arg;
+	uint64_t group = 0;
+	while (!__atomic_load_n(&inodeInitStopping, __ATOMIC_ACQUIRE)) {
+		lockVolume(false);
+		while (sb->inodeStart + group * sb->inodeGroupBlocks < sb->bitVectorStart &&
+				inodeBlockReady(sb->inodeStart + group * sb->inodeGroupBlocks))
+			group++;
+		bool done = sb->inodeStart + group * sb->inodeGroupBlocks >= sb->bitVectorStart ||
+			initInodeGroup(group) == -1;
+		unlockVolume();
+		if (done)
+			break;
+		usleep(INODE_INIT_PAUSE_MS * 1000);
+	}
+	return NULL;
+}
+
+/** Stops the background initialization of the inode table, if it is running */
+static int stopInodeInit() {
+	if (!inodeInitRunning)
+		return 0;
+	__atomic_store_n(&inodeInitStopping, true, __ATOMIC_RELEASE);
+	pthread_join(inodeInitThread, NULL);
+	inodeInitRunning = false;
+	return 0;
+}
+
+/** Starts initializing the groups of the inode table left in the background */
+static void startInodeInit() {
+	if (sb->inodeGroupBlocks == 0 || inodeInitRunning)
+		return;
+	__atomic_store_n(&inodeInitStopping, false, __ATOMIC_RELAXED);
+	if (pthread_create(&inodeInitThread, NULL, inodeInitMain, NULL) != 0)
+		return;
+	inodeInitRunning = true;
+	registerCloseHook(stopInodeInit);
+}
+
+/** Returns the bytes each inode takes in the table */
+static uint64_t inodeBytes() {
+	return sb->inodeBytes != 0 ? sb->inodeBytes : INODE_LEGACY_BYTES;
+}
+
+/**
+ * Finds an inode in the table: block is set to the block of the table it
+ * starts in, counted from the start of the table, and offset to where in
+ * that block. On volumes with INODE_BYTES inodes that is one division.
+ * Returns the number of blocks the inode spans, 2 only for a legacy inode
+ */
+static uint64_t locateInode(uint64_t inodeID, uint64_t* block, uint64_t* offset) {
+	uint64_t blockSize = partInfop->blocksize;
+	if (sb->inodeBytes != 0) {
+		uint64_t perBlock = blockSize / sb->inodeBytes;
+		*block = inodeID / perBlock;
+		*offset = inodeID % perBlock * sb->inodeBytes;
+		return 1;
+	}
+	uint64_t byteLocation = inodeID * INODE_LEGACY_BYTES;
+	*block = byteLocation / blockSize;
+	*offset = byteLocation % blockSize;
+	return *offset > blockSize - INODE_LEGACY_BYTES ? 2 : 1;
+}
+
+/** Copies an inode out of its place in the table, zeroing what a legacy inode has no room for */
+static void loadInode(Inode_p inode, const char* slot) {
+	uint64_t bytes = inodeBytes();
+	memcpy(inode, slot, bytes);
+	memset((char*) inode + bytes, 0, sizeof(Inode) - bytes);
+}
+
+/** Reads an inode from the inode table, around the inode cache */
+static int readInodeTable(uint64_t inodeID, Inode_p inodeBuffer) {
+	uint64_t blockLocation, offset;
+	uint64_t blocks = locateInode(inodeID, &blockLocation, &offset);
+	blockLocation += sb->inodeStart;
+
+	/* On a mapped volume copy the inode straight out of the mapping */
+	char* mapped = NULL;
+	if (inodeBlockReady(blockLocation) && inodeBlockReady(blockLocation + blocks - 1))
+		mapped = LBAborrow(blockLocation, blocks);
+	if (mapped != NULL) {
+		loadInode(inodeBuffer, &mapped[offset]);
+		return 0;
+	}
+
+	char* buffer = LBAallocBuffer(2);
+	memset(buffer, 0, partInfop->blocksize * 2);
+	readInodeBlocks(buffer, blocks, blockLocation);
+	loadInode(inodeBuffer, &buffer[offset]);
+	LBAfreeBuffer(buffer, 2);
+	return 0;
+}
+
+/** Writes an inode to the inode table, around the inode cache */
+static int writeInodeTable(uint64_t inodeID, Inode_p inodeBuffer) {
+	uint64_t blockLocation, offset;
+	uint64_t blocks = locateInode(inodeID, &blockLocation, &offset);
+	blockLocation += sb->inodeStart;
+	if (initInodeBlocks(blocks, blockLocation) == -1)
+		return -1;
+
+	/* On a mapped volume update the inode in place, unless a snapshot may need the old block copied first */
+	char* mapped = __atomic_load_n(&snapshotCount, __ATOMIC_ACQUIRE) == 0 ? LBAborrow(blockLocation, blocks) : NULL;
+	if (mapped != NULL) {
+		memcpy(&mapped[offset], inodeBuffer, inodeBytes());
+		LBAreturn(blockLocation, blocks, 1);
+		return 0;
+	}
+
+	/* The blocks hold other inodes too, which may be changing at the same time */
+	char* buffer = LBAallocBuffer(2);
+	memset(buffer, 0, partInfop->blocksize * 2);
+	pthread_mutex_lock(&inodeTableMutex);
+	cacheRead(buffer, blocks, blockLocation);
+	memcpy(&buffer[offset], inodeBuffer, inodeBytes());
+	cacheWrite(buffer, blocks, blockLocation);
+	pthread_mutex_unlock(&inodeTableMutex);
+	LBAfreeBuffer(buffer, 2);
+	return 0;
+}
+
+/** Returns the cache entry of an inode, NULL if it is not cached */
+static InodeCacheEntry_p findCachedInode(uint64_t inodeID) {
+	InodeCacheEntry_p entry = inodeCacheMap[inodeID & (INODE_CACHE_BUCKETS - 1)];
+	while (entry != NULL && entry->inodeID != inodeID)
+		entry = entry->hashNext;
+	return entry;
+}
+
+/** Takes an entry out of the LRU list */
+static void unlinkLRU(InodeCacheEntry_p entry) {
+	if (entry->lruPrev != NULL)
+		entry->lruPrev->lruNext = entry->lruNext;
+	else
+		lruHead = entry->lruNext;
+	if (entry->lruNext != NULL)
+		entry->lruNext->lruPrev = entry->lruPrev;
+	else
+		lruTail = entry->lruPrev;
+}
+
+/** Puts an entry at the most recently used end of the LRU list */
+static void pushLRU(InodeCacheEntry_p entry) {
+	entry->lruPrev = NULL;
+	entry->lruNext = lruHead;
+	if (lruHead != NULL)
+		lruHead->lruPrev = entry;
+	lruHead = entry;
+	if (lruTail == NULL)
+		lruTail = entry;
+}
+
+/**
+ * Writes the dirty cached inodes that share a block of the inode table with
+ * the given inode back to the table, with one read and one write of the
+ * blocks they span. Called with inodeCacheMutex held.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int writeInodeSpan(uint64_t inodeID) {
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t bytes = inodeBytes();
+	uint64_t firstBlock = inodeID * bytes / blockSize;
+	uint64_t lastBlock = ((inodeID + 1) * bytes - 1) / blockSize;
+	uint64_t firstID = firstBlock * blockSize / bytes;
+	uint64_t lastID = ((lastBlock + 1) * blockSize - 1) / bytes;
+	if (lastID >= sb->numInodes)
+		lastID = sb->numInodes - 1;
+
+	/* Legacy inodes at either end may run into the next blocks out */
+	uint64_t spanStart = firstID * bytes / blockSize;
+	uint64_t spanBlocks = ((lastID + 1) * bytes - 1) / blockSize + 1 - spanStart;
+	uint64_t lba = sb->inodeStart + spanStart;
+	if (initInodeBlocks(spanBlocks, lba) == -1)
+		return -1;
+
+	char* buffer = LBAallocBuffer(spanBlocks);
+	int retVal = 0;
+	uint64_t written = 0;
+	pthread_mutex_lock(&inodeTableMutex);
+	if (readInodeBlocks(buffer, spanBlocks, lba) != spanBlocks)
+		retVal = -1;
+	for (uint64_t id = firstID; retVal == 0 && id <= lastID; id++) {
+		InodeCacheEntry_p entry = findCachedInode(id);
+		if (entry == NULL || !entry->dirty)
+			continue;
+		memcpy(&buffer[id * bytes - spanStart * blockSize], &entry->inode, bytes);
+		entry->dirty = false;
+		__atomic_fetch_sub(&inodeCacheDirty, 1, __ATOMIC_RELAXED);
+		written++;
+	}
+	if (retVal == 0 && cacheWrite(buffer, spanBlocks, lba) != spanBlocks)
+		retVal = -1;
+	pthread_mutex_unlock(&inodeTableMutex);
+	LBAfreeBuffer(buffer, spanBlocks);
+	inodeCacheStats.writebacks += written;
+	inodeCacheStats.tableWrites++;
+	return retVal;
+}
+
+/**
+ * Returns the cache entry of an inode, reading it from the table on a miss
+ * if read is set, and evicting the least recently used entry nobody holds
+ * to make room. Called with inodeCacheMutex held, which it lets go of while
+ * it reads; other threads wanting the inode meanwhile wait for it.
+ * Returns NULL if every entry is held or an eviction failed
+ */
+static InodeCacheEntry_p loadCachedInode(uint64_t inodeID, bool read) {
+	InodeCacheEntry_p entry;
+	while ((entry = findCachedInode(inodeID)) != NULL && entry->loading)
+		pthread_cond_wait(&inodeCacheCond, &inodeCacheMutex);
+	if (entry != NULL) {
+		inodeCacheStats.hits++;
+		unlinkLRU(entry);
+		pushLRU(entry);
+		return entry;
+	}
+
+	if (inodeCacheUsed < INODE_CACHE_ENTRIES) {
+		entry = &inodeCache[inodeCacheUsed++];
+	} else {
+		entry = lruTail;
+		while (entry != NULL && (entry->refs != 0 || entry->lockers != 0 || entry->loading))
+			entry = entry->lruPrev;
+		if (entry == NULL || (entry->dirty && writeInodeSpan(entry->inodeID) == -1))
+			return NULL;
+		InodeCacheEntry_p* link = &inodeCacheMap[entry->inodeID & (INODE_CACHE_BUCKETS - 1)];
+		while (*link != entry)
+			link = &(*link)->hashNext;
+		*link = entry->hashNext;
+		unlinkLRU(entry);
+		inodeCacheStats.evictions++;
+	}
+
+	entry->inodeID = inodeID;
+	entry->refs = 0;
+	entry->lockers = 0;
+	entry->dirty = false;
+	entry->loading = read;
+	entry->hashNext = inodeCacheMap[inodeID & (INODE_CACHE_BUCKETS - 1)];
+	inodeCacheMap[inodeID & (INODE_CACHE_BUCKETS - 1)] = entry;
+	pushLRU(entry);
+	if (read) {
+		/* The entry is found but passed over for eviction until it is read */
+		inodeCacheStats.misses++;
+		pthread_mutex_unlock(&inodeCacheMutex);
+		readInodeTable(inodeID, &entry->inode);
+		pthread_mutex_lock(&inodeCacheMutex);
+		entry->loading = false;
+		pthread_cond_broadcast(&inodeCacheCond);
+	}
+	return entry;
+}
+
+/**
+ * Writes every dirty cached inode back to the inode table, batching those
+ * that share blocks.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int flushInodeCache() {
+	int retVal = 0;
+	pthread_mutex_lock(&inodeCacheMutex);
+	for (uint64_t i = 0; i < inodeCacheUsed; i++) {
+		if (inodeCache[i].dirty && writeInodeSpan(inodeCache[i].inodeID) == -1)
+			retVal = -1;
+	}
+	pthread_mutex_unlock(&inodeCacheMutex);
+	return retVal;
+}
+
+/** Flushes the inode cache when the partition closes */
+static int inodeCacheShutdown() {
+	return inodeCache != NULL && sb != NULL ? flushInodeCache() : 0;
+}
+
+/**
+ * Empties the inode cache without writing anything back, for a volume
+ * whose inode table was just formatted, mounted or restored, and holds the
+ * root directory in it again. Allocates the cache the first time.
+ */
+static void dropInodeCache() {
+	pthread_mutex_lock(&inodeCacheMutex);
+	if (inodeCache == NULL) {
+		inodeCache = malloc(INODE_CACHE_ENTRIES * sizeof(InodeCacheEntry));
+		inodeCacheMap = malloc(INODE_CACHE_BUCKETS * sizeof(InodeCacheEntry_p));
+		for (int i = 0; i < INODE_CACHE_ENTRIES; i++)
+			pthread_rwlock_init(&inodeCache[i].lock, NULL);
+	}
+	memset(inodeCacheMap, 0, INODE_CACHE_BUCKETS * sizeof(InodeCacheEntry_p));
+	lruHead = NULL;
+	lruTail = NULL;
+	inodeCacheUsed = 0;
+	__atomic_store_n(&inodeCacheDirty, 0, __ATOMIC_RELAXED);
+	InodeCacheEntry_p root = loadCachedInode(0, true);
+	root->refs++;
+	pthread_mutex_unlock(&inodeCacheMutex);
+}
+
+/** Keeps an inode in the cache until releaseInode, such as the inode of an open file */
+static void holdInode(uint64_t inodeID) {
+	pthread_mutex_lock(&inodeCacheMutex);
+	InodeCacheEntry_p entry = inodeCache != NULL ? loadCachedInode(inodeID, true) : NULL;
+	if (entry != NULL)
+		entry->refs++;
+	pthread_mutex_unlock(&inodeCacheMutex);
+}
+
+/** Lets go of an inode kept by holdInode */
+static void releaseInode(uint64_t inodeID) {
+	pthread_mutex_lock(&inodeCacheMutex);
+	InodeCacheEntry_p entry = inodeCache != NULL ? findCachedInode(inodeID) : NULL;
+	if (entry != NULL && entry->refs > 0 && --entry->refs == 0)
+		pthread_cond_broadcast(&inodeCacheCond);
+	pthread_mutex_unlock(&inodeCacheMutex);
+}
+
+/**
+ * Takes the lock of an inode, exclusive to change it. The lock lives in
+ * the inode's cache entry, which stays put until unlockInode; while every
+ * entry is held or locked this waits for one to come free.
+ */
+static void lockInode(uint64_t inodeID, bool exclusive) {
+	pthread_mutex_lock(&inodeCacheMutex);
+	if (inodeCache == NULL) {
+		pthread_mutex_unlock(&inodeCacheMutex);
+		return;
+	}
+	InodeCacheEntry_p entry;
+	while ((entry = loadCachedInode(inodeID, true)) == NULL)
+		pthread_cond_wait(&inodeCacheCond, &inodeCacheMutex);
+	entry->lockers++;
+	pthread_mutex_unlock(&inodeCacheMutex);
+	if (exclusive)
+		pthread_rwlock_wrlock(&entry->lock);
+	else
+		pthread_rwlock_rdlock(&entry->lock);
+}
+
+static void unlockInode(uint64_t inodeID) {
+	pthread_mutex_lock(&inodeCacheMutex);
+	InodeCacheEntry_p entry = inodeCache != NULL ? findCachedInode(inodeID) : NULL;
+	if (entry != NULL) {
+		pthread_rwlock_unlock(&entry->lock);
+		if (--entry->lockers == 0 && entry->refs == 0)
+			pthread_cond_broadcast(&inodeCacheCond);
+	}
+	pthread_mutex_unlock(&inodeCacheMutex);
+}
+
+/**
+ * Takes the locks of a source inode to read and a destination inode to
+ * change, in inode order; one lock, exclusive, when they are the same.
+ */
+static void lockInodePair(uint64_t sourceID, uint64_t destID) {
+	if (sourceID == destID) {
+		lockInode(destID, true);
+	} else if (sourceID < destID) {
+		lockInode(sourceID, false);
+		lockInode(destID, true);
+	} else {
+		lockInode(destID, true);
+		lockInode(sourceID, false);
+	}
+}
+
+static void unlockInodePair(uint64_t sourceID, uint64_t destID) {
+	unlockInode(destID);
+	if (sourceID != destID)
+		unlockInode(sourceID);
+}
+
+/** Records whether an inode is used in the inode bitmap. Called with inodeCacheMutex held. */
+static void markInode(uint64_t inodeID, bool used) {
+	uint64_t word = inodeID / 64;
+	if (used)
+		inodeMap[word] |= 1ULL << (inodeID % 64);
+	else
+		inodeMap[word] &= ~(1ULL << (inodeID % 64));
+	if (inodeMap[word] == UINT64_MAX)
+		inodeMapFull[word / 64] |= 1ULL << (word % 64);
+	else
+		inodeMapFull[word / 64] &= ~(1ULL << (word % 64));
+}
+
+/**
+ * Returns the first free inode from start on, before end, going a word of
+ * the bitmap at a time and skipping the words the summary says are full.
+ * Called with inodeCacheMutex held.
+ * Returns end if there is none
+ */
+static uint64_t nextFreeInode(uint64_t start, uint64_t end) {
+	if (start >= end)
+		return end;
+	uint64_t word = start / 64;
+	uint64_t free = ~inodeMap[word] & (UINT64_MAX << (start % 64));
+	while (free == 0) {
+		if (++word * 64 >= end)
+			return end;
+		uint64_t open = ~inodeMapFull[word / 64] & (UINT64_MAX << (word % 64));
+		while (open == 0 && (word / 64 + 1) * 4096 < end) {
+			word = (word / 64 + 1) * 64;
+			open = ~inodeMapFull[word / 64];
+		}
+		if (open == 0)
+			return end;
+		word = word / 64 * 64 + __builtin_ctzll(open);
+		if (word * 64 >= end)
+			return end;
+		free = ~inodeMap[word];
+	}
+	uint64_t inodeID = word * 64 + __builtin_ctzll(free);
+	return inodeID < end ? inodeID : end;
+}
+
+/**
+ * Empties the inode bitmap for the mounted volume, allocating it to size.
+ * Inode 0, the root directory, is never handed out, and neither are the
+ * bits past the last inode. Called with volumeLock held exclusive.
+ */
+static void resetInodeMap() {
+	pthread_mutex_lock(&inodeCacheMutex);
+	free(inodeMap);
+	free(inodeMapFull);
+	inodeMapWords = (sb->numInodes + 63) / 64;
+	uint64_t summaryWords = (inodeMapWords + 63) / 64;
+	inodeMap = calloc(inodeMapWords, sizeof(uint64_t));
+	inodeMapFull = calloc(summaryWords, sizeof(uint64_t));
+	/* Make the padding look used, so neither level ever points past the end */
+	for (uint64_t word = inodeMapWords; word < summaryWords * 64; word++)
+		inodeMapFull[word / 64] |= 1ULL << (word % 64);
+	for (uint64_t inodeID = sb->numInodes; inodeID < inodeMapWords * 64; inodeID++)
+		markInode(inodeID, true);
+	markInode(0, true);
+	pthread_mutex_unlock(&inodeCacheMutex);
+}
+
+/** Returns the number of inodes the inode bitmap has marked used */
+static uint64_t countInodeMap() {
+	uint64_t used = 0;
+	pthread_mutex_lock(&inodeCacheMutex);
+	for (uint64_t word = 0; word < inodeMapWords; word++)
+		used += __builtin_popcountll(inodeMap[word]);
+	pthread_mutex_unlock(&inodeCacheMutex);
+	return used - (inodeMapWords * 64 - sb->numInodes);
+}
+
+/**
+ * Fills the inode bitmap from the inode table, skipping groups that were
+ * never initialized, and sets usedInodes from it. Called with volumeLock
+ * held exclusive, after the inode cache was written back or dropped.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int loadInodeMap() {
+	resetInodeMap();
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t bytes = inodeBytes();
+	uint64_t tableBlocks = sb->bitVectorStart - sb->inodeStart;
+	char* buffer = LBAallocBuffer(ZERO_CHUNK_BLOCKS);
+	int retVal = 0;
+	for (uint64_t block = 0; block < tableBlocks && retVal == 0; block += ZERO_CHUNK_BLOCKS) {
+		uint64_t count = tableBlocks - block < ZERO_CHUNK_BLOCKS ? tableBlocks - block : ZERO_CHUNK_BLOCKS;
+		bool ready = false;
+		for (uint64_t i = 0; i < count && !ready; i++)
+			ready = inodeBlockReady(sb->inodeStart + block + i);
+		if (!ready)
+			continue;
+		if (readInodeBlocks(buffer, count, sb->inodeStart + block) != count) {
+			retVal = -1;
+			break;
+		}
+		/* Only the used byte at the front of each inode matters, which never straddles */
+		uint64_t first = (block * blockSize + bytes - 1) / bytes;
+		uint64_t last = ((block + count) * blockSize + bytes - 1) / bytes;
+		if (last > sb->numInodes)
+			last = sb->numInodes;
+		pthread_mutex_lock(&inodeCacheMutex);
+		for (uint64_t inodeID = first; inodeID < last; inodeID++) {
+			if (buffer[inodeID * bytes - block * blockSize] != UNUSED_FLAG)
+				markInode(inodeID, true);
+		}
+		pthread_mutex_unlock(&inodeCacheMutex);
+	}
+	LBAfreeBuffer(buffer, ZERO_CHUNK_BLOCKS);
+	__atomic_store_n(&sb->usedInodes, countInodeMap(), __ATOMIC_RELAXED);
+	return retVal;
+}
+
 /**
- * Finds and returns a free inode number in the inode table.
+ * Finds and claims a free inode number in the inode table, the first
+ * one from where name hashes to on, from the inode bitmap. It is marked
+ * used there at once, so no other caller gets it before it is written.
  * Returns 0 if unsuccessful
  * Returns a free inode
  */
 uint64_t findFreeInode(char* name, uint64_t parentInode) {
-	if (sb->usedInodes == sb->numInodes)
+	if (__atomic_load_n(&sb->usedInodes, __ATOMIC_RELAXED) == sb->numInodes)
 		return 0;
 
-	uint64_t numberSearched = 0;
-	uint64_t inodeID = hashInode(name, parentInode);
-	uint64_t currentID = inodeID;
-
-	char* buffer = malloc(partInfop->blocksize * 2);
-	uint64_t byteLocation = inodeID * sizeof(Inode) + partInfop->blocksize * sb->inodeStart;
-	uint64_t blockLocation = byteLocation / partInfop->blocksize;
-	uint64_t offset = byteLocation % partInfop->blocksize;
-	LBAread(&buffer[partInfop->blocksize], 1, blockLocation);
-	blockLocation++;
-	while (numberSearched < sb->numInodes - 1) {
-		memcpy(buffer, &buffer[partInfop->blocksize], partInfop->blocksize);
-		if (blockLocation < sb->freeBlocks) {
-			LBAread(&buffer[partInfop->blocksize], 1, blockLocation);
-		}
-
-		while (offset < partInfop->blocksize * 2 - sizeof(Inode)) {
-			if (buffer[offset] == UNUSED_FLAG) {
-				free(buffer);
-				return currentID;
-			} else {
-				numberSearched++;
-				currentID++;
-				if (currentID > sb->numInodes) {
-					currentID = 1;
-					offset = sizeof(Inode);
-					break;
-				} else {
-					offset += sizeof(Inode);
-				}
-			}
+	uint64_t start = hashInode(name, parentInode);
+	pthread_mutex_lock(&inodeCacheMutex);
+	uint64_t inodeID = nextFreeInode(start, sb->numInodes);
+	/* Wrap around, stopping short of where the search began */
+	if (inodeID == sb->numInodes && (inodeID = nextFreeInode(1, start)) == start)
+		inodeID = 0;
+	if (inodeID != 0)
+		markInode(inodeID, true);
+	pthread_mutex_unlock(&inodeCacheMutex);
+	return inodeID;
+}
+
+/**
+ * Gives back an inode findFreeInode claimed, unless a file was written to
+ * it since. Called with volumeLock held.
+ */
+static void unclaimInode(uint64_t inodeID) {
+	Inode inode;
+	if (inodeID == 0 || readInode(inodeID, &inode) != 0 || inode.used != UNUSED_FLAG)
+		return;
+	pthread_mutex_lock(&inodeCacheMutex);
+	if (inodeMap != NULL)
+		markInode(inodeID, false);
+	pthread_mutex_unlock(&inodeCacheMutex);
+}
+
+/** Returns the LBA of a data pointer, NO_BLOCK for NO_BLOCK */
+static uint64_t dataLBA(uint64_t pointer) {
+	return pointer == NO_BLOCK ? NO_BLOCK : pointer + sb->rootDataPointer;
+}
+
+/** Returns whether files written to the volume are mapped by extents */
+static bool extentsSupported() {
+	return sb->inodeBytes != 0;
+}
+
+/** Returns the number of entries an extent tree node block holds */
+static uint64_t extentsPerNode() {
+	return (partInfop->blocksize - sizeof(ExtentHeader)) / sizeof(Extent);
+}
+
+/**
+ * Maps the file blocks [firstBlock, firstBlock + count) that fall under the
+ * given extent tree entries into lbas, reading the nodes below them through
+ * the cache. Blocks no extent covers are left as they are.
+ * Returns 0 if successful
+ * Returns -1 if a node could not be read
+ */
+static int mapExtents(const ExtentHeader* header, const Extent* entries, uint64_t firstBlock, uint64_t count, uint64_t* lbas) {
+	uint64_t endBlock = firstBlock + count;
+	for (uint64_t e = 0; e < header->count && entries[e].fileBlock < endBlock; e++) {
+		const Extent* extent = &entries[e];
+		if (header->depth == 0) {
+			uint64_t from = extent->fileBlock > firstBlock ? extent->fileBlock : firstBlock;
+			uint64_t to = (uint64_t) extent->fileBlock + extent->length;
+			if (to > endBlock)
+				to = endBlock;
+			for (uint64_t block = from; block < to; block++)
+				lbas[block - firstBlock] = extent->start + (block - extent->fileBlock) + sb->rootDataPointer;
+			continue;
+		}
+
+		/* A node maps everything up to where the next one starts */
+		if (e + 1 < header->count && entries[e + 1].fileBlock <= firstBlock)
+			continue;
+		char* node = LBAallocBuffer(1);
+		int retVal = -1;
+		if (cacheRead(node, 1, extent->start + sb->rootDataPointer) == 1)
+			retVal = mapExtents((ExtentHeader*) node, (Extent*) &node[sizeof(ExtentHeader)], firstBlock, count, lbas);
+		LBAfreeBuffer(node, 1);
+		if (retVal == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Translates count logical blocks of a file, starting at firstBlock, into
+ * LBAs on the volume. Data pointers (direct, in indirect blocks and in the
+ * double indirect block) and extents are all relative to the root data
+ * pointer; a file block with nothing stored behind it (NO_BLOCK) maps to
+ * NO_BLOCK.
+ * Returns 0 if successful
+ * Returns -1 if the blocks lie beyond what the inode can map
+ */
+int mapFileBlocks(Inode_p inode, uint64_t firstBlock, uint64_t count, uint64_t* lbas) {
+	if (inode->flags & INODE_EXTENTS) {
+		if (firstBlock + count > (uint64_t) UINT32_MAX + 1) {
+			printf("Error: This filesystem does not support this large of a file size");
+			return -1;
+		}
+		for (uint64_t i = 0; i < count; i++)
+			lbas[i] = NO_BLOCK;
+		return mapExtents(&inode->extentHeader, inode->extents, firstBlock, count, lbas);
+	}
+
+	uint64_t pointersPerBlock = sb->maxPointersPerIndirect[0];
+	uint64_t* indirect = LBAallocBuffer(1);
+	uint64_t* doubleIndirect = LBAallocBuffer(1);
+	uint64_t indirectLoaded = UINT64_MAX;
+	bool doubleLoaded = false;
+
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t block = firstBlock + i;
+		uint64_t indirectLBA;
+
+		if (block < NUM_DIRECT) {
+			lbas[i] = dataLBA(inode->directData[block]);
+			continue;
 		}
-		if (currentID == 1) {
-			blockLocation = sb->inodeStart;
+
+		block -= NUM_DIRECT;
+		if (block < pointersPerBlock) {
+			indirectLBA = inode->indirectData[0] + sb->rootDataPointer;
+		} else if (block - pointersPerBlock < sb->maxPointersPerIndirect[1]) {
+			block -= pointersPerBlock;
+			if (!doubleLoaded) {
+				cacheRead(doubleIndirect, 1, inode->indirectData[1] + sb->rootDataPointer);
+				doubleLoaded = true;
+			}
+			indirectLBA = doubleIndirect[block / pointersPerBlock] + sb->rootDataPointer;
+			block %= pointersPerBlock;
 		} else {
-			blockLocation++;
-			offset -= partInfop->blocksize;
+			printf("Error: This filesystem does not support this large of a file size");
+			LBAfreeBuffer(indirect, 1);
+			LBAfreeBuffer(doubleIndirect, 1);
+			return -1;
+		}
+
+		if (indirectLBA != indirectLoaded) {
+			cacheRead(indirect, 1, indirectLBA);
+			indirectLoaded = indirectLBA;
+		}
+		lbas[i] = dataLBA(indirect[block]);
+	}
+
+	LBAfreeBuffer(indirect, 1);
+	LBAfreeBuffer(doubleIndirect, 1);
+	return 0;
+}
+
+/** Returns the number of file bytes in the given cluster of a file of size bytes */
+static uint64_t clusterBytes(uint64_t size, uint64_t cluster) {
+	uint64_t bytes = COMPRESS_CLUSTER_BLOCKS * partInfop->blocksize;
+	uint64_t start = cluster * bytes;
+	return size - start < bytes ? size - start : bytes;
+}
+
+/**
+ * Packs one cluster of file data into stored, which must hold a whole
+ * cluster of blocks: compressed, behind a uint32_t byte count, when that
+ * takes fewer blocks than the data itself, otherwise as it is. The rest of
+ * the last block used is zeroed.
+ * Returns the number of blocks used
+ */
+static uint64_t packCluster(const char* data, uint64_t bytes, char* stored) {
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t blocks = (bytes + blockSize - 1) / blockSize;
+	uint64_t used = bytes;
+	uint32_t packed = 0;
+
+	if (blocks > 1)
+		packed = lzCompress(data, bytes, stored + sizeof(uint32_t), (blocks - 1) * blockSize - sizeof(uint32_t));
+	if (packed != 0) {
+		memcpy(stored, &packed, sizeof(uint32_t));
+		used = packed + sizeof(uint32_t);
+	} else {
+		memcpy(stored, data, bytes);
+	}
+
+	uint64_t usedBlocks = (used + blockSize - 1) / blockSize;
+	memset(stored + used, 0, usedBlocks * blockSize - used);
+	return usedBlocks;
+}
+
+/**
+ * Unpacks one cluster of bytes of file data from its stored blocks. lbas
+ * maps the blocks of the cluster; the cluster is compressed when its last
+ * block has nothing stored behind it.
+ * Returns 0 if successful
+ * Returns -1 if the cluster is corrupt
+ */
+static int unpackCluster(const char* stored, const uint64_t* lbas, uint64_t bytes, char* data) {
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t blocks = (bytes + blockSize - 1) / blockSize;
+	uint32_t packed;
+
+	if (lbas[blocks - 1] != NO_BLOCK) {
+		memcpy(data, stored, bytes);
+		return 0;
+	}
+	memcpy(&packed, stored, sizeof(uint32_t));
+	if (packed > (blocks - 1) * blockSize - sizeof(uint32_t) ||
+			lzDecompress(stored + sizeof(uint32_t), packed, data, bytes) != bytes) {
+		printf("Error: Corrupt compressed cluster at block %lu\n", lbas[0]);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * readFile for a compressed file. The stored blocks of every cluster the
+ * read touches come in with a single LBAreadv, into a staging area laid out
+ * like the uncompressed file, and each cluster is then unpacked in turn.
+ * Returns bytesToRead if successful
+ * Returns 0 if unsuccessful
+ */
+static uint64_t readClusters(Inode_p inode, char* destination, uint64_t bytesToRead) {
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t clusterSize = COMPRESS_CLUSTER_BLOCKS * blockSize;
+	uint64_t clusters = (bytesToRead + clusterSize - 1) / clusterSize;
+	uint64_t slots = (inode->size + blockSize - 1) / blockSize;
+	if (slots > clusters * COMPRESS_CLUSTER_BLOCKS)
+		slots = clusters * COMPRESS_CLUSTER_BLOCKS;
+	if (slots == 0)
+		return 0;
+
+	uint64_t* lbas = malloc(slots * sizeof(uint64_t));
+	lbaSegment_p segments = malloc(slots * sizeof(lbaSegment_t));
+	char* staging = LBAallocBuffer(slots);
+	char* cluster = malloc(clusterSize);
+	bool ok = lbas != NULL && segments != NULL && staging != NULL && cluster != NULL &&
+		mapFileBlocks(inode, 0, slots, lbas) == 0;
+
+	/* One segment per run of adjacent stored blocks */
+	if (ok) {
+		int numSegments = 0;
+		uint64_t stored = 0;
+		uint64_t i = 0;
+		while (i < slots) {
+			if (lbas[i] == NO_BLOCK) {
+				i++;
+				continue;
+			}
+			uint64_t run = 1;
+			while (i + run < slots && lbas[i + run] == lbas[i] + run)
+				run++;
+			segments[numSegments].buffer = &staging[i * blockSize];
+			segments[numSegments].lbaCount = run;
+			segments[numSegments].lbaPosition = lbas[i];
+			numSegments++;
+			stored += run;
+			i += run;
 		}
+		ok = LBAreadv(segments, numSegments) == stored;
+		if (!ok)
+			printf("Error: Failed reading the data of inode %lu", inode->inode);
+	}
+
+	/* Blocks still dirty in the cache are newer than what was just read */
+	for (uint64_t i = 0; ok && i < slots; i++) {
+		if (lbas[i] != NO_BLOCK)
+			cacheOverlay(&staging[i * blockSize], 1, lbas[i]);
+	}
+
+	for (uint64_t c = 0; ok && c < clusters; c++) {
+		uint64_t bytes = clusterBytes(inode->size, c);
+		uint64_t wanted = bytesToRead - c * clusterSize < bytes ? bytesToRead - c * clusterSize : bytes;
+		char* data = wanted == bytes ? &destination[c * clusterSize] : cluster;
+		ok = unpackCluster(&staging[c * clusterSize], &lbas[c * COMPRESS_CLUSTER_BLOCKS], bytes, data) == 0;
+		if (ok && data == cluster)
+			memcpy(&destination[c * clusterSize], cluster, wanted);
+	}
+
+	free(lbas);
+	free(segments);
+	LBAfreeBuffer(staging, slots);
+	free(cluster);
+	return ok ? bytesToRead : 0;
+}
+
+/**
+ * Reads the data of an inode already in memory, as readFile does.
+ * Returns the number of bytes read into destination if successful
+ * Returns 0 if unsuccessful
+ */
+static uint64_t readInodeData(Inode_p inode, char* destination, const uint64_t length) {
+	uint64_t bytesToRead;
+
+	if (length == 0)
+		bytesToRead = inode->size;
+	else
+		bytesToRead = length;
+
+	if (destination == NULL)
+		destination = malloc(bytesToRead);
+
+	if (inode->flags & INODE_COMPRESSED) {
+		if (bytesToRead > inode->size)
+			bytesToRead = inode->size;
+		return readClusters(inode, destination, bytesToRead);
+	}
+
+	uint64_t numberOfBlocksToRead = (bytesToRead + partInfop->blocksize - 1) / partInfop->blocksize;
+	uint64_t fullBlocks = bytesToRead / partInfop->blocksize;
+	uint64_t* blocks = malloc(numberOfBlocksToRead * sizeof(uint64_t));
+	char* blockBuffer = LBAallocBuffer(1);
+	if (mapFileBlocks(inode, 0, numberOfBlocksToRead, blocks) == -1) {
+		free(blocks);
+		LBAfreeBuffer(blockBuffer, 1);
+		return 0;
+	}
+
+	/* One segment per run of adjacent blocks, LBAreadv keeps them all in flight */
+	lbaSegment_p segments = malloc((numberOfBlocksToRead + 1) * sizeof(lbaSegment_t));
+	int numSegments = 0;
+	uint64_t i = 0;
+	while (i < fullBlocks) {
+		uint64_t run = 1;
+		while (i + run < fullBlocks && blocks[i + run] == blocks[i] + run)
+			run++;
+		segments[numSegments].buffer = &destination[i * partInfop->blocksize];
+		segments[numSegments].lbaCount = run;
+		segments[numSegments].lbaPosition = blocks[i];
+		numSegments++;
+		i += run;
+	}
+	if (fullBlocks < numberOfBlocksToRead) {
+		segments[numSegments].buffer = blockBuffer;
+		segments[numSegments].lbaCount = 1;
+		segments[numSegments].lbaPosition = blocks[fullBlocks];
+		numSegments++;
+	}
+
+	uint64_t blocksRead = LBAreadv(segments, numSegments);
+	free(segments);
+	if (blocksRead != numberOfBlocksToRead) {
+		printf("Error: Failed reading the data of inode %lu", inode->inode);
+		free(blocks);
+		LBAfreeBuffer(blockBuffer, 1);
+		return 0;
+	}
+
+	/* Blocks still dirty in the cache are newer than what was just read */
+	for (i = 0; i < fullBlocks; i++)
+		cacheOverlay(&destination[i * partInfop->blocksize], 1, blocks[i]);
+	if (fullBlocks < numberOfBlocksToRead) {
+		cacheOverlay(blockBuffer, 1, blocks[fullBlocks]);
+		memcpy(&destination[fullBlocks * partInfop->blocksize], blockBuffer, bytesToRead % partInfop->blocksize);
+	}
+
+	free(blocks);
+	LBAfreeBuffer(blockBuffer, 1);
+	return bytesToRead;
+}
+
+/**
+ * Reads the data of the file from the filesystem and stores it into the destination.
+ * If the pointer is null, then memory will be allocated to hold the file data.
+ * All of the file's data blocks are read with one LBAreadv, so runs of
+ * adjacent blocks (including the partial last block) share a request and
+ * every request is in flight at once.
+ * @param destination the buffer that the file data will be stored in.
+ * @param inodeID the file's inode.
+ * @param length is the number of bytes to read. 0 if reading the entire file.
+ * Returns the number of bytes read into destination if successful
+ * Returns 0 if unsuccessful
+ */
+uint64_t readFile(char* destination, const uint64_t inodeID, const uint64_t length) {
+	Inode inode;
+	uint64_t bytesRead = 0;
+
+	lockVolume(false);
+	lockInode(inodeID, false);
+	if (readInode(inodeID, &inode) == -1)
+		printf("Error: Failed retrieving inode %lu", inodeID);
+	else
+		bytesRead = readInodeData(&inode, destination, length);
+	unlockInode(inodeID);
+	unlockVolume();
+	return bytesRead;
+}
+
+/**
+ * Given an inode number and an Inode_p pointer, readInode
+ * will read from the request inode into either a buffer already
+ * preallocated, or will allocate a buffer if the pointer is null.
+ * Served from the inode cache, which only reads the table on a miss.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int readInode(uint64_t inodeID, Inode_p inodeBuffer) {
+	if (inodeID >= sb->numInodes || inodeID < 0)
+		return -1;
+
+	if (inodeBuffer == NULL) {
+		inodeBuffer = malloc(sizeof(Inode));
+		memset(inodeBuffer, 0, sizeof(Inode));
+	}
+
+	int retVal = 0;
+	pthread_mutex_lock(&inodeCacheMutex);
+	InodeCacheEntry_p entry = inodeCache != NULL ? loadCachedInode(inodeID, true) : NULL;
+	if (entry != NULL)
+		memcpy(inodeBuffer, &entry->inode, sizeof(Inode));
+	pthread_mutex_unlock(&inodeCacheMutex);
+	/* Not cached, so the table has it as it is */
+	if (entry == NULL)
+		retVal = readInodeTable(inodeID, inodeBuffer);
+	return retVal;
+}
+
+/**
+ * Given an inode number and an Inode_p buffer, writeInode
+ * will write to the given inode number from the provided buffer.
+ * The inode buffer must be preallocated with the contents. The inode
+ * only goes to the table when its cache entry is evicted or flushed.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int writeInode(uint64_t inodeID, Inode_p inodeBuffer) {
+	if (inodeBuffer == NULL || inodeID >= sb->numInodes || inodeID < 0)
+		return -1;
+
+	int retVal = 0;
+	pthread_mutex_lock(&inodeCacheMutex);
+	InodeCacheEntry_p entry = inodeCache != NULL ? loadCachedInode(inodeID, false) : NULL;
+	if (entry != NULL) {
+		memcpy(&entry->inode, inodeBuffer, sizeof(Inode));
+		if (!entry->dirty)
+			__atomic_fetch_add(&inodeCacheDirty, 1, __ATOMIC_RELAXED);
+		entry->dirty = true;
+	} else {
+		retVal = writeInodeTable(inodeID, inodeBuffer);
+	}
+	if (retVal == 0 && inodeMap != NULL && inodeID != 0)
+		markInode(inodeID, inodeBuffer->used != UNUSED_FLAG);
+	pthread_mutex_unlock(&inodeCacheMutex);
+	return retVal;
+}
+
+/** Returns the number of blocks the free block bit vector takes up */
+static uint64_t bitVectorBlocks() {
+	uint64_t end = sb->checksumBlocks != 0 ? sb->checksumStart : sb->rootDataPointer;
+	if (sb->dedupBlocks != 0)
+		end = sb->dedupStart;
+	return end - sb->bitVectorStart;
+}
+
+/**
+ * Returns the data blocks of a word of the bit vectors that are free, held
+ * by no snapshot and not waiting on a commit, as a bit each. Blocks past
+ * the last data block are never available.
+ */
+static uint64_t availableBits(uint64_t word) {
+	uint64_t taken = ((uint64_t*) bitVector)[word];
+	if (heldBlocks != NULL)
+		taken |= ((uint64_t*) heldBlocks)[word];
+	if (freedBlocks != NULL)
+		taken |= ((uint64_t*) freedBlocks)[word];
+	if ((word + 1) * 64 > sb->totalDataBlocks)
+		taken |= word * 64 >= sb->totalDataBlocks ? UINT64_MAX : UINT64_MAX << (sb->totalDataBlocks % 64);
+	return ~taken;
+}
+
+/** Returns whether a data block can be allocated */
+static bool blockAvailable(uint64_t block) {
+	return availableBits(block / 64) & (1ULL << (block % 64));
+}
+
+/** Recounts the available blocks of every chunk from the bit vectors. Called with the allocator locked. */
+static void countChunks() {
+	uint64_t chunks = (sb->totalDataBlocks + ALLOC_CHUNK_BLOCKS - 1) / ALLOC_CHUNK_BLOCKS;
+	free(chunkFree);
+	chunkFree = calloc(chunks + 1, sizeof(uint32_t));
+	for (uint64_t word = 0; word * 64 < sb->totalDataBlocks; word++)
+		chunkFree[word * 64 / ALLOC_CHUNK_BLOCKS] += __builtin_popcountll(availableBits(word));
+}
+
+/**
+ * Recounts the available blocks of every chunk from the bit vectors and
+ * compares them with the counts the allocator keeps.
+ * Returns the number of chunks whose count is off
+ */
+uint64_t checkAllocator() {
+	uint64_t chunks = (sb->totalDataBlocks + ALLOC_CHUNK_BLOCKS - 1) / ALLOC_CHUNK_BLOCKS;
+	uint32_t* counted = calloc(chunks + 1, sizeof(uint32_t));
+	uint64_t wrong = 0;
+	lockAllocator();
+	for (uint64_t word = 0; word * 64 < sb->totalDataBlocks; word++)
+		counted[word * 64 / ALLOC_CHUNK_BLOCKS] += __builtin_popcountll(availableBits(word));
+	for (uint64_t chunk = 0; chunk < chunks; chunk++)
+		wrong += counted[chunk] != chunkFree[chunk];
+	unlockAllocator();
+	free(counted);
+	return wrong;
+}
+
+/**
+ * Returns the first available data block from block on, before end, a word
+ * at a time, passing over the chunks with none available without looking
+ * at their words. Called with the allocator locked.
+ * Returns end if there is none
+ */
+static uint64_t nextAvailableBlock(uint64_t block, uint64_t end) {
+	while (block < end) {
+		if (chunkFree[block / ALLOC_CHUNK_BLOCKS] == 0) {
+			block = (block / ALLOC_CHUNK_BLOCKS + 1) * ALLOC_CHUNK_BLOCKS;
+			continue;
+		}
+		uint64_t bits = availableBits(block / 64) & (UINT64_MAX << (block % 64));
+		if (bits != 0) {
+			block = block / 64 * 64 + __builtin_ctzll(bits);
+			return block < end ? block : end;
+		}
+		block = (block / 64 + 1) * 64;
+	}
+	return end;
+}
+
+/**
+ * Returns the first data block from block on, before end, that cannot be
+ * allocated, passing over chunks with every block available. Called with
+ * the allocator locked.
+ * Returns end if there is none
+ */
+static uint64_t nextTakenBlock(uint64_t block, uint64_t end) {
+	while (block < end) {
+		if (block % ALLOC_CHUNK_BLOCKS == 0 && chunkFree[block / ALLOC_CHUNK_BLOCKS] == ALLOC_CHUNK_BLOCKS) {
+			block += ALLOC_CHUNK_BLOCKS;
+			continue;
+		}
+		uint64_t bits = ~availableBits(block / 64) & (UINT64_MAX << (block % 64));
+		if (bits != 0) {
+			block = block / 64 * 64 + __builtin_ctzll(bits);
+			return block < end ? block : end;
+		}
+		block = (block / 64 + 1) * 64;
+	}
+	return end;
+}
+
+/**
+ * Returns the first data block of the first run of count available blocks
+ * that starts from start on and ends by end. Called with the allocator
+ * locked.
+ * Returns end if there is none
+ */
+static uint64_t findRun(uint64_t count, uint64_t start, uint64_t end) {
+	uint64_t block = nextAvailableBlock(start, end);
+	while (block < end && end - block >= count) {
+		uint64_t taken = nextTakenBlock(block, block + count);
+		if (taken == block + count)
+			return block;
+		block = nextAvailableBlock(taken, end);
+	}
+	return end;
+}
+
+/**
+ * Puts up to count available data blocks from start on, before end, into
+ * blocks in ascending order. Called with the allocator locked.
+ * Returns the number of blocks found
+ */
+static uint64_t gatherAvailable(uint64_t start, uint64_t end, uint64_t count, uint64_t* blocks) {
+	uint64_t found = 0;
+	uint64_t block = nextAvailableBlock(start, end);
+	while (found < count && block < end) {
+		uint64_t word = block / 64;
+		uint64_t bits = availableBits(word) & (UINT64_MAX << (block % 64));
+		while (bits != 0 && found < count && word * 64 + __builtin_ctzll(bits) < end) {
+			blocks[found++] = word * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+		}
+		block = nextAvailableBlock((word + 1) * 64, end);
+	}
+	return found;
+}
+
+/**
+ * Loads the free block bit vector from the volume into bitVector.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int readBitVector() {
+	uint64_t blocks = bitVectorBlocks();
+	lockAllocator();
+	if (bitVector != NULL)
+		LBAfreeBuffer(bitVector, bitVectorBuffer);
+	if (heldBlocks != NULL)
+		LBAfreeBuffer(heldBlocks, bitVectorBuffer);
+	if (freedBlocks != NULL)
+		LBAfreeBuffer(freedBlocks, bitVectorBuffer);
+	heldBlocks = NULL;
+	freedBlocks = NULL;
+	bitVectorBuffer = blocks;
+	bitVector = LBAallocBuffer(blocks);
+	free(bitVectorDirty);
+	bitVectorDirty = calloc(blocks, sizeof(bool));
+	int retVal = 0;
+	if (bitVector == NULL || bitVectorDirty == NULL || cacheRead(bitVector, blocks, sb->bitVectorStart) != blocks)
+		retVal = -1;
+	else
+		countChunks();
+	unlockAllocator();
+	return retVal;
+}
+
+/**
+ * Writes the blocks of bitVector changed since the last write, runs of
+ * adjacent ones together, then the block reference counts and the
+ * superblock counters that go with them back to the volume. Blocks that
+ * fail to write stay marked for the next call.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int writeBitVector() {
+	uint64_t blocks = bitVectorBlocks();
+	int retVal = 0;
+	lockAllocator();
+	uint64_t block = 0;
+	while (block < blocks && retVal == 0) {
+		if (!bitVectorDirty[block]) {
+			block++;
+			continue;
+		}
+		uint64_t run = 1;
+		while (block + run < blocks && bitVectorDirty[block + run])
+			run++;
+		if (cacheWrite(&bitVector[block * partInfop->blocksize], run, sb->bitVectorStart + block) != run)
+			retVal = -1;
+		else
+			memset(&bitVectorDirty[block], 0, run * sizeof(bool));
+		block += run;
+	}
+	if (retVal == 0 && (dedupFlush() != 0 || writeSuperBlock() != 0))
+		retVal = -1;
+	unlockAllocator();
+	return retVal;
+}
+
+/** Returns the number of bit vector blocks changed since writeBitVector last wrote them */
+uint64_t bitVectorDirtyBlocks() {
+	uint64_t dirty = 0;
+	lockAllocator();
+	for (uint64_t block = 0; block < bitVectorBlocks(); block++)
+		dirty += bitVectorDirty[block];
+	unlockAllocator();
+	return dirty;
+}
+
+/** Returns whether a snapshot holds the data block */
+static bool blockHeld(uint64_t block) {
+	return heldBlocks != NULL && (heldBlocks[block / 8] & (1 << (block % 8)));
+}
+
+/** Returns whether the data block was freed by an operation the journal has not committed yet */
+static bool blockFreed(uint64_t block) {
+	return freedBlocks != NULL && (freedBlocks[block / 8] & (1 << (block % 8)));
+}
+
+/**
+ * Keeps count data blocks from firstBlock out of reach until the next
+ * commit. Until their release is committed a crash gives them back to their
+ * old owner, so they must keep their contents.
+ */
+static void deferRelease(uint64_t firstBlock, uint64_t count) {
+	if (freedBlocks == NULL) {
+		freedBlocks = LBAallocBuffer(bitVectorBuffer);
+		memset(freedBlocks, 0, bitVectorBuffer * partInfop->blocksize);
+	}
+	for (uint64_t block = firstBlock; block < firstBlock + count; block++) {
+		if (blockAvailable(block))
+			chunkFree[block / ALLOC_CHUNK_BLOCKS]--;
+		freedBlocks[block / 8] |= 1 << (block % 8);
+	}
+}
+
+/** After a commit, hands the space of the blocks freed before it back to the host and lets them be reused */
+static void settleReleased() {
+	lockAllocator();
+	if (freedBlocks == NULL) {
+		unlockAllocator();
+		return;
+	}
+	uint64_t block = 0;
+	while (block < sb->totalDataBlocks) {
+		if (block % 64 == 0 && ((uint64_t*) freedBlocks)[block / 64] == 0) {
+			block += 64;
+			continue;
+		}
+		uint64_t run = 0;
+		while (block + run < sb->totalDataBlocks && blockFreed(block + run))
+			run++;
+		if (run == 0) {
+			block++;
+			continue;
+		}
+		LBAdiscard(run, sb->rootDataPointer + block);
+		/* Available again, unless in use or held since */
+		for (uint64_t i = block; i < block + run; i++) {
+			freedBlocks[i / 8] &= ~(1 << (i % 8));
+			dedupForget(i);
+			if (blockAvailable(i))
+				chunkFree[i / ALLOC_CHUNK_BLOCKS]++;
+		}
+		block += run;
+	}
+	LBAfreeBuffer(freedBlocks, bitVectorBuffer);
+	freedBlocks = NULL;
+	unlockAllocator();
+}
+
+/**
+ * Ends an operation, committing it to the journal along with the others
+ * since the last commit once one is due (cacheCommit), counting the dirty
+ * inodes and cached blocks the commit would add, so it fits the log. The
+ * commit waits for the operations in progress to finish, so it holds none
+ * of them in part. Called without volumeLock.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int commitMetadata() {
+	if (!journalDue(__atomic_load_n(&inodeCacheDirty, __ATOMIC_RELAXED) + cacheDirtyBlocks()))
+		return 0;
+	lockVolume(true);
+	int committed = flushInodeCache() == 0 ? cacheCommit() : -1;
+	if (committed == 1)
+		settleReleased();
+	unlockVolume();
+	return committed == -1 ? -1 : 0;
+}
+
+/**
+ * Makes every metadata change so far durable (cacheFlush). Whole operations
+ * only if the caller holds volumeLock exclusive.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int flushMetadata() {
+	if (flushInodeCache() != 0 || cacheFlush() != 0)
+		return -1;
+	settleReleased();
+	return 0;
+}
+
+/** Returns the number of blocks the inodes, bit vector and fingerprint table take up together */
+static uint64_t metadataBlocks() {
+	uint64_t end = sb->checksumBlocks != 0 ? sb->checksumStart : sb->rootDataPointer;
+	return end - sb->inodeStart;
+}
+
+/** Sets or clears count bits of a bit vector from first, returns how many changed */
+static uint64_t setBits(uint8_t* bits, uint64_t first, uint64_t count, bool on) {
+	uint64_t changed = 0;
+	for (uint64_t block = first; block < first + count; block++) {
+		bool set = bits[block / 8] & (1 << (block % 8));
+		if (set == on)
+			continue;
+		bits[block / 8] ^= 1 << (block % 8);
+		changed++;
+	}
+	return changed;
+}
+
+/** Returns the number of blocks the block map of a snapshot takes, an entry per metadata block */
+static uint64_t snapshotMapBlocks() {
+	return (metadataBlocks() * sizeof(uint64_t) + partInfop->blocksize - 1) / partInfop->blocksize;
+}
+
+/** Keeps a data block out of reach for the snapshots. Called with the allocator locked. */
+static void holdBlock(uint64_t block) {
+	if (heldBlocks == NULL) {
+		heldBlocks = LBAallocBuffer(bitVectorBuffer);
+		memset(heldBlocks, 0, bitVectorBuffer * partInfop->blocksize);
+	}
+	if (blockAvailable(block))
+		chunkFree[block / ALLOC_CHUNK_BLOCKS]--;
+	heldBlocks[block / 8] |= 1 << (block % 8);
+}
+
+/** Drops the block maps of the snapshots from memory, before the layout changes */
+static void unloadSnapshotMaps() {
+	lockAllocator();
+	for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+		if (snapshotMaps[i] != NULL)
+			LBAfreeBuffer(snapshotMaps[i], snapshotMapBuffer);
+		snapshotMaps[i] = NULL;
+	}
+	__atomic_store_n(&snapshotCount, 0, __ATOMIC_RELEASE);
+	unlockAllocator();
+}
+
+/**
+ * Reads the block map of every snapshot into memory.
+ * Returns 0 if successful
+ * Returns -1 if a map could not be read or points outside the data blocks
+ */
+static int loadSnapshotMaps() {
+	unloadSnapshotMaps();
+	uint64_t blocks = snapshotMapBlocks();
+	uint64_t entries = metadataBlocks();
+	int retVal = 0;
+	lockAllocator();
+	snapshotMapBuffer = blocks;
+	for (int i = 0; i < MAX_SNAPSHOTS && retVal == 0; i++) {
+		if (sb->snapshots[i].created == 0)
+			continue;
+		snapshotMaps[i] = LBAallocBuffer(blocks);
+		__atomic_add_fetch(&snapshotCount, 1, __ATOMIC_RELEASE);
+		if (cacheRead(snapshotMaps[i], blocks, sb->rootDataPointer + sb->snapshots[i].mapStart) != blocks)
+			retVal = -1;
+		for (uint64_t entry = 0; retVal == 0 && entry < entries; entry++) {
+			if (snapshotMaps[i][entry] > sb->totalDataBlocks)
+				retVal = -1;
+		}
+	}
+	unlockAllocator();
+	return retVal;
+}
+
+/**
+ * Reads count metadata blocks from lba as a snapshot sees them: a block
+ * changed since the snapshot was taken from the copy its block map points
+ * at, the others from the volume.
+ * Returns the number of blocks read
+ */
+static uint64_t readSnapshotBlocks(int snapshot, void* buffer, uint64_t count, uint64_t lba) {
+	uint64_t read = 0;
+	lockAllocator();
+	const uint64_t* map = &snapshotMaps[snapshot][lba - sb->inodeStart];
+	while (read < count) {
+		char* block = (char*) buffer + read * partInfop->blocksize;
+		uint64_t run = 1;
+		uint64_t got;
+		if (map[read] != 0) {
+			got = cacheRead(block, 1, sb->rootDataPointer + map[read] - 1);
+		} else {
+			while (read + run < count && map[read + run] == 0)
+				run++;
+			got = readInodeBlocks(block, run, lba + read);
+		}
+		if (got != run)
+			break;
+		read += run;
+	}
+	unlockAllocator();
+	return read;
+}
+
+/**
+ * The copy-before-write of snapshots, called by cacheWrite before it writes
+ * any block (cacheSetWriteHook). The metadata blocks among them that some
+ * snapshot still shares with the live volume are copied to free data
+ * blocks, held from then on, and the block maps of those snapshots pointed
+ * at the copies. Data blocks need none of this, a snapshot keeps them by
+ * holding them.
+ * Returns 0 if the write may go ahead
+ * Returns -1 if a block could not be preserved
+ */
+static int preserveShared(uint64_t lbaCount, uint64_t lbaPosition) {
+	if (__atomic_load_n(&snapshotCount, __ATOMIC_ACQUIRE) == 0)
+		return 0;
+	uint64_t first = lbaPosition > sb->inodeStart ? lbaPosition : sb->inodeStart;
+	uint64_t end = sb->inodeStart + metadataBlocks();
+	if (lbaPosition + lbaCount < end)
+		end = lbaPosition + lbaCount;
+	if (first >= end)
+		return 0;
+
+	int retVal = 0;
+	char* old = LBAallocBuffer(1);
+	lockAllocator();
+	for (uint64_t lba = first; lba < end && retVal == 0; lba++) {
+		uint64_t entry = lba - sb->inodeStart;
+		bool shared = false;
+		for (int i = 0; i < MAX_SNAPSHOTS; i++)
+			shared |= snapshotMaps[i] != NULL && snapshotMaps[i][entry] == 0;
+		if (!shared)
+			continue;
+
+		uint64_t copy = nextAvailableBlock(0, sb->totalDataBlocks);
+		if (copy == sb->totalDataBlocks) {
+			printf("Error: No free block left to keep the snapshots in\n");
+			retVal = -1;
+			break;
+		}
+		if (readInodeBlocks(old, 1, lba) != 1 || cacheWrite(old, 1, sb->rootDataPointer + copy) != 1) {
+			retVal = -1;
+			break;
+		}
+		holdBlock(copy);
+		uint64_t mapBlock = entry * sizeof(uint64_t) / partInfop->blocksize;
+		for (int i = 0; i < MAX_SNAPSHOTS && retVal == 0; i++) {
+			if (snapshotMaps[i] == NULL || snapshotMaps[i][entry] != 0)
+				continue;
+			snapshotMaps[i][entry] = copy + 1;
+			if (cacheWrite((char*) snapshotMaps[i] + mapBlock * partInfop->blocksize, 1,
+					sb->rootDataPointer + sb->snapshots[i].mapStart + mapBlock) != 1)
+				retVal = -1;
+		}
+	}
+	unlockAllocator();
+	LBAfreeBuffer(old, 1);
+	return retVal;
+}
+
+/**
+ * Rebuilds heldBlocks from the snapshots: the data blocks in use in the bit
+ * vector each of them sees, its block map and its copies. Called after
+ * readBitVector has sized the buffers for the layout.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int loadHeldBlocks() {
+	uint64_t blocks = bitVectorBuffer;
+	uint64_t entries = metadataBlocks();
+	int retVal = 0;
+	uint8_t* view = LBAallocBuffer(blocks);
+	lockAllocator();
+	if (heldBlocks != NULL)
+		LBAfreeBuffer(heldBlocks, blocks);
+	heldBlocks = NULL;
+	for (int i = 0; i < MAX_SNAPSHOTS && retVal == 0; i++) {
+		if (snapshotMaps[i] == NULL)
+			continue;
+		if (heldBlocks == NULL) {
+			heldBlocks = LBAallocBuffer(blocks);
+			memset(heldBlocks, 0, blocks * partInfop->blocksize);
+		}
+		if (readSnapshotBlocks(i, view, blocks, sb->bitVectorStart) != blocks) {
+			retVal = -1;
+			break;
+		}
+		for (uint64_t byte = 0; byte < blocks * partInfop->blocksize; byte++)
+			heldBlocks[byte] |= view[byte];
+		setBits(heldBlocks, sb->snapshots[i].mapStart, snapshotMapBuffer, true);
+		for (uint64_t entry = 0; entry < entries; entry++) {
+			if (snapshotMaps[i][entry] != 0)
+				setBits(heldBlocks, snapshotMaps[i][entry] - 1, 1, true);
+		}
+	}
+	countChunks();
+	unlockAllocator();
+	LBAfreeBuffer(view, blocks);
+	return retVal;
+}
+
+/** Marks the data block as used */
+void setBitOn(uint64_t block) {
+	lockAllocator();
+	if (!(bitVector[block / 8] & (1 << (block % 8)))) {
+		if (blockAvailable(block))
+			chunkFree[block / ALLOC_CHUNK_BLOCKS]--;
+		bitVector[block / 8] |= 1 << (block % 8);
+		bitVectorDirty[block / 8 / partInfop->blocksize] = true;
+		__atomic_fetch_sub(&sb->freeBlocks, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sb->usedBlocks, 1, __ATOMIC_RELAXED);
+	}
+	unlockAllocator();
+}
+
+/** Marks the data block as free */
+void setBitOff(uint64_t block) {
+	lockAllocator();
+	if (bitVector[block / 8] & (1 << (block % 8))) {
+		bitVector[block / 8] &= ~(1 << (block % 8));
+		bitVectorDirty[block / 8 / partInfop->blocksize] = true;
+		if (blockAvailable(block))
+			chunkFree[block / ALLOC_CHUNK_BLOCKS]++;
+		__atomic_fetch_add(&sb->freeBlocks, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&sb->usedBlocks, 1, __ATOMIC_RELAXED);
+	}
+	unlockAllocator();
+}
+
+/**
+ * Frees count data blocks starting at firstBlock (relative to the root data
+ * pointer) and hands their space back to the host by punching a hole,
+ * leaving the bit vector for the caller to write back once it is done.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int freeDataRun(uint64_t firstBlock, uint64_t count) {
+	if (firstBlock + count > sb->totalDataBlocks)
+		return -1;
+
+	lockAllocator();
+	for (uint64_t i = 0; i < count; i++) {
+		setBitOff(firstBlock + i);
+		/* Matchable again only once the release is final, and never from a snapshot */
+		if (!journalEnabled() || blockHeld(firstBlock + i))
+			dedupForget(firstBlock + i);
+	}
+
+	/* The contents are dead unless a snapshot holds them, drop them rather than writing them back */
+	uint64_t i = 0;
+	while (i < count) {
+		if (blockHeld(firstBlock + i)) {
+			i++;
+			continue;
+		}
+		uint64_t run = 1;
+		while (i + run < count && !blockHeld(firstBlock + i + run))
+			run++;
+		cacheInvalidate(run, sb->rootDataPointer + firstBlock + i);
+		if (journalEnabled())
+			deferRelease(firstBlock + i, run);
+		else
+			LBAdiscard(run, sb->rootDataPointer + firstBlock + i);
+		i += run;
+	}
+	unlockAllocator();
+	return 0;
+}
+
+/**
+ * Frees count data blocks starting at firstBlock (relative to the root data
+ * pointer) and writes the bit vector back.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int releaseDataBlocks(uint64_t firstBlock, uint64_t count) {
+	lockAllocator();
+	int retVal = freeDataRun(firstBlock, count) == 0 ? writeBitVector() : -1;
+	unlockAllocator();
+	return retVal;
+}
+
+/**
+ * Frees the node blocks of an extent tree below the given entries.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int releaseExtentNodes(const ExtentHeader* header, const Extent* entries) {
+	if (header->depth == 0)
+		return 0;
+	int retVal = 0;
+	char* node = LBAallocBuffer(1);
+	for (uint64_t e = 0; e < header->count; e++) {
+		if (cacheRead(node, 1, entries[e].start + sb->rootDataPointer) != 1 ||
+				releaseExtentNodes((ExtentHeader*) node, (Extent*) &node[sizeof(ExtentHeader)]) == -1)
+			retVal = -1;
+		if (freeDataRun(entries[e].start, 1) == -1)
+			retVal = -1;
+	}
+	LBAfreeBuffer(node, 1);
+	return retVal;
+}
+
+/**
+ * Frees every data block of the inode, along with its indirect blocks or
+ * extent tree nodes, releasing runs of adjacent blocks together, then
+ * writes the bit vector back once. A block shared with other files only
+ * loses a reference.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int releaseInodeBlocks(Inode_p inode) {
+	uint64_t count = inode->blocksReserved;
+	if (count == 0)
+		return 0;
+
+	uint64_t* blocks = malloc(count * sizeof(uint64_t));
+	if (mapFileBlocks(inode, 0, count, blocks) == -1) {
+		free(blocks);
+		return -1;
+	}
+	/* Shared blocks stay until their last reference goes */
+	lockAllocator();
+	for (uint64_t i = 0; dedupEnabled() && i < count; i++) {
+		if (blocks[i] != NO_BLOCK && !dedupRelease(blocks[i] - sb->rootDataPointer))
+			blocks[i] = NO_BLOCK;
+	}
+
+	int retVal = 0;
+	uint64_t i = 0;
+	while (i < count) {
+		if (blocks[i] == NO_BLOCK) {
+			i++;
+			continue;
+		}
+		uint64_t run = 1;
+		while (i + run < count && blocks[i + run] == blocks[i] + run)
+			run++;
+		if (freeDataRun(blocks[i] - sb->rootDataPointer, run) == -1)
+			retVal = -1;
+		i += run;
+	}
+	free(blocks);
+
+	/* Then the blocks that held the pointers */
+	if (inode->flags & INODE_EXTENTS) {
+		if (releaseExtentNodes(&inode->extentHeader, inode->extents) == -1)
+			retVal = -1;
+	} else {
+		if (count > NUM_DIRECT && freeDataRun(inode->indirectData[0], 1) == -1)
+			retVal = -1;
+		if (count > NUM_DIRECT + sb->maxPointersPerIndirect[0]) {
+			uint64_t* doubleIndirect = LBAallocBuffer(1);
+			uint64_t used = count - NUM_DIRECT - sb->maxPointersPerIndirect[0];
+			cacheRead(doubleIndirect, 1, inode->indirectData[1] + sb->rootDataPointer);
+			for (uint64_t j = 0; j * sb->maxPointersPerIndirect[0] < used; j++) {
+				if (freeDataRun(doubleIndirect[j], 1) == -1)
+					retVal = -1;
+			}
+			LBAfreeBuffer(doubleIndirect, 1);
+			if (freeDataRun(inode->indirectData[1], 1) == -1)
+				retVal = -1;
+		}
+	}
+	if (writeBitVector() == -1)
+		retVal = -1;
+	unlockAllocator();
+	return retVal;
+}
+
+/**
+ * Allocates count free data blocks, the first ones found from goal on,
+ * wrapping around to the start of the bit vector, and marks them used. The
+ * blocks come back in the order found, so a free run is handed out as
+ * adjacent blocks. Blocks a snapshot holds are not free, which is what
+ * keeps every write away from snapshot data.
+ * Returns 0 if successful
+ * Returns -1 if there are not enough free blocks
+ */
+static int allocDataBlocks(uint64_t count, uint64_t goal, uint64_t* blocks) {
+	int retVal = 0;
+	lockAllocator();
+	if (count > sb->freeBlocks) {
+		unlockAllocator();
+		return -1;
+	}
+	if (goal >= sb->totalDataBlocks)
+		goal = 0;
+	uint64_t found = gatherAvailable(goal, sb->totalDataBlocks, count, blocks);
+	found += gatherAvailable(0, goal, count - found, &blocks[found]);
+	/* Blocks waiting for a commit stay out of reach, a commit mid-operation would hold half of it */
+	if (found < count)
+		retVal = -1;
+	else {
+		for (uint64_t i = 0; i < count; i++)
+			setBitOn(blocks[i]);
+	}
+	unlockAllocator();
+	return retVal;
+}
+
+/**
+ * Allocates count adjacent free data blocks, the first run found from goal
+ * on, or failing that from the start of the bit vector, and marks them used.
+ * Returns 0 if successful
+ * Returns -1 if there is no free run that long
+ */
+static int allocDataRun(uint64_t count, uint64_t goal, uint64_t* first) {
+	int retVal = 0;
+	lockAllocator();
+	uint64_t end = sb->totalDataBlocks;
+	uint64_t run = end;
+	if (count <= sb->freeBlocks) {
+		run = goal < end ? findRun(count, goal, end) : end;
+		if (run == end && goal != 0)
+			run = findRun(count, 0, end);
+	}
+	if (run == end)
+		retVal = -1;
+	else {
+		*first = run;
+		for (uint64_t i = 0; i < count; i++)
+			setBitOn(*first + i);
+	}
+	unlockAllocator();
+	return retVal;
+}
+
+/**
+ * The overflow hook of the journal: finds count data blocks that are free
+ * in the bit vector as committed, as one run if there is one, for the
+ * record of a transaction too big for the log. Commits have the volume to
+ * themselves, so nothing allocates the blocks while the journal uses them.
+ * Returns the number of blocks found, as volume blocks in lbas
+ */
+static uint64_t findOverflowBlocks(uint64_t count, uint64_t* lbas) {
+	if (sb == NULL || bitVector == NULL)
+		return 0;
+	lockAllocator();
+	uint64_t found = 0;
+	uint64_t run = findRun(count, 0, sb->totalDataBlocks);
+	if (run != sb->totalDataBlocks) {
+		for (found = 0; found < count; found++)
+			lbas[found] = run + found;
+	} else {
+		found = gatherAvailable(0, sb->totalDataBlocks, count, lbas);
+	}
+	unlockAllocator();
+	for (uint64_t i = 0; i < found; i++)
+		lbas[i] += sb->rootDataPointer;
+	return found;
+}
+
+/**
+ * Fills in the data pointers of an inode for slots file blocks from
+ * pointers, writing out the indirect blocks it needs (taken from indirect).
+ */
+static void setFilePointers(Inode_p inode, const uint64_t* pointers, uint64_t slots, const uint64_t* indirect) {
+	uint64_t pointersPerBlock = sb->maxPointersPerIndirect[0];
+	uint64_t* block = LBAallocBuffer(1);
+
+	inode->flags &= ~INODE_EXTENTS;
+	memset(inode->reserved, 0, sizeof(inode->reserved));
+	for (uint64_t i = 0; i < NUM_DIRECT; i++)
+		inode->directData[i] = i < slots ? pointers[i] : 0;
+	if (slots <= NUM_DIRECT) {
+		LBAfreeBuffer(block, 1);
+		return;
+	}
+
+	/* Single indirect */
+	uint64_t done = NUM_DIRECT;
+	uint64_t used = slots - done < pointersPerBlock ? slots - done : pointersPerBlock;
+	memset(block, 0, partInfop->blocksize);
+	memcpy(block, &pointers[done], used * sizeof(uint64_t));
+	inode->indirectData[0] = *indirect++;
+	cacheWrite(block, 1, inode->indirectData[0] + sb->rootDataPointer);
+	done += used;
+	if (done == slots) {
+		LBAfreeBuffer(block, 1);
+		return;
+	}
+
+	/* Double indirect, its pointers go in first so they can be written last */
+	uint64_t* doubleIndirect = LBAallocBuffer(1);
+	memset(doubleIndirect, 0, partInfop->blocksize);
+	inode->indirectData[1] = *indirect++;
+	for (uint64_t j = 0; done < slots; j++) {
+		used = slots - done < pointersPerBlock ? slots - done : pointersPerBlock;
+		memset(block, 0, partInfop->blocksize);
+		memcpy(block, &pointers[done], used * sizeof(uint64_t));
+		doubleIndirect[j] = *indirect++;
+		cacheWrite(block, 1, doubleIndirect[j] + sb->rootDataPointer);
+		done += used;
+	}
+	cacheWrite(doubleIndirect, 1, inode->indirectData[1] + sb->rootDataPointer);
+	LBAfreeBuffer(doubleIndirect, 1);
+	LBAfreeBuffer(block, 1);
+}
+
+/** Returns the number of extents, one per run of adjacent stored blocks, that map pointers */
+static uint64_t countExtents(const uint64_t* pointers, uint64_t slots) {
+	uint64_t extents = 0;
+	for (uint64_t i = 0; i < slots; i++) {
+		if (pointers[i] != NO_BLOCK && (i == 0 || pointers[i - 1] == NO_BLOCK || pointers[i] != pointers[i - 1] + 1))
+			extents++;
+	}
+	return extents;
+}
+
+/** Returns the number of node blocks the extent tree of slots file blocks at pointers needs */
+static uint64_t extentNodesFor(const uint64_t* pointers, uint64_t slots) {
+	uint64_t entries = countExtents(pointers, slots);
+	uint64_t nodes = 0;
+	while (entries > EXTENT_ROOT_ENTRIES) {
+		entries = (entries + extentsPerNode() - 1) / extentsPerNode();
+		nodes += entries;
+	}
+	return nodes;
+}
+
+/**
+ * Maps an inode for slots file blocks from pointers by extents, one per run
+ * of adjacent stored blocks. The tree is built from the bottom: extents that
+ * do not fit in the inode are packed into full node blocks (taken from
+ * nodes, as many as extentNodesFor gives), and those nodes into nodes above
+ * them, until what is left fits in the inode.
+ */
+static void setFileExtents(Inode_p inode, const uint64_t* pointers, uint64_t slots, const uint64_t* nodes) {
+	uint64_t count = 0;
+	Extent* entries = malloc((countExtents(pointers, slots) + 1) * sizeof(Extent));
+	for (uint64_t i = 0; i < slots; i++) {
+		if (pointers[i] == NO_BLOCK)
+			continue;
+		Extent* last = count > 0 ? &entries[count - 1] : NULL;
+		if (last != NULL && last->fileBlock + last->length == i && last->start + last->length == pointers[i]) {
+			last->length++;
+			continue;
+		}
+		entries[count].start = pointers[i];
+		entries[count].fileBlock = i;
+		entries[count].length = 1;
+		count++;
+	}
+
+	uint64_t perNode = extentsPerNode();
+	uint16_t depth = 0;
+	char* node = LBAallocBuffer(1);
+	while (count > EXTENT_ROOT_ENTRIES) {
+		uint64_t parents = (count + perNode - 1) / perNode;
+		Extent* above = malloc(parents * sizeof(Extent));
+		for (uint64_t p = 0; p < parents; p++) {
+			uint64_t first = p * perNode;
+			uint64_t used = count - first < perNode ? count - first : perNode;
+			ExtentHeader* header = (ExtentHeader*) node;
+			memset(node, 0, partInfop->blocksize);
+			header->count = used;
+			header->depth = depth;
+			memcpy(&node[sizeof(ExtentHeader)], &entries[first], used * sizeof(Extent));
+			above[p].start = *nodes++;
+			above[p].fileBlock = entries[first].fileBlock;
+			above[p].length = 0;
+			cacheWrite(node, 1, above[p].start + sb->rootDataPointer);
+		}
+		free(entries);
+		entries = above;
+		count = parents;
+		depth++;
+	}
+	LBAfreeBuffer(node, 1);
+
+	memset(&inode->extentHeader, 0, sizeof(Inode) - offsetof(Inode, extentHeader));
+	inode->extentHeader.count = count;
+	inode->extentHeader.depth = depth;
+	memcpy(inode->extents, entries, count * sizeof(Extent));
+	inode->flags |= INODE_EXTENTS;
+	free(entries);
+}
+
+/**
+ * Reads the inode into inode and drops all of its data, claiming it as a
+ * new file first if it is not in use.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int emptyFile(const uint64_t inodeID, Inode_p inode) {
+	if (readInode(inodeID, inode) == -1)
+		return -1;
+	if (inode->used == UNUSED_FLAG) {
+		uint8_t flags = inode->flags & ~INODE_EXTENTS;
+		memset(inode, 0, sizeof(Inode));
+		inode->used = USED_FLAG;
+		inode->flags = flags;
+		inode->type = FILE_TYPE;
+		inode->inode = inodeID;
+		inode->parent_p = CURRENT_WORKING_DIRECTORY;
+		__atomic_fetch_add(&sb->usedInodes, 1, __ATOMIC_RELAXED);
+	} else if (releaseInodeBlocks(inode) == -1) {
+		return -1;
+	}
+	inode->size = 0;
+	inode->blocksReserved = 0;
+	inode->dateModified = time(NULL);
+
+	/* Decoded clusters of this file held by open files are stale now */
+	pthread_mutex_lock(&openFileMutex);
+	for (int fd = 0; openFileList != NULL && fd < FDOPENMAX; fd++) {
+		if (openFileList[fd].flags != FDOPENFREE && openFileList[fd].inodeId == inodeID)
+			openFileList[fd].clusterIndex = UINT64_MAX;
+	}
+	pthread_mutex_unlock(&openFileMutex);
+	return 0;
+}
+
+/** Returns the number of indirect blocks a file of slots blocks needs */
+static uint64_t indirectBlocksFor(uint64_t slots) {
+	uint64_t pointersPerBlock = sb->maxPointersPerIndirect[0];
+	uint64_t indirectBlocks = 0;
+	if (slots > NUM_DIRECT)
+		indirectBlocks++;
+	if (slots > NUM_DIRECT + pointersPerBlock)
+		indirectBlocks += 1 + (slots - NUM_DIRECT - pointersPerBlock + pointersPerBlock - 1) / pointersPerBlock;
+	return indirectBlocks;
+}
+
+/* A block about to be written, for finding repeats within one write */
+typedef struct BlockPrint {
+	uint64_t fingerprint;
+	uint64_t slot;
+} BlockPrint;
+
+static int compareBlockPrints(const void* a, const void* b) {
+	const BlockPrint* x = a;
+	const BlockPrint* y = b;
+	if (x->fingerprint != y->fingerprint)
+		return x->fingerprint < y->fingerprint ? -1 : 1;
+	return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+/**
+ * Matches the blocks of a file about to be written against the blocks
+ * already stored and against each other. A block found on the volume takes
+ * that block as its pointer, and a reference to it at once so no other
+ * file can free it meanwhile, and gets no writer; a repeat of an earlier
+ * block of the same write gets the slot of that block as its writer.
+ * Returns the number of blocks that no longer need writing
+ */
+static uint64_t matchBlocks(char** blockData, uint64_t slots, uint64_t* pointers, uint64_t* writer,
+		uint64_t* fingerprints) {
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t matched = 0;
+	uint64_t fresh = 0;
+	BlockPrint* prints = malloc((slots + 1) * sizeof(BlockPrint));
+
+	for (uint64_t i = 0; i < slots; i++) {
+		if (blockData[i] != NULL)
+			fingerprints[i] = dedupFingerprint(blockData[i], blockSize);
+	}
+	lockAllocator();
+	for (uint64_t i = 0; i < slots; i++) {
+		if (blockData[i] == NULL)
+			continue;
+		uint64_t found = dedupFind(fingerprints[i], blockData[i]);
+		if (found != UINT64_MAX && !blockFreed(found) && dedupShare(found)) {
+			pointers[i] = found;
+			writer[i] = NO_BLOCK;
+			matched++;
+			continue;
+		}
+		prints[fresh].fingerprint = fingerprints[i];
+		prints[fresh].slot = i;
+		fresh++;
+	}
+	unlockAllocator();
+
+	/* Equal fingerprints end up next to each other, the first slot writes */
+	qsort(prints, fresh, sizeof(BlockPrint), compareBlockPrints);
+	uint64_t first = 0;
+	for (uint64_t k = 1; k < fresh; k++) {
+		if (prints[k].fingerprint != prints[first].fingerprint) {
+			first = k;
+			continue;
+		}
+		uint64_t slot = prints[k].slot;
+		if (memcmp(blockData[slot], blockData[prints[first].slot], blockSize) == 0) {
+			writer[slot] = prints[first].slot;
+			matched++;
+		}
+	}
+	free(prints);
+	return matched;
+}
+
+/**
+ * writeFile for a caller that already holds the volume lock and the
+ * inode's lock exclusively.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int writeFileData(const uint64_t inodeID, char* source, const uint64_t length) {
+	Inode inode;
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t pointersPerBlock = sb->maxPointersPerIndirect[0];
+
+	/* A file written again goes back where it was, or as near as the free space allows */
+	uint64_t goal = 0;
+	if (readInode(inodeID, &inode) == 0 && inode.used != UNUSED_FLAG && inode.blocksReserved != 0 &&
+			mapFileBlocks(&inode, 0, 1, &goal) == 0 && goal != NO_BLOCK)
+		goal -= sb->rootDataPointer;
+	else
+		goal = 0;
+	if (emptyFile(inodeID, &inode) == -1)
+		return -1;
+
+	/* Extents only need their node blocks once the data blocks are known */
+	bool extents = extentsSupported();
+	uint64_t slots = (length + blockSize - 1) / blockSize;
+	if (extents ? slots > UINT32_MAX : slots > NUM_DIRECT + pointersPerBlock + sb->maxPointersPerIndirect[1]) {
+		printf("Error: This filesystem does not support this large of a file size");
+		writeInode(inodeID, &inode);
+		writeBitVector();
+		return -1;
+	}
+	uint64_t indirectBlocks = extents ? 0 : indirectBlocksFor(slots);
+
+	/* Lay out the blocks to store, NO_BLOCK for those compression saved */
+	uint64_t* pointers = malloc((slots + 1) * sizeof(uint64_t));
+	char* staging = NULL;
+	char* tail = LBAallocBuffer(1);
+	uint64_t stored = slots;
+	if (inode.flags & INODE_COMPRESSED) {
+		uint64_t clusterSize = COMPRESS_CLUSTER_BLOCKS * blockSize;
+		staging = LBAallocBuffer(slots);
+		stored = 0;
+		for (uint64_t c = 0; c * clusterSize < length; c++) {
+			uint64_t bytes = clusterBytes(length, c);
+			uint64_t blocks = (bytes + blockSize - 1) / blockSize;
+			uint64_t used = packCluster(&source[c * clusterSize], bytes, &staging[c * clusterSize]);
+			for (uint64_t i = 0; i < blocks; i++)
+				pointers[c * COMPRESS_CLUSTER_BLOCKS + i] = i < used ? 0 : NO_BLOCK;
+			stored += used;
+		}
+	} else {
+		for (uint64_t i = 0; i < slots; i++)
+			pointers[i] = 0;
+		/* The partial last block goes out zero padded */
+		if (length % blockSize != 0) {
+			memset(tail, 0, blockSize);
+			memcpy(tail, &source[(slots - 1) * blockSize], length % blockSize);
+		}
+	}
+
+	/* Where each stored block comes from, and which slot writes it */
+	char** blockData = malloc((slots + 1) * sizeof(char*));
+	uint64_t* writer = malloc((slots + 1) * sizeof(uint64_t));
+	uint64_t* fingerprints = malloc((slots + 1) * sizeof(uint64_t));
+	for (uint64_t i = 0; i < slots; i++) {
+		writer[i] = pointers[i] == NO_BLOCK ? NO_BLOCK : i;
+		if (pointers[i] == NO_BLOCK)
+			blockData[i] = NULL;
+		else if (staging != NULL)
+			blockData[i] = &staging[i * blockSize];
+		else if (i == slots - 1 && length % blockSize != 0)
+			blockData[i] = tail;
+		else
+			blockData[i] = &source[i * blockSize];
+	}
+	if (dedupEnabled())
+		stored -= matchBlocks(blockData, slots, pointers, writer, fingerprints);
+
+	uint64_t* blocks = malloc((stored + indirectBlocks + 1) * sizeof(uint64_t));
+	uint64_t* nodes = NULL;
+	/* One run from where the file was, scattered blocks only when no run is that long */
+	int allocated = -1;
+	uint64_t first;
+	if (stored + indirectBlocks > 1 && allocDataRun(stored + indirectBlocks, goal, &first) == 0) {
+		for (uint64_t i = 0; i < stored + indirectBlocks; i++)
+			blocks[i] = first + i;
+		allocated = 0;
+	} else {
+		allocated = allocDataBlocks(stored + indirectBlocks, goal, blocks);
+	}
+	if (allocated == 0) {
+		uint64_t next = 0;
+		for (uint64_t i = 0; i < slots; i++) {
+			if (writer[i] == i)
+				pointers[i] = blocks[next++];
+			else if (writer[i] != NO_BLOCK)
+				pointers[i] = pointers[writer[i]];
+		}
+	}
+	/* The extent tree nodes go right after the data they map, if there is room */
+	if (allocated == 0 && extents) {
+		indirectBlocks = extentNodesFor(pointers, slots);
+		nodes = malloc((indirectBlocks + 1) * sizeof(uint64_t));
+		uint64_t nodeGoal = stored != 0 ? blocks[stored - 1] + 1 : goal;
+		if (indirectBlocks != 0 && allocDataBlocks(indirectBlocks, nodeGoal, nodes) == -1) {
+			lockAllocator();
+			for (uint64_t i = 0; i < stored; i++)
+				freeDataRun(blocks[i], 1);
+			unlockAllocator();
+			allocated = -1;
+		}
+	}
+	if (allocated == -1) {
+		printf("Error: Not enough free blocks for inode %lu", inodeID);
+		/* Give back the references matchBlocks took */
+		lockAllocator();
+		for (uint64_t i = 0; dedupEnabled() && i < slots; i++) {
+			if (pointers[i] != NO_BLOCK && writer[i] == NO_BLOCK && dedupRelease(pointers[i]))
+				freeDataRun(pointers[i], 1);
+		}
+		unlockAllocator();
+		free(pointers);
+		free(blocks);
+		free(nodes);
+		free(blockData);
+		free(writer);
+		free(fingerprints);
+		LBAfreeBuffer(staging, slots);
+		LBAfreeBuffer(tail, 1);
+		writeInode(inodeID, &inode);
+		writeBitVector();
+		return -1;
+	}
+
+	/* One segment per run of adjacent blocks to write */
+	lbaSegment_p segments = malloc((stored + 1) * sizeof(lbaSegment_t));
+	int numSegments = 0;
+	for (uint64_t i = 0; i < slots; i++) {
+		if (writer[i] != i)
+			continue;
+		char* data = blockData[i];
+
+		lbaSegment_p last = numSegments > 0 ? &segments[numSegments - 1] : NULL;
+		if (last != NULL && pointers[i] == last->lbaPosition - sb->rootDataPointer + last->lbaCount &&
+				data == (char*)last->buffer + last->lbaCount * blockSize) {
+			last->lbaCount++;
+			continue;
+		}
+		segments[numSegments].buffer = data;
+		segments[numSegments].lbaCount = 1;
+		segments[numSegments].lbaPosition = pointers[i] + sb->rootDataPointer;
+		numSegments++;
+	}
+
+	int retVal = 0;
+	for (int i = 0; i < numSegments; i++)
+		cacheInvalidate(segments[i].lbaCount, segments[i].lbaPosition);
+	if (LBAwritev(segments, numSegments) != stored) {
+		printf("Error: Failed writing the data of inode %lu", inodeID);
+		retVal = -1;
+	}
+
+	/* Take the references now that every block this file points at exists */
+	lockAllocator();
+	for (uint64_t i = 0; dedupEnabled() && i < slots; i++) {
+		if (pointers[i] == NO_BLOCK || writer[i] == NO_BLOCK)
+			continue;
+		if (writer[i] == i)
+			dedupAdd(pointers[i], fingerprints[i]);
+		else
+			dedupShare(pointers[i]);
+	}
+	unlockAllocator();
+
+	if (extents)
+		setFileExtents(&inode, pointers, slots, nodes);
+	else
+		setFilePointers(&inode, pointers, slots, &blocks[stored]);
+	inode.size = length;
+	inode.blocksReserved = slots;
+	if (writeInode(inodeID, &inode) == -1 || writeBitVector() == -1)
+		retVal = -1;
+
+	free(segments);
+	free(pointers);
+	free(blocks);
+	free(nodes);
+	free(blockData);
+	free(writer);
+	free(fingerprints);
+	LBAfreeBuffer(staging, slots);
+	LBAfreeBuffer(tail, 1);
+	return retVal;
+}
+
+/**
+ * Replaces the data of the file with length bytes from source. A file with
+ * INODE_COMPRESSED set goes through packCluster one cluster at a time into a
+ * staging area laid out like the uncompressed file; blocks a compressed
+ * cluster does not need get NO_BLOCK pointers and no space. On a
+ * deduplicated volume blocks that are already stored, or repeat an earlier
+ * block of the file, are shared instead. Every block left then goes out with
+ * a single LBAwritev.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int writeFile(const uint64_t inodeID, char* source, const uint64_t length) {
+	lockVolume(false);
+	lockInode(inodeID, true);
+	int retVal = writeFileData(inodeID, source, length);
+	unlockInode(inodeID);
+	unlockVolume();
+	if (commitMetadata() == -1)
+		retVal = -1;
+	return retVal;
+}
+
+/**
+ * Turns compression of the file on or off, rewriting any data it already
+ * has in the new form.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int setFileCompression(const uint64_t inodeID, bool compressed) {
+	Inode inode;
+	int retVal = 0;
+
+	lockVolume(false);
+	lockInode(inodeID, true);
+	if (readInode(inodeID, &inode) == -1)
+		retVal = -1;
+	else if (((inode.flags & INODE_COMPRESSED) != 0) != compressed) {
+		/* Read the data back in its current form before the flag changes */
+		uint64_t size = inode.used != UNUSED_FLAG ? inode.size : 0;
+		char* data = malloc(size + 1);
+		if (size != 0 && readInodeData(&inode, data, 0) != size)
+			retVal = -1;
+		else {
+			inode.flags ^= INODE_COMPRESSED;
+			retVal = writeInode(inodeID, &inode);
+			if (retVal == 0 && inode.used != UNUSED_FLAG)
+				retVal = writeFileData(inodeID, data, size);
+		}
+		free(data);
+	}
+	unlockInode(inodeID);
+	unlockVolume();
+	if (commitMetadata() == -1)
+		retVal = -1;
+	return retVal;
+}
+
+/**
+ * cloneFile for a caller that already holds the volume lock and the locks
+ * of both inodes.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int cloneFileData(const uint64_t sourceID, const uint64_t destID) {
+	Inode source;
+	Inode dest;
+	if (sourceID == destID)
+		return 0;
+	if (readInode(sourceID, &source) == -1 || source.used == UNUSED_FLAG)
+		return -1;
+
+	/* References first, so blocks the two files already share survive emptying the destination */
+	uint64_t slots = source.blocksReserved;
+	uint64_t* pointers = malloc((slots + 1) * sizeof(uint64_t));
+	if (mapFileBlocks(&source, 0, slots, pointers) == -1) {
+		free(pointers);
+		return -1;
+	}
+	lockAllocator();
+	for (uint64_t i = 0; i < slots; i++) {
+		if (pointers[i] == NO_BLOCK)
+			continue;
+		pointers[i] -= sb->rootDataPointer;
+		dedupShare(pointers[i]);
+	}
+	unlockAllocator();
+
+	bool extents = extentsSupported();
+	uint64_t indirectBlocks = extents ? extentNodesFor(pointers, slots) : indirectBlocksFor(slots);
+	uint64_t* blocks = malloc((indirectBlocks + 1) * sizeof(uint64_t));
+	/* The pointer blocks go right after the data they point to, if there is room */
+	uint64_t indirectGoal = slots != 0 && pointers[slots - 1] != NO_BLOCK ? pointers[slots - 1] + 1 : 0;
+	int emptied = emptyFile(destID, &dest);
+	if (emptied == -1 || allocDataBlocks(indirectBlocks, indirectGoal, blocks) == -1) {
+		lockAllocator();
+		for (uint64_t i = 0; i < slots; i++) {
+			if (pointers[i] != NO_BLOCK)
+				dedupRelease(pointers[i]);
+		}
+		unlockAllocator();
+		if (emptied == 0)
+			writeInode(destID, &dest);
+		writeBitVector();
+		free(pointers);
+		free(blocks);
+		return -1;
+	}
+
+	/* The copy has the layout of the source, compressed or not */
+	if (extents)
+		setFileExtents(&dest, pointers, slots, blocks);
+	else
+		setFilePointers(&dest, pointers, slots, blocks);
+	dest.flags = (dest.flags & ~INODE_COMPRESSED) | (source.flags & INODE_COMPRESSED);
+	dest.size = source.size;
+	dest.blocksReserved = slots;
+	int retVal = 0;
+	if (writeInode(destID, &dest) == -1 || writeBitVector() == -1)
+		retVal = -1;
+	free(pointers);
+	free(blocks);
+	return retVal;
+}
+
+/**
+ * Points the destination file at the data of the source file, taking a
+ * reference to every block, so the copy only writes its indirect blocks or
+ * extent tree nodes. Only for deduplicated volumes, where the references are counted.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int cloneFile(const uint64_t sourceID, const uint64_t destID) {
+	lockVolume(false);
+	lockInodePair(sourceID, destID);
+	int retVal = cloneFileData(sourceID, destID);
+	unlockInodePair(sourceID, destID);
+	unlockVolume();
+	if (commitMetadata() == -1)
+		retVal = -1;
+	return retVal;
+}
+
+/** Returns a copy of the blocks in use or held by a snapshot, for discardReleased */
+static uint8_t* blocksInUse() {
+	uint64_t bytes = bitVectorBlocks() * partInfop->blocksize;
+	uint8_t* inUse = malloc(bytes);
+	for (uint64_t byte = 0; byte < bytes; byte++)
+		inUse[byte] = bitVector[byte] | (heldBlocks != NULL ? heldBlocks[byte] : 0);
+	return inUse;
+}
+
+/** Discards the blocks that were in before but are neither in use nor held by a snapshot any more */
+static void discardReleased(const uint8_t* before) {
+	uint64_t block = 0;
+	lockAllocator();
+	while (block < sb->totalDataBlocks) {
+		uint64_t run = 0;
+		while (block + run < sb->totalDataBlocks && (before[(block + run) / 8] & (1 << ((block + run) % 8))) &&
+				!(bitVector[(block + run) / 8] & (1 << ((block + run) % 8))) && !blockHeld(block + run))
+			run++;
+		if (run == 0) {
+			block++;
+			continue;
+		}
+		cacheInvalidate(run, sb->rootDataPointer + block);
+		if (journalEnabled())
+			deferRelease(block, run);
+		else
+			LBAdiscard(run, sb->rootDataPointer + block);
+		block += run;
+	}
+	unlockAllocator();
+}
+
+/**
+ * fs_snapshot for a caller that holds volumeLock exclusive.
+ * returns the number of the snapshot if successful
+ * returns -1 if unsuccessful
+ */
+static int takeSnapshot() {
+	int snapshot = -1;
+	for (int i = 0; i < MAX_SNAPSHOTS && snapshot == -1; i++) {
+		if (sb->snapshots[i].created == 0)
+			snapshot = i;
+	}
+	if (snapshot == -1) {
+		printf("Error: All %d snapshots are in use\n", MAX_SNAPSHOTS);
+		return -1;
+	}
+
+	/* The snapshot starts out sharing every metadata block as the volume holds it now */
+	if (flushInodeCache() == -1 || writeBitVector() == -1)
+		return -1;
+	uint64_t blocks = snapshotMapBlocks();
+	lockAllocator();
+	uint64_t first = findRun(blocks, 0, sb->totalDataBlocks);
+	if (first == sb->totalDataBlocks) {
+		unlockAllocator();
+		printf("Error: No run of %lu free blocks for the snapshot\n", blocks);
+		return -1;
+	}
+	uint64_t* map = LBAallocBuffer(blocks);
+	memset(map, 0, blocks * partInfop->blocksize);
+	if (cacheWrite(map, blocks, sb->rootDataPointer + first) != blocks) {
+		unlockAllocator();
+		LBAfreeBuffer(map, blocks);
+		return -1;
 	}
-	free(buffer);
-	return 0;
+	for (uint64_t i = 0; i < blocks; i++)
+		holdBlock(first + i);
+	sb->snapshots[snapshot].mapStart = first;
+	snapshotMapBuffer = blocks;
+	snapshotMaps[snapshot] = map;
+	__atomic_add_fetch(&snapshotCount, 1, __ATOMIC_RELEASE);
+	unlockAllocator();
+	cacheSetWriteHook(preserveShared);
+
+	sb->snapshots[snapshot].usedBlocks = sb->usedBlocks;
+	sb->snapshots[snapshot].usedInodes = sb->usedInodes;
+	sb->snapshots[snapshot].created = time(NULL);
+	if (writeSuperBlock() == -1 || loadHeldBlocks() == -1)
+		return -1;
+	/* A snapshot is only worth having once it is on stable storage */
+	if (flushMetadata() != 0)
+		return -1;
+	return snapshot;
 }
 
 /**
- * Reads the data of the file from the filesystem and stores it into the destination.
- * If the pointer is null, then memory will be allocated to hold the file data.
- * @param destination the buffer that the file data will be stored in.
- * @param inodeID the file's inode.
- * @param length is the number of bytes to read. 0 if reading the entire file.
- * Returns the number of bytes read into destination if successful
- * Returns 0 if unsuccessful
+ * Takes a snapshot of the volume: all it writes is an empty block map, one
+ * entry per metadata block, and the bit vector it sees holds every data
+ * block that was in use. Block maps and copies are held rather than marked
+ * used, so they belong to no point in time.
+ * returns the number of the snapshot if successful
+ * returns -1 if unsuccessful
  */
-uint64_t readFile(char* destination, const uint64_t inodeID, const uint64_t length) {
-	Inode_p inodeBuffer = malloc(sizeof(Inode));
-	uint64_t bytesToRead;
-	uint64_t numberOfBlocksToRead;
-	uint64_t blockToRead;
-	char* blockBuffer = malloc(partInfop->blocksize);
-	memset(blockBuffer, 0, partInfop->blocksize);
-	char* indirectBlockBuffer = malloc(partInfop->blocksize * NUM_INDIRECT);
+int fs_snapshot() {
+	lockVolume(true);
+	int snapshot = takeSnapshot();
+	unlockVolume();
+	return snapshot;
+}
 
-	if (readInode(inodeID, inodeBuffer) == -1) {
-		printf("Error: Failed retrieving inode %lu", inodeID);
-		return 0;
+/**
+ * Deletes a snapshot, freeing its block map, its copies and the blocks only
+ * it was holding.
+ * returns 0 if successful
+ * returns -1 if there is no such snapshot
+ */
+int fs_snapshotDelete(int snapshot) {
+	lockVolume(true);
+	if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS || sb->snapshots[snapshot].created == 0) {
+		unlockVolume();
+		return -1;
 	}
 
-	if (length == 0)
-		bytesToRead = inodeBuffer->size;
-	else
-		bytesToRead = length;
-
-	if (destination == NULL)
-		destination = malloc(bytesToRead);
+	uint8_t* before = blocksInUse();
+	lockAllocator();
+	LBAfreeBuffer(snapshotMaps[snapshot], snapshotMapBuffer);
+	snapshotMaps[snapshot] = NULL;
+	__atomic_sub_fetch(&snapshotCount, 1, __ATOMIC_RELEASE);
+	unlockAllocator();
+	memset(&sb->snapshots[snapshot], 0, sizeof(SnapshotRecord));
+	int retVal = 0;
+	if (writeSuperBlock() == -1 || loadHeldBlocks() == -1)
+		retVal = -1;
+	discardReleased(before);
+	free(before);
+	unlockVolume();
+	if (commitMetadata() == -1)
+		retVal = -1;
+	return retVal;
+}
 
-	numberOfBlocksToRead = (bytesToRead + partInfop->blocksize - 1) / partInfop->blocksize;
-	uint32_t j = 0;
-	for (uint32_t i = 0; i < numberOfBlocksToRead; i++) {
-		if (i < NUM_DIRECT) {
-			blockToRead = sb->rootDataPointer + inodeBuffer->directData[i];
-		} else if (i < NUM_DIRECT + sb->maxPointersPerIndirect[0]) {
-			if (i == NUM_DIRECT)
-				LBAread(indirectBlockBuffer, 1, inodeBuffer->indirectData[0]);
+/**
+ * fs_snapshotRestore for a caller that holds volumeLock exclusive.
+ * returns 0 if successful
+ * returns -1 if unsuccessful
+ */
+static int restoreSnapshot(int snapshot) {
+	if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS || sb->snapshots[snapshot].created == 0)
+		return -1;
 
-			blockToRead = indirectBlockBuffer[i-NUM_DIRECT] + sb->rootDataPointer;
-		} else {
-			if (i == NUM_DIRECT + sb->maxPointersPerIndirect[0])
-				LBAread(&indirectBlockBuffer[partInfop->blocksize], 1, inodeBuffer->indirectData[1] + sb->rootDataPointer);
-
-			if ((i - (NUM_DIRECT + sb->maxPointersPerIndirect[0])) % sb->maxPointersPerIndirect[0] == 0) {
-				LBAread(indirectBlockBuffer, 1, indirectBlockBuffer[partInfop->blocksize + j] + sb->rootDataPointer);
-				j++;
-				if (j > sb->maxPointersPerIndirect[0] - 1) {
-					printf("Error: This filesystem does not support this large of a file size");
-					return 0;
-				}
-			}
-			blockToRead = indirectBlockBuffer[((i - NUM_DIRECT) % sb->maxPointersPerIndirect[0])] + sb->rootDataPointer;
-		}
-		if (i == numberOfBlocksToRead - 1) {
-			LBAread(blockBuffer, 1, blockToRead);
-			memcpy(&destination[i], blockBuffer, (bytesToRead % partInfop->blocksize));
-		} else {
-			LBAread(&destination[i], 1, blockToRead);
-		}
+	/* readBitVector forgets the blocks waiting on a commit, so let them settle first */
+	if (flushMetadata() != 0)
+		return -1;
+	uint8_t* before = blocksInUse();
+	uint64_t entries = metadataBlocks();
+	char* block = LBAallocBuffer(1);
+	int retVal = 0;
+	/* Only the blocks changed since the snapshot differ from it, one at a time */
+	for (uint64_t entry = 0; entry < entries && retVal == 0; entry++) {
+		uint64_t copy = snapshotMaps[snapshot][entry];
+		if (copy != 0 && (cacheRead(block, 1, sb->rootDataPointer + copy - 1) != 1 ||
+				cacheWrite(block, 1, sb->inodeStart + entry) != 1))
+			retVal = -1;
 	}
-	return bytesToRead;
+	LBAfreeBuffer(block, 1);
+	if (retVal == 0 && (readBitVector() == -1 || loadHeldBlocks() == -1))
+		retVal = -1;
+	dropInodeCache();
+	sb->usedBlocks = sb->snapshots[snapshot].usedBlocks;
+	sb->freeBlocks = sb->totalDataBlocks - sb->usedBlocks;
+	if (loadInodeMap() == -1)
+		retVal = -1;
+	if (sb->dedupBlocks != 0 &&
+			dedupStart(sb->dedupStart, sb->dedupBlocks, sb->rootDataPointer, sb->totalDataBlocks) != 0)
+		retVal = -1;
+	if (writeSuperBlock() == -1)
+		retVal = -1;
+	discardReleased(before);
+	free(before);
+
+	/* Whatever open files decoded belongs to the files that were just replaced */
+	pthread_mutex_lock(&openFileMutex);
+	for (int fd = 0; openFileList != NULL && fd < FDOPENMAX; fd++)
+		openFileList[fd].clusterIndex = UINT64_MAX;
+	pthread_mutex_unlock(&openFileMutex);
+	if (flushMetadata() != 0)
+		retVal = -1;
+	return retVal;
 }
 
 /**
- * Given an inode number and an Inode_p pointer, readInode
- * will read from the request inode into either a buffer already
- * preallocated, or will allocate a buffer if the pointer is null.
- * Returns 0 if successful
- * Returns -1 if unsuccessful
+ * Rolls the volume back to a snapshot by writing its copies over the
+ * metadata blocks changed since it was taken; those it still shares are
+ * already as it saw them. Other snapshots sharing the overwritten blocks
+ * get copies of their own first, like for any other write.
+ * returns 0 if successful
+ * returns -1 if unsuccessful
  */
-int readInode(uint64_t inodeID, Inode_p inodeBuffer) {
-	if (inodeID >= sb->numInodes || inodeID < 0)
-		return -1;
+int fs_snapshotRestore(int snapshot) {
+	lockVolume(true);
+	int retVal = restoreSnapshot(snapshot);
+	unlockVolume();
+	return retVal;
+}
 
-	if (inodeBuffer == NULL) {
-		inodeBuffer = malloc(sizeof(Inode));
-		memset(inodeBuffer, 0, sizeof(Inode));
+/** Outputs the snapshots of the volume */
+void fs_snapshotList() {
+	lockVolume(false);
+	for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+		if (sb->snapshots[i].created == 0)
+			continue;
+		time_t created = sb->snapshots[i].created;
+		printf("Snapshot %d: %.24s, %ld blocks and %ld inodes used\n", i, ctime(&created),
+			sb->snapshots[i].usedBlocks, sb->snapshots[i].usedInodes);
 	}
-
-	char* buffer = malloc(partInfop->blocksize * 2);
-	memset(buffer, 0, partInfop->blocksize * 2);
-	uint64_t byteLocation = inodeID * sizeof(Inode) + partInfop->blocksize * sb->inodeStart;
-	uint64_t blockLocation = byteLocation / partInfop->blocksize;
-	uint64_t offset = byteLocation % partInfop->blocksize;
-	if (offset > partInfop->blocksize - sizeof(Inode))
-		LBAread(buffer, 2, blockLocation);
-	else
-		LBAread(buffer, 1, blockLocation);
-	memcpy(inodeBuffer, &buffer[offset], sizeof(Inode));
-	free(buffer);
-	return 0;
+	unlockVolume();
 }
 
 /**
- * Given an inode number and an Inode_p buffer, writeInode
- * will write to the given inode number from the provided buffer.
- * The inode buffer must be preallocated with the contents.
- * Returns 0 if successful
- * Returns -1 if unsuccessful
+ * readSnapshotFile for a caller that holds volumeLock.
+ * Returns the number of bytes read into destination if successful
+ * Returns 0 if unsuccessful
  */
-int writeInode(uint64_t inodeID, Inode_p inodeBuffer) {
-	if (inodeBuffer == NULL || inodeID >= sb->numInodes || inodeID < 0)
-		return -1;
+static uint64_t readSnapshotData(int snapshot, char* destination, const uint64_t inodeID, const uint64_t length) {
+	if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS || sb->snapshots[snapshot].created == 0 ||
+			inodeID >= sb->numInodes)
+		return 0;
 
-	char* buffer = malloc(partInfop->blocksize * 2);
-	memset(buffer, 0, partInfop->blocksize * 2);
-	uint64_t byteLocation = inodeID * sizeof(Inode) + partInfop->blocksize * sb->inodeStart;
-	uint64_t blockLocation = byteLocation / partInfop->blocksize;
-	uint64_t offset = byteLocation % partInfop->blocksize;
-	if (offset > partInfop->blocksize - sizeof(Inode)) {
-		LBAread(buffer, 2, blockLocation);
-		memcpy(&buffer[offset], inodeBuffer, sizeof(Inode));
-		LBAwrite(buffer, 2, blockLocation);
-	} else {
-		LBAread(buffer, 1, blockLocation);
-		memcpy(&buffer[offset], inodeBuffer, sizeof(Inode));
-		LBAwrite(buffer, 1, blockLocation);
+	Inode inode;
+	uint64_t blockLocation, offset;
+	uint64_t blocks = locateInode(inodeID, &blockLocation, &offset);
+	blockLocation += sb->inodeStart;
+	char* buffer = LBAallocBuffer(2);
+	if (readSnapshotBlocks(snapshot, buffer, blocks, blockLocation) != blocks) {
+		LBAfreeBuffer(buffer, 2);
+		return 0;
 	}
-	free(buffer);
-	return 0;
+	loadInode(&inode, &buffer[offset]);
+	LBAfreeBuffer(buffer, 2);
+	if (inode.used == UNUSED_FLAG)
+		return 0;
+	return readInodeData(&inode, destination, length);
+}
+
+/**
+ * Reads a file as it was when the snapshot was taken, through the inode the
+ * snapshot sees; its data blocks are still where that inode says.
+ * Returns the number of bytes read into destination if successful
+ * Returns 0 if unsuccessful
+ */
+uint64_t readSnapshotFile(int snapshot, char* destination, const uint64_t inodeID, const uint64_t length) {
+	lockVolume(false);
+	uint64_t bytesRead = readSnapshotData(snapshot, destination, inodeID, length);
+	unlockVolume();
+	return bytesRead;
 }
 
 /**
@@ -291,78 +2877,275 @@ void initWorkingDirectory() {
     
     
 }
-int check_fs() {
-	SuperBlock_p buffer = malloc(partInfop->blocksize);
-	LBAread(buffer, 1, 0);
+
+/**
+ * check_fs for a caller that holds volumeLock exclusive.
+ * Returns 1 if filesystem exists
+ * Returns 0 if filesystem does not exist
+ */
+static int mountVolume() {
+	unloadSnapshotMaps();
+	SuperBlock_p buffer = LBAallocBuffer(1);
+	cacheRead(buffer, 1, 0);
 	if (buffer->superSignature != SUPER_SIGNATURE || buffer->superSignature2 != SUPER_SIGNATURE2) {
-		free(buffer);
+		LBAfreeBuffer(buffer, 1);
 		return 0;
 	}
 	sb = malloc(sizeof(SuperBlock));
 	memcpy(sb, buffer, sizeof(SuperBlock));
-	free(buffer);
+	/* Volumes formatted before checksums may hold anything past superSignature2 */
+	if (sb->checksumBlocks != LBAchecksumBlocks(partInfop->numberOfBlocks, partInfop->blocksize) ||
+			sb->checksumStart <= sb->bitVectorStart ||
+			sb->checksumStart + sb->checksumBlocks != sb->rootDataPointer) {
+		sb->checksumStart = 0;
+		sb->checksumBlocks = 0;
+	}
+	if (sb->checksumBlocks != 0 && LBAchecksumStart(sb->checksumStart, sb->checksumBlocks) != 0)
+		printf("Could not load the block checksums, reads will not be verified\n");
+	/* Volumes formatted before the journal may hold anything here too */
+	if (sb->journalStart != 1 || sb->journalBlocks != journalBlocksFor(partInfop->numberOfBlocks) ||
+			sb->inodeStart != sb->journalStart + sb->journalBlocks) {
+		sb->journalStart = 0;
+		sb->journalBlocks = 0;
+	}
+	/* Replay before anything else is loaded, the superblock itself may be in the journal */
+	if (sb->journalBlocks != 0) {
+		journalSetOverflow(findOverflowBlocks);
+		int replayed = journalStart(sb->journalStart, sb->journalBlocks);
+		if (replayed == -1) {
+			printf("Could not replay the metadata journal\n");
+			LBAfreeBuffer(buffer, 1);
+			return 0;
+		}
+		if (replayed > 0) {
+			cacheInvalidate(1, 0);
+			cacheRead(buffer, 1, 0);
+			memcpy(sb, buffer, sizeof(SuperBlock));
+		}
+		/* A mapped volume bypasses the block cache, so the journal would never see a write */
+		if (LBAisMapped()) {
+			journalStop();
+			printf("Warning: the metadata journal is inactive on a memory-mapped partition, a crash may leave the volume inconsistent\n");
+		}
+	}
+	LBAfreeBuffer(buffer, 1);
+	/* Volumes formatted before INODE_BYTES inodes packed them back to back, and may hold anything here */
+	if (sb->inodeBytes != INODE_BYTES || partInfop->blocksize % INODE_BYTES != 0 ||
+			sb->bitVectorStart != sb->inodeStart + (sb->numInodes * INODE_BYTES + partInfop->blocksize - 1) / partInfop->blocksize)
+		sb->inodeBytes = 0;
+	/* Volumes formatted before the pointer count fix recorded 0 here */
+	if (sb->maxPointersPerIndirect[0] == 0) {
+		sb->maxPointersPerIndirect[0] = partInfop->blocksize / sizeof(uint64_t);
+		for (uint32_t i = 1; i < NUM_INDIRECT; i++)
+			sb->maxPointersPerIndirect[i] = sb->maxPointersPerIndirect[i - 1] * sb->maxPointersPerIndirect[0];
+	}
+	uint64_t dedupEnd = sb->checksumBlocks != 0 ? sb->checksumStart : sb->rootDataPointer;
+	if (sb->dedupBlocks != dedupTableBlocks(partInfop->numberOfBlocks, partInfop->blocksize) ||
+			sb->dedupStart <= sb->bitVectorStart || sb->dedupStart + sb->dedupBlocks != dedupEnd) {
+		sb->dedupStart = 0;
+		sb->dedupBlocks = 0;
+	}
+	/* Volumes formatted before lazy initialization zeroed the whole inode table */
+	if (sb->inodeGroupBlocks != inodeGroupBlocksFor(sb->bitVectorStart - sb->inodeStart))
+		sb->inodeGroupBlocks = 0;
+	if (readBitVector() == -1)
+		return 0;
+	/* Volumes formatted before snapshots may hold anything in the records */
+	for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+		SnapshotRecord_p record = &sb->snapshots[i];
+		if (record->created != 0 && (record->mapStart + snapshotMapBlocks() > sb->totalDataBlocks ||
+				record->usedBlocks > sb->totalDataBlocks || record->usedInodes > sb->numInodes)) {
+			memset(sb->snapshots, 0, sizeof(sb->snapshots));
+			break;
+		}
+	}
+	cacheSetWriteHook(preserveShared);
+	if (loadSnapshotMaps() == -1 || loadHeldBlocks() == -1) {
+		printf("Could not load the snapshots\n");
+		return 0;
+	}
+	/* Without its reference counts a shared block would be freed under its other files */
+	if (sb->dedupBlocks != 0 &&
+			dedupStart(sb->dedupStart, sb->dedupBlocks, sb->rootDataPointer, sb->totalDataBlocks) != 0) {
+		printf("Could not load the block fingerprint table\n");
+		return 0;
+	}
+	dropInodeCache();
+	if (loadInodeMap() == -1) {
+		printf("Could not load the inode bitmap\n");
+		return 0;
+	}
+	registerCloseHook(inodeCacheShutdown);
+	startInodeInit();
 	return 1;
 }
 
 /**
- * Formats the current partition and installs a new filesystem.
+ * Checks for the filesystem on this partition, by checking the signatures
+ * of the first block for a match, and mounts it.
+ * Returns 1 if filesystem exists
+ * Returns 0 if filesystem does not exist
+ */
+int check_fs() {
+	stopInodeInit();
+	lockVolume(true);
+	int retVal = mountVolume();
+	unlockVolume();
+	return retVal;
+}
+
+/**
+ * Formats the current partition and installs a new filesystem, with a
+ * metadata journal unless the partition is memory-mapped. The inode table
+ * is not written: each group of it is zeroed on first use, or by a
+ * background thread, whichever comes first.
  * returns 0 if format was successful
  * returns -1 if format was unsuccessful
  */
 int fs_format() {
-	SuperBlock_p buffer = malloc(partInfop->blocksize);
+	return fs_formatWith(LBAisMapped() ? 0 : FORMAT_JOURNAL);
+}
+
+/** Progress of the metadata regions fs_format is zeroing */
+typedef struct FormatProgress {
+	uint64_t total;					//Blocks to zero across every region
+	uint64_t done;					//Blocks zeroed so far
+	double seconds;					//Time spent zeroing them
+} FormatProgress, *FormatProgress_p;
+
+/** Returns a monotonic clock reading in seconds */
+static double nowSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/** Returns the rate blocks have been zeroed at so far, in MB/s */
+static double formatRate(FormatProgress_p progress) {
+	return progress->seconds > 0 ? progress->done * partInfop->blocksize / progress->seconds / 1e6 : 0;
+}
+
+/**
+ * Zeroes a metadata region for fs_format, FORMAT_REPORT_BLOCKS at a time,
+ * reporting progress and throughput after each slice when the format is
+ * big enough to take a while.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int formatRegion(FormatProgress_p progress, uint64_t count, uint64_t lba) {
+	uint64_t done = 0;
+	while (done < count) {
+		uint64_t slice = count - done < FORMAT_REPORT_BLOCKS ? count - done : FORMAT_REPORT_BLOCKS;
+		double started = nowSeconds();
+		if (zeroBlocks(slice, lba + done) == -1)
+			return -1;
+		progress->seconds += nowSeconds() - started;
+		done += slice;
+		progress->done += slice;
+		if (progress->total > FORMAT_REPORT_BLOCKS)
+			printf("Format: %lu of %lu blocks zeroed, %.1f MB/s\n", progress->done, progress->total,
+				formatRate(progress));
+	}
+	return 0;
+}
+
+/**
+ * fs_formatWith for a caller that holds volumeLock exclusive.
+ * returns 0 if format was successful
+ * returns -1 if format was unsuccessful
+ */
+static int formatVolume(uint32_t flags) {
+	/* Checksums, fingerprints and logged blocks kept for the old layout would land on the new one */
+	journalStop();
+	LBAchecksumStop();
+	dedupStop();
+	unloadSnapshotMaps();
+
+	SuperBlock_p buffer = LBAallocBuffer(1);
 	memset(buffer, 0, partInfop->blocksize);
 	buffer->superSignature = SUPER_SIGNATURE;
 	/* For every BLOCKS_PER_INODE there is one Inode. Set to a prime number to make the hash more efficient */
 	buffer->numInodes = findNextPrime(partInfop->numberOfBlocks / BLOCKS_PER_INODE);
-	buffer->inodeStart = 1;	//Inode blocks start right after superblock
+	/* The journal, if any, sits between the superblock and the inodes */
+	if (flags & FORMAT_JOURNAL) {
+		buffer->journalStart = 1;
+		buffer->journalBlocks = journalBlocksFor(partInfop->numberOfBlocks);
+	}
+	buffer->inodeStart = 1 + buffer->journalBlocks;	//Inode blocks start right after superblock and journal
 
+	/* Inodes only fill blocks exactly if INODE_BYTES divides them, otherwise they are packed as before */
+	buffer->inodeBytes = partInfop->blocksize % INODE_BYTES == 0 ? INODE_BYTES : 0;
+	uint64_t tableBytes = buffer->numInodes * (buffer->inodeBytes != 0 ? INODE_BYTES : INODE_LEGACY_BYTES);
 	/* Free Blocks starts at one block after blocks used by inodes and block used by superblock */
-	buffer->bitVectorStart = ((buffer->numInodes * sizeof(Inode) + partInfop->blocksize - 1) / partInfop->blocksize) + buffer->inodeStart;
+	buffer->bitVectorStart = ((tableBytes + partInfop->blocksize - 1) / partInfop->blocksize) + buffer->inodeStart;
 	/* Total Free Blocks = Total number of blocks - total blocks used by inodes - block used by superblock - blocks used by freeblocks */
-	uint64_t unusedBlocks = partInfop->numberOfBlocks - (buffer->bitVectorStart - 1);
-	uint64_t totalBytesForBitVector = (unusedBlocks * partInfop->blocksize + 8 - 1) / 8;
+	uint64_t unusedBlocks = partInfop->numberOfBlocks - buffer->bitVectorStart;
+	uint64_t totalBytesForBitVector = (unusedBlocks + 8 - 1) / 8;	//One bit per block
 	uint64_t blocksUsedByBitVector = (totalBytesForBitVector + partInfop->blocksize - 1) / partInfop->blocksize;
 	buffer->freeBlocks = unusedBlocks - blocksUsedByBitVector;
+	/* The fingerprint table, then the checksum region, sit between the bit vector and the data blocks */
+	if (flags & FORMAT_DEDUP) {
+		buffer->dedupStart = buffer->bitVectorStart + blocksUsedByBitVector;
+		buffer->dedupBlocks = dedupTableBlocks(partInfop->numberOfBlocks, partInfop->blocksize);
+		buffer->freeBlocks -= buffer->dedupBlocks;
+	}
+	if (flags & FORMAT_CHECKSUMS) {
+		buffer->checksumStart = buffer->bitVectorStart + blocksUsedByBitVector + buffer->dedupBlocks;
+		buffer->checksumBlocks = LBAchecksumBlocks(partInfop->numberOfBlocks, partInfop->blocksize);
+		buffer->freeBlocks -= buffer->checksumBlocks;
+	}
 	buffer->usedBlocks = 0;
 	buffer->totalDataBlocks = buffer->freeBlocks;
-	buffer->maxPointersPerIndirect[0] = sizeof(uint64_t) / partInfop->blocksize;
+	buffer->maxPointersPerIndirect[0] = partInfop->blocksize / sizeof(uint64_t);
 	for (uint32_t i = 1; i < NUM_INDIRECT; i++) {
 		uint64_t pointers = buffer->maxPointersPerIndirect[0];
 		for (uint32_t j = 0; j < i; j++)
 			pointers *= buffer->maxPointersPerIndirect[0];
 		buffer->maxPointersPerIndirect[i] = pointers;
 	}
-	buffer->rootDataPointer = buffer->bitVectorStart + blocksUsedByBitVector;
+	buffer->rootDataPointer = buffer->bitVectorStart + blocksUsedByBitVector + buffer->dedupBlocks +
+		buffer->checksumBlocks;
 	buffer->superSignature2 = SUPER_SIGNATURE2;
+	/* The inode table is zeroed a group at a time as it is used, none are yet */
+	buffer->inodeGroupBlocks = inodeGroupBlocksFor(buffer->bitVectorStart - buffer->inodeStart);
 
-	if (LBAwrite(buffer, 1, 0) == 0) {
-		free(buffer);
+	if (cacheWrite(buffer, 1, 0) == 0) {
+		LBAfreeBuffer(buffer, 1);
 		return -1;
 	}
 	sb = malloc(sizeof(SuperBlock));
 	memcpy(sb, buffer, sizeof(SuperBlock));
-	free(buffer);
-
-	/* Initialize Inodes */
-	uint64_t inodeReservedBlocks = sb->bitVectorStart - sb->inodeStart;
-	Inode_p inode_buffer = malloc(partInfop->blocksize * inodeReservedBlocks);
-	memset(inode_buffer, 0, partInfop->blocksize * inodeReservedBlocks);
-	if (LBAwrite(inode_buffer, inodeReservedBlocks, sb->inodeStart) == 0) {
-		free(inode_buffer);
+	LBAfreeBuffer(buffer, 1);
+
+	/* Initialize the bit vector and the tables after it, as holes wherever the host allows */
+	FormatProgress progress;
+	progress.total = blocksUsedByBitVector + sb->dedupBlocks + sb->checksumBlocks;
+	progress.done = 0;
+	progress.seconds = 0;
+	if (formatRegion(&progress, blocksUsedByBitVector, sb->bitVectorStart) == -1)
 		return -1;
+	/* The block layer loads the region straight from the volume, so the zeros must be there */
+	if (sb->checksumBlocks != 0) {
+		if (formatRegion(&progress, sb->checksumBlocks, sb->checksumStart) == -1 || cacheFlush() != 0)
+			return -1;
+		cacheInvalidate(sb->checksumBlocks, sb->checksumStart);
+		if (LBAchecksumStart(sb->checksumStart, sb->checksumBlocks) != 0)
+			return -1;
 	}
-	free(inode_buffer);
-
-	/* Initialize bit vector */
-	char* bvBuffer = malloc(blocksUsedByBitVector * partInfop->blocksize);
-	memset(bvBuffer, 0, blocksUsedByBitVector * partInfop->blocksize);
-	if (LBAwrite(bvBuffer, blocksUsedByBitVector, sb->bitVectorStart) == 0) {
-		free(bvBuffer);
+	if (readBitVector() == -1 || loadHeldBlocks() == -1)
 		return -1;
+	if (sb->dedupBlocks != 0) {
+		if (formatRegion(&progress, sb->dedupBlocks, sb->dedupStart) == -1)
+			return -1;
+		if (dedupStart(sb->dedupStart, sb->dedupBlocks, sb->rootDataPointer, sb->totalDataBlocks) != 0)
+			return -1;
 	}
+	printf("Format: %lu metadata blocks zeroed in %.2f seconds, %.1f MB/s\n", progress.done,
+		progress.seconds, formatRate(&progress));
+	/* Whatever the cache held belongs to the volume that was just formatted over */
+	dropInodeCache();
+	resetInodeMap();
     
-        
     Inode_p root = calloc(1, sizeof(Inode));
     root->used = USED_FLAG;
     root->type = DIRECTORY_TYPE;
@@ -374,30 +3157,98 @@ int fs_format() {
     root->blocksReserved = 1;
     setBitOn(0);
     writeInode(0, root);
+    sb->usedInodes = countInodeMap();
     Inode_p buff = calloc(1,sizeof(Inode));
     readInode(0,buff);
     
-    readBitVector();
     writeBitVector();
     initWorkingDirectory();
     
-    
-	free(bvBuffer);
+	/* Format is one bulk operation, make it durable once at the end */
+	if (flushInodeCache() != 0 || cacheFlush() != 0)
+		return -1;
+	/* Only what changes from here on goes through the journal */
+	if (sb->journalBlocks != 0 && (journalFormat(sb->journalStart, sb->journalBlocks) != 0 ||
+			journalStart(sb->journalStart, sb->journalBlocks) == -1))
+		return -1;
+	registerCloseHook(inodeCacheShutdown);
+	startInodeInit();
 	return 0;
 }
 
+/**
+ * Same as fs_format with FORMAT_ flags.
+ * returns 0 if format was successful
+ * returns -1 if format was unsuccessful
+ */
+int fs_formatWith(uint32_t flags) {
+	/* The journal logs what goes through the block cache, which a mapped volume bypasses */
+	if ((flags & FORMAT_JOURNAL) && LBAisMapped()) {
+		printf("Error: a memory-mapped partition cannot keep a metadata journal, format it without one\n");
+		return -1;
+	}
+	stopInodeInit();
+	lockVolume(true);
+	int retVal = formatVolume(flags);
+	unlockVolume();
+	return retVal;
+}
+
 /** Outputs data about the current filesystem */
 void fs_lsfs() {
+	lockVolume(false);
 	printf("Volume name: %s\n", partInfop->volumeName);
 	printf("Volume size: %ld\n", partInfop->volumesize);
 	printf("Block size: %ld\n", partInfop->blocksize);
 	printf("Blocks: %ld\n", partInfop->numberOfBlocks);
 	printf("Inodes: %ld\n", sb->numInodes);
-	printf("Free Blocks: %ld\n", sb->freeBlocks);
-	printf("Used Blocks: %ld\n", sb->usedBlocks);
+	printf("Inode size: %ld%s\n", inodeBytes(), sb->inodeBytes != 0 ? "" : " (legacy, packed across blocks)");
+	printf("Free Blocks: %ld\n", __atomic_load_n(&sb->freeBlocks, __ATOMIC_RELAXED));
+	printf("Used Blocks: %ld\n", __atomic_load_n(&sb->usedBlocks, __ATOMIC_RELAXED));
 	printf("Inode index: %ld\n", sb->inodeStart);
 	printf("Bit Vector index: %ld\n", sb->bitVectorStart);
 	printf("Root index: %ld\n", sb->rootDataPointer);
+	if (sb->checksumBlocks != 0)
+		printf("Checksum index: %ld (%ld blocks, crc32c %s)\n", sb->checksumStart, sb->checksumBlocks, crc32cKernel());
+	else
+		printf("Checksums: off\n");
+	if (sb->dedupBlocks != 0) {
+		lockAllocator();
+		uint64_t saved = dedupSavedBlocks();
+		unlockAllocator();
+		printf("Dedup index: %ld (%ld blocks, %ld blocks saved)\n", sb->dedupStart, sb->dedupBlocks, saved);
+	} else {
+		printf("Dedup: off\n");
+	}
+	if (sb->journalBlocks != 0 && !journalEnabled()) {
+		printf("Journal index: %ld (%ld blocks, inactive on a memory-mapped partition)\n", sb->journalStart,
+			sb->journalBlocks);
+	} else if (sb->journalBlocks != 0) {
+		JournalStats journalStats;
+		journalGetStats(&journalStats);
+		printf("Journal index: %ld (%ld blocks, %ld commits of %ld blocks, %ld outside the log, %ld checkpoints, %ld replayed)\n",
+			sb->journalStart, sb->journalBlocks, journalStats.commits, journalStats.blocksLogged,
+			journalStats.overflows, journalStats.checkpoints, journalStats.replayed);
+	} else {
+		printf("Journal: off\n");
+	}
+	unlockVolume();
+	fs_snapshotList();
+
+	CacheStats cacheStats;
+	cacheGetStats(&cacheStats);
+	printf("Cache blocks: %ld\n", cacheStats.capacity);
+	printf("Cache hits: %ld\n", cacheStats.hits);
+	printf("Cache misses: %ld\n", cacheStats.misses);
+	printf("Cache evictions: %ld\n", cacheStats.evictions);
+	printf("Cache writebacks: %ld\n", cacheStats.writebacks);
+	printf("Cache prefetches: %ld\n", cacheStats.prefetches);
+
+	pthread_mutex_lock(&inodeCacheMutex);
+	InodeCacheStats inodeStats = inodeCacheStats;
+	pthread_mutex_unlock(&inodeCacheMutex);
+	printf("Inode cache: %ld hits, %ld misses, %ld evictions, %ld inodes written back in %ld table writes\n",
+		inodeStats.hits, inodeStats.misses, inodeStats.evictions, inodeStats.writebacks, inodeStats.tableWrites);
 }
 
 /** Lists the files in the current directory */
@@ -436,7 +3287,7 @@ int fs_mkdir(char* directoryName) {
            uint64_t indirectSecondOffset=-1;
            uint64_t * indirectPointer=malloc(sizeof(uint64_t));
            uint64_t inodeIndex=0;
-           uint64_t * indirectBlock = malloc(partInfop->blocksize);
+           uint64_t * indirectBlock = LBAallocBuffer(1);
            memset(indirectBlock,0,partInfop->blocksize);
        //Buffers for traversing directory tree
            char* nameBuffer = malloc(sizeof(char));
@@ -445,7 +3296,7 @@ int fs_mkdir(char* directoryName) {
            memset(inodeBuffer, 0, sizeof(Inode));
            FCB_p buffer= malloc(sizeof(FCB));
            memset(buffer, 0, sizeof(FCB));
-           char * blockBuffer = malloc(partInfop->blocksize);
+           char * blockBuffer = LBAallocBuffer(1);
            memset(blockBuffer, 0, partInfop->blocksize);
            
            
@@ -469,14 +3320,19 @@ int fs_mkdir(char* directoryName) {
        //Travesre through all direct data pointers
        for(int k = 0;k<NUM_DIRECT;k++){
           
-           //Read the block that the direct data pointer points to
-           LBAread(blockBuffer,1,inodeBuffer->directData[k]);
+           //Scan the block in place when the volume is mapped, otherwise
+           //read the block that the direct data pointer points to
+           char* dirBlock = LBAborrow(inodeBuffer->directData[k], 1);
+           if (dirBlock == NULL) {
+               cacheRead(blockBuffer,1,inodeBuffer->directData[k]);
+               dirBlock = blockBuffer;
+           }
            
            //Loop through the file control blocks
            for(int l=0;l<partInfop->blocksize/sizeof(FCB);l++){
                
                //set buffer to FBC in block buffer
-               buffer=blockBuffer+sizeof(FCB)*l;
+               buffer=dirBlock+sizeof(FCB)*l;
                printf("(%s , %s)",buffer->name, dirName);
            
            //compare name of FCB name to name of directory trying to be made
@@ -501,10 +3357,13 @@ int fs_mkdir(char* directoryName) {
                strcpy(newFCB->name,dirName);
                
                //copy FCB buffer to memory
-               memcpy(blockBuffer+sizeof(FCB)*(l+1),newFCB,sizeof(FCB));
+               memcpy(dirBlock+sizeof(FCB)*(l+1),newFCB,sizeof(FCB));
                
                //Write buffer to available slot in directData
-               LBAwrite(blockBuffer,1,inodeBuffer->directData[k]);
+               if (dirBlock == blockBuffer)
+                   cacheWrite(blockBuffer,1,inodeBuffer->directData[k]);
+               else
+                   LBAreturn(inodeBuffer->directData[k],1,1);
                
                
            }
@@ -524,14 +3383,14 @@ int fs_mkdir(char* directoryName) {
                for(int n=0;n<NUM_INDIRECT;n++){
                    indirectPointer=inodeBuffer->indirectData[n];
      
-                   LBAread(indirectBlock,1,indirectPointer);
+                   cacheRead(indirectBlock,1,indirectPointer);
                    indirectPointer=*indirectBlock;
                    //printf("n%d",indirectPointer);
                    
                    for(int m=0;m<(partInfop->blocksize/sizeof(uint64_t));m++){
-                       LBAread(indirectBlock,1,indirectPointer);
+                       cacheRead(indirectBlock,1,indirectPointer);
                        indirectPointer=*indirectBlock+sizeof(uint64_t)*m;
-                       LBAread(indirectBlock,1,indirectPointer);
+                       cacheRead(indirectBlock,1,indirectPointer);
 
                        for(int l=0;l<partInfop->blocksize/sizeof(FCB);l++){
                   
@@ -593,15 +3452,33 @@ int fs_rmdir(char* directoryName) {
  */
 int fs_cp(char* sourceFile, char* destFile) {
 		int srcfd, desfd;
-		char * buf;
+		int retVal = 0;
 		srcfd = myfsOpen(sourceFile);
+		if (srcfd < 0)
+			return -2;
 		desfd = myfsOpen(destFile);
-		//read entire file
-		readFile(buf,openFileList[srcfd].inodeId,0);
-		//write to destination file
-		writeFile(openFileList[desfd].inodeId, buf, 0);
+		if (desfd < 0) {
+			myfsClose(srcfd);
+			return -1;
+		}
+		uint64_t size = openFileList[srcfd].size;
+		//identical content on a deduplicated volume, only the pointers are copied
+		if (dedupEnabled()) {
+			if (cloneFile(openFileList[srcfd].inodeId, openFileList[desfd].inodeId) == -1)
+				retVal = -1;
+		} else {
+			char * buf = malloc(size + 1);
+			//read entire file
+			if (readFile(buf, openFileList[srcfd].inodeId, 0) != size)
+				retVal = -1;
+			//write to destination file
+			else if (writeFile(openFileList[desfd].inodeId, buf, size) == -1)
+				retVal = -1;
+			free(buf);
+		}
 		myfsClose(srcfd);
 		myfsClose(desfd);
+		return retVal;
 }
 
 /**
@@ -632,21 +3509,63 @@ int fs_del(char* filename) {
  * returns -2 if source file does not exist
  */
 int fs_cpin(char* sourceFile, char* destFile)
+{
+	return fs_cpinWith(sourceFile, destFile, 0);
+}
+
+/**
+ * Copies a file from another filesystem to destination in the current
+ * filesystem, with the inode flags given (INODE_COMPRESSED to store it
+ * compressed).
+ * returns 0 if successful
+ * returns -1 if unsuccessful
+ * returns -2 if source file does not exist
+ */
+int fs_cpinWith(char* sourceFile, char* destFile, uint8_t flags)
 {
 	int srcfd, desfd;
+	int retVal = 0;
 
 	srcfd = open(sourceFile, O_RDONLY);//open source file in linux for read only
+	if(srcfd == -1)
+		return -2;
 
 	off_t srcSize = lseek(srcfd, 0, SEEK_END);
+	lseek(srcfd, 0, SEEK_SET);
 
-	char *buf = malloc(srcSize);
+	char *buf = malloc(srcSize + 1);
+	off_t done = 0;
+	while(done < srcSize)
+	{
+		ssize_t got = read(srcfd, buf + done, srcSize - done);
+		if(got <= 0)
+			break;
+		done += got;
+	}
+	close(srcfd);
+	if(done != srcSize)
+	{
+		perror("Program");
+		free(buf);
+		return -1;
+	}
 
 	desfd = myfsOpen(destFile); //open destination file
-
-	read(srcfd,buf,srcSize);
-	writeFile(openFileList[desfd].inodeId, buf, 0);
-	close(srcfd);
+	if(desfd < 0)
+	{
+		free(buf);
+		return -1;
+	}
+	if(setFileCompression(openFileList[desfd].inodeId, (flags & INODE_COMPRESSED) != 0) == -1 ||
+			writeFile(openFileList[desfd].inodeId, buf, srcSize) == -1)
+		retVal = -1;
 	myfsClose(desfd);
+	free(buf);
+	/* Sync the whole copy once instead of on every block */
+	lockVolume(true);
+	flushMetadata();
+	unlockVolume();
+	return retVal;
 }
 
 /**
@@ -658,27 +3577,55 @@ int fs_cpin(char* sourceFile, char* destFile)
 int fs_cpout(char* sourceFile, char* destFile)
 {
 	int srcfd, desfd;
-	char * buf;
+	int retVal = 0;
+	uint64_t bytesRead;
 	srcfd = myfsOpen(sourceFile); //open file for read
-	desfd = open(destFile, O_WRONLY|O_CREAT);  //create destination file in linux for write
+	if(srcfd == -1)
+		return -2;
+	desfd = open(destFile, O_WRONLY|O_CREAT|O_TRUNC, 0644);  //create destination file in linux for write
 	//error checking in Linux file system
 	if(desfd == -1)
 	{
 		printf("Error Number % d\n", errno);
 		perror("Program");
+		myfsClose(srcfd);
+		return -1;
+	}
+	//read then write a chunk at a time, myfsRead keeps the next chunks coming
+	char * buf = LBAallocBuffer(COPY_CHUNK_BLOCKS);
+	while((bytesRead = myfsRead(srcfd, buf, COPY_CHUNK_BLOCKS * partInfop->blocksize)) > 0)
+	{
+		if(write(desfd, buf, bytesRead) != (ssize_t) bytesRead)
+		{
+			perror("Program");
+			retVal = -1;
+			break;
+		}
 	}
-	//read then write
-	readFile(buf, openFileList[srcfd].inodeId, 0);
-		//myfsSeek(srcfd,partInfop->blocksize,MYSEEK_CUR);
-	write(desfd,buf, openFileList[srcfd].size);
+	LBAfreeBuffer(buf, COPY_CHUNK_BLOCKS);
 	myfsClose(srcfd);
 	close(desfd);
+	return retVal;
 }
 
 //similar to fsOpen in Linux, based off Professor Bierman's demo in class
 int myfsOpen(char *filename)
 {
-	int fd;
+	int fd = -1;
+	Inode inode;
+	pthread_once(&lockOnce, initLocks);
+	pthread_mutex_lock(&openFileMutex);
+	if(openFileList == NULL)
+	{
+		openFileList = malloc(FDOPENMAX * sizeof(openFileEntry));
+		if(openFileList == NULL)
+		{
+			pthread_mutex_unlock(&openFileMutex);
+			return -1;
+		}
+		for(int i = 0; i < FDOPENMAX; i++)
+			openFileList[i].flags = FDOPENFREE;
+	}
 	//get a file descriptor
 	for(int i = 0; i < FDOPENMAX; i++)
 	{
@@ -687,19 +3634,315 @@ int myfsOpen(char *filename)
 			fd = i;
 			break;
 		}
+	}
+	//claim it before letting go of the list
+	if(fd != -1)
+		openFileList[fd].flags = FDOPENINUSE|FDOPENFORREAD|FDOPENFORWRITE;
+	pthread_mutex_unlock(&openFileMutex);
+	if(fd == -1)
+		return -1;
 
 	//find file in directory
 	
 
 
 	//null, file does not exist
-	openFileList[i].flags = FDOPENINUSE|FDOPENFORREAD|FDOPENFORWRITE;
-	openFileList[i].filebuffer = malloc (partInfop->blocksize *2); //allocate 2 blocks for the file
-	openFileList[i].position = 0; //seek is beginning of FILEIDINCREMENT
-	openFileList[i].size  = 0; //assume it's empty file (this is from demo in class)
-	openFileList[i].inodeId = findFreeInode(filename, CURRENT_WORKING_DIRECTORY); //parent inode unknown
+	openFileList[fd].filebuffer = LBAallocBuffer(2); //allocate 2 blocks for the file
+	openFileList[fd].position = 0; //seek is beginning of FILEIDINCREMENT
+	openFileList[fd].size  = 0; //assume it's empty file (this is from demo in class)
+	lockVolume(false);
+	uint64_t inodeId = findFreeInode(filename, CURRENT_WORKING_DIRECTORY); //parent inode unknown
+	if(inodeId == 0)
+	{
+		//no inode left to create the file in
+		unlockVolume();
+		LBAfreeBuffer(openFileList[fd].filebuffer, 2);
+		pthread_mutex_lock(&openFileMutex);
+		openFileList[fd].flags = FDOPENFREE;
+		pthread_mutex_unlock(&openFileMutex);
+		return -1;
+	}
+	lockInode(inodeId, false);
+	//keep the inode cached for as long as the file is open
+	holdInode(inodeId);
+	if(readInode(inodeId, &inode) == 0 && inode.used != UNUSED_FLAG)
+		openFileList[fd].size = inode.size;
+	unlockInode(inodeId);
+	unlockVolume();
+	openFileList[fd].nextBlock = 0;
+	openFileList[fd].readahead = 0;
+	openFileList[fd].prefetched = 0;
+	openFileList[fd].cluster = NULL;
+	//writers of the file scan these two
+	pthread_mutex_lock(&openFileMutex);
+	openFileList[fd].inodeId = inodeId;
+	openFileList[fd].clusterIndex = UINT64_MAX;
+	pthread_mutex_unlock(&openFileMutex);
+	//a file created here is complete, commit it with anything else due
+	commitMetadata();
 	return(fd);
+}
+
+/**
+ * Returns the LBA of the extent tree leaf node that maps the given file
+ * block, or 0 if the extents in the inode map it themselves.
+ */
+static uint64_t extentLeafFor(Inode_p inode, uint64_t block) {
+	const ExtentHeader* header = &inode->extentHeader;
+	const Extent* entries = inode->extents;
+	char* node = LBAallocBuffer(1);
+	uint64_t lba = 0;
+	while (header->depth > 0 && header->count > 0) {
+		uint64_t e = 0;
+		while (e + 1 < header->count && entries[e + 1].fileBlock <= block)
+			e++;
+		lba = entries[e].start + sb->rootDataPointer;
+		if (header->depth == 1 || cacheRead(node, 1, lba) != 1)
+			break;
+		header = (ExtentHeader*) node;
+		entries = (Extent*) &node[sizeof(ExtentHeader)];
+	}
+	LBAfreeBuffer(node, 1);
+	return lba;
+}
+
+/**
+ * Returns the LBA of the indirect block or extent tree leaf that maps the
+ * given file block, or 0 if the inode maps the block itself or the block is
+ * beyond what the inode can map.
+ */
+static uint64_t indirectBlockFor(Inode_p inode, uint64_t block) {
+	if (inode->flags & INODE_EXTENTS)
+		return extentLeafFor(inode, block);
+
+	uint64_t pointersPerBlock = sb->maxPointersPerIndirect[0];
+	if (block < NUM_DIRECT)
+		return 0;
+	block -= NUM_DIRECT;
+	if (block < pointersPerBlock)
+		return inode->indirectData[0] + sb->rootDataPointer;
+	block -= pointersPerBlock;
+	if (block >= sb->maxPointersPerIndirect[1])
+		return 0;
+
+	uint64_t* doubleIndirect = LBAallocBuffer(1);
+	cacheRead(doubleIndirect, 1, inode->indirectData[1] + sb->rootDataPointer);
+	uint64_t lba = doubleIndirect[block / pointersPerBlock] + sb->rootDataPointer;
+	LBAfreeBuffer(doubleIndirect, 1);
+	return lba;
+}
+
+/**
+ * Prefetches the file blocks [firstBlock, endBlock) into the cache, one
+ * cachePrefetch per run of adjacent blocks, and then the indirect block
+ * or extent tree leaf that the next window will need.
+ * Returns the file block the prefetch got up to, endBlock unless the cache
+ * ran out of room
+ */
+static uint64_t prefetchFileBlocks(Inode_p inode, uint64_t firstBlock, uint64_t endBlock, uint64_t fileBlocks) {
+	uint64_t count = endBlock - firstBlock;
+	uint64_t* lbas = malloc(count * sizeof(uint64_t));
+	if (lbas == NULL || mapFileBlocks(inode, firstBlock, count, lbas) == -1) {
+		free(lbas);
+		return firstBlock;
+	}
+
+	uint64_t i = 0;
+	while (i < count) {
+		if (lbas[i] == NO_BLOCK) {
+			i++;
+			continue;
+		}
+		uint64_t run = 1;
+		while (i + run < count && lbas[i + run] == lbas[i] + run)
+			run++;
+		uint64_t queued = cachePrefetch(run, lbas[i]);
+		i += queued;
+		if (queued < run)
+			break;
+	}
+	free(lbas);
+	if (i < count)
+		return firstBlock + i;
+
+	if (endBlock < fileBlocks) {
+		uint64_t indirectLBA = indirectBlockFor(inode, endBlock);
+		if (indirectLBA != 0)
+			cachePrefetch(1, indirectLBA);
+	}
+	return endBlock;
+}
+
+/**
+ * Updates the stream state of an open file for a read of the file blocks
+ * [firstBlock, endBlock) and starts the next readahead window when less
+ * than half of the current one is left ahead of the reader.
+ */
+static void readAhead(openFileEntry* file, Inode_p inode, uint64_t firstBlock, uint64_t endBlock) {
+	uint64_t fileBlocks = (file->size + partInfop->blocksize - 1) / partInfop->blocksize;
+	uint64_t readBlocks = endBlock - firstBlock;
+
+	/* A window bigger than a quarter of the cache evicts itself before use */
+	CacheStats cacheStats;
+	cacheGetStats(&cacheStats);
+	uint64_t maxWindow = READAHEAD_MAX_BLOCKS;
+	if (cacheStats.capacity / 4 < maxWindow)
+		maxWindow = cacheStats.capacity / 4;
+	if (maxWindow == 0)
+		return;
+
+	/* Sequential if it picks up where the last read ended, or in its last block */
+	if (firstBlock == file->nextBlock || firstBlock + 1 == file->nextBlock) {
+		/* A new stream starts with a window at least as big as the read */
+		if (file->readahead == 0)
+			file->readahead = readBlocks > READAHEAD_MIN_BLOCKS ? readBlocks : READAHEAD_MIN_BLOCKS;
+		if (file->readahead > maxWindow)
+			file->readahead = maxWindow;
+	} else {
+		file->readahead = 0;
+		file->prefetched = 0;
+	}
+	file->nextBlock = endBlock;
+	if (file->readahead == 0)
+		return;
+
+	if (file->prefetched < endBlock)
+		file->prefetched = endBlock;
+	if (file->prefetched >= fileBlocks || file->prefetched - endBlock > file->readahead / 2)
+		return;
+
+	uint64_t windowEnd = endBlock + file->readahead;
+	if (windowEnd > fileBlocks)
+		windowEnd = fileBlocks;
+	uint64_t reached = prefetchFileBlocks(inode, file->prefetched, windowEnd, fileBlocks);
+	if (reached > file->prefetched)
+		file->prefetched = reached;
+
+	/* Only grow the window while the cache keeps up with it */
+	if (reached == windowEnd) {
+		file->readahead *= 2;
+		if (file->readahead > maxWindow)
+			file->readahead = maxWindow;
+	}
+}
+
+/**
+ * Reads count bytes of a compressed file at its current position, a cluster
+ * at a time. The last cluster decoded stays in the open file entry, so small
+ * sequential reads decompress each cluster once.
+ * Returns the number of bytes read
+ */
+static uint64_t readCompressed(openFileEntry* file, Inode_p inode, char * buffer, uint64_t count) {
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t clusterSize = COMPRESS_CLUSTER_BLOCKS * blockSize;
+	uint64_t lbas[COMPRESS_CLUSTER_BLOCKS];
+
+	if (file->cluster == NULL) {
+		/* The decoded cluster, followed by room for it as stored */
+		file->cluster = LBAallocBuffer(2 * COMPRESS_CLUSTER_BLOCKS);
+		file->clusterIndex = UINT64_MAX;
 	}
+	char* stored = &file->cluster[clusterSize];
+	readAhead(file, inode, file->position / blockSize, (file->position + count + blockSize - 1) / blockSize);
+
+	uint64_t copied = 0;
+	while (copied < count) {
+		uint64_t position = file->position + copied;
+		uint64_t index = position / clusterSize;
+		if (index != file->clusterIndex) {
+			uint64_t bytes = clusterBytes(inode->size, index);
+			uint64_t blocks = (bytes + blockSize - 1) / blockSize;
+			if (mapFileBlocks(inode, index * COMPRESS_CLUSTER_BLOCKS, blocks, lbas) == -1)
+				break;
+			uint64_t i = 0;
+			while (i < blocks && lbas[i] != NO_BLOCK && cacheRead(&stored[i * blockSize], 1, lbas[i]) == 1)
+				i++;
+			if ((i < blocks && lbas[i] != NO_BLOCK) || unpackCluster(stored, lbas, bytes, file->cluster) == -1)
+				break;
+			file->clusterIndex = index;
+		}
+		uint64_t offset = position % clusterSize;
+		uint64_t length = clusterSize - offset;
+		if (length > count - copied)
+			length = count - copied;
+		memcpy(&buffer[copied], &file->cluster[offset], length);
+		copied += length;
+	}
+	file->position += copied;
+	return copied;
+}
+
+//myfsRead once the request is checked, with the volume and the file's inode locked
+static uint64_t readOpenFile(openFileEntry* file, char * buffer, uint64_t count)
+{
+	Inode inode;
+	if(readInode(file->inodeId, &inode) == -1)
+		return 0;
+	if(inode.flags & INODE_COMPRESSED)
+		return readCompressed(file, &inode, buffer, count);
+
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t firstBlock = file->position / blockSize;
+	uint64_t endBlock = (file->position + count + blockSize - 1) / blockSize;
+	uint64_t* lbas = malloc((endBlock - firstBlock) * sizeof(uint64_t));
+	if(lbas == NULL || mapFileBlocks(&inode, firstBlock, endBlock - firstBlock, lbas) == -1)
+	{
+		free(lbas);
+		return 0;
+	}
+	readAhead(file, &inode, firstBlock, endBlock);
+
+	uint64_t copied = 0;
+	for(uint64_t i = 0; i < endBlock - firstBlock; i++)
+	{
+		uint64_t offset = (file->position + copied) % blockSize;
+		uint64_t length = blockSize - offset;
+		if(length > count - copied)
+			length = count - copied;
+
+		//whole blocks go straight into the caller's buffer
+		if(length == blockSize)
+		{
+			if(cacheRead(&buffer[copied], 1, lbas[i]) != 1)
+				break;
+		}
+		else
+		{
+			if(cacheRead(file->filebuffer, 1, lbas[i]) != 1)
+				break;
+			memcpy(&buffer[copied], &file->filebuffer[offset], length);
+		}
+		copied += length;
+	}
+	free(lbas);
+	file->position += copied;
+	return copied;
+}
+
+/**
+ * Reads up to count bytes from the open file at its current position and
+ * advances the position. The blocks come through the cache, which
+ * readAhead keeps filled ahead of a sequential reader.
+ * Returns the number of bytes read, 0 at the end of the file or on error
+ */
+uint64_t myfsRead(int fd, char * buffer, uint64_t count)
+{
+	if(fd < 0 || fd >= FDOPENMAX || openFileList == NULL)
+		return 0;
+	openFileEntry* file = &openFileList[fd];
+	if((file->flags & FDOPENINUSE) != FDOPENINUSE || (file->flags & FDOPENFORREAD) != FDOPENFORREAD)
+		return 0;
+	if(file->position >= file->size || count == 0)
+		return 0;
+	if(count > file->size - file->position)
+		count = file->size - file->position;
+
+	lockVolume(false);
+	lockInode(file->inodeId, false);
+	uint64_t copied = readOpenFile(file, buffer, count);
+	unlockInode(file->inodeId);
+	unlockVolume();
+	return copied;
 }
 
 //similar to fsSeek in Linux, based off Professor Bierman's demo in class
@@ -734,9 +3977,21 @@ uint64_t myfsSeek(int fd, uint64_t position, int method)
 
 //set fd to free
 int myfsClose(int fd){
-	openFileList[fd].flags = FDOPENFREE;
 	openFileList[fd].position = 0;
-	free(openFileList[fd].filebuffer);
+	LBAfreeBuffer(openFileList[fd].filebuffer, 2);
+	if(openFileList[fd].cluster != NULL)
+		LBAfreeBuffer(openFileList[fd].cluster, 2 * COMPRESS_CLUSTER_BLOCKS);
+	openFileList[fd].cluster = NULL;
 	openFileList[fd].size = 0;
-	return 0;
+	//a file never written was not created after all
+	lockVolume(false);
+	unclaimInode(openFileList[fd].inodeId);
+	unlockVolume();
+	releaseInode(openFileList[fd].inodeId);
+	//only hand the descriptor back once nothing here refers to it
+	pthread_mutex_lock(&openFileMutex);
+	openFileList[fd].flags = FDOPENFREE;
+	pthread_mutex_unlock(&openFileMutex);
+	/* Whatever the file went through is complete, commit it with anything else due */
+	return commitMetadata();
 }
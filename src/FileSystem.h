@@ -5,6 +5,8 @@
 #define FILE_SYSTEM_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -23,6 +25,23 @@
 #define USED_FLAG 0xFF
 #define UNUSED_FLAG 0
 
+#define ZERO_CHUNK_BLOCKS 256
+#define ZERO_PIPELINE_SEGMENTS 64	//Writes of ZERO_CHUNK_BLOCKS zeros sent out together
+#define FORMAT_REPORT_BLOCKS 1048576	//fs_format reports progress every this many blocks zeroed
+#define COPY_CHUNK_BLOCKS 64
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 256
+#define ALLOC_CHUNK_BLOCKS 4096		//Data blocks per free count the allocator keeps, a multiple of 64
+
+#define FORMAT_CHECKSUMS 0x1		//Keep a CRC32C of every block, verified on read
+#define FORMAT_DEDUP 0x2			//Share data blocks with identical contents
+#define FORMAT_JOURNAL 0x4			//Log metadata changes ahead of writing them in place
+
+#define INODE_COMPRESSED 0x01		//File data is stored in compressed clusters
+#define INODE_EXTENTS 0x02			//Data is mapped by an extent tree instead of data pointers
+#define COMPRESS_CLUSTER_BLOCKS 16	//File blocks compressed together as one cluster
+#define NO_BLOCK UINT64_MAX			//Data pointer of a file block with nothing stored behind it
+
 #define MAX_PATH_NAME 4096
 #define MAX_DIRECTORIES 1024
 #define MAX_NAME_SIZE 128
@@ -37,6 +56,28 @@
 #define MYSEEK_END 3
 #define CURRENT_WORKING_DIRECTORY 5  //temporary number for myfsOpen function
 
+#define MAX_SNAPSHOTS 8
+#define INODE_GROUPS 256			//Groups the inode table is initialized in, on first use
+#define INODE_INIT_PAUSE_MS 10		//Pause between groups initialized in the background
+#define INODE_CACHE_ENTRIES 1024	//Inodes kept in memory
+#define INODE_CACHE_BUCKETS 1024	//Hash chains over them, a power of 2
+#define INODE_BYTES 256				//Size of an inode in the table, a power of 2 so none straddles a block
+#define INODE_LEGACY_BYTES 144		//Inodes packed back to back, on volumes formatted before INODE_BYTES
+#define EXTENT_ROOT_ENTRIES 12		//Extents held in the inode itself, before the tree needs node blocks
+
+/*
+ * A point-in-time view of the inodes, bit vector and fingerprint table. Its
+ * block map has an entry per metadata block: 0 while the block is still
+ * shared with the live volume, else 1 + the data block its copy was saved
+ * to before the live block was first overwritten.
+ */
+typedef struct SnapshotRecord {
+    uint64_t created;				//Time the snapshot was taken, 0 for a free slot
+    uint64_t mapStart;				//First data block of the block map
+    uint64_t usedBlocks;			//Data blocks in use at the time
+    uint64_t usedInodes;			//Inodes in use at the time
+} SnapshotRecord, *SnapshotRecord_p;
+
 /* Volume Control Block */
 typedef struct SuperBlock {
     uint64_t superSignature;		//Signature for file system
@@ -50,21 +91,77 @@ typedef struct SuperBlock {
     uint64_t maxPointersPerIndirect[NUM_INDIRECT]; //Max pointers per indirect block
     uint64_t rootDataPointer;		//Pointer to root data block, also start of data blocks
     uint64_t superSignature2;
+    uint64_t checksumStart;			//Pointer to block checksum region, 0 when the volume has none
+    uint64_t checksumBlocks;		//Number of blocks in the checksum region
+    uint64_t dedupStart;			//Pointer to block fingerprint and reference table, 0 when the volume has none
+    uint64_t dedupBlocks;			//Number of blocks in the fingerprint table
+    SnapshotRecord snapshots[MAX_SNAPSHOTS]; //Snapshots of the volume, unused on older volumes
+    uint64_t journalStart;			//Pointer to the metadata journal, 0 when the volume has none
+    uint64_t journalBlocks;			//Number of blocks in the journal
+    uint64_t inodeGroupBlocks;		//Inode table blocks per lazily initialized group, 0 when format zeroed the whole table
+    uint8_t inodeGroupsReady[INODE_GROUPS / 8]; //Groups zeroed so far, the others read as zeros
+    uint64_t inodeBytes;			//INODE_BYTES, 0 when the table packs INODE_LEGACY_BYTES inodes across blocks
 } SuperBlock, *SuperBlock_p;
 
-/* Inodes to point to data */
+/*
+ * A run of length data blocks from start (relative to the root data
+ * pointer) holding the file blocks from fileBlock on. In an interior node of
+ * an extent tree start is instead the node block below, which maps the file
+ * blocks from fileBlock up to the fileBlock of the next entry, and length
+ * is 0.
+ */
+typedef struct Extent {
+	uint64_t start;
+	uint32_t fileBlock;
+	uint32_t length;
+} Extent;
+
+/* Heads the extents in the inode and in every node block of the tree */
+typedef struct ExtentHeader {
+	uint16_t count;						//Entries that follow
+	uint16_t depth;						//Levels of nodes below, 0 when the entries are extents
+	uint32_t spare;						//Zero
+} ExtentHeader;
+
+/*
+ * Inodes to point to data. This is also the layout on the volume: every
+ * field is at its natural alignment with no padding left to the compiler,
+ * and the struct is INODE_BYTES, so inodes in the table start on cache
+ * line boundaries. Legacy volumes hold only the first INODE_LEGACY_BYTES.
+ * A file with INODE_EXTENTS set, only ever on INODE_BYTES volumes, keeps
+ * the root of an extent tree where the data pointers would be.
+ */
 typedef struct Inode {
 	char used;							//Whether this Inode is in use
+	uint8_t flags;						//INODE_ flags, in what used to be padding
+	uint16_t spare;						//Zero, in what is still padding on legacy volumes
 	uint32_t type;						//File or Directory
 	uint64_t parent_p;					//Pointer to parent inode
 	uint64_t size;                      //Size of file in bytes
     uint64_t inode;
     uint64_t blocksReserved;
 	uint64_t dateModified;				//Date when the file/directory was last modified
-	uint64_t directData[NUM_DIRECT]; 	//Pointers directly to data blocks
-	uint64_t indirectData[NUM_INDIRECT];//Pointers to data block that points to other data blocks
+	union {
+		struct {
+			uint64_t directData[NUM_DIRECT]; 	//Pointers directly to data blocks
+			uint64_t indirectData[NUM_INDIRECT];//Pointers to data block that points to other data blocks
+			uint8_t reserved[INODE_BYTES - INODE_LEGACY_BYTES]; //Room for fields only INODE_BYTES volumes have
+		};
+		struct {
+			ExtentHeader extentHeader;			//Root of the extent tree, with INODE_EXTENTS set
+			Extent extents[EXTENT_ROOT_ENTRIES];
+		};
+	};
 } Inode, *Inode_p;
 
+/* The table layout, checked at compile time so a new field cannot move the legacy ones */
+_Static_assert(sizeof(Inode) == INODE_BYTES, "Inode must fill INODE_BYTES exactly");
+_Static_assert(offsetof(Inode, directData) == 48, "Data pointers must stay where legacy volumes keep them");
+_Static_assert(offsetof(Inode, indirectData) == offsetof(Inode, directData) + NUM_DIRECT * sizeof(uint64_t),
+		"Indirect pointers must follow the direct ones");
+_Static_assert(offsetof(Inode, indirectData) + NUM_INDIRECT * sizeof(uint64_t) == INODE_LEGACY_BYTES,
+		"The legacy fields must end at INODE_LEGACY_BYTES");
+
 /* File Control Block(FCB) */
 typedef struct FCB
 {
@@ -76,11 +173,17 @@ typedef struct openFileEntry
 {
   int flags;
   uint64_t position; //where in the file am i
+  uint64_t size;      //size of the file in bytes
   uint64_t inodeId;   //number of inode of file
   char * filebuffer;
+  uint64_t nextBlock;   //file block a sequential read would start at
+  uint64_t readahead;   //readahead window in blocks, 0 while reads are random
+  uint64_t prefetched;  //first file block not prefetched yet
+  char * cluster;       //last cluster of a compressed file decoded, NULL if none
+  uint64_t clusterIndex; //which cluster that is
 }openFileEntry, openFileEntry_p;
 
-openFileEntry * openFileList; //array of currently open files
+extern openFileEntry * openFileList; //array of currently open files
 
 /* Current working path */
 typedef struct WorkingDirectory {
@@ -101,12 +204,32 @@ extern SuperBlock_p sb;
 int check_fs();
 
 /**
- * Formats the current partition and installs a new filesystem.
+ * Formats the current partition and installs a new filesystem, with a
+ * metadata journal unless the partition is memory-mapped. The inode table
+ * is not written: each group of it is zeroed on first use, or by a
+ * background thread, whichever comes first.
  * returns 0 if format was successful
  * returns -1 if format was unsuccessful
  */
 int fs_format();
 
+/**
+ * Same as fs_format with FORMAT_ flags. With FORMAT_CHECKSUMS a checksum
+ * region is laid out between the bit vector and the data blocks and every
+ * block read from then on is verified against it. With FORMAT_DEDUP a table
+ * of block fingerprints and reference counts goes in front of that, and
+ * file blocks whose contents are already stored are shared, not written.
+ * With FORMAT_JOURNAL a journal goes between the superblock and the inodes,
+ * and metadata changes are committed to it in batches before they are
+ * written in place, so a crash never leaves an operation half done. A
+ * memory-mapped partition bypasses the block cache the journal logs from,
+ * so it refuses FORMAT_JOURNAL, and mounts a journaled volume with the
+ * journal inactive once it is replayed.
+ * returns 0 if format was successful
+ * returns -1 if format was unsuccessful
+ */
+int fs_formatWith(uint32_t flags);
+
 /** Outputs data about the current filesystem */
 void fs_lsfs();
 
@@ -130,7 +253,8 @@ int fs_mkdir(char* directoryName);
 int fs_rmdir(char* directoryName);
 
 /**
- * Copies the file from source to destination
+ * Copies the file from source to destination. On a deduplicated volume the
+ * copy shares the blocks of the source and no file data is read or written.
  * returns 0 if successful
  * returns -1 if could not copy file
  * returns -2 if source file does not exist
@@ -162,6 +286,14 @@ int fs_del(char* filename);
  */
 int fs_cpin(char* sourceFile, char* destFile);
 
+/**
+ * Same as fs_cpin with INODE_ flags (INODE_COMPRESSED) for the new file.
+ * returns 0 if successful
+ * returns -1 if unsuccessful
+ * returns -2 if source file does not exist
+ */
+int fs_cpinWith(char* sourceFile, char* destFile, uint8_t flags);
+
 /**
  * Copies a file from this filesystem to another filesystem
  * returns 0 if successful
@@ -170,10 +302,51 @@ int fs_cpin(char* sourceFile, char* destFile);
  */
 int fs_cpout(char* sourceFile, char* destFile);
 
+/**
+ * Takes a snapshot of the volume. Nothing is copied up front: the inodes,
+ * bit vector and fingerprint table are shared with the live volume, and a
+ * metadata block is copied aside only when it is first overwritten after
+ * the snapshot. The data blocks in use stay reserved for the snapshot when
+ * the live files let go of them. File data is never overwritten in place,
+ * so new writes land in other blocks.
+ * returns the number of the snapshot if successful
+ * returns -1 if unsuccessful
+ */
+int fs_snapshot();
+
+/**
+ * Deletes a snapshot, freeing its block map, its copies and the blocks only
+ * it was holding.
+ * returns 0 if successful
+ * returns -1 if there is no such snapshot
+ */
+int fs_snapshotDelete(int snapshot);
+
+/**
+ * Rolls the volume back to a snapshot, which is kept, by writing back the
+ * copies of the metadata blocks changed since. Blocks written since are
+ * freed unless another snapshot holds them.
+ * returns 0 if successful
+ * returns -1 if unsuccessful
+ */
+int fs_snapshotRestore(int snapshot);
+
+/** Outputs the snapshots of the volume */
+void fs_snapshotList();
+
+/**
+ * Reads a file as it was when the snapshot was taken, like readFile.
+ * Returns the number of bytes read into destination if successful
+ * Returns 0 if unsuccessful
+ */
+uint64_t readSnapshotFile(int snapshot, char* destination, const uint64_t inodeID, const uint64_t length);
+
 /**
  * Given an inode number and an Inode_p pointer, readInode
  * will read from the request inode into either a buffer already
  * preallocated, or will allocate a buffer if the pointer is null.
+ * Served from the inode cache, which only reads the table on a miss.
+ * Takes no lock of the inode, that is up to the caller.
  * Returns 0 if successful
  * Returns -1 if unsuccessful
  */
@@ -182,15 +355,27 @@ int readInode(uint64_t inodeID, Inode_p inodeBuffer);
 /**
  * Given an inode number and an Inode_p buffer, writeInode
  * will write to the given inode number from the provided buffer.
- * The inode buffer must be preallocated with the contents.
+ * The inode buffer must be preallocated with the contents. The inode
+ * only goes to the table when its cache entry is evicted or flushed.
+ * Takes no lock of the inode, that is up to the caller.
  * Returns 0 if successful
  * Returns -1 if unsuccessful
  */
 int writeInode(uint64_t inodeID, Inode_p inodeBuffer);
 
+/**
+ * Translates count logical blocks of a file, starting at firstBlock, into
+ * LBAs on the volume and stores them in lbas, through the data pointers or
+ * the extent tree of the inode.
+ * Returns 0 if successful
+ * Returns -1 if the blocks lie beyond what the inode can map
+ */
+int mapFileBlocks(Inode_p inode, uint64_t firstBlock, uint64_t count, uint64_t* lbas);
+
 /**
  * Reads the data of the file from the filesystem and stores it into the destination.
  * If the pointer is null, then memory will be allocated to hold the file data.
+ * The data blocks are read with a single vectored LBAreadv.
  * @param destination the buffer that the file data will be stored in.
  * @param inodeID the file's inode.
  * @param length is the number of bytes to read. 0 if reading the entire file.
@@ -200,7 +385,31 @@ int writeInode(uint64_t inodeID, Inode_p inodeBuffer);
 uint64_t readFile(char* destination, const uint64_t inodeID, const uint64_t length);
 
 /**
- * Finds and returns a free inode number in the inode table.
+ * Replaces the data of the file with length bytes from source, allocating
+ * data and indirect blocks from the bit vector and marking the inode used.
+ * On a volume with INODE_BYTES inodes the file is mapped by extents, one
+ * per run of adjacent blocks, instead of a pointer per block.
+ * A file with INODE_COMPRESSED set is written in clusters of
+ * COMPRESS_CLUSTER_BLOCKS blocks, each stored compressed when that saves at
+ * least a block. readFile and myfsRead decompress transparently. Writers
+ * of the same file take turns, and readers of it wait for them.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int writeFile(const uint64_t inodeID, char* source, const uint64_t length);
+
+/**
+ * Turns compression of the file on or off, rewriting any data it already
+ * has in the new form.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int setFileCompression(const uint64_t inodeID, bool compressed);
+
+/**
+ * Finds and claims a free inode number in the inode table, the first
+ * one from where name hashes to on, from the inode bitmap. It is marked
+ * used there at once, so no other caller gets it before it is written.
  * Returns 0 if unsuccessful
  * Returns a free inode
  */
@@ -221,8 +430,64 @@ uint64_t hashInode(char* name, uint64_t parentInode);
  */
 uint64_t findNextPrime(uint64_t minBlockSize);
 
+/**
+ * Loads the free block bit vector from the volume.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int readBitVector();
+
+/**
+ * Writes the blocks of the free block bit vector changed since the last
+ * write, and the superblock counters that go with it, back to the volume.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int writeBitVector();
+
+/** Returns the number of bit vector blocks changed since writeBitVector last wrote them */
+uint64_t bitVectorDirtyBlocks();
+
+/**
+ * Recounts the available blocks of every ALLOC_CHUNK_BLOCKS chunk from the
+ * bit vectors and compares them with the counts the allocator keeps.
+ * Returns the number of chunks whose count is off
+ */
+uint64_t checkAllocator();
+
+/** Marks the data block (relative to the root data pointer) as used */
+void setBitOn(uint64_t block);
+
+/** Marks the data block (relative to the root data pointer) as free */
+void setBitOff(uint64_t block);
+
+/**
+ * Frees count data blocks starting at firstBlock (relative to the root data
+ * pointer) and returns their space to the host by punching a hole.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int releaseDataBlocks(uint64_t firstBlock, uint64_t count);
+
+/**
+ * Frees every data block of the inode along with its indirect blocks or
+ * extent tree nodes.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int releaseInodeBlocks(Inode_p inode);
+
 int myfsClose(int fd);
 
 int myfsOpen(char * filename);
 
+/**
+ * Reads up to count bytes from the open file at its current position and
+ * advances the position. While the reads are sequential the blocks ahead
+ * of them are prefetched into the cache, with a window that doubles on
+ * every sustained step up to READAHEAD_MAX_BLOCKS.
+ * Returns the number of bytes read, 0 at the end of the file or on error
+ */
+uint64_t myfsRead(int fd, char * buffer, uint64_t count);
+
 #endif
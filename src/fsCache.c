@@ -0,0 +1,666 @@
+/**
+ * Block buffer cache for the filesystem. Each frame holds one block of the
+ * volume; frames are found through a chained hash table keyed by LBA and
+ * recycled with the CLOCK algorithm, so a block that was touched since the
+ * hand last passed gets a second chance before it is evicted. Writes only
+ * dirty the frame, and dirty frames are written back when they are evicted
+ * or when the cache is flushed (runs of adjacent dirty blocks are written
+ * with a single LBAwrite). Requests larger than half the cache bypass it so
+ * that formatting or copying a large file does not wipe out the metadata
+ * blocks that are actually hot. Blocks can also be prefetched: their frames
+ * are claimed at once and filled in the background with LBAreadAsync, and
+ * anything that needs a frame that is still loading waits for it first.
+ * While a metadata journal is running, blocks leaving the cache go to the
+ * journal instead of their home locations, and blocks coming in pick up
+ * any newer image the journal still holds.
+ * Every entry point takes cacheMutex, and lets go of it while a missed
+ * block is read (its frame is marked reading, and anyone else after it
+ * waits on loadedCond) or while prefetches are waited for. A prefetch
+ * completes on whichever thread collects it, so its callback only queues
+ * the run; finishPrefetches applies it with the mutex held.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "fsCache.h"
+#include "fsJournal.h"
+
+#define CACHE_NO_FRAME -1
+#define CACHE_FLUSH_RUN 64
+#define CACHE_MAX_LOADING(frames) ((frames) / 4)
+
+typedef struct CacheFrame {
+	uint64_t lba;					//Block held by this frame
+	int64_t next;					//Next frame in the same hash chain
+	bool valid;						//Frame holds a block
+	bool dirty;						//Frame differs from the volume
+	bool referenced;				//Used since the clock hand last passed
+	bool loading;					//Prefetch into this frame still in flight
+	bool reading;					//Missed block being read into this frame
+	char* data;
+} CacheFrame, *CacheFrame_p;
+
+/* Frames filled by one LBAreadAsync, consecutive frames hold consecutive blocks */
+typedef struct PrefetchRun {
+	int64_t first;					//First frame of the run
+	uint64_t lba;					//Block held by the first frame
+	uint64_t count;					//Number of frames in the run
+	uint64_t generation;			//journalGeneration when the read was issued
+	uint64_t blocksRead;			//Set on completion
+	struct PrefetchRun* next;		//Next completed run waiting for finishPrefetches
+} PrefetchRun, *PrefetchRun_p;
+
+static CacheFrame_p frames = NULL;
+static char* frameData = NULL;
+static int64_t* buckets = NULL;
+static uint64_t numFrames = 0;
+static uint64_t numBuckets = 0;
+static uint64_t clockHand = 0;
+static uint64_t loadingFrames = 0;
+static uint64_t readingFrames = 0;
+static uint64_t blockSize = 0;
+static CacheStats stats;
+
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loadedCond = PTHREAD_COND_INITIALIZER;	//A missed block has been read
+static pthread_mutex_t finishedMutex = PTHREAD_MUTEX_INITIALIZER;
+static PrefetchRun_p finishedRuns = NULL;
+static int (*writeHook)(uint64_t lbaCount, uint64_t lbaPosition) = NULL;	//See cacheSetWriteHook
+
+static uint64_t hashBlock(uint64_t lba) {
+	lba ^= lba >> 33;
+	lba *= 0xff51afd7ed558ccdULL;
+	lba ^= lba >> 33;
+	return lba & (numBuckets - 1);
+}
+
+static int64_t findFrame(uint64_t lba) {
+	int64_t i = buckets[hashBlock(lba)];
+	while (i != CACHE_NO_FRAME) {
+		if (frames[i].lba == lba)
+			return i;
+		i = frames[i].next;
+	}
+	return CACHE_NO_FRAME;
+}
+
+static void unlinkFrame(int64_t index) {
+	int64_t* link = &buckets[hashBlock(frames[index].lba)];
+	while (*link != CACHE_NO_FRAME) {
+		if (*link == index) {
+			*link = frames[index].next;
+			break;
+		}
+		link = &frames[*link].next;
+	}
+	frames[index].valid = false;
+	frames[index].next = CACHE_NO_FRAME;
+}
+
+static void linkFrame(int64_t index, uint64_t lba) {
+	uint64_t bucket = hashBlock(lba);
+	frames[index].lba = lba;
+	frames[index].valid = true;
+	frames[index].next = buckets[bucket];
+	buckets[bucket] = index;
+}
+
+/** Writes blocks leaving the cache to the journal if one is running, home otherwise */
+static uint64_t storeBlocks(void* buffer, uint64_t lbaCount, uint64_t lbaPosition) {
+	if (journalEnabled())
+		return journalAppend(buffer, lbaCount, lbaPosition);
+	return LBAwrite(buffer, lbaCount, lbaPosition);
+}
+
+static int writeBackFrame(int64_t index) {
+	if (storeBlocks(frames[index].data, 1, frames[index].lba) != 1)
+		return -1;
+	frames[index].dirty = false;
+	stats.writebacks++;
+	return 0;
+}
+
+/**
+ * Completes the prefetches whose reads are done, dropping the frames a read
+ * did not fill. The blocks are brought up to date from the journal, and
+ * dropped as well if a checkpoint retired images while the read was in
+ * flight.
+ */
+static void finishPrefetches() {
+	pthread_mutex_lock(&finishedMutex);
+	PrefetchRun_p run = finishedRuns;
+	finishedRuns = NULL;
+	pthread_mutex_unlock(&finishedMutex);
+
+	while (run != NULL) {
+		PrefetchRun_p next = run->next;
+		uint64_t blocksRead = run->blocksRead;
+		if (blocksRead > 0)
+			journalOverlay(frames[run->first].data, blocksRead, run->lba);
+		if (journalGeneration() != run->generation)
+			blocksRead = 0;
+		for (uint64_t i = 0; i < run->count; i++) {
+			frames[run->first + i].loading = false;
+			loadingFrames--;
+			if (i >= blocksRead)
+				unlinkFrame(run->first + i);
+		}
+		free(run);
+		run = next;
+	}
+}
+
+/** Queues a completed prefetch for finishPrefetches, on whatever thread collected it */
+static void prefetchDone(void* context, uint64_t blocksRead) {
+	PrefetchRun_p run = context;
+	run->blocksRead = blocksRead;
+	pthread_mutex_lock(&finishedMutex);
+	run->next = finishedRuns;
+	finishedRuns = run;
+	pthread_mutex_unlock(&finishedMutex);
+}
+
+/**
+ * Waits for some load in flight to complete, with cacheMutex let go
+ * meanwhile: every prefetch if there are any, otherwise the next missed
+ * block another thread is reading.
+ */
+static void waitForLoads() {
+	if (loadingFrames > 0) {
+		pthread_mutex_unlock(&cacheMutex);
+		LBAasyncWait();
+		pthread_mutex_lock(&cacheMutex);
+		finishPrefetches();
+	} else if (readingFrames > 0) {
+		pthread_cond_wait(&loadedCond, &cacheMutex);
+	}
+}
+
+/**
+ * Advances the clock hand until it finds a frame that is free or has not
+ * been referenced since the last pass, writing it back if it is dirty.
+ * Frames that are still being loaded are passed over; if nothing else is
+ * left and wait is set the loads are waited for and the hand goes round
+ * again.
+ * Returns the index of a frame that is ready to be reused
+ * Returns CACHE_NO_FRAME if no frame could be written back
+ */
+static int64_t evictFrame(bool wait) {
+	for (int pass = 0; pass < 2; pass++) {
+		for (uint64_t tries = 0; tries <= numFrames * 2; tries++) {
+			int64_t index = clockHand;
+			clockHand = (clockHand + 1) % numFrames;
+
+			if (!frames[index].valid)
+				return index;
+			if (frames[index].loading || frames[index].reading)
+				continue;
+			if (frames[index].referenced) {
+				frames[index].referenced = false;
+				continue;
+			}
+			if (frames[index].dirty && writeBackFrame(index) == -1)
+				continue;
+			unlinkFrame(index);
+			stats.evictions++;
+			return index;
+		}
+		if (!wait || (loadingFrames == 0 && readingFrames == 0))
+			break;
+		waitForLoads();
+	}
+	/* Every frame is dirty and the volume refuses the write backs */
+	return CACHE_NO_FRAME;
+}
+
+/**
+ * Returns the frame holding lba, if any, once any load into it is done.
+ */
+static int64_t findLoadedFrame(uint64_t lba) {
+	int64_t index = findFrame(lba);
+	while (index != CACHE_NO_FRAME && (frames[index].loading || frames[index].reading)) {
+		/* The load may fail and drop the frame, so look again */
+		waitForLoads();
+		index = findFrame(lba);
+	}
+	return index;
+}
+
+/**
+ * Returns the frame holding lba, loading it from the volume when load is
+ * set and the block is not cached yet. The read is done without cacheMutex,
+ * so other threads carry on meanwhile.
+ * Returns CACHE_NO_FRAME if the block could not be read or no frame was free
+ */
+static int64_t getFrame(uint64_t lba, bool load) {
+	int64_t index = findLoadedFrame(lba);
+	if (index != CACHE_NO_FRAME) {
+		stats.hits++;
+		frames[index].referenced = true;
+		return index;
+	}
+
+	index = evictFrame(true);
+	if (index == CACHE_NO_FRAME)
+		return CACHE_NO_FRAME;
+	/* Someone else may have brought the block in while evictFrame waited */
+	if (findFrame(lba) != CACHE_NO_FRAME)
+		return getFrame(lba, load);
+
+	stats.misses++;
+	linkFrame(index, lba);
+	frames[index].referenced = true;
+	frames[index].dirty = false;
+	if (!load)
+		return index;
+
+	frames[index].reading = true;
+	readingFrames++;
+	pthread_mutex_unlock(&cacheMutex);
+	uint64_t blocksRead = journalRead(frames[index].data, 1, lba);
+	pthread_mutex_lock(&cacheMutex);
+	frames[index].reading = false;
+	readingFrames--;
+	pthread_cond_broadcast(&loadedCond);
+	if (blocksRead != 1) {
+		unlinkFrame(index);
+		return CACHE_NO_FRAME;
+	}
+	return index;
+}
+
+static void issuePrefetch(PrefetchRun_p run) {
+	if (LBAreadAsync(frames[run->first].data, run->count, run->lba, prefetchDone, run) == -1)
+		prefetchDone(run, 0);
+}
+
+static int compareFrames(const void* a, const void* b) {
+	uint64_t lbaA = frames[*(const int64_t*)a].lba;
+	uint64_t lbaB = frames[*(const int64_t*)b].lba;
+	return (lbaA > lbaB) - (lbaA < lbaB);
+}
+
+/**
+ * Allocates a cache of numBlocks block frames for the open partition and
+ * registers a flush with closePartitionSystem.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int cacheInit(uint64_t numBlocks) {
+	if (partInfop == NULL)
+		return -1;
+	if (frames != NULL)
+		return 0;
+	/* A mapped volume is already served from the page cache */
+	if (LBAisMapped())
+		return 0;
+	if (numBlocks < CACHE_MIN_BLOCKS)
+		numBlocks = CACHE_MIN_BLOCKS;
+
+	blockSize = partInfop->blocksize;
+	numFrames = numBlocks;
+	numBuckets = 1;
+	while (numBuckets < numFrames * 2)
+		numBuckets <<= 1;
+
+	frames = calloc(numFrames, sizeof(CacheFrame));
+	frameData = LBAallocBuffer(numFrames);
+	buckets = malloc(numBuckets * sizeof(int64_t));
+	if (frames == NULL || frameData == NULL || buckets == NULL) {
+		free(frames);
+		LBAfreeBuffer(frameData, numFrames);
+		free(buckets);
+		frames = NULL;
+		frameData = NULL;
+		buckets = NULL;
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < numFrames; i++) {
+		frames[i].data = &frameData[i * blockSize];
+		frames[i].next = CACHE_NO_FRAME;
+	}
+	for (uint64_t i = 0; i < numBuckets; i++)
+		buckets[i] = CACHE_NO_FRAME;
+
+	memset(&stats, 0, sizeof(CacheStats));
+	stats.capacity = numFrames;
+	clockHand = 0;
+	loadingFrames = 0;
+	readingFrames = 0;
+	registerCloseHook(cacheShutdown);
+	return 0;
+}
+
+/**
+ * Writes back every dirty block and releases the cache.
+ * Returns 0 if successful
+ * Returns -1 if a write back failed
+ */
+int cacheShutdown() {
+	if (frames == NULL)
+		return 0;
+
+	int retVal = cacheFlush();
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	if (loadingFrames > 0)
+		waitForLoads();
+	free(frames);
+	LBAfreeBuffer(frameData, numFrames);
+	free(buckets);
+	frames = NULL;
+	frameData = NULL;
+	buckets = NULL;
+	numFrames = 0;
+	stats.capacity = 0;
+	pthread_mutex_unlock(&cacheMutex);
+	return retVal;
+}
+
+/**
+ * Same contract as LBAread, served from the cache where possible.
+ * Returns the number of blocks read
+ */
+uint64_t cacheRead(void* buffer, uint64_t lbaCount, uint64_t lbaPosition) {
+	if (frames == NULL)
+		return LBAread(buffer, lbaCount, lbaPosition);
+
+	char* dest = buffer;
+	if (lbaCount > numFrames / 2) {
+		/* Too big to cache, read around it but keep any newer cached copies */
+		uint64_t blocksRead = journalRead(buffer, lbaCount, lbaPosition);
+		cacheOverlay(buffer, lbaCount, lbaPosition);
+		return blocksRead;
+	}
+
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	for (uint64_t i = 0; i < lbaCount; i++) {
+		int64_t index = getFrame(lbaPosition + i, true);
+		if (index == CACHE_NO_FRAME) {
+			pthread_mutex_unlock(&cacheMutex);
+			return i;
+		}
+		memcpy(&dest[i * blockSize], frames[index].data, blockSize);
+	}
+	pthread_mutex_unlock(&cacheMutex);
+	return lbaCount;
+}
+
+/**
+ * Same contract as LBAwrite, but the blocks are only marked dirty in the
+ * cache. Returns the number of blocks written
+ */
+uint64_t cacheWrite(void* buffer, uint64_t lbaCount, uint64_t lbaPosition) {
+	if (writeHook != NULL && writeHook(lbaCount, lbaPosition) != 0)
+		return 0;
+	if (frames == NULL)
+		return LBAwrite(buffer, lbaCount, lbaPosition);
+	if (lbaPosition + lbaCount > partInfop->numberOfBlocks)
+		return 0;
+
+	char* src = buffer;
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	if (lbaCount > numFrames / 2) {
+		/* Too big to cache, write through and refresh any cached copies */
+		uint64_t blocksWritten = storeBlocks(buffer, lbaCount, lbaPosition);
+		for (uint64_t i = 0; i < lbaCount; i++) {
+			int64_t index = findLoadedFrame(lbaPosition + i);
+			if (index != CACHE_NO_FRAME) {
+				memcpy(frames[index].data, &src[i * blockSize], blockSize);
+				frames[index].dirty = false;
+			}
+		}
+		pthread_mutex_unlock(&cacheMutex);
+		return blocksWritten;
+	}
+
+	for (uint64_t i = 0; i < lbaCount; i++) {
+		int64_t index = getFrame(lbaPosition + i, false);
+		if (index == CACHE_NO_FRAME) {
+			if (storeBlocks(&src[i * blockSize], 1, lbaPosition + i) != 1) {
+				pthread_mutex_unlock(&cacheMutex);
+				return i;
+			}
+			continue;
+		}
+		memcpy(frames[index].data, &src[i * blockSize], blockSize);
+		frames[index].dirty = true;
+	}
+	pthread_mutex_unlock(&cacheMutex);
+	return lbaCount;
+}
+
+/** Sets the function cacheWrite calls first, NULL for none */
+void cacheSetWriteHook(int (*hook)(uint64_t lbaCount, uint64_t lbaPosition)) {
+	writeHook = hook;
+}
+
+/**
+ * Starts reading lbaCount blocks into the cache in the background. Blocks
+ * that are already cached are skipped, adjacent blocks that land in adjacent
+ * frames share one LBAreadAsync, and at most a quarter of the cache is ever
+ * loading at once so prefetching can not push out everything else.
+ * Returns the number of blocks from lbaPosition on that are now cached or
+ * loading, which is less than lbaCount if the prefetch had to stop early
+ */
+uint64_t cachePrefetch(uint64_t lbaCount, uint64_t lbaPosition) {
+	if (frames == NULL || lbaPosition >= partInfop->numberOfBlocks)
+		return 0;
+	if (lbaCount > partInfop->numberOfBlocks - lbaPosition)
+		lbaCount = partInfop->numberOfBlocks - lbaPosition;
+
+	uint64_t queued = 0;
+	uint64_t i;
+	PrefetchRun_p run = NULL;
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	for (i = 0; i < lbaCount; i++) {
+		uint64_t lba = lbaPosition + i;
+		if (findFrame(lba) != CACHE_NO_FRAME) {
+			if (run != NULL)
+				issuePrefetch(run);
+			run = NULL;
+			continue;
+		}
+		if (loadingFrames >= CACHE_MAX_LOADING(numFrames))
+			break;
+
+		/* Waiting would let go of the mutex with this run claimed but not issued */
+		int64_t index = evictFrame(false);
+		if (index == CACHE_NO_FRAME)
+			break;
+		linkFrame(index, lba);
+		frames[index].referenced = true;
+		frames[index].dirty = false;
+		frames[index].loading = true;
+		loadingFrames++;
+		queued++;
+
+		if (run != NULL && index == run->first + (int64_t)run->count &&
+				lba == run->lba + run->count) {
+			run->count++;
+			continue;
+		}
+		if (run != NULL)
+			issuePrefetch(run);
+		run = malloc(sizeof(PrefetchRun));
+		if (run == NULL) {
+			frames[index].loading = false;
+			loadingFrames--;
+			unlinkFrame(index);
+			queued--;
+			break;
+		}
+		run->first = index;
+		run->lba = lba;
+		run->count = 1;
+		run->generation = journalGeneration();
+	}
+	if (run != NULL)
+		issuePrefetch(run);
+
+	LBAasyncSubmit();
+	stats.prefetches += queued;
+	pthread_mutex_unlock(&cacheMutex);
+	return i;
+}
+
+/**
+ * Writes every dirty block back, runs of adjacent blocks together, with
+ * cacheMutex held.
+ * Returns 0 if successful
+ * Returns -1 if a write back failed
+ */
+static int writeBackDirty() {
+	uint64_t numDirty = 0;
+	int64_t* dirty = malloc(numFrames * sizeof(int64_t));
+	char* run = LBAallocBuffer(CACHE_FLUSH_RUN);
+	if (dirty == NULL || run == NULL) {
+		free(dirty);
+		LBAfreeBuffer(run, CACHE_FLUSH_RUN);
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < numFrames; i++) {
+		if (frames[i].valid && frames[i].dirty)
+			dirty[numDirty++] = i;
+	}
+	qsort(dirty, numDirty, sizeof(int64_t), compareFrames);
+
+	/* Write adjacent dirty blocks together */
+	int retVal = 0;
+	uint64_t i = 0;
+	while (i < numDirty) {
+		uint64_t runLength = 1;
+		memcpy(run, frames[dirty[i]].data, blockSize);
+		while (i + runLength < numDirty && runLength < CACHE_FLUSH_RUN &&
+				frames[dirty[i + runLength]].lba == frames[dirty[i]].lba + runLength) {
+			memcpy(&run[runLength * blockSize], frames[dirty[i + runLength]].data, blockSize);
+			runLength++;
+		}
+
+		if (storeBlocks(run, runLength, frames[dirty[i]].lba) != runLength) {
+			retVal = -1;
+		} else {
+			for (uint64_t j = i; j < i + runLength; j++)
+				frames[dirty[j]].dirty = false;
+			stats.writebacks += runLength;
+		}
+		i += runLength;
+	}
+
+	free(dirty);
+	LBAfreeBuffer(run, CACHE_FLUSH_RUN);
+	return retVal;
+}
+
+/**
+ * Writes every dirty block back to the volume and waits for them to reach
+ * stable storage. With a journal running they are committed to it instead.
+ * Returns 0 if successful
+ * Returns -1 if a write back failed
+ */
+int cacheFlush() {
+	if (frames == NULL)
+		return 0;
+
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	int retVal = writeBackDirty();
+	pthread_mutex_unlock(&cacheMutex);
+	if (journalEnabled() && journalCommit() != 0)
+		retVal = -1;
+	if (LBAbarrier() != 0)
+		retVal = -1;
+	return retVal;
+}
+
+/** Returns the number of dirty blocks in the cache, which a commit would add to the journal */
+uint64_t cacheDirtyBlocks() {
+	if (frames == NULL)
+		return 0;
+	uint64_t dirty = 0;
+	pthread_mutex_lock(&cacheMutex);
+	for (uint64_t i = 0; i < numFrames; i++) {
+		if (frames[i].valid && frames[i].dirty)
+			dirty++;
+	}
+	pthread_mutex_unlock(&cacheMutex);
+	return dirty;
+}
+
+/**
+ * Ends a filesystem operation. Once the journal is due a commit, every dirty
+ * block goes to it and the lot is committed as one transaction; until then,
+ * and without a journal, dirty blocks just stay in the cache.
+ * Returns 1 if a transaction was committed
+ * Returns 0 if none was due
+ * Returns -1 if the commit failed
+ */
+int cacheCommit() {
+	if (frames == NULL || !journalDue(cacheDirtyBlocks()))
+		return 0;
+
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	int written = writeBackDirty();
+	pthread_mutex_unlock(&cacheMutex);
+	if (written != 0 || journalCommit() != 0)
+		return -1;
+	return 1;
+}
+
+/**
+ * Copies any cached copies of the given blocks over buffer. Used after
+ * reading around the cache, since a cached block may be newer than the volume.
+ */
+void cacheOverlay(void* buffer, uint64_t lbaCount, uint64_t lbaPosition) {
+	if (frames == NULL)
+		return;
+
+	/* The journal may be newer than the volume, and the cache newer than both */
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	journalOverlay(buffer, lbaCount, lbaPosition);
+	char* dest = buffer;
+	for (uint64_t i = 0; i < lbaCount; i++) {
+		/* A frame still loading holds nothing newer than the volume */
+		int64_t index = findFrame(lbaPosition + i);
+		if (index != CACHE_NO_FRAME && !frames[index].loading && !frames[index].reading)
+			memcpy(&dest[i * blockSize], frames[index].data, blockSize);
+	}
+	pthread_mutex_unlock(&cacheMutex);
+}
+
+/**
+ * Drops any cached copies of the given blocks without writing them back,
+ * along with any images of them the journal holds.
+ */
+void cacheInvalidate(uint64_t lbaCount, uint64_t lbaPosition) {
+	journalRevoke(lbaCount, lbaPosition);
+	if (frames == NULL)
+		return;
+
+	pthread_mutex_lock(&cacheMutex);
+	finishPrefetches();
+	for (uint64_t i = 0; i < lbaCount; i++) {
+		int64_t index = findLoadedFrame(lbaPosition + i);
+		if (index != CACHE_NO_FRAME) {
+			unlinkFrame(index);
+			frames[index].dirty = false;
+		}
+	}
+	pthread_mutex_unlock(&cacheMutex);
+}
+
+/** Copies the current cache counters into stats */
+void cacheGetStats(CacheStats_p cacheStats) {
+	pthread_mutex_lock(&cacheMutex);
+	memcpy(cacheStats, &stats, sizeof(CacheStats));
+	pthread_mutex_unlock(&cacheMutex);
+}
@@ -0,0 +1,115 @@
+#ifndef FS_CACHE_H
+#define FS_CACHE_H
+
+#include <stdint.h>
+
+#include "fsLow.h"
+
+/*
+ * Block buffer cache that sits between FileSystem.c and the LBA calls in
+ * fsLow.c. Blocks are cached one at a time, written back lazily (dirty
+ * blocks only reach the volume on eviction or flush) and evicted with the
+ * CLOCK (second chance) algorithm. Until cacheInit is called, and on a
+ * mapped volume where the mapping already does this job, every cache call
+ * passes straight through to LBAread/LBAwrite. With a journal running
+ * (fsJournal.h) dirty blocks go to the journal rather than the volume.
+ * Any number of threads may call into the cache at once; a block read
+ * from the volume does not hold up lookups of other blocks.
+ */
+
+#define CACHE_DEFAULT_BLOCKS 256
+#define CACHE_MIN_BLOCKS 8
+
+typedef struct CacheStats {
+	uint64_t capacity;				//Number of block frames in the cache
+	uint64_t hits;					//Block lookups served from the cache
+	uint64_t misses;				//Block lookups that had to read the volume
+	uint64_t evictions;				//Valid blocks dropped to make room
+	uint64_t writebacks;			//Dirty blocks written back to the volume
+	uint64_t prefetches;			//Blocks queued by cachePrefetch
+} CacheStats, *CacheStats_p;
+
+/**
+ * Allocates a cache of numBlocks block frames for the open partition and
+ * registers a flush with closePartitionSystem.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int cacheInit(uint64_t numBlocks);
+
+/**
+ * Writes back every dirty block and releases the cache.
+ * Returns 0 if successful
+ * Returns -1 if a write back failed
+ */
+int cacheShutdown();
+
+/**
+ * Same contract as LBAread, served from the cache where possible.
+ * Returns the number of blocks read
+ */
+uint64_t cacheRead(void* buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+/**
+ * Same contract as LBAwrite, but the blocks are only marked dirty in the
+ * cache. Returns the number of blocks written
+ */
+uint64_t cacheWrite(void* buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+/**
+ * Sets a function every cacheWrite calls first with the blocks it is about
+ * to write, before it looks at the cache, or NULL for none. The hook may
+ * read and write other blocks through the cache; if it fails the write is
+ * refused and cacheWrite returns 0.
+ */
+void cacheSetWriteHook(int (*hook)(uint64_t lbaCount, uint64_t lbaPosition));
+
+/**
+ * Starts reading the given blocks into the cache in the background with
+ * LBAreadAsync, skipping blocks that are already cached. A later lookup of
+ * a block that is still loading waits for it.
+ * Returns the number of blocks from lbaPosition on that are now cached or
+ * loading, less than lbaCount if the cache could not take them all
+ */
+uint64_t cachePrefetch(uint64_t lbaCount, uint64_t lbaPosition);
+
+/**
+ * Writes every dirty block back to the volume and waits for them to reach
+ * stable storage (LBAbarrier), whatever the durability mode. With a journal
+ * running they are committed to it as one transaction instead.
+ * Returns 0 if successful
+ * Returns -1 if a write back failed
+ */
+int cacheFlush();
+
+/** Returns the number of dirty blocks in the cache, which a commit would add to the journal */
+uint64_t cacheDirtyBlocks();
+
+/**
+ * Marks the end of a filesystem operation. If a journal is running and due
+ * a commit (journalDue, counting the dirty blocks as on their way to it),
+ * every dirty block is committed to it as one transaction. Operations are
+ * batched this way, and are never split between two transactions.
+ * Returns 1 if a transaction was committed
+ * Returns 0 if none was due
+ * Returns -1 if the commit failed
+ */
+int cacheCommit();
+
+/**
+ * Copies any cached copies of the given blocks over buffer. Used after
+ * reading around the cache (for example with LBAreadAsync), since a cached
+ * block may be newer than the volume.
+ */
+void cacheOverlay(void* buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+/**
+ * Drops any cached copies of the given blocks without writing them back,
+ * and revokes any images of them the journal holds
+ */
+void cacheInvalidate(uint64_t lbaCount, uint64_t lbaPosition);
+
+/** Copies the current cache counters into stats */
+void cacheGetStats(CacheStats_p stats);
+
+#endif
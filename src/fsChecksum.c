@@ -0,0 +1,195 @@
+/**
+ * CRC32C kernels for the block checksums. A block is hashed as three equal
+ * lanes at once, because the crc32 instruction takes three cycles but can
+ * start a new one every cycle; the three lane CRCs are then joined by moving
+ * each one past the bytes that follow it, which is a multiplication by a
+ * power of x modulo the polynomial and takes one carry-less multiply and one
+ * more crc32. Short tails, and CPUs without PCLMULQDQ, use a single stream of
+ * crc32 instructions, and anything without SSE4.2 the slicing-by-8 table.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "fsChecksum.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CRC_HAVE_X86 1
+#endif
+
+#define CRC_POLY 0x82f63b78			//Castagnoli polynomial, bit reflected
+#define CRC_LONG_LANE 1024			//Lane bytes while at least 3 of these remain
+#define CRC_SHORT_LANE 128			//Lane bytes for what is left after that
+
+typedef uint32_t (*crcKernel_t)(uint32_t crc, const unsigned char* p, size_t len);
+
+static uint32_t crcTable[8][256];
+static uint32_t longShift[2];		//Constants moving a CRC past 2 and 1 long lanes
+static uint32_t shortShift[2];		//Same for short lanes
+static crcKernel_t kernel;
+static const char* kernelName;
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+/* a * b modulo the polynomial, both bit reflected (x^0 is the top bit) */
+static uint32_t multModP(uint32_t a, uint32_t b) {
+	uint32_t m = (uint32_t) 1 << 31;
+	uint32_t p = 0;
+	while (m != 0) {
+		if (a & m)
+			p ^= b;
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^n modulo the polynomial, bit reflected */
+static uint32_t xPowModP(uint64_t n) {
+	uint32_t result = (uint32_t) 1 << 31;
+	uint32_t square = (uint32_t) 1 << 30;
+	while (n != 0) {
+		if (n & 1)
+			result = multModP(square, result);
+		square = multModP(square, square);
+		n >>= 1;
+	}
+	return result;
+}
+
+static uint32_t crcSoftware(uint32_t crc, const unsigned char* p, size_t len) {
+	while (len != 0 && ((uintptr_t) p & 7) != 0) {
+		crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		word ^= crc;
+		crc = crcTable[7][word & 0xff] ^ crcTable[6][(word >> 8) & 0xff] ^
+			crcTable[5][(word >> 16) & 0xff] ^ crcTable[4][(word >> 24) & 0xff] ^
+			crcTable[3][(word >> 32) & 0xff] ^ crcTable[2][(word >> 40) & 0xff] ^
+			crcTable[1][(word >> 48) & 0xff] ^ crcTable[0][word >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len != 0) {
+		crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	return crc;
+}
+
+#ifdef CRC_HAVE_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crcSse42(uint32_t crc, const unsigned char* p, size_t len) {
+	uint64_t c = crc;
+	while (len != 0 && ((uintptr_t) p & 7) != 0) {
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		c = _mm_crc32_u64(c, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len != 0) {
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+		len--;
+	}
+	return (uint32_t) c;
+}
+
+/*
+ * Moves crc past the bytes the shift constant was made for. The carry-less
+ * product of crc and x^(8n-33) fed through crc32 multiplies by the missing
+ * x^33 and reduces, leaving crc * x^(8n) modulo the polynomial.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crcShift(uint32_t crc, uint32_t shift) {
+	__m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int) crc),
+		_mm_cvtsi32_si128((int) shift), 0);
+	return (uint32_t) _mm_crc32_u64(0, (uint64_t) _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static const unsigned char* crcLanes(uint64_t* crc, const unsigned char* p, size_t lanes,
+		size_t lane, const uint32_t* shift) {
+	const unsigned char* end = p + lanes * 3 * lane;
+	while (p < end) {
+		uint64_t c0 = *crc, c1 = 0, c2 = 0;
+		for (size_t i = 0; i < lane; i += 8) {
+			uint64_t w0, w1, w2;
+			memcpy(&w0, p + i, 8);
+			memcpy(&w1, p + lane + i, 8);
+			memcpy(&w2, p + 2 * lane + i, 8);
+			c0 = _mm_crc32_u64(c0, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+		*crc = crcShift((uint32_t) c0, shift[0]) ^ crcShift((uint32_t) c1, shift[1]) ^ c2;
+		p += 3 * lane;
+	}
+	return p;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crcPclmul(uint32_t crc, const unsigned char* p, size_t len) {
+	uint64_t c = crc;
+	while (len != 0 && ((uintptr_t) p & 7) != 0) {
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+		len--;
+	}
+	size_t lanes = len / (3 * CRC_LONG_LANE);
+	p = crcLanes(&c, p, lanes, CRC_LONG_LANE, longShift);
+	len -= lanes * 3 * CRC_LONG_LANE;
+	lanes = len / (3 * CRC_SHORT_LANE);
+	p = crcLanes(&c, p, lanes, CRC_SHORT_LANE, shortShift);
+	len -= lanes * 3 * CRC_SHORT_LANE;
+	return crcSse42((uint32_t) c, p, len);
+}
+
+#endif
+
+static void crcSetup() {
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = n;
+		for (int k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+		crcTable[0][n] = crc;
+	}
+	for (uint32_t n = 0; n < 256; n++)
+		for (int k = 1; k < 8; k++)
+			crcTable[k][n] = crcTable[0][crcTable[k - 1][n] & 0xff] ^ (crcTable[k - 1][n] >> 8);
+
+	longShift[0] = xPowModP(8 * 2 * CRC_LONG_LANE - 33);
+	longShift[1] = xPowModP(8 * CRC_LONG_LANE - 33);
+	shortShift[0] = xPowModP(8 * 2 * CRC_SHORT_LANE - 33);
+	shortShift[1] = xPowModP(8 * CRC_SHORT_LANE - 33);
+
+	kernel = crcSoftware;
+	kernelName = "table";
+#ifdef CRC_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		kernel = crcSse42;
+		kernelName = "sse4.2";
+		if (__builtin_cpu_supports("pclmul")) {
+			kernel = crcPclmul;
+			kernelName = "sse4.2+pclmul";
+		}
+	}
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+	pthread_once(&crcOnce, crcSetup);
+	return ~kernel(~crc, (const unsigned char*) data, len);
+}
+
+const char* crc32cKernel() {
+	pthread_once(&crcOnce, crcSetup);
+	return kernelName;
+}
@@ -0,0 +1,24 @@
+#ifndef FS_CHECKSUM_H
+#define FS_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli) used for the per-block checksums of the volume. The
+ * kernel is picked once at run time: three interleaved SSE4.2 crc32 streams
+ * joined with PCLMULQDQ where the CPU has both, a single SSE4.2 stream with
+ * only SSE4.2, and a slicing-by-8 table everywhere else. All three give the
+ * same result.
+ */
+
+/**
+ * Continues crc (0 to start) over len bytes of data, like zlib's crc32.
+ * Returns the CRC32C of everything seen so far
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+/** Returns the name of the kernel crc32c is using */
+const char* crc32cKernel();
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * LZ codec for compressed files. The compressor keeps a table of the last
+ * position each 4 byte sequence was seen at, hashed on those 4 bytes, and
+ * takes whatever match the table offers if it really matches; the step
+ * between probes grows while no match turns up, so incompressible data is
+ * skipped over quickly. Matches are at least 4 bytes and at most 64K back.
+ * The decompressor checks every length and offset against both buffers, so
+ * a corrupt cluster fails to decode instead of overrunning memory.
+ */
+
+#include <string.h>
+#include "fsCompress.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 13
+#define LZ_SKIP_SHIFT 5				//Probe step grows by one every 32 misses
+
+static uint32_t read32(const char* p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint64_t read64(const char* p) {
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t hashSequence(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the extra length bytes for a length that did not fit its nibble */
+static char* putLength(char* op, char* end, uint64_t length) {
+	while (length >= 255) {
+		if (op >= end)
+			return NULL;
+		*op++ = (char) 255;
+		length -= 255;
+	}
+	if (op >= end)
+		return NULL;
+	*op++ = (char) length;
+	return op;
+}
+
+/* Emits one sequence; offset 0 marks the final, literal only sequence */
+static char* putSequence(char* op, char* end, const char* literals, uint64_t literalCount,
+		uint64_t offset, uint64_t matchLength) {
+	uint64_t matchCode = offset != 0 ? matchLength - LZ_MIN_MATCH : 0;
+
+	if (op >= end)
+		return NULL;
+	char* token = op++;
+	*token = (char) (((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+	if (literalCount >= 15 && (op = putLength(op, end, literalCount - 15)) == NULL)
+		return NULL;
+	if ((uint64_t) (end - op) < literalCount)
+		return NULL;
+	memcpy(op, literals, literalCount);
+	op += literalCount;
+
+	if (offset == 0)
+		return op;
+	if (end - op < 2)
+		return NULL;
+	*op++ = (char) (offset & 0xff);
+	*op++ = (char) (offset >> 8);
+	if (matchCode >= 15 && (op = putLength(op, end, matchCode - 15)) == NULL)
+		return NULL;
+	return op;
+}
+
+uint64_t lzCompress(const char* src, uint64_t srcLen, char* dst, uint64_t dstCap) {
+	uint32_t table[1 << LZ_HASH_BITS];		//Position + 1 of the last sighting, 0 for none
+	char* op = dst;
+	char* end = dst + dstCap;
+	uint64_t anchor = 0;
+	uint64_t ip = 0;
+	uint64_t misses = 0;
+
+	memset(table, 0, sizeof(table));
+	while (srcLen >= LZ_MIN_MATCH && ip <= srcLen - LZ_MIN_MATCH) {
+		uint32_t sequence = read32(src + ip);
+		uint32_t h = hashSequence(sequence);
+		uint64_t candidate = table[h];
+		table[h] = (uint32_t) (ip + 1);
+
+		if (candidate == 0 || ip + 1 - candidate > LZ_MAX_OFFSET || read32(src + candidate - 1) != sequence) {
+			ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		uint64_t ref = candidate - 1;
+		uint64_t length = LZ_MIN_MATCH;
+		while (ip + length + 8 <= srcLen) {
+			uint64_t diff = read64(src + ref + length) ^ read64(src + ip + length);
+			if (diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+				length += __builtin_ctzll(diff) / 8;	//first differing byte
+#else
+				length += __builtin_clzll(diff) / 8;
+#endif
+				break;
+			}
+			length += 8;
+		}
+		if (ip + length + 8 > srcLen) {
+			while (ip + length < srcLen && src[ref + length] == src[ip + length])
+				length++;
+		}
+		/* Pull the match back over literals that also match */
+		while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+			ip--;
+			ref--;
+			length++;
+		}
+
+		op = putSequence(op, end, src + anchor, ip - anchor, ip - ref, length);
+		if (op == NULL)
+			return 0;
+		ip += length;
+		anchor = ip;
+		misses = 0;
+	}
+
+	op = putSequence(op, end, src + anchor, srcLen - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+	return op - dst;
+}
+
+/* Reads the extra length bytes that follow a nibble of 15 */
+static int getLength(const unsigned char** ip, const unsigned char* end, uint64_t* length) {
+	unsigned char byte;
+	do {
+		if (*ip >= end)
+			return -1;
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+uint64_t lzDecompress(const char* src, uint64_t srcLen, char* dst, uint64_t dstLen) {
+	const unsigned char* ip = (const unsigned char*) src;
+	const unsigned char* end = ip + srcLen;
+	uint64_t op = 0;
+
+	while (ip < end) {
+		unsigned char token = *ip++;
+		uint64_t literalCount = token >> 4;
+		if (literalCount == 15 && getLength(&ip, end, &literalCount) == -1)
+			return 0;
+		if (literalCount > (uint64_t) (end - ip) || literalCount > dstLen - op)
+			return 0;
+		memcpy(dst + op, ip, literalCount);
+		ip += literalCount;
+		op += literalCount;
+		if (ip == end)
+			break;				//The final sequence has no match
+
+		if (end - ip < 2)
+			return 0;
+		uint64_t offset = ip[0] | ((uint64_t) ip[1] << 8);
+		ip += 2;
+		uint64_t length = token & 15;
+		if (length == 15 && getLength(&ip, end, &length) == -1)
+			return 0;
+		length += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || length > dstLen - op)
+			return 0;
+
+		/* A match may overlap the bytes it produces, so copy forwards */
+		char* from = dst + op - offset;
+		char* to = dst + op;
+		if (offset >= length) {
+			memcpy(to, from, length);
+		} else if (offset >= 8) {
+			uint64_t i = 0;
+			for (; i + 8 <= length; i += 8)
+				memcpy(to + i, from + i, 8);
+			for (; i < length; i++)
+				to[i] = from[i];
+		} else {
+			for (uint64_t i = 0; i < length; i++)
+				to[i] = from[i];
+		}
+		op += length;
+	}
+	return op;
+}
@@ -0,0 +1,29 @@
+#ifndef FS_COMPRESS_H
+#define FS_COMPRESS_H
+
+#include <stdint.h>
+
+/*
+ * Byte oriented LZ77 codec (in the style of LZ4) used for compressed files.
+ * The stream is a series of sequences, each a token byte (literal count in
+ * the high nibble, match length - 4 in the low one, 15 meaning more length
+ * bytes follow, each added until one is not 255), the literals, and then a
+ * two byte little endian match offset. The last sequence has literals only.
+ * It favours speed over ratio: one hash probe per position, no entropy stage.
+ */
+
+/**
+ * Compresses srcLen bytes of src into dst, which has room for dstCap bytes.
+ * Returns the compressed size
+ * Returns 0 if it would not fit in dstCap
+ */
+uint64_t lzCompress(const char* src, uint64_t srcLen, char* dst, uint64_t dstCap);
+
+/**
+ * Decompresses srcLen bytes of src into dst, which has room for dstLen bytes.
+ * Returns the number of bytes produced
+ * Returns 0 if the stream is corrupt or would overflow dst
+ */
+uint64_t lzDecompress(const char* src, uint64_t srcLen, char* dst, uint64_t dstLen);
+
+#endif
@@ -0,0 +1,251 @@
+/**
+ * Block sharing for deduplicated volumes. The table on the volume is an
+ * array of one entry per data block; in memory it is indexed by an open
+ * addressing hash table of block numbers, placed by fingerprint and probed
+ * linearly, and entries are deleted by shifting the rest of their cluster
+ * back so no tombstones build up. Fingerprints come from a four lane
+ * multiply and rotate hash, which keeps up with the block copies around it;
+ * it is not collision resistant, which is why every match is compared
+ * against the stored block before it is shared. A block whose last
+ * reference goes keeps its fingerprint, with no references, until
+ * dedupForget: the release may not be committed yet, and until it is the
+ * block must be neither matched nor dropped from the index. Changed table
+ * blocks are only marked dirty and go out with dedupFlush, next to the bit
+ * vector.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "fsDedup.h"
+#include "fsCache.h"
+
+#define FP_PRIME1 0x9e3779b185ebca87ULL
+#define FP_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define FP_PRIME3 0x165667b19e3779f9ULL
+
+typedef struct DedupEntry {
+	uint64_t fingerprint;			//Fingerprint of the block, 0 if it is not indexed
+	uint64_t refs;					//References to the block, 0 for an untracked single owner, or released if indexed
+} DedupEntry;
+
+static DedupEntry* table;
+static bool* dirty;					//Per table block, changed since the last flush
+static uint64_t* slots;				//Index: data block + 1, 0 for an empty slot
+static uint64_t mask;
+static char* verify;				//One block, for comparing a match with the volume
+static uint64_t tableStart;
+static uint64_t tableBlocks;
+static uint64_t dataStart;
+static uint64_t dataBlocks;
+static uint64_t saved;
+
+uint64_t dedupTableBlocks(uint64_t numberOfBlocks, uint64_t blockSize) {
+	return (numberOfBlocks * DEDUP_ENTRY_BYTES + blockSize - 1) / blockSize;
+}
+
+static uint64_t rotl(uint64_t x, int bits) {
+	return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t fpRound(uint64_t lane, uint64_t word) {
+	return rotl(lane + word * FP_PRIME2, 31) * FP_PRIME1;
+}
+
+uint64_t dedupFingerprint(const void* data, uint64_t len) {
+	const unsigned char* p = data;
+	uint64_t lanes[4] = { FP_PRIME1 + FP_PRIME2, FP_PRIME2, 0, -FP_PRIME1 };
+	uint64_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		for (int lane = 0; lane < 4; lane++) {
+			uint64_t word;
+			memcpy(&word, p + i + lane * 8, 8);
+			lanes[lane] = fpRound(lanes[lane], word);
+		}
+	}
+	uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + len;
+	for (; i < len; i++)
+		h = rotl(h ^ (p[i] * FP_PRIME3), 11) * FP_PRIME1;
+
+	/* Final avalanche, so the low bits can place the block in the index */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h != 0 ? h : 1;
+}
+
+static void markDirty(uint64_t block) {
+	dirty[block * DEDUP_ENTRY_BYTES / partInfop->blocksize] = true;
+}
+
+static void indexInsert(uint64_t block) {
+	uint64_t slot = table[block].fingerprint & mask;
+	while (slots[slot] != 0)
+		slot = (slot + 1) & mask;
+	slots[slot] = block + 1;
+}
+
+static void indexRemove(uint64_t block) {
+	uint64_t hole = table[block].fingerprint & mask;
+	while (slots[hole] != block + 1) {
+		if (slots[hole] == 0)
+			return;
+		hole = (hole + 1) & mask;
+	}
+
+	/* Move back any later entry of the cluster that may not skip the hole */
+	uint64_t next = hole;
+	for (;;) {
+		next = (next + 1) & mask;
+		if (slots[next] == 0)
+			break;
+		uint64_t home = table[slots[next] - 1].fingerprint & mask;
+		bool movable = hole <= next ? (home <= hole || home > next) : (home <= hole && home > next);
+		if (movable) {
+			slots[hole] = slots[next];
+			hole = next;
+		}
+	}
+	slots[hole] = 0;
+}
+
+int dedupStart(uint64_t start, uint64_t blocks, uint64_t firstData, uint64_t numData) {
+	dedupStop();
+	if (numData * DEDUP_ENTRY_BYTES > blocks * partInfop->blocksize)
+		return -1;
+
+	uint64_t capacity = 16;
+	while (capacity < 2 * numData)
+		capacity *= 2;
+	table = LBAallocBuffer(blocks);
+	dirty = calloc(blocks, sizeof(bool));
+	slots = calloc(capacity, sizeof(uint64_t));
+	verify = LBAallocBuffer(1);
+	if (table == NULL || dirty == NULL || slots == NULL || verify == NULL ||
+			cacheRead(table, blocks, start) != blocks) {
+		LBAfreeBuffer(table, blocks);
+		LBAfreeBuffer(verify, 1);
+		free(dirty);
+		free(slots);
+		table = NULL;
+		return -1;
+	}
+	tableStart = start;
+	tableBlocks = blocks;
+	dataStart = firstData;
+	dataBlocks = numData;
+	mask = capacity - 1;
+
+	saved = 0;
+	for (uint64_t block = 0; block < dataBlocks; block++) {
+		if (table[block].refs > 1)
+			saved += table[block].refs - 1;
+		/* A release that was final when the volume closed, forget it now */
+		if (table[block].fingerprint != 0 && table[block].refs == 0) {
+			table[block].fingerprint = 0;
+			markDirty(block);
+		}
+		if (table[block].fingerprint != 0)
+			indexInsert(block);
+	}
+	return 0;
+}
+
+void dedupStop() {
+	if (table == NULL)
+		return;
+	LBAfreeBuffer(table, tableBlocks);
+	LBAfreeBuffer(verify, 1);
+	free(dirty);
+	free(slots);
+	table = NULL;
+	dirty = NULL;
+	slots = NULL;
+	verify = NULL;
+}
+
+bool dedupEnabled() {
+	return table != NULL;
+}
+
+uint64_t dedupFind(uint64_t fingerprint, const void* data) {
+	if (table == NULL)
+		return UINT64_MAX;
+	for (uint64_t slot = fingerprint & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+		uint64_t block = slots[slot] - 1;
+		if (table[block].fingerprint != fingerprint || table[block].refs == 0)
+			continue;
+		if (cacheRead(verify, 1, dataStart + block) == 1 && memcmp(verify, data, partInfop->blocksize) == 0)
+			return block;
+	}
+	return UINT64_MAX;
+}
+
+void dedupAdd(uint64_t block, uint64_t fingerprint) {
+	if (table == NULL || block >= dataBlocks)
+		return;
+	if (table[block].fingerprint != 0)
+		indexRemove(block);
+	table[block].fingerprint = fingerprint;
+	table[block].refs = 1;
+	indexInsert(block);
+	markDirty(block);
+}
+
+bool dedupShare(uint64_t block) {
+	if (table == NULL || block >= dataBlocks)
+		return true;
+	if (table[block].fingerprint != 0 && table[block].refs == 0)
+		return false;
+	table[block].refs = table[block].refs == 0 ? 2 : table[block].refs + 1;
+	saved++;
+	markDirty(block);
+	return true;
+}
+
+bool dedupRelease(uint64_t block) {
+	if (table == NULL || block >= dataBlocks || table[block].refs == 0)
+		return true;
+	markDirty(block);
+	if (table[block].refs > 1) {
+		table[block].refs--;
+		saved--;
+		return false;
+	}
+	table[block].refs = 0;
+	return true;
+}
+
+void dedupForget(uint64_t block) {
+	if (table == NULL || block >= dataBlocks || table[block].fingerprint == 0 || table[block].refs != 0)
+		return;
+	indexRemove(block);
+	table[block].fingerprint = 0;
+	markDirty(block);
+}
+
+int dedupFlush() {
+	if (table == NULL)
+		return 0;
+	uint64_t block = 0;
+	while (block < tableBlocks) {
+		if (!dirty[block]) {
+			block++;
+			continue;
+		}
+		uint64_t run = 1;
+		while (block + run < tableBlocks && dirty[block + run])
+			run++;
+		if (cacheWrite((char*) table + block * partInfop->blocksize, run, tableStart + block) != run)
+			return -1;
+		memset(&dirty[block], 0, run * sizeof(bool));
+		block += run;
+	}
+	return 0;
+}
+
+uint64_t dedupSavedBlocks() {
+	return saved;
+}
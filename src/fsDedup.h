@@ -0,0 +1,86 @@
+#ifndef FS_DEDUP_H
+#define FS_DEDUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fsLow.h"
+
+/*
+ * Content addressed sharing of data blocks. On a volume formatted with
+ * FORMAT_DEDUP a table in front of the data blocks holds, for every data
+ * block, a 64 bit fingerprint of its contents and a reference count. The
+ * table is loaded at mount and indexed by fingerprint in memory, so a block
+ * about to be written can be matched against every block already stored;
+ * a match is confirmed byte for byte before the block is shared, so a
+ * fingerprint collision only costs a read. Block numbers here are relative
+ * to the first data block, like the bit vector. The table has no lock of
+ * its own; FileSystem.c calls in under the lock that covers the bit vector.
+ */
+
+#define DEDUP_ENTRY_BYTES 16
+
+/**
+ * Returns the number of blocks the table takes on a volume of
+ * numberOfBlocks blocks of blockSize bytes
+ */
+uint64_t dedupTableBlocks(uint64_t numberOfBlocks, uint64_t blockSize);
+
+/**
+ * Loads the table of tableBlocks blocks at tableStart, for dataBlocks data
+ * blocks starting at dataStart, and builds the fingerprint index.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int dedupStart(uint64_t tableStart, uint64_t tableBlocks, uint64_t dataStart, uint64_t dataBlocks);
+
+/** Releases the table and the index; sharing is off until dedupStart */
+void dedupStop();
+
+/** Returns whether sharing is on for the mounted volume */
+bool dedupEnabled();
+
+/** Returns the fingerprint of len bytes at data, never 0 */
+uint64_t dedupFingerprint(const void* data, uint64_t len);
+
+/**
+ * Looks for a data block holding exactly the block at data, whose
+ * fingerprint is given. Released blocks waiting on dedupForget never match.
+ * Returns the data block
+ * Returns UINT64_MAX if there is none
+ */
+uint64_t dedupFind(uint64_t fingerprint, const void* data);
+
+/** Records a newly written data block with one reference */
+void dedupAdd(uint64_t block, uint64_t fingerprint);
+
+/**
+ * Adds a reference to a data block.
+ * Returns false if the block was released and waits on dedupForget
+ */
+bool dedupShare(uint64_t block);
+
+/**
+ * Drops a reference to a data block. The last one leaves the block in the
+ * index, unmatchable, until dedupForget.
+ * Returns true if the block is now unreferenced and should be freed
+ */
+bool dedupRelease(uint64_t block);
+
+/**
+ * Drops a released block from the index once its release is final, before
+ * the block can be handed out again. Does nothing for any other block.
+ */
+void dedupForget(uint64_t block);
+
+/**
+ * Writes the table blocks changed since the last flush through the cache.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int dedupFlush();
+
+/** Returns the number of block references that share another block's space */
+uint64_t dedupSavedBlocks();
+
+#endif
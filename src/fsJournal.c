@@ -0,0 +1,1021 @@
+/**
+ * Metadata journal. The region starts with a header block naming the first
+ * record to replay; the rest is a circular log of records, one per
+ * transaction, each a descriptor (sequence number, the blocks it holds and
+ * the blocks it revokes) followed by the block images, with a CRC32C over
+ * the whole record so a torn write reads as the end of the log. A record
+ * goes wherever the last one ended, or back at the first log block when it
+ * does not fit before the end, so replay follows the chain of sequence
+ * numbers from the header and tries the start of the log when the chain
+ * breaks. In memory every block with a logged image has an entry in a
+ * chained hash table pointing at its newest image, which serves reads until
+ * a checkpoint has written the block home and moved the header past it.
+ * Blocks that are freed while still logged are revoked: their entries go,
+ * and the next record lists them so replay skips the older images. A record
+ * too big for the log is written to free blocks outside it instead, and the
+ * record in the log only lists where; that one is checkpointed at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "fsJournal.h"
+#include "fsChecksum.h"
+
+#define JOURNAL_MAGIC 0x4a726e6c48656164ULL
+#define JOURNAL_RECORD_MAGIC 0x4a726e6c52656364ULL
+#define JOURNAL_NO_BLOCK UINT64_MAX
+#define JOURNAL_CHECKPOINT_RUN 64
+#define JOURNAL_RECORD_OVERFLOW 1		//The record is held outside the log, in the runs its descriptor lists
+
+/* Block 0 of the region */
+typedef struct JournalHeader {
+	uint64_t magic;
+	uint64_t sequence;				//Sequence number of the first record to replay
+	uint64_t tail;					//Log block that record should start at
+} JournalHeader, *JournalHeader_p;
+
+/* Start of a record, followed by its block numbers and then its revoked runs */
+typedef struct JournalRecord {
+	uint64_t magic;
+	uint64_t sequence;
+	uint64_t blockCount;			//Block images after the descriptor
+	uint64_t revokeCount;			//Runs of revoked blocks, as first block and count
+	uint64_t descriptorBlocks;		//Blocks the descriptor takes
+	uint32_t crc;					//CRC32C of the whole record with this field 0
+	uint32_t flags;
+} JournalRecord, *JournalRecord_p;
+
+typedef struct JournalTxn {
+	uint64_t sequence;
+	uint64_t start;					//Log block of the record, once committed
+	uint64_t length;				//Log blocks the record takes
+	uint64_t count;					//Block images
+	uint64_t capacity;
+	uint64_t* lbas;					//Block of each image, JOURNAL_NO_BLOCK once revoked
+	char* images;
+	uint64_t revokeCount;
+	uint64_t revokeCapacity;
+	uint64_t* revokes;				//Pairs of first block and count
+	struct JournalTxn* next;		//Next committed transaction
+} JournalTxn, *JournalTxn_p;
+
+typedef struct JournalEntry {
+	uint64_t lba;
+	JournalTxn_p txn;				//Transaction holding the newest image
+	uint64_t index;					//Which of its images
+	JournalTxn_p committed;			//Newest committed transaction holding an image, NULL if none
+	struct JournalEntry* next;
+} JournalEntry, *JournalEntry_p;
+
+/* A block for a checkpoint to write home */
+typedef struct CheckpointBlock {
+	uint64_t lba;
+	const char* data;
+} CheckpointBlock, *CheckpointBlock_p;
+
+static pthread_mutex_t journalMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static pthread_t checkpointThread;
+static bool logging = false;
+static bool stopping = false;
+static bool urgent = false;			//Someone is waiting for log space
+static bool checkpointFailed = false;
+static bool holding = false;		//journalHoldCheckpoints
+static uint64_t (*overflowHook)(uint64_t count, uint64_t* lbas) = NULL;
+
+static uint64_t blockSize;
+static uint64_t regionStart;
+static uint64_t regionBlocks;
+static uint64_t head;				//Log block the next record goes to
+static uint64_t nextSequence;
+static uint64_t checkpointing;		//Last sequence number of the checkpoint in flight, 0 if none
+static uint64_t generation;
+static uint64_t lastCommit;
+
+static JournalTxn_p current = NULL;	//Running transaction, NULL until something is added
+static JournalTxn_p oldest = NULL;	//Committed transactions not checkpointed yet
+static JournalTxn_p newest = NULL;
+static JournalEntry_p* map = NULL;
+static uint64_t mapMask;
+static JournalStats stats;
+
+static uint64_t nowMs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t hashBlock(uint64_t lba) {
+	lba ^= lba >> 33;
+	lba *= 0xff51afd7ed558ccdULL;
+	lba ^= lba >> 33;
+	return lba & mapMask;
+}
+
+static JournalEntry_p findEntry(uint64_t lba) {
+	JournalEntry_p entry = map[hashBlock(lba)];
+	while (entry != NULL && entry->lba != lba)
+		entry = entry->next;
+	return entry;
+}
+
+static void removeEntry(uint64_t lba) {
+	JournalEntry_p* link = &map[hashBlock(lba)];
+	while (*link != NULL) {
+		if ((*link)->lba == lba) {
+			JournalEntry_p entry = *link;
+			*link = entry->next;
+			free(entry);
+			return;
+		}
+		link = &(*link)->next;
+	}
+}
+
+static void freeTxn(JournalTxn_p txn) {
+	if (txn == NULL)
+		return;
+	free(txn->lbas);
+	free(txn->images);
+	free(txn->revokes);
+	free(txn);
+}
+
+static uint64_t descriptorBlocks(uint64_t count, uint64_t revokeCount) {
+	uint64_t bytes = sizeof(JournalRecord) + count * sizeof(uint64_t) + revokeCount * 2 * sizeof(uint64_t);
+	return (bytes + blockSize - 1) / blockSize;
+}
+
+/** Returns whether the running transaction can take more and still fit half the log */
+static bool currentFits(uint64_t moreBlocks, uint64_t moreRevokes) {
+	uint64_t count = (current != NULL ? current->count : 0) + moreBlocks;
+	uint64_t revokes = (current != NULL ? current->revokeCount : 0) + moreRevokes;
+	return descriptorBlocks(count, revokes) + count <= (regionBlocks - 1) / 2;
+}
+
+static int writeHeader(uint64_t sequence, uint64_t tail) {
+	JournalHeader_p header = LBAallocBuffer(1);
+	if (header == NULL)
+		return -1;
+	memset(header, 0, blockSize);
+	header->magic = JOURNAL_MAGIC;
+	header->sequence = sequence;
+	header->tail = tail;
+	uint64_t written = LBAwrite(header, 1, regionStart);
+	LBAfreeBuffer(header, 1);
+	return written == 1 ? 0 : -1;
+}
+
+/**
+ * Returns the log block a record of length blocks can start at without
+ * overwriting one that is not checkpointed yet
+ * Returns 0 if there is no room until a checkpoint frees some
+ */
+static uint64_t findSpace(uint64_t length) {
+	uint64_t position = head + length <= regionBlocks ? head : 1;
+	if (oldest == NULL)
+		return position;
+	uint64_t tail = oldest->start;
+	if (tail < head) {
+		/* Live records sit in [tail, head), everything else is free */
+		if (position == head || position + length <= tail)
+			return position;
+		return 0;
+	}
+	/* Live records wrap around the end, only [head, tail) is free */
+	if (position == head && head + length <= tail)
+		return position;
+	return 0;
+}
+
+/**
+ * Lays out the record of the running transaction: its descriptor, block
+ * numbers, revoked runs and images, with the CRC over all of it.
+ * Returns the record, length blocks to free with LBAfreeBuffer
+ * Returns NULL if unsuccessful
+ */
+static char* buildRecord(JournalTxn_p txn, uint64_t descBlocks, uint64_t length) {
+	char* record = LBAallocBuffer(length);
+	if (record == NULL)
+		return NULL;
+	memset(record, 0, descBlocks * blockSize);
+	JournalRecord_p desc = (JournalRecord_p) record;
+	desc->magic = JOURNAL_RECORD_MAGIC;
+	desc->sequence = nextSequence;
+	desc->blockCount = txn->count;
+	desc->revokeCount = txn->revokeCount;
+	desc->descriptorBlocks = descBlocks;
+	uint64_t* list = (uint64_t*) (desc + 1);
+	if (txn->count != 0) {
+		memcpy(list, txn->lbas, txn->count * sizeof(uint64_t));
+		memcpy(&record[descBlocks * blockSize], txn->images, txn->count * blockSize);
+	}
+	if (txn->revokeCount != 0)
+		memcpy(&list[txn->count], txn->revokes, txn->revokeCount * 2 * sizeof(uint64_t));
+	desc->crc = crc32c(0, record, length * blockSize);
+	return record;
+}
+
+/**
+ * Waits for log space for a record of length blocks, with journalMutex held.
+ * Returns the log block it can start at
+ * Returns 0 if a checkpoint failed and there is none
+ */
+static uint64_t waitForSpace(uint64_t length) {
+	uint64_t position;
+	while ((position = findSpace(length)) == 0) {
+		urgent = true;
+		pthread_cond_signal(&wakeCond);
+		pthread_cond_wait(&doneCond, &journalMutex);
+		if (checkpointFailed && findSpace(length) == 0)
+			return 0;
+	}
+	return position;
+}
+
+/** Makes the running transaction the newest committed one, its record at position, with journalMutex held */
+static void addCommitted(uint64_t position, uint64_t length) {
+	JournalTxn_p txn = current;
+	txn->sequence = nextSequence++;
+	txn->start = position;
+	txn->length = length;
+	for (uint64_t i = 0; i < txn->count; i++)
+		findEntry(txn->lbas[i])->committed = txn;
+	if (newest != NULL)
+		newest->next = txn;
+	else
+		oldest = txn;
+	newest = txn;
+	head = position + length;
+	current = NULL;
+
+	stats.commits++;
+	stats.blocksLogged += txn->count;
+	lastCommit = nowMs();
+}
+
+/**
+ * Commits a record too big for the log. It goes to free blocks outside the
+ * log that the overflow hook finds, and a record in the log lists their
+ * runs, so a replay still gets all of the transaction or none of it. The
+ * transaction is checkpointed before this returns, so nothing is left to
+ * replay from those blocks once they are free to be written again. Called
+ * and returns with journalMutex held, but lets go of it while writing.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful, with the transaction still running
+ */
+static int commitOverflow(char* record, uint64_t length) {
+	uint64_t* lbas = malloc(length * sizeof(uint64_t));
+	if (lbas == NULL)
+		return -1;
+	/* Only this thread commits, and the hook's blocks stay free while it does */
+	pthread_mutex_unlock(&journalMutex);
+	uint64_t found = overflowHook != NULL ? overflowHook(length, lbas) : 0;
+	uint64_t runs = 0;
+	for (uint64_t i = 0; i < found; i++) {
+		if (i == 0 || lbas[i] != lbas[i - 1] + 1)
+			runs++;
+	}
+	uint64_t pointerBlocks = descriptorBlocks(0, runs);
+	if (found < length || pointerBlocks > regionBlocks - 1) {
+		printf("Error: A transaction of %lu blocks fits neither the journal nor the free space\n", length);
+		free(lbas);
+		pthread_mutex_lock(&journalMutex);
+		return -1;
+	}
+
+	JournalRecord_p pointer = LBAallocBuffer(pointerBlocks);
+	if (pointer == NULL) {
+		free(lbas);
+		pthread_mutex_lock(&journalMutex);
+		return -1;
+	}
+	memset(pointer, 0, pointerBlocks * blockSize);
+	pointer->magic = JOURNAL_RECORD_MAGIC;
+	pointer->sequence = nextSequence;
+	pointer->revokeCount = runs;
+	pointer->descriptorBlocks = pointerBlocks;
+	pointer->flags = JOURNAL_RECORD_OVERFLOW;
+	uint64_t* list = (uint64_t*) (pointer + 1);
+	bool written = LBAbarrier() == 0;
+	uint64_t run = 0;
+	for (uint64_t i = 0; written && i < length; run++) {
+		uint64_t count = 1;
+		while (i + count < length && lbas[i + count] == lbas[i] + count)
+			count++;
+		list[run * 2] = lbas[i];
+		list[run * 2 + 1] = count;
+		written = LBAwrite(&record[i * blockSize], count, lbas[i]) == count;
+		i += count;
+	}
+	pointer->crc = crc32c(0, pointer, pointerBlocks * blockSize);
+	/* The record must be whole where the log points before the log points there */
+	if (written)
+		written = LBAbarrier() == 0;
+	pthread_mutex_lock(&journalMutex);
+	uint64_t position = written ? waitForSpace(pointerBlocks) : 0;
+	pthread_mutex_unlock(&journalMutex);
+	if (position != 0)
+		written = LBAwrite(pointer, pointerBlocks, regionStart + position) == pointerBlocks;
+	pthread_mutex_lock(&journalMutex);
+	if (position == 0 || !written) {
+		LBAfreeBuffer(pointer, pointerBlocks);
+		free(lbas);
+		return -1;
+	}
+
+	uint64_t sequence = nextSequence;
+	addCommitted(position, pointerBlocks);
+	stats.overflows++;
+	int retVal = 0;
+	while (!holding && retVal == 0 && oldest != NULL && oldest->sequence <= sequence) {
+		urgent = true;
+		pthread_cond_signal(&wakeCond);
+		pthread_cond_wait(&doneCond, &journalMutex);
+		if (checkpointFailed && oldest != NULL && oldest->sequence <= sequence)
+			retVal = -1;
+	}
+	/* Checkpointed, the blocks are free again and need not keep the copy */
+	bool checkpointed = oldest == NULL || oldest->sequence > sequence;
+	pthread_mutex_unlock(&journalMutex);
+	for (uint64_t r = 0; checkpointed && retVal == 0 && r < runs; r++)
+		LBAdiscard(list[r * 2 + 1], list[r * 2]);
+	pthread_mutex_lock(&journalMutex);
+	LBAfreeBuffer(pointer, pointerBlocks);
+	free(lbas);
+	return retVal;
+}
+
+/**
+ * Writes the running transaction to the log. Called and returns with
+ * journalMutex held, but lets go of it while waiting for log space and
+ * while writing.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int commitCurrent() {
+	JournalTxn_p txn = current;
+	if (txn == NULL) {
+		lastCommit = nowMs();
+		return 0;
+	}
+
+	/* Squeeze out revoked images, keeping the map pointing at the rest */
+	uint64_t kept = 0;
+	for (uint64_t i = 0; i < txn->count; i++) {
+		if (txn->lbas[i] == JOURNAL_NO_BLOCK)
+			continue;
+		if (kept != i) {
+			txn->lbas[kept] = txn->lbas[i];
+			memcpy(&txn->images[kept * blockSize], &txn->images[i * blockSize], blockSize);
+			findEntry(txn->lbas[kept])->index = kept;
+		}
+		kept++;
+	}
+	txn->count = kept;
+	if (txn->count == 0 && txn->revokeCount == 0) {
+		lastCommit = nowMs();
+		return 0;
+	}
+
+	uint64_t descBlocks = descriptorBlocks(txn->count, txn->revokeCount);
+	uint64_t length = descBlocks + txn->count;
+	char* record = buildRecord(txn, descBlocks, length);
+	if (record == NULL)
+		return -1;
+	if (length > regionBlocks - 1) {
+		int retVal = commitOverflow(record, length);
+		LBAfreeBuffer(record, length);
+		return retVal;
+	}
+	uint64_t position = waitForSpace(length);
+	if (position == 0) {
+		LBAfreeBuffer(record, length);
+		return -1;
+	}
+
+	/* Only this thread commits, and a checkpoint can only free more space meanwhile */
+	pthread_mutex_unlock(&journalMutex);
+	bool written = LBAbarrier() == 0 && LBAwrite(record, length, regionStart + position) == length;
+	pthread_mutex_lock(&journalMutex);
+	LBAfreeBuffer(record, length);
+	if (!written)
+		return -1;
+	addCommitted(position, length);
+	return 0;
+}
+
+/** Adds one block to the running transaction, with journalMutex held */
+static int addImage(uint64_t lba, const char* data) {
+	if (current == NULL) {
+		current = calloc(1, sizeof(JournalTxn));
+		if (current == NULL)
+			return -1;
+	}
+	if (current->count == current->capacity) {
+		uint64_t capacity = current->capacity == 0 ? 16 : current->capacity * 2;
+		uint64_t* lbas = realloc(current->lbas, capacity * sizeof(uint64_t));
+		if (lbas == NULL)
+			return -1;
+		current->lbas = lbas;
+		char* images = realloc(current->images, capacity * blockSize);
+		if (images == NULL)
+			return -1;
+		current->images = images;
+		current->capacity = capacity;
+	}
+
+	JournalEntry_p entry = findEntry(lba);
+	if (entry == NULL) {
+		entry = malloc(sizeof(JournalEntry));
+		if (entry == NULL)
+			return -1;
+		uint64_t bucket = hashBlock(lba);
+		entry->lba = lba;
+		entry->committed = NULL;
+		entry->next = map[bucket];
+		map[bucket] = entry;
+	}
+	entry->txn = current;
+	entry->index = current->count;
+	current->lbas[current->count] = lba;
+	memcpy(&current->images[current->count * blockSize], data, blockSize);
+	current->count++;
+	return 0;
+}
+
+/** Lists lba as revoked in the running transaction, with journalMutex held */
+static int addRevoke(uint64_t lba) {
+	if (current == NULL) {
+		current = calloc(1, sizeof(JournalTxn));
+		if (current == NULL)
+			return -1;
+	}
+	uint64_t* last = current->revokeCount > 0 ? &current->revokes[(current->revokeCount - 1) * 2] : NULL;
+	if (last != NULL && last[0] + last[1] == lba) {
+		last[1]++;
+		return 0;
+	}
+	if (current->revokeCount == current->revokeCapacity) {
+		uint64_t capacity = current->revokeCapacity == 0 ? 16 : current->revokeCapacity * 2;
+		uint64_t* revokes = realloc(current->revokes, capacity * 2 * sizeof(uint64_t));
+		if (revokes == NULL)
+			return -1;
+		current->revokes = revokes;
+		current->revokeCapacity = capacity;
+	}
+	current->revokes[current->revokeCount * 2] = lba;
+	current->revokes[current->revokeCount * 2 + 1] = 1;
+	current->revokeCount++;
+	return 0;
+}
+
+static int compareCheckpointBlocks(const void* a, const void* b) {
+	uint64_t lbaA = ((const CheckpointBlock*) a)->lba;
+	uint64_t lbaB = ((const CheckpointBlock*) b)->lba;
+	return (lbaA > lbaB) - (lbaA < lbaB);
+}
+
+/**
+ * Writes every committed transaction home and moves the header past them.
+ * Called and returns with journalMutex held, but lets go of it for the
+ * writes; transactions committed meanwhile wait for the next checkpoint.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+static int checkpointBatch() {
+	JournalTxn_p last = newest;
+	checkpointing = last->sequence;
+
+	/* Only the newest committed image of each block needs to go home */
+	uint64_t count = 0;
+	for (JournalTxn_p txn = oldest; txn != last->next; txn = txn->next) {
+		for (uint64_t i = 0; i < txn->count; i++) {
+			JournalEntry_p entry = findEntry(txn->lbas[i]);
+			if (entry != NULL && entry->committed == txn)
+				count++;
+		}
+	}
+	CheckpointBlock_p plan = malloc((count + 1) * sizeof(CheckpointBlock));
+	char* run = LBAallocBuffer(JOURNAL_CHECKPOINT_RUN);
+	int retVal = plan != NULL && run != NULL ? 0 : -1;
+	count = 0;
+	for (JournalTxn_p txn = oldest; retVal == 0 && txn != last->next; txn = txn->next) {
+		for (uint64_t i = 0; i < txn->count; i++) {
+			JournalEntry_p entry = findEntry(txn->lbas[i]);
+			if (entry != NULL && entry->committed == txn) {
+				plan[count].lba = txn->lbas[i];
+				plan[count].data = &txn->images[i * blockSize];
+				count++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&journalMutex);
+
+	/* The records must be durable before anything they describe is overwritten */
+	if (retVal == 0 && LBAbarrier() != 0)
+		retVal = -1;
+	if (retVal == 0)
+		qsort(plan, count, sizeof(CheckpointBlock), compareCheckpointBlocks);
+	uint64_t i = 0;
+	while (retVal == 0 && i < count) {
+		uint64_t runLength = 1;
+		memcpy(run, plan[i].data, blockSize);
+		while (i + runLength < count && runLength < JOURNAL_CHECKPOINT_RUN &&
+				plan[i + runLength].lba == plan[i].lba + runLength) {
+			memcpy(&run[runLength * blockSize], plan[i + runLength].data, blockSize);
+			runLength++;
+		}
+		if (LBAwrite(run, runLength, plan[i].lba) != runLength)
+			retVal = -1;
+		i += runLength;
+	}
+	if (retVal == 0 && LBAbarrier() != 0)
+		retVal = -1;
+
+	pthread_mutex_lock(&journalMutex);
+	JournalTxn_p next = last->next;
+	uint64_t sequence = next != NULL ? next->sequence : nextSequence;
+	uint64_t tail = next != NULL ? next->start : head;
+	pthread_mutex_unlock(&journalMutex);
+	if (retVal == 0 && (writeHeader(sequence, tail) != 0 || LBAbarrier() != 0))
+		retVal = -1;
+	pthread_mutex_lock(&journalMutex);
+
+	if (retVal == 0) {
+		/* Anything committed since goes on after last, whatever the header says */
+		next = last->next;
+		JournalTxn_p txn = oldest;
+		while (txn != next) {
+			JournalTxn_p following = txn->next;
+			for (uint64_t j = 0; j < txn->count; j++) {
+				JournalEntry_p entry = findEntry(txn->lbas[j]);
+				if (entry == NULL)
+					continue;
+				if (entry->committed == txn)
+					entry->committed = NULL;
+				if (entry->txn == txn)
+					removeEntry(txn->lbas[j]);
+			}
+			freeTxn(txn);
+			txn = following;
+		}
+		oldest = next;
+		if (oldest == NULL)
+			newest = NULL;
+		generation++;
+		stats.checkpoints++;
+	}
+	checkpointFailed = retVal != 0;
+	checkpointing = 0;
+	pthread_cond_broadcast(&doneCond);
+	free(plan);
+	LBAfreeBuffer(run, JOURNAL_CHECKPOINT_RUN);
+	return retVal;
+}
+
+/** Checkpoints every JOURNAL_CHECKPOINT_MS, or at once when log space runs out */
+static void* checkpointMain(void* unused) {
+	(void) unused;
+	pthread_mutex_lock(&journalMutex);
+	while (!stopping || oldest != NULL) {
+		if (!urgent && !stopping) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += JOURNAL_CHECKPOINT_MS / 1000;
+			deadline.tv_nsec += (JOURNAL_CHECKPOINT_MS % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&wakeCond, &journalMutex, &deadline);
+		}
+		urgent = false;
+		if (oldest != NULL && (!holding || stopping) && checkpointBatch() != 0 && stopping)
+			break;
+	}
+	pthread_mutex_unlock(&journalMutex);
+	return NULL;
+}
+
+/** Returns whether the checksum of a record read back holds and the blocks it lists are outside the log */
+static bool recordHolds(char* record, uint64_t length) {
+	JournalRecord_p desc = (JournalRecord_p) record;
+	uint32_t crc = desc->crc;
+	desc->crc = 0;
+	bool valid = crc32c(0, record, length * blockSize) == crc;
+	uint64_t* lbas = (uint64_t*) (desc + 1);
+	for (uint64_t i = 0; valid && i < desc->blockCount; i++) {
+		valid = lbas[i] < partInfop->numberOfBlocks &&
+			(lbas[i] < regionStart || lbas[i] >= regionStart + regionBlocks);
+	}
+	return valid;
+}
+
+/**
+ * Reads the record an overflow record lists the runs of, if it carries the
+ * same sequence number and its checksum holds.
+ * Returns the record, and its length in blocks through length
+ * Returns NULL if it is not all there
+ */
+static char* readOverflow(JournalRecord_p pointer, uint64_t* length) {
+	uint64_t* runs = (uint64_t*) (pointer + 1);
+	*length = 0;
+	for (uint64_t r = 0; r < pointer->revokeCount; r++) {
+		uint64_t first = runs[r * 2];
+		uint64_t count = runs[r * 2 + 1];
+		if (count == 0 || first >= partInfop->numberOfBlocks || count > partInfop->numberOfBlocks - first ||
+				(first < regionStart + regionBlocks && first + count > regionStart))
+			return NULL;
+		*length += count;
+	}
+	char* record = *length != 0 ? LBAallocBuffer(*length) : NULL;
+	if (record == NULL)
+		return NULL;
+	bool valid = true;
+	uint64_t offset = 0;
+	for (uint64_t r = 0; valid && r < pointer->revokeCount; r++) {
+		valid = LBAread(&record[offset * blockSize], runs[r * 2 + 1], runs[r * 2]) == runs[r * 2 + 1];
+		offset += runs[r * 2 + 1];
+	}
+	JournalRecord_p desc = (JournalRecord_p) record;
+	valid = valid && desc->magic == JOURNAL_RECORD_MAGIC && desc->sequence == pointer->sequence &&
+		desc->flags == 0 && desc->blockCount < *length && desc->revokeCount < *length * blockSize &&
+		desc->descriptorBlocks == descriptorBlocks(desc->blockCount, desc->revokeCount) &&
+		desc->descriptorBlocks + desc->blockCount == *length && recordHolds(record, *length);
+	if (!valid) {
+		LBAfreeBuffer(record, *length);
+		return NULL;
+	}
+	return record;
+}
+
+/**
+ * Reads the record at log block position if it carries the given sequence
+ * number and its checksum holds, from where it overflowed to if it did.
+ * Returns the record, its length in blocks through length, and the log
+ * blocks it takes through logLength
+ * Returns NULL if there is no such record
+ */
+static char* readRecord(uint64_t position, uint64_t sequence, uint64_t* length, uint64_t* logLength) {
+	if (position == 0 || position >= regionBlocks)
+		return NULL;
+	JournalRecord_p desc = LBAallocBuffer(1);
+	if (desc == NULL)
+		return NULL;
+	bool valid = LBAread(desc, 1, regionStart + position) == 1 &&
+		desc->magic == JOURNAL_RECORD_MAGIC && desc->sequence == sequence &&
+		(desc->flags & ~JOURNAL_RECORD_OVERFLOW) == 0 &&
+		desc->blockCount < regionBlocks && desc->revokeCount < regionBlocks * blockSize &&
+		desc->descriptorBlocks == descriptorBlocks(desc->blockCount, desc->revokeCount) &&
+		position + desc->descriptorBlocks + desc->blockCount <= regionBlocks;
+	*logLength = valid ? desc->descriptorBlocks + desc->blockCount : 0;
+	LBAfreeBuffer(desc, 1);
+	if (!valid)
+		return NULL;
+
+	char* record = LBAallocBuffer(*logLength);
+	if (record == NULL)
+		return NULL;
+	if (LBAread(record, *logLength, regionStart + position) != *logLength || !recordHolds(record, *logLength)) {
+		LBAfreeBuffer(record, *logLength);
+		return NULL;
+	}
+	*length = *logLength;
+	desc = (JournalRecord_p) record;
+	if (desc->flags & JOURNAL_RECORD_OVERFLOW) {
+		char* overflow = readOverflow(desc, length);
+		LBAfreeBuffer(record, *logLength);
+		return overflow;
+	}
+	return record;
+}
+
+/** Returns whether one of the records after first revokes lba */
+static bool revokedLater(char** records, uint64_t first, uint64_t numRecords, uint64_t lba) {
+	for (uint64_t r = first + 1; r < numRecords; r++) {
+		JournalRecord_p desc = (JournalRecord_p) records[r];
+		uint64_t* revokes = (uint64_t*) (desc + 1) + desc->blockCount;
+		for (uint64_t i = 0; i < desc->revokeCount; i++) {
+			if (lba >= revokes[i * 2] && lba - revokes[i * 2] < revokes[i * 2 + 1])
+				return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Writes every committed record after the header home, then empties the log.
+ * Returns the number of records replayed
+ * Returns -1 if unsuccessful
+ */
+static int replay() {
+	JournalHeader_p header = LBAallocBuffer(1);
+	if (header == NULL)
+		return -1;
+	bool valid = LBAread(header, 1, regionStart) == 1 && header->magic == JOURNAL_MAGIC &&
+		header->tail != 0 && header->tail <= regionBlocks;
+	uint64_t position = header->tail;
+	uint64_t sequence = header->sequence;
+	LBAfreeBuffer(header, 1);
+	if (!valid)
+		return -1;
+
+	/* Follow the chain of sequence numbers, wrapping to the start of the log where it breaks */
+	uint64_t numRecords = 0;
+	uint64_t capacity = 16;
+	char** records = malloc(capacity * sizeof(char*));
+	uint64_t* lengths = malloc(capacity * sizeof(uint64_t));
+	int retVal = records != NULL && lengths != NULL ? 0 : -1;
+	while (retVal == 0) {
+		uint64_t length;
+		uint64_t logLength;
+		char* record = readRecord(position, sequence, &length, &logLength);
+		if (record == NULL && position != 1) {
+			position = 1;
+			record = readRecord(position, sequence, &length, &logLength);
+		}
+		if (record == NULL)
+			break;
+		if (numRecords == capacity) {
+			capacity *= 2;
+			char** moreRecords = realloc(records, capacity * sizeof(char*));
+			if (moreRecords != NULL)
+				records = moreRecords;
+			uint64_t* moreLengths = realloc(lengths, capacity * sizeof(uint64_t));
+			if (moreLengths != NULL)
+				lengths = moreLengths;
+			if (moreRecords == NULL || moreLengths == NULL) {
+				LBAfreeBuffer(record, length);
+				retVal = -1;
+				break;
+			}
+		}
+		records[numRecords] = record;
+		lengths[numRecords] = length;
+		numRecords++;
+		position += logLength;
+		sequence++;
+	}
+
+	for (uint64_t r = 0; retVal == 0 && r < numRecords; r++) {
+		JournalRecord_p desc = (JournalRecord_p) records[r];
+		uint64_t* lbas = (uint64_t*) (desc + 1);
+		char* images = &records[r][desc->descriptorBlocks * blockSize];
+		for (uint64_t i = 0; i < desc->blockCount; i++) {
+			if (revokedLater(records, r, numRecords, lbas[i]))
+				continue;
+			if (LBAwrite(&images[i * blockSize], 1, lbas[i]) != 1)
+				retVal = -1;
+		}
+	}
+	if (retVal == 0 && numRecords > 0 && LBAbarrier() != 0)
+		retVal = -1;
+
+	/* Nothing is left to replay once the header points past it all */
+	head = 1;
+	nextSequence = sequence;
+	if (retVal == 0 && (writeHeader(nextSequence, head) != 0 || LBAbarrier() != 0))
+		retVal = -1;
+
+	for (uint64_t r = 0; r < numRecords; r++)
+		LBAfreeBuffer(records[r], lengths[r]);
+	free(records);
+	free(lengths);
+	return retVal == 0 ? (int) numRecords : -1;
+}
+
+uint64_t journalBlocksFor(uint64_t numberOfBlocks) {
+	uint64_t blocks = numberOfBlocks / 64;
+	if (blocks < JOURNAL_MIN_BLOCKS)
+		blocks = JOURNAL_MIN_BLOCKS;
+	if (blocks > JOURNAL_MAX_BLOCKS)
+		blocks = JOURNAL_MAX_BLOCKS;
+	return blocks;
+}
+
+int journalFormat(uint64_t start, uint64_t numBlocks) {
+	if (partInfop == NULL || numBlocks < 3)
+		return -1;
+	blockSize = partInfop->blocksize;
+	regionStart = start;
+	regionBlocks = numBlocks;
+
+	/*
+	 * Records of an earlier journal here have sequence numbers below its
+	 * header's plus the log size, and older journals started from earlier
+	 * clock readings
+	 */
+	uint64_t sequence = (uint64_t) time(NULL) << 24;
+	JournalHeader_p header = LBAallocBuffer(1);
+	if (header == NULL)
+		return -1;
+	if (LBAread(header, 1, start) == 1 && header->magic == JOURNAL_MAGIC &&
+			header->sequence + numBlocks > sequence)
+		sequence = header->sequence + numBlocks;
+	LBAfreeBuffer(header, 1);
+	return writeHeader(sequence, 1);
+}
+
+int journalStart(uint64_t start, uint64_t numBlocks) {
+	journalStop();
+	if (partInfop == NULL || numBlocks < 3)
+		return -1;
+	blockSize = partInfop->blocksize;
+	regionStart = start;
+	regionBlocks = numBlocks;
+
+	int replayed = replay();
+	if (replayed < 0)
+		return -1;
+
+	uint64_t buckets = 64;
+	while (buckets < numBlocks * 2)
+		buckets <<= 1;
+	map = calloc(buckets, sizeof(JournalEntry_p));
+	if (map == NULL)
+		return -1;
+	mapMask = buckets - 1;
+	current = NULL;
+	oldest = NULL;
+	newest = NULL;
+	checkpointing = 0;
+	stopping = false;
+	urgent = false;
+	checkpointFailed = false;
+	lastCommit = nowMs();
+	memset(&stats, 0, sizeof(JournalStats));
+	stats.replayed = replayed;
+
+	if (pthread_create(&checkpointThread, NULL, checkpointMain, NULL) != 0) {
+		free(map);
+		map = NULL;
+		return -1;
+	}
+	logging = true;
+	registerCloseHook(journalStop);
+	return replayed;
+}
+
+int journalStop() {
+	if (!logging)
+		return 0;
+
+	pthread_mutex_lock(&journalMutex);
+	int retVal = commitCurrent();
+	stopping = true;
+	pthread_cond_signal(&wakeCond);
+	pthread_mutex_unlock(&journalMutex);
+	pthread_join(checkpointThread, NULL);
+	logging = false;
+
+	if (oldest != NULL)
+		retVal = -1;
+	while (oldest != NULL) {
+		JournalTxn_p next = oldest->next;
+		freeTxn(oldest);
+		oldest = next;
+	}
+	newest = NULL;
+	freeTxn(current);
+	current = NULL;
+	for (uint64_t i = 0; i <= mapMask; i++) {
+		while (map[i] != NULL) {
+			JournalEntry_p next = map[i]->next;
+			free(map[i]);
+			map[i] = next;
+		}
+	}
+	free(map);
+	map = NULL;
+	return retVal;
+}
+
+void journalSetOverflow(uint64_t (*findBlocks)(uint64_t count, uint64_t* lbas)) {
+	pthread_mutex_lock(&journalMutex);
+	overflowHook = findBlocks;
+	pthread_mutex_unlock(&journalMutex);
+}
+
+void journalHoldCheckpoints(bool hold) {
+	pthread_mutex_lock(&journalMutex);
+	holding = hold;
+	pthread_cond_signal(&wakeCond);
+	pthread_mutex_unlock(&journalMutex);
+}
+
+bool journalEnabled() {
+	return logging;
+}
+
+uint64_t journalAppend(const void* buffer, uint64_t lbaCount, uint64_t lbaPosition) {
+	if (!logging)
+		return 0;
+
+	const char* src = buffer;
+	uint64_t i;
+	pthread_mutex_lock(&journalMutex);
+	for (i = 0; i < lbaCount; i++) {
+		JournalEntry_p entry = findEntry(lbaPosition + i);
+		if (entry != NULL && entry->txn == current) {
+			memcpy(&current->images[entry->index * blockSize], &src[i * blockSize], blockSize);
+			continue;
+		}
+		if (addImage(lbaPosition + i, &src[i * blockSize]) != 0)
+			break;
+	}
+	pthread_mutex_unlock(&journalMutex);
+	return i;
+}
+
+int journalCommit() {
+	if (!logging)
+		return 0;
+	pthread_mutex_lock(&journalMutex);
+	int retVal = commitCurrent();
+	pthread_mutex_unlock(&journalMutex);
+	return retVal;
+}
+
+bool journalDue(uint64_t pendingBlocks) {
+	if (!logging)
+		return false;
+	pthread_mutex_lock(&journalMutex);
+	bool due = nowMs() - lastCommit >= JOURNAL_COMMIT_MS || !currentFits(pendingBlocks, 0);
+	pthread_mutex_unlock(&journalMutex);
+	return due;
+}
+
+void journalRevoke(uint64_t lbaCount, uint64_t lbaPosition) {
+	if (!logging)
+		return;
+
+	pthread_mutex_lock(&journalMutex);
+	uint64_t i = 0;
+	while (i < lbaCount) {
+		uint64_t lba = lbaPosition + i;
+		JournalEntry_p entry = findEntry(lba);
+		if (entry == NULL) {
+			i++;
+			continue;
+		}
+		if (entry->committed != NULL) {
+			/* A checkpoint in flight may be about to write the block home */
+			if (checkpointing != 0) {
+				pthread_cond_wait(&doneCond, &journalMutex);
+				continue;
+			}
+			if (addRevoke(lba) != 0)
+				break;
+		}
+		if (entry->txn == current)
+			current->lbas[entry->index] = JOURNAL_NO_BLOCK;
+		removeEntry(lba);
+		i++;
+	}
+	pthread_mutex_unlock(&journalMutex);
+}
+
+uint64_t journalRead(void* buffer, uint64_t lbaCount, uint64_t lbaPosition) {
+	if (!logging)
+		return LBAread(buffer, lbaCount, lbaPosition);
+
+	for (;;) {
+		uint64_t before = journalGeneration();
+		uint64_t blocksRead = LBAread(buffer, lbaCount, lbaPosition);
+		journalOverlay(buffer, lbaCount, lbaPosition);
+		if (journalGeneration() == before)
+			return blocksRead;
+	}
+}
+
+void journalOverlay(void* buffer, uint64_t lbaCount, uint64_t lbaPosition) {
+	if (!logging)
+		return;
+
+	char* dest = buffer;
+	pthread_mutex_lock(&journalMutex);
+	for (uint64_t i = 0; i < lbaCount; i++) {
+		JournalEntry_p entry = findEntry(lbaPosition + i);
+		if (entry != NULL)
+			memcpy(&dest[i * blockSize], &entry->txn->images[entry->index * blockSize], blockSize);
+	}
+	pthread_mutex_unlock(&journalMutex);
+}
+
+uint64_t journalGeneration() {
+	pthread_mutex_lock(&journalMutex);
+	uint64_t value = generation;
+	pthread_mutex_unlock(&journalMutex);
+	return value;
+}
+
+void journalGetStats(JournalStats_p journalStats) {
+	pthread_mutex_lock(&journalMutex);
+	memcpy(journalStats, &stats, sizeof(JournalStats));
+	pthread_mutex_unlock(&journalMutex);
+}
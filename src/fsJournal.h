@@ -0,0 +1,137 @@
+#ifndef FS_JOURNAL_H
+#define FS_JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fsLow.h"
+
+/*
+ * Write-ahead log for the metadata blocks of a volume formatted with
+ * FORMAT_JOURNAL. The block cache hands its dirty blocks to the journal
+ * instead of writing them in place; they collect in a running transaction
+ * that is committed as a single sequential record (a descriptor listing the
+ * blocks, their images and a CRC32C over all of it) once it is due, so many
+ * operations share one write. A background thread later copies committed
+ * blocks to their home locations (checkpointing) and frees their log space,
+ * and journalStart replays whatever was committed but not checkpointed when
+ * the volume was last closed. Until then the newest image of a block lives
+ * in the journal, so reads of metadata go through journalRead.
+ */
+
+#define JOURNAL_MIN_BLOCKS 64
+#define JOURNAL_MAX_BLOCKS 8192
+#define JOURNAL_COMMIT_MS 100			//Age after which the running transaction is due
+#define JOURNAL_CHECKPOINT_MS 1000		//How often the background thread checkpoints
+
+typedef struct JournalStats {
+	uint64_t commits;				//Transactions written to the log
+	uint64_t blocksLogged;			//Block images in those transactions
+	uint64_t checkpoints;			//Batches of transactions copied home
+	uint64_t replayed;				//Transactions replayed by journalStart
+	uint64_t overflows;				//Transactions too big for the log, committed outside it
+} JournalStats, *JournalStats_p;
+
+/** Returns the number of blocks the journal takes on a volume of numberOfBlocks blocks */
+uint64_t journalBlocksFor(uint64_t numberOfBlocks);
+
+/**
+ * Writes an empty journal over the numBlocks blocks at start. Sequence
+ * numbers carry on from any journal found there, so records left over from
+ * an earlier format are never mistaken for new ones.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int journalFormat(uint64_t start, uint64_t numBlocks);
+
+/**
+ * Replays the journal of numBlocks blocks at start, leaves it empty and
+ * starts logging to it, with a close hook that stops it again.
+ * Returns the number of transactions replayed
+ * Returns -1 if the journal could not be read or replayed
+ */
+int journalStart(uint64_t start, uint64_t numBlocks);
+
+/**
+ * Commits the running transaction, checkpoints everything and stops the
+ * background thread; later writes go straight to the volume.
+ * Returns 0 if successful
+ * Returns -1 if some transactions could not be checkpointed
+ */
+int journalStop();
+
+/**
+ * Sets the function a commit too big for the log calls to find count free
+ * blocks outside it to hold the record, until the transaction has been
+ * checkpointed. It returns how many it found, their numbers in lbas; nothing
+ * may write them while a commit runs.
+ */
+void journalSetOverflow(uint64_t (*findBlocks)(uint64_t count, uint64_t* lbas));
+
+/**
+ * Holds off checkpoints while hold is set, so committed records stay in the
+ * log for a test to crash with. A commit short of log space then waits for
+ * good, and one too big for the log returns before it is checkpointed, with
+ * nothing keeping its blocks free: only for a process about to crash.
+ */
+void journalHoldCheckpoints(bool hold);
+
+/** Returns whether the journal is logging */
+bool journalEnabled();
+
+/**
+ * Adds the given blocks to the running transaction. The transaction is
+ * never committed from here, however big it grows, so it only ever ends
+ * between operations.
+ * Returns the number of blocks added
+ */
+uint64_t journalAppend(const void* buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+/**
+ * Writes the running transaction to the log after a barrier, so the file
+ * data it points at is on stable storage first. Does not wait for the
+ * record itself to be durable; that follows the durability mode or the
+ * next LBAbarrier. The record of a transaction too big for the whole log
+ * goes to blocks the overflow hook finds, with only their runs in the log,
+ * and is checkpointed before this returns.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful, the transaction still running if it was too
+ * big for the log and the free space
+ */
+int journalCommit();
+
+/**
+ * Returns whether the running transaction is old enough to commit, or with
+ * pendingBlocks more blocks still on their way to it would outgrow half the
+ * log
+ */
+bool journalDue(uint64_t pendingBlocks);
+
+/**
+ * Drops any logged images of the given blocks, which are about to be freed
+ * or overwritten in place, so neither a checkpoint nor a replay writes them
+ * back over newer contents.
+ */
+void journalRevoke(uint64_t lbaCount, uint64_t lbaPosition);
+
+/**
+ * Same contract as LBAread, but blocks the journal holds a newer image of
+ * come from the journal.
+ * Returns the number of blocks read
+ */
+uint64_t journalRead(void* buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+/** Copies the newest logged images of the given blocks over buffer */
+void journalOverlay(void* buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+/**
+ * Returns a counter that changes whenever checkpointed images are dropped
+ * from memory. A read from the volume started before a change may have
+ * missed them, so it must be repeated.
+ */
+uint64_t journalGeneration();
+
+/** Copies the current journal counters into stats */
+void journalGetStats(JournalStats_p stats);
+
+#endif
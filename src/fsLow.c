@@ -1,3 +1,4 @@
+#define _GNU_SOURCE		//O_DIRECT, statx
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -9,230 +10,2365 @@
 #include <pthread.h>
 #include <errno.h>
 #include <math.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include "fsLow.h"
+#include "fsChecksum.h"
 
 partitionInfo_p partInfop = NULL;
 
-int initializePartition (int fd, uint64_t volSize, uint64_t blockSize)
+static partitionCloseHook_t closeHooks[MAXCLOSEHOOKS];
+static int numCloseHooks = 0;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static partitionOptions_t partOptions;
+
+//Second descriptor opened with O_DIRECT (-1 when not in direct mode).
+//partInfop->fd stays buffered and serves callers whose buffer, length or
+//offset is not aligned to bufferAlign.
+static int directFd = -1;
+static uint64_t bufferAlign = MINBLOCKSIZE;
+
+//PART_IO_LOCKED moves the shared file offset with lseek, and the fcntl lock
+//does not keep threads of this process apart, so each seek and the read or
+//write that follows it are done under this mutex
+static pthread_mutex_t seekMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Aligned buffer pool, one free list per size up to POOLMAXBLOCKS blocks
+#define POOLMAXBLOCKS	4
+#define POOLMAXFREE		32
+
+typedef struct poolBuffer {
+	struct poolBuffer *	next;
+	} poolBuffer_t;
+
+static poolBuffer_t * poolFree[POOLMAXBLOCKS + 1];
+static int poolFreeCount[POOLMAXBLOCKS + 1];
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Start of block 0 when the volume is mapped (the header block precedes it)
+static char * mapBase = NULL;
+static uint64_t mapLength = 0;
+
+//Number of member files of a striped volume, 0 when it is a single file
+static int stripeCount = 0;
+static int stripeSync (int dataOnly);
+
+//Block checksums, NULL until LBAchecksumStart
+static uint32_t * checksums = NULL;
+static int checksumFlush ();
+
+//Durability state.  unsyncedBlocks counts blocks written since the last
+//fsync and firstUnsynced is when the oldest of them was written.
+static pthread_mutex_t syncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncCond = PTHREAD_COND_INITIALIZER;
+static pthread_t syncThread;
+static int syncThreadRunning = 0;
+static uint64_t unsyncedBlocks = 0;
+static struct timespec firstUnsynced;
+
+//I/O statistics, updated with relaxed atomics from any thread
+static partitionStats_t ioStats;
+
+static const char * statNames[PART_STAT_OPS] =
+	{ "read", "write", "readv", "writev", "aread", "awrite", "sync", "lock", "discard" };
+
+static uint64_t nsNow ()
+	{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	}
+
+//Counts one call of op that transferred blocks and started at start (nsNow)
+static void statRecord (int op, uint64_t blocks, uint64_t start)
+	{
+	partitionOpStats_t * stat = &ioStats.op[op];
+	uint64_t ns = nsNow() - start;
+	uint64_t us = ns / 1000;
+	int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+	if (bucket >= PART_STAT_BUCKETS)
+		bucket = PART_STAT_BUCKETS - 1;
+
+	__atomic_fetch_add(&stat->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->blocks, blocks, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->totalNs, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->latency[bucket], 1, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&stat->maxNs, __ATOMIC_RELAXED);
+	while (ns > max &&
+			!__atomic_compare_exchange_n(&stat->maxNs, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	}
+
+//fsync (or fdatasync when dataOnly) of the volume, every member of a striped
+//one, counted as a sync.  Pending block checksums are written out first so
+//they become durable with the blocks they cover.
+static int timedSync (int dataOnly)
+	{
+	uint64_t start = nsNow();
+	int ret;
+	int flushed = checksumFlush();
+	if (stripeCount > 0)
+		ret = stripeSync(dataOnly);
+	else
+		ret = dataOnly ? fdatasync(partInfop->fd) : fsync(partInfop->fd);
+	statRecord(PART_STAT_SYNC, 0, start);
+	return flushed == 0 ? ret : -1;
+	}
+
+//Takes the fcntl byte range lock described by fl, counting the wait
+static void fileLock (struct flock * fl)
+	{
+	uint64_t start = nsNow();
+	fcntl(partInfop->fd, F_SETLKW, fl);
+	statRecord(PART_STAT_LOCK, fl->l_len / partInfop->blocksize, start);
+	}
+
+void LBAgetStats (partitionStats_p stats)
+	{
+	uint64_t * from = (uint64_t *)&ioStats;
+	uint64_t * to = (uint64_t *)stats;
+	for (size_t i = 0; i < sizeof(partitionStats_t) / sizeof(uint64_t); i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	}
+
+void LBAresetStats ()
+	{
+	uint64_t * counters = (uint64_t *)&ioStats;
+	for (size_t i = 0; i < sizeof(partitionStats_t) / sizeof(uint64_t); i++)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+	}
+
+const char * LBAstatName (int op)
+	{
+	if (op < 0 || op >= PART_STAT_OPS)
+		return "unknown";
+	return statNames[op];
+	}
+
+static uint64_t msSince (struct timespec * then)
+	{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+	}
+
+//Called with syncMutex held
+static int syncLocked ()
+	{
+	int ret = 0;
+	if (unsyncedBlocks > 0)
+		ret = timedSync(1);
+	unsyncedBlocks = 0;
+	return ret;
+	}
+
+//Applies the durability mode after blocks have been written
+static void writeCompleted (uint64_t blocks)
+	{
+	if (partOptions.durability == PART_SYNC_ALWAYS)
+		{
+		timedSync(0);
+		return;
+		}
+
+	pthread_mutex_lock(&syncMutex);
+	if (unsyncedBlocks == 0)
+		clock_gettime(CLOCK_MONOTONIC, &firstUnsynced);
+	unsyncedBlocks += blocks;
+
+	if (partOptions.durability == PART_SYNC_GROUP &&
+			(unsyncedBlocks >= partOptions.groupCommitBlocks ||
+			 msSince(&firstUnsynced) >= partOptions.groupCommitMs))
+		syncLocked();
+	pthread_mutex_unlock(&syncMutex);
+	}
+
+//Group commit thread, syncs writes that were followed by an idle volume
+static void * groupCommitThread (void * arg)
+	{
+	(void) arg;
+	pthread_mutex_lock(&syncMutex);
+	while (syncThreadRunning)
+		{
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += partOptions.groupCommitMs / 1000;
+		wake.tv_nsec += (partOptions.groupCommitMs % 1000) * 1000000;
+		if (wake.tv_nsec >= 1000000000)
+			{
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000;
+			}
+		pthread_cond_timedwait(&syncCond, &syncMutex, &wake);
+
+		if (unsyncedBlocks > 0 && msSince(&firstUnsynced) >= partOptions.groupCommitMs)
+			syncLocked();
+		}
+	pthread_mutex_unlock(&syncMutex);
+	return NULL;
+	}
+
+//In-process range lock table used by PART_IO_POSITIONAL.  A range may be
+//held by any number of readers or by one writer; callers wait on the
+//condition until no conflicting range is held.
+#define MAXRANGELOCKS 64
+
+typedef struct rangeLock {
+	uint64_t	start;
+	uint64_t	end;
+	int			write;
+	int			inUse;
+	} rangeLock_t;
+
+static rangeLock_t rangeLocks[MAXRANGELOCKS];
+static pthread_mutex_t rangeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rangeCond = PTHREAD_COND_INITIALIZER;
+
+static int rangeConflicts (uint64_t start, uint64_t end, int write, int * freeSlot)
+	{
+	*freeSlot = -1;
+	for (int i = 0; i < MAXRANGELOCKS; i++)
+		{
+		if (!rangeLocks[i].inUse)
+			{
+			if (*freeSlot == -1)
+				*freeSlot = i;
+			continue;
+			}
+		if ((write || rangeLocks[i].write) &&
+				start < rangeLocks[i].end && rangeLocks[i].start < end)
+			return 1;
+		}
+	return 0;
+	}
+
+static int rangeLock (uint64_t start, uint64_t len, int write)
+	{
+	int slot;
+	uint64_t end = start + len;
+	uint64_t waitStart = nsNow();
+
+	pthread_mutex_lock(&rangeMutex);
+	while (rangeConflicts(start, end, write, &slot) || slot == -1)
+		pthread_cond_wait(&rangeCond, &rangeMutex);
+
+	rangeLocks[slot].start = start;
+	rangeLocks[slot].end = end;
+	rangeLocks[slot].write = write;
+	rangeLocks[slot].inUse = 1;
+	pthread_mutex_unlock(&rangeMutex);
+	statRecord(PART_STAT_LOCK, len / partInfop->blocksize, waitStart);
+	return slot;
+	}
+
+static void rangeUnlock (int slot)
+	{
+	pthread_mutex_lock(&rangeMutex);
+	rangeLocks[slot].inUse = 0;
+	pthread_cond_broadcast(&rangeCond);
+	pthread_mutex_unlock(&rangeMutex);
+	}
+
+static int asyncSetup (unsigned depth);
+static void asyncTeardown ();
+static void poolDrain ();
+static int asyncQueue (int write, struct iovec * iov, int iovcnt, uint64_t offset,
+					   uint64_t length, char * checkBuffer, LBAcallback_t callback, void * context);
+
+//Descriptors of a member of the volume, member 0 being the file itself
+static int memberFd (int member);
+static int memberDirectFd (int member);
+
+//Picks the descriptor for a transfer: O_DIRECT only when everything is aligned
+static int pickMemberFd (int member, struct iovec * iov, int iovcnt, uint64_t offset)
+	{
+	int direct = memberDirectFd(member);
+	if (direct == -1 || offset % bufferAlign != 0)
+		return memberFd(member);
+
+	for (int i = 0; i < iovcnt; i++)
+		if ((uintptr_t)iov[i].iov_base % bufferAlign != 0 || iov[i].iov_len % bufferAlign != 0)
+			return memberFd(member);
+
+	return direct;
+	}
+
+static int pickFd (struct iovec * iov, int iovcnt, uint64_t offset)
+	{
+	return pickMemberFd(0, iov, iovcnt, offset);
+	}
+
+//Steps an iovec list past bytes that have already been transferred
+static void advanceIov (struct iovec ** iov, int * iovcnt, uint64_t bytes)
+	{
+	while (*iovcnt > 0 && bytes >= (*iov)->iov_len)
+		{
+		bytes -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+		}
+	if (*iovcnt > 0)
+		{
+		(*iov)->iov_base = (char *)(*iov)->iov_base + bytes;
+		(*iov)->iov_len -= bytes;
+		}
+	}
+
+//Vectored positional transfer at offset within one member file; consumes
+//(modifies) the iovec list
+static uint64_t memberIO (int member, int write, struct iovec * iov, int iovcnt, uint64_t offset)
+	{
+	uint64_t done = 0;
+	int fd = pickMemberFd(member, iov, iovcnt, offset);
+	while (iovcnt > 0)
+		{
+		ssize_t ret;
+		int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		if (write)
+			ret = pwritev(fd, iov, count, offset + done);
+		else
+			ret = preadv(fd, iov, count, offset + done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		//The device wants a stricter alignment, finish buffered
+		if (ret < 0 && errno == EINVAL && fd == memberDirectFd(member))
+			{
+			fd = memberFd(member);
+			continue;
+			}
+		if (ret <= 0)
+			break;
+		done += ret;
+		advanceIov(&iov, &iovcnt, ret);
+		}
+	return done;
+	}
+
+//
+// Striped volumes.  Stripe unit u (stripeBytes of the volume starting at
+// u * stripeBytes) lives on member u % stripeCount, at the same offset its
+// unit number u / stripeCount would have in an unstriped file.  Every member
+// starts with its own header block carrying a stripeHeader_t, so offsets
+// inside a member are worked out just like in a single file.  A transfer is
+// cut at the unit boundaries; the pieces that land on one member are always
+// contiguous there, so each member gets a single preadv/pwritev.  Member 0
+// is the file given to startPartitionSystem and uses partInfop->fd and
+// directFd; every other member has a worker thread so that one call keeps
+// all of them busy at once.
+//
+#define STRIPEHEADEROFFSET	256		//in the header block, past partitionInfo_t
+
+typedef struct stripeHeader {
+	uint64_t	signature;
+	uint64_t	count;
+	uint64_t	index;
+	uint64_t	unitBlocks;
+	uint64_t	numberOfBlocks;
+	} stripeHeader_t;
+
+#define STRIPEIDLE		0
+#define STRIPEREAD		1
+#define STRIPEWRITE		2
+#define STRIPEFSYNC		3
+#define STRIPEDATASYNC	4
+
+typedef struct stripeJob {
+	int				job;
+	struct iovec *	iov;
+	int				iovcnt;
+	uint64_t		offset;
+	uint64_t		length;
+	uint64_t		done;		//bytes transferred, or 0 for a sync that worked
+	} stripeJob_t;
+
+typedef struct stripeMember {
+	int				fd;
+	int				directFd;
+	pthread_t		thread;
+	int				threadRunning;
+	pthread_cond_t	wake;
+	stripeJob_t *	pending;	//handed over by stripeRun, NULL once done
+	} stripeMember_t;
+
+static stripeMember_t * members = NULL;
+static uint64_t stripeBytes = 0;
+static int stripeStopping = 0;
+static pthread_mutex_t stripeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripeDone = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t dispatchMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int memberFd (int member)
+	{
+	return member == 0 ? partInfop->fd : members[member].fd;
+	}
+
+static int memberDirectFd (int member)
+	{
+	return member == 0 ? directFd : members[member].directFd;
+	}
+
+static void runJob (int member, stripeJob_t * job)
+	{
+	switch (job->job)
+		{
+		case STRIPEREAD:
+		case STRIPEWRITE:
+			job->done = memberIO(member, job->job == STRIPEWRITE, job->iov, job->iovcnt, job->offset);
+			break;
+		case STRIPEFSYNC:
+			job->done = fsync(memberFd(member)) == 0 ? 0 : 1;
+			break;
+		case STRIPEDATASYNC:
+			job->done = fdatasync(memberFd(member)) == 0 ? 0 : 1;
+			break;
+		}
+	}
+
+static void * stripeWorker (void * arg)
+	{
+	int member = (int)(intptr_t)arg;
+	stripeMember_t * m = &members[member];
+
+	pthread_mutex_lock(&stripeMutex);
+	while (!stripeStopping)
+		{
+		if (m->pending == NULL)
+			{
+			pthread_cond_wait(&m->wake, &stripeMutex);
+			continue;
+			}
+		stripeJob_t * job = m->pending;
+		pthread_mutex_unlock(&stripeMutex);
+		runJob(member, job);
+		pthread_mutex_lock(&stripeMutex);
+		m->pending = NULL;
+		pthread_cond_broadcast(&stripeDone);
+		}
+	pthread_mutex_unlock(&stripeMutex);
+	return NULL;
+	}
+
+//Runs jobs[member] on every member that has one.  The caller does one of
+//them and the workers the rest; if another thread is already using the
+//workers the caller simply does every job itself.
+static void stripeRun (stripeJob_t * jobs)
+	{
+	int mine = -1;
+	int handedOut = 0;
+
+	if (pthread_mutex_trylock(&dispatchMutex) != 0)
+		{
+		for (int i = 0; i < stripeCount; i++)
+			if (jobs[i].job != STRIPEIDLE)
+				runJob(i, &jobs[i]);
+		return;
+		}
+
+	pthread_mutex_lock(&stripeMutex);
+	for (int i = 0; i < stripeCount; i++)
+		{
+		if (jobs[i].job == STRIPEIDLE)
+			continue;
+		if (mine == -1 && (i == 0 || jobs[0].job == STRIPEIDLE))
+			mine = i;
+		else if (members[i].threadRunning)
+			{
+			members[i].pending = &jobs[i];
+			pthread_cond_signal(&members[i].wake);
+			handedOut = 1;
+			}
+		}
+	pthread_mutex_unlock(&stripeMutex);
+
+	//Anything a worker could not take is done here as well
+	for (int i = 0; i < stripeCount; i++)
+		if (jobs[i].job != STRIPEIDLE && (i == mine || !members[i].threadRunning))
+			runJob(i, &jobs[i]);
+
+	if (handedOut)
+		{
+		pthread_mutex_lock(&stripeMutex);
+		for (int i = 1; i < stripeCount; i++)
+			while (members[i].pending != NULL)
+				pthread_cond_wait(&stripeDone, &stripeMutex);
+		pthread_mutex_unlock(&stripeMutex);
+		}
+	pthread_mutex_unlock(&dispatchMutex);
+	}
+
+//Finds the member holding the volume byte pos and the offset of that byte
+//in the member file
+static int stripeLocate (uint64_t pos, uint64_t * memberOffset)
+	{
+	uint64_t unit = pos / stripeBytes;
+	*memberOffset = partInfop->blocksize + (unit / stripeCount) * stripeBytes + pos % stripeBytes;
+	return unit % stripeCount;
+	}
+
+typedef struct stripePiece {
+	void *		base;
+	uint64_t	length;
+	uint64_t	end;		//bytes of its member's job up to the end of this piece
+	int			member;
+	} stripePiece_t;
+
+//vectorIO for a striped volume, offset being as if the volume were one file
+static uint64_t stripedIO (int write, struct iovec * iov, int iovcnt, uint64_t offset)
+	{
+	uint64_t start = offset - partInfop->blocksize;
+	uint64_t pos = start;
+	int pieces = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		{
+		uint64_t left = iov[i].iov_len;
+		while (left > 0)
+			{
+			uint64_t take = stripeBytes - pos % stripeBytes;
+			if (take > left)
+				take = left;
+			pos += take;
+			left -= take;
+			pieces++;
+			}
+		}
+	if (pieces == 0)
+		return 0;
+
+	stripePiece_t * piece = malloc(pieces * sizeof(stripePiece_t));
+	struct iovec * cut = malloc(pieces * sizeof(struct iovec));
+	stripeJob_t * jobs = calloc(stripeCount, sizeof(stripeJob_t));
+	if (piece == NULL || cut == NULL || jobs == NULL)
+		{
+		free (piece);
+		free (cut);
+		free (jobs);
+		return 0;
+		}
+
+	//Cut the list at every unit boundary and count each member's pieces
+	int p = 0;
+	pos = start;
+	for (int i = 0; i < iovcnt; i++)
+		{
+		char * base = iov[i].iov_base;
+		uint64_t left = iov[i].iov_len;
+		while (left > 0)
+			{
+			uint64_t memberOffset;
+			int member = stripeLocate(pos, &memberOffset);
+			uint64_t take = stripeBytes - pos % stripeBytes;
+			if (take > left)
+				take = left;
+
+			if (jobs[member].job == STRIPEIDLE)
+				{
+				jobs[member].job = write ? STRIPEWRITE : STRIPEREAD;
+				jobs[member].offset = memberOffset;
+				}
+			jobs[member].iovcnt++;
+			piece[p].base = base;
+			piece[p].length = take;
+			piece[p].member = member;
+			p++;
+
+			base += take;
+			pos += take;
+			left -= take;
+			}
+		}
+
+	//Give each member a contiguous slice of cut, filled in volume order
+	int next = 0;
+	for (int i = 0; i < stripeCount; i++)
+		{
+		jobs[i].iov = &cut[next];
+		next += jobs[i].iovcnt;
+		jobs[i].iovcnt = 0;
+		}
+	for (p = 0; p < pieces; p++)
+		{
+		stripeJob_t * job = &jobs[piece[p].member];
+		job->iov[job->iovcnt].iov_base = piece[p].base;
+		job->iov[job->iovcnt].iov_len = piece[p].length;
+		job->iovcnt++;
+		job->length += piece[p].length;
+		piece[p].end = job->length;
+		}
+
+	stripeRun(jobs);
+
+	//Report only what was transferred without a gap, in volume order
+	uint64_t done = 0;
+	for (p = 0; p < pieces; p++)
+		{
+		if (jobs[piece[p].member].done < piece[p].end)
+			break;
+		done += piece[p].length;
+		}
+
+	free (piece);
+	free (cut);
+	free (jobs);
+	return done;
+	}
+
+//Syncs every member at once
+static int stripeSync (int dataOnly)
+	{
+	stripeJob_t * jobs = calloc(stripeCount, sizeof(stripeJob_t));
+	int ret = 0;
+
+	if (jobs == NULL)
+		return -1;
+	for (int i = 0; i < stripeCount; i++)
+		jobs[i].job = dataOnly ? STRIPEDATASYNC : STRIPEFSYNC;
+	stripeRun(jobs);
+	for (int i = 0; i < stripeCount; i++)
+		if (jobs[i].done != 0)
+			ret = -1;
+	free (jobs);
+	return ret;
+	}
+
+//Punches a hole over len bytes of the volume at offset, on every member the
+//range touches (its part of each member is contiguous)
+static int punchHole (uint64_t offset, uint64_t len)
+	{
+	if (stripeCount == 0)
+		return fallocate(partInfop->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+
+	int ret = 0;
+	uint64_t pos = offset - partInfop->blocksize;
+	uint64_t end = pos + len;
+	for (int i = 0; i < stripeCount && pos < end; i++)
+		{
+		//The first unit of each member the range touches, and its length there
+		uint64_t memberOffset;
+		int member = stripeLocate(pos, &memberOffset);
+		uint64_t memberLen = 0;
+		for (uint64_t unitPos = pos; unitPos < end;
+				unitPos += stripeBytes * stripeCount - unitPos % stripeBytes)
+			{
+			uint64_t take = stripeBytes - unitPos % stripeBytes;
+			if (take > end - unitPos)
+				take = end - unitPos;
+			memberLen += take;
+			}
+
+		if (fallocate(memberFd(member), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, memberOffset, memberLen) == -1)
+			ret = -1;
+		pos += stripeBytes - pos % stripeBytes;
+		}
+	return ret;
+	}
+
+//Vectored positional transfer at offset in the volume; consumes (modifies)
+//the iovec list
+static uint64_t vectorIO (int write, struct iovec * iov, int iovcnt, uint64_t offset)
+	{
+	if (stripeCount > 0)
+		return stripedIO(write, iov, iovcnt, offset);
+	return memberIO(0, write, iov, iovcnt, offset);
+	}
+
+//Positional transfer of len bytes at offset; loops only on short transfers
+static ssize_t positionalIO (int write, void * buffer, uint64_t len, uint64_t offset)
+	{
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+	return vectorIO(write, &iov, 1, offset);
+	}
+
+//
+// Block checksums.  checksums holds the whole region in memory (one CRC32C
+// per block, 0 meaning unknown) and checksumDirty marks the region blocks
+// that changed since they were last written.  Entries and dirty marks are
+// updated with atomics, the entry before its mark, and checksumFlush clears
+// a mark before copying its block out, so a concurrent update is either in
+// the copy or leaves the mark set for the next flush.  Writers record and
+// readers verify while they hold the range lock of the blocks concerned.
+//
+static unsigned char * checksumDirty = NULL;
+static uint64_t checksumStart = 0;
+static uint64_t checksumBlocks = 0;
+static uint64_t readBlocks (void * buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+uint64_t LBAchecksumBlocks (uint64_t numberOfBlocks, uint64_t blockSize)
+	{
+	if (blockSize == 0)
+		return 0;
+	return (numberOfBlocks * sizeof(uint32_t) + blockSize - 1) / blockSize;
+	}
+
+static int inChecksumRegion (uint64_t lba)
+	{
+	return lba >= checksumStart && lba < checksumStart + checksumBlocks;
+	}
+
+//Records (write) or verifies the checksums of count blocks of buffer that
+//sit at lbaPosition.  Returns the number of blocks before the first one that
+//failed verification, count for a write.
+static uint64_t checksumRun (int write, char * buffer, uint64_t count, uint64_t lbaPosition)
+	{
+	uint64_t blockSize = partInfop->blocksize;
+	uint32_t * table = checksums;
+
+	if (table == NULL)
+		return count;
+
+	for (uint64_t i = 0; i < count; i++)
+		{
+		uint64_t lba = lbaPosition + i;
+		if (inChecksumRegion(lba))
+			continue;
+
+		uint32_t sum = crc32c(0, buffer + i * blockSize, blockSize);
+		if (sum == 0)
+			sum = 1;		//0 is kept for unknown
+
+		if (write)
+			{
+			__atomic_store_n(&table[lba], sum, __ATOMIC_RELAXED);
+			__atomic_store_n(&checksumDirty[lba * sizeof(uint32_t) / blockSize], 1, __ATOMIC_RELEASE);
+			continue;
+			}
+
+		uint32_t stored = __atomic_load_n(&table[lba], __ATOMIC_RELAXED);
+		if (stored != 0 && stored != sum)
+			{
+			__atomic_fetch_add(&ioStats.checksumErrors, 1, __ATOMIC_RELAXED);
+			printf("Checksum mismatch in block %llu\n", (ull_t)lba);
+			errno = EBADMSG;
+			return i;
+			}
+		}
+	return count;
+	}
+
+//Forgets the checksums of discarded blocks
+static void checksumClear (uint64_t count, uint64_t lbaPosition)
+	{
+	if (checksums == NULL)
+		return;
+
+	for (uint64_t lba = lbaPosition; lba < lbaPosition + count; lba++)
+		{
+		__atomic_store_n(&checksums[lba], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&checksumDirty[lba * sizeof(uint32_t) / partInfop->blocksize], 1,
+						 __ATOMIC_RELEASE);
+		}
+	}
+
+//Writes every changed block of the checksum region to the volume
+static int checksumFlush ()
+	{
+	uint64_t blockSize;
+	int ret = 0;
+
+	if (checksums == NULL)
+		return 0;
+
+	blockSize = partInfop->blocksize;
+	for (uint64_t i = 0; i < checksumBlocks; i++)
+		{
+		if (!__atomic_exchange_n(&checksumDirty[i], 0, __ATOMIC_ACQUIRE))
+			continue;
+
+		char * from = (char *)checksums + i * blockSize;
+		uint64_t lba = checksumStart + i;
+		if (mapBase != NULL)
+			memcpy(mapBase + lba * blockSize, from, blockSize);
+		else if (positionalIO(1, from, blockSize, (lba * blockSize) + blockSize) != (ssize_t)blockSize)
+			{
+			__atomic_store_n(&checksumDirty[i], 1, __ATOMIC_RELAXED);
+			ret = -1;
+			}
+		}
+	return ret;
+	}
+
+//Opens an O_DIRECT descriptor for filename and raises the buffer alignment
+//to what it needs.  Returns -1 when the file can not do direct I/O.
+static int directOpen (char * filename)
+	{
+	int fd = open(filename, O_RDWR | O_DIRECT);
+	if (fd == -1)
+		{
+		printf("File %s does not support direct I/O, using buffered I/O, errno = %d\n", filename, errno);
+		return -1;
+		}
+
+	uint64_t align = MINBLOCKSIZE;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+			(stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_mem_align > 0)
+		{
+		align = stx.stx_dio_offset_align;
+		if (stx.stx_dio_mem_align > align)
+			align = stx.stx_dio_mem_align;
+		}
+#endif
+	if (align > bufferAlign)
+		bufferAlign = align;
+	if (align > partInfop->blocksize)
+		printf("Direct I/O needs %llu byte alignment, single blocks will be buffered\n",
+			   (ull_t)align);
+	return fd;
+	}
+
+//Takes the whole file write lock of an exclusive open
+static int lockWholeFile (int fd)
+	{
+	struct flock whole;
+	whole.l_type = F_WRLCK;
+	whole.l_whence = SEEK_SET;
+	whole.l_start = 0;
+	whole.l_len = 0;		//to the end of the file, however large
+	return fcntl(fd, F_SETLK, &whole);
+	}
+
+//Writes the header block and sizes the file.  For a member of a striped
+//volume stripe is its stripe header, and the file only holds that member's
+//share of the units.
+static int initializeMember (int fd, uint64_t volSize, uint64_t blockSize, int preallocate,
+							 stripeHeader_t * stripe)
+	{
+	ssize_t writeRet;
+	partitionInfo_p buf = malloc (blockSize);
+
+	if (buf == NULL)
+		{
+		//abort
+		}
+
+	memset (buf, 0, blockSize);
+	strcpy(buf->volumePrefix, PART_CAPTION);
+	buf->signature = PART_SIGNATURE;
+	buf->volumesize = volSize;
+	buf->blocksize = blockSize;
+	buf->numberOfBlocks = volSize / blockSize;
+	buf->signature2 = PART_SIGNATURE2;
+	strcpy(buf->volumeName, "Untitled");
+	if (stripe != NULL)
+		memcpy((char *)buf + STRIPEHEADEROFFSET, stripe, sizeof(stripeHeader_t));
+
+	lseek(fd, 0 , SEEK_SET);
+	writeRet = write(fd, buf, blockSize);
+
+	if (writeRet < 0 || (uint64_t) writeRet != blockSize)
+		{
+		//process error
+		}
+
+	fsync(fd);
+	uint64_t blkCount = buf->numberOfBlocks;
+	memset (buf, 0, blockSize);
+
+	//A stripe member holds whole units, as many as the busiest member has
+	uint64_t fileSize = volSize;
+	if (stripe != NULL)
+		{
+		uint64_t units = (blkCount + stripe->unitBlocks - 1) / stripe->unitBlocks;
+		fileSize = (units + stripe->count - 1) / stripe->count * stripe->unitBlocks * blockSize;
+		}
+
+	//Size the file to the header plus the volume.  Left sparse the host only
+	//spends space on blocks as they are written; preallocated it is reserved
+	//up front so later writes can not run out of space.
+	if (preallocate)
+		{
+		if (fallocate(fd, 0, 0, fileSize + blockSize) == -1)
+			{
+			if (errno == ENOSPC)
+				{
+				free (buf);
+				return -2;
+				}
+			//No fallocate here, write one block at the end instead
+			lseek (fd, fileSize, SEEK_SET);
+			writeRet = write(fd, buf, blockSize);
+			}
+		}
+	else
+		ftruncate(fd, fileSize + blockSize);
+	fsync(fd);
+	if (stripe == NULL || stripe->index == 0)
+		printf("Created a volume with %llu bytes, broken into %llu blocks of %llu bytes.\n",
+					 (ull_t)volSize, (ull_t)blkCount, (ull_t)blockSize);
+	if (stripe != NULL)
+		printf("Created stripe member %llu of %llu, holding %llu bytes.\n",
+					 (ull_t)stripe->index, (ull_t)stripe->count, (ull_t)fileSize);
+	free (buf);
+	buf = NULL;
+	return PART_NOERROR;
+	}
+
+int initializePartition (int fd, uint64_t volSize, uint64_t blockSize, int preallocate)
+	{
+	return initializeMember(fd, volSize, blockSize, preallocate, NULL);
+	}
+
+//Number of files in the stripe file list of the options
+static int listedStripeFiles ()
+	{
+	int listed = 0;
+	while (partOptions.stripeFiles != NULL && partOptions.stripeFiles[listed] != NULL)
+		listed++;
+	return listed;
+	}
+
+//Creates every member of a new striped volume; member 0 is fd, the file
+//being created by startPartitionSystemEx
+static int stripeCreate (int fd, uint64_t volSize, uint64_t blockSize)
+	{
+	stripeHeader_t stripe;
+	int created = 0;
+	int ret = PART_NOERROR;
+
+	stripe.signature = PART_STRIPE_SIGNATURE;
+	stripe.count = listedStripeFiles() + 1;
+	stripe.unitBlocks = partOptions.stripeBlocks > 0 ? partOptions.stripeBlocks : PART_STRIPE_BLOCKS;
+	stripe.numberOfBlocks = volSize / blockSize;
+	if (stripe.count > PART_MAX_STRIPES)
+		{
+		printf("A volume can be striped across at most %d files\n", PART_MAX_STRIPES);
+		return PART_ERR_INVALID;
+		}
+
+	for (stripe.index = 0; stripe.index < stripe.count && ret == PART_NOERROR; stripe.index++)
+		{
+		int memberFd = fd;
+		if (stripe.index > 0)
+			{
+			memberFd = open(partOptions.stripeFiles[stripe.index - 1], O_CREAT | O_TRUNC | O_RDWR,
+							S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (memberFd == -1)
+				{
+				ret = -1;
+				break;
+				}
+			created++;
+			}
+		ret = initializeMember(memberFd, volSize, blockSize, partOptions.preallocate, &stripe);
+		if (stripe.index > 0)
+			close (memberFd);
+		}
+
+	if (ret != PART_NOERROR)
+		for (int i = 0; i < created; i++)
+			unlink (partOptions.stripeFiles[i]);
+	return ret;
+	}
+
+//Opens the other members of a striped volume and checks that each is the
+//member it is listed as.  header is the header block read from member 0.
+static int stripeOpen (partitionInfo_p header)
+	{
+	stripeHeader_t * stripe = (stripeHeader_t *)((char *)header + STRIPEHEADEROFFSET);
+	int listed = listedStripeFiles();
+	int striped = stripe->signature == PART_STRIPE_SIGNATURE && stripe->count > 1;
+
+	if (!striped && listed == 0)
+		return PART_NOERROR;
+	if (!striped || stripe->index != 0 || stripe->count != (uint64_t)listed + 1)
+		{
+		printf("The stripe files given do not match how %s is striped\n", partInfop->filename);
+		return PART_ERR_INVALID;
+		}
+
+	members = calloc(stripe->count, sizeof(stripeMember_t));
+	partitionInfo_p buf = malloc (MINBLOCKSIZE);
+	if (members == NULL || buf == NULL)
+		{
+		free (members);
+		free (buf);
+		members = NULL;
+		return -1;
+		}
+
+	int ret = PART_NOERROR;
+	int opened;
+	for (opened = 1; opened < (int)stripe->count; opened++)
+		{
+		char * name = partOptions.stripeFiles[opened - 1];
+		members[opened].fd = open(name, O_RDWR);
+		members[opened].directFd = -1;
+		if (members[opened].fd == -1)
+			{
+			printf("Stripe file %s can not be opened, errno = %d\n", name, errno);
+			ret = PART_ERR_INVALID;
+			break;
+			}
+		if (partOptions.exclusive && lockWholeFile(members[opened].fd) == -1)
+			{
+			printf("File %s is in use by another process\n", name);
+			close (members[opened].fd);
+			ret = PART_ERR_BUSY;
+			break;
+			}
+
+		stripeHeader_t * mine = (stripeHeader_t *)((char *)buf + STRIPEHEADEROFFSET);
+		if (pread(members[opened].fd, buf, MINBLOCKSIZE, 0) != MINBLOCKSIZE ||
+				buf->signature != PART_SIGNATURE || buf->signature2 != PART_SIGNATURE2 ||
+				buf->blocksize != header->blocksize || buf->numberOfBlocks != header->numberOfBlocks ||
+				mine->signature != PART_STRIPE_SIGNATURE || mine->count != stripe->count ||
+				mine->index != (uint64_t)opened || mine->unitBlocks != stripe->unitBlocks)
+			{
+			printf("Stripe file %s is not member %d of %s\n", name, opened, partInfop->filename);
+			close (members[opened].fd);
+			ret = PART_ERR_INVALID;
+			break;
+			}
+		}
+	free (buf);
+
+	if (ret != PART_NOERROR)
+		{
+		while (--opened > 0)
+			close (members[opened].fd);
+		free (members);
+		members = NULL;
+		return ret;
+		}
+
+	stripeCount = stripe->count;
+	stripeBytes = stripe->unitBlocks * header->blocksize;
+	stripeStopping = 0;
+	for (int i = 1; i < stripeCount; i++)
+		{
+		pthread_cond_init(&members[i].wake, NULL);
+		members[i].threadRunning =
+			pthread_create(&members[i].thread, NULL, stripeWorker, (void *)(intptr_t)i) == 0;
+		}
+	return PART_NOERROR;
+	}
+
+//Stops the workers and closes every member but member 0
+static void stripeClose ()
+	{
+	if (stripeCount == 0)
+		return;
+
+	pthread_mutex_lock(&stripeMutex);
+	stripeStopping = 1;
+	for (int i = 1; i < stripeCount; i++)
+		pthread_cond_signal(&members[i].wake);
+	pthread_mutex_unlock(&stripeMutex);
+
+	for (int i = 1; i < stripeCount; i++)
+		{
+		if (members[i].threadRunning)
+			pthread_join(members[i].thread, NULL);
+		pthread_cond_destroy(&members[i].wake);
+		if (members[i].directFd != -1)
+			close (members[i].directFd);
+		close (members[i].fd);
+		}
+	free (members);
+	members = NULL;
+	stripeCount = 0;
+	}
+//
+// Start Partition System
+//
+// This is the first function to call before your filesystem starts
+// If the filename already exists, then the input values stored in
+// volSize and blockSize are ignored.  If the file does not exist, it will
+// be created to the specified volume size in units of the block size
+// (must be power of 2) plus one for the partition header.
+//
+// On return
+// 		return value 0 = success;
+//		return value -1 = file exists but can not open for write
+//		return value -2 = insufficient space for the volume
+//		volSize will be filled with the volume size
+//		blockSize will be filled with the block size
+//
+// Partition Options
+//
+// Fills in the options used by startPartitionSystem: fcntl locked I/O,
+// shared with other processes, with every write synced.
+void defaultPartitionOptions (partitionOptions_p options)
+	{
+	options->ioMode = PART_IO_LOCKED;
+	options->exclusive = 0;
+	options->durability = PART_SYNC_ALWAYS;
+	options->groupCommitMs = PART_GROUP_COMMIT_MS;
+	options->groupCommitBlocks = PART_GROUP_COMMIT_BLOCKS;
+	options->asyncDepth = PART_ASYNC_DEPTH;
+	options->mapped = 0;
+	options->direct = 0;
+	options->preallocate = 0;
+	options->stripeFiles = NULL;
+	options->stripeBlocks = PART_STRIPE_BLOCKS;
+	}
+
+int startPartitionSystem (char * filename, uint64_t * volSize, uint64_t * blockSize)
+	{
+	return startPartitionSystemEx (filename, volSize, blockSize, NULL);
+	}
+
+int startPartitionSystemEx (char * filename, uint64_t * volSize, uint64_t * blockSize,
+							partitionOptions_p options)
+	{
+	int fd;
+	int retVal = PART_NOERROR;
+
+	if (options != NULL)
+		partOptions = *options;
+	else
+		defaultPartitionOptions (&partOptions);
+
+	int accessRet = access(filename, F_OK);
+	printf ("File %s does %sexist, errno = %d\n", filename, accessRet==-1?"not ":"",errno);
+
+	accessRet = access(filename, R_OK | W_OK);
+	printf ("File %s %sgood to go, errno = %d\n", filename, accessRet==-1?"not ":"",errno);
+
+	//Some issue -
+	if (accessRet == -1)
+		{
+		if (errno == ENOENT)
+			{
+			//File does not exist, create it and initialize
+			fd = open(filename, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (fd == -1)
+				{
+				//Error
+				return -1;
+				}
+
+			//insure that blocksize is a power of 2 (min 512);
+			uint64_t blksz = *blockSize;
+			printf("Block size is : %llu\n", (ull_t)blksz);
+			if (blksz < MINBLOCKSIZE) //too small
+				blksz = MINBLOCKSIZE;
+
+			// example 1000 0111 anded = 0 1010 1001 = 1000 when anded i.e. not power of 2
+			if ((blksz & (blksz - 1)) != 0) //not a power of 2
+				{
+				printf("%llu is not a power of 2\n", (ull_t)blksz);
+
+				blksz = 1 << (uint64_t)(ceil(log2(blksz)));
+				printf("Block size is now: %llu\n", (ull_t)blksz);
+				*blockSize = blksz;
+				}
+			// insure the volume size is a multiple of blockSize
+			uint64_t blockCount = *volSize / blksz;
+			*volSize = blockCount * blksz;
+
+			int initRet;
+			if (listedStripeFiles() > 0)
+				initRet = stripeCreate (fd, *volSize, *blockSize);
+			else
+				initRet = initializePartition (fd, *volSize, *blockSize, partOptions.preallocate);
+			close (fd);
+			if (initRet != PART_NOERROR)
+				{
+				unlink (filename);
+				return initRet;
+				}
+			}
+		else
+			{
+			// Exists but can not read/write
+			}
+		}
+
+	// If there is no access issue or we fall through the if because we
+	// have initialized the
+	fd = open(filename, O_RDWR);
+
+	if (partOptions.exclusive)
+		{
+		if (lockWholeFile(fd) == -1)
+			{
+			printf("File %s is in use by another process\n", filename);
+			close (fd);
+			return PART_ERR_BUSY;
+			}
+		}
+
+	partitionInfo_p buf = malloc (MINBLOCKSIZE);
+	ssize_t readCount = read (fd, buf, MINBLOCKSIZE);
+	if ((readCount == MINBLOCKSIZE) && (buf->signature == PART_SIGNATURE) && (buf->signature2 == PART_SIGNATURE2))
+		{
+		*volSize = buf->volumesize;
+		*blockSize = buf->blocksize;
+		partInfop = malloc (sizeof(partitionInfo_t)+strlen(buf->volumeName)+4);
+		memcpy(partInfop, buf, sizeof(partitionInfo_t)+strlen(buf->volumeName)+4);
+		partInfop->filename = malloc (strlen(filename)+4);
+		strcpy(partInfop->filename, filename);
+		partInfop->fd = fd;
+		retVal = stripeOpen(buf);
+		}
+	else
+		retVal = PART_ERR_INVALID;
+
+	if (retVal == PART_NOERROR)
+		{
+		unsyncedBlocks = 0;
+		if (partOptions.groupCommitMs == 0)
+			partOptions.groupCommitMs = PART_GROUP_COMMIT_MS;
+		if (partOptions.durability == PART_SYNC_GROUP)
+			{
+			syncThreadRunning = 1;
+			if (pthread_create(&syncThread, NULL, groupCommitThread, NULL) != 0)
+				syncThreadRunning = 0;
+			}
+
+		if (partOptions.mapped && stripeCount > 0)
+			{
+			printf("Striped volumes are not mapped, using file I/O\n");
+			partOptions.mapped = 0;
+			}
+		if (partOptions.mapped)
+			{
+			//Map from offset 0 so the mapping is page aligned whatever the
+			//block size, then step over the header block
+			mapLength = (partInfop->numberOfBlocks + 1) * partInfop->blocksize;
+			char * map = mmap(NULL, mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				{
+				printf("Could not map %s, using file I/O, errno = %d\n", filename, errno);
+				partOptions.mapped = 0;
+				}
+			else
+				mapBase = map + partInfop->blocksize;
+			}
+
+		if (partOptions.direct && !partOptions.mapped)
+			{
+			bufferAlign = MINBLOCKSIZE;
+			directFd = directOpen(filename);
+			for (int i = 1; i < stripeCount; i++)
+				members[i].directFd = directOpen(partOptions.stripeFiles[i - 1]);
+			}
+
+		//Without a ring the async calls simply run synchronously
+		if (partOptions.asyncDepth > 0 && partOptions.exclusive && !partOptions.mapped &&
+				partOptions.ioMode == PART_IO_POSITIONAL && stripeCount == 0)
+			asyncSetup(partOptions.asyncDepth);
+		}
+	else
+		{
+		if (partInfop != NULL)
+			{
+			free (partInfop->filename);
+			free (partInfop);
+			partInfop = NULL;
+			}
+		*volSize = 0;
+		*blockSize = 0;
+		}
+
+	free (buf);
+	if (retVal != PART_NOERROR)
+		close (fd);
+	return retVal;
+	}
+
+int registerCloseHook (partitionCloseHook_t hook)
+	{
+	for (int i = 0; i < numCloseHooks; i++)
+		if (closeHooks[i] == hook)
+			return 0;	//already registered
+
+	if (numCloseHooks >= MAXCLOSEHOOKS)
+		return -1;
+
+	closeHooks[numCloseHooks++] = hook;
+	return 0;
+	}
+
+int LBAbarrier ()
+	{
+	if (partInfop == NULL)		//System Not initialized
+		return -1;
+
+	pthread_mutex_lock(&syncMutex);
+	unsyncedBlocks = 0;
+	int ret = timedSync(0);
+	pthread_mutex_unlock(&syncMutex);
+	return ret;
+	}
+
+int LBAchecksumStart (uint64_t regionStart, uint64_t regionBlocks)
+	{
+	if (partInfop == NULL)		//System Not initialized
+		return -1;
+
+	LBAchecksumStop();
+
+	uint64_t blockSize = partInfop->blocksize;
+	uint64_t needed = LBAchecksumBlocks(partInfop->numberOfBlocks, blockSize);
+	if (needed == 0 || regionBlocks < needed || regionStart + needed >= partInfop->numberOfBlocks)
+		return -1;
+
+	uint64_t align = bufferAlign > blockSize ? bufferAlign : blockSize;
+	void * table = NULL;
+	if (posix_memalign(&table, align, needed * blockSize) != 0)
+		return -1;
+	checksumDirty = calloc(needed, 1);
+	if (checksumDirty == NULL || readBlocks(table, needed, regionStart) != needed)
+		{
+		free (checksumDirty);
+		checksumDirty = NULL;
+		free (table);
+		return -1;
+		}
+
+	pthread_mutex_lock(&syncMutex);		//the group commit thread flushes them
+	checksumStart = regionStart;
+	checksumBlocks = needed;
+	checksums = table;
+	pthread_mutex_unlock(&syncMutex);
+	return 0;
+	}
+
+int LBAchecksumStop ()
+	{
+	if (checksums == NULL)
+		return 0;
+
+	pthread_mutex_lock(&syncMutex);
+	int ret = checksumFlush();
+	free (checksums);
+	free (checksumDirty);
+	checksums = NULL;
+	checksumDirty = NULL;
+	checksumStart = 0;
+	checksumBlocks = 0;
+	pthread_mutex_unlock(&syncMutex);
+	return ret;
+	}
+
+int closePartitionSystem ()
+	{
+	//Let the layers above flush while the volume is still open
+	while (numCloseHooks > 0)
+		{
+		numCloseHooks--;
+		closeHooks[numCloseHooks]();
+		}
+
+	asyncTeardown();
+
+	if (syncThreadRunning)
+		{
+		pthread_mutex_lock(&syncMutex);
+		syncThreadRunning = 0;
+		pthread_cond_signal(&syncCond);
+		pthread_mutex_unlock(&syncMutex);
+		pthread_join(syncThread, NULL);
+		}
+
+	LBAchecksumStop();
+
+	if (mapBase != NULL)
+		{
+		munmap(mapBase - partInfop->blocksize, mapLength);
+		mapBase = NULL;
+		}
+
+	if (directFd != -1)
+		{
+		close (directFd);
+		directFd = -1;
+		}
+	poolDrain();
+
+	timedSync(0);
+	stripeClose();
+	close (partInfop->fd);
+	free (partInfop->filename);
+	free (partInfop);
+
+	partInfop = NULL;
+	return 0;
+	}
+
+
+//Check to see if Write or read is beyond the capacity of the volume
+static uint64_t writeBlocks (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
+	{
+	struct flock fl;
+	ssize_t retWrite;
+
+	if (partInfop == NULL)		//System Not initialized
+		return 0;
+
+	if(lbaCount == 0)
+		return 0;
+
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (lbaPosition * partInfop->blocksize)+ partInfop->blocksize;
+	fl.l_len = lbaCount * partInfop->blocksize;
+
+	//Validate that they stay within the volume
+	if ((lbaPosition + lbaCount) > partInfop->numberOfBlocks)
+		{
+		//The are trying to write too far
+		if (lbaPosition+1 >= partInfop->numberOfBlocks)
+			return 0;	//no write because starting beyond volume
+
+		lbaCount = 	partInfop->numberOfBlocks - lbaPosition;
+		fl.l_len = lbaCount * partInfop->blocksize;
+		}
+
+	if (mapBase != NULL)
+		{
+		int slot = -1;
+		if (!partOptions.exclusive)
+			slot = rangeLock(fl.l_start, fl.l_len, 1);
+
+		checksumRun(1, buffer, lbaCount, lbaPosition);
+		memcpy(mapBase + lbaPosition * partInfop->blocksize, buffer, fl.l_len);
+		writeCompleted(lbaCount);
+
+		if (slot != -1)
+			rangeUnlock(slot);
+		return lbaCount;
+		}
+
+	if (partOptions.ioMode == PART_IO_POSITIONAL)
+		{
+		int slot = -1;
+		if (!partOptions.exclusive)
+			slot = rangeLock(fl.l_start, fl.l_len, 1);
+
+		checksumRun(1, buffer, lbaCount, lbaPosition);
+		retWrite = positionalIO(1, buffer, fl.l_len, fl.l_start);
+		writeCompleted(lbaCount);
+
+		if (slot != -1)
+			rangeUnlock(slot);
+		return retWrite / partInfop->blocksize;
+		}
+
+	if (!partOptions.exclusive)
+		fileLock(&fl);
+
+	checksumRun(1, buffer, lbaCount, lbaPosition);
+	struct iovec iov = { buffer, fl.l_len };
+	int fd = pickFd(&iov, 1, fl.l_start);
+	if (stripeCount > 0)
+		retWrite = positionalIO(1, buffer, fl.l_len, fl.l_start);
+	else
+		{
+		pthread_mutex_lock(&seekMutex);
+		lseek (fd, fl.l_start, SEEK_SET);
+		retWrite = write(fd, buffer, fl.l_len);
+		if (retWrite < 0 && errno == EINVAL && fd == directFd)
+			{
+			lseek (partInfop->fd, fl.l_start, SEEK_SET);
+			retWrite = write(partInfop->fd, buffer, fl.l_len);
+			}
+		pthread_mutex_unlock(&seekMutex);
+		}
+
+	writeCompleted(lbaCount);
+
+	if (!partOptions.exclusive)
+		{
+		fl.l_type = F_UNLCK;
+		fcntl(partInfop->fd, F_SETLKW, &fl);
+		}
+
+	if (retWrite < 0)
+		return 0;
+	return retWrite / partInfop->blocksize;
+	}
+
+static uint64_t readBlocks (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
+	{
+	struct flock fl;
+	ssize_t retRead;
+
+	if (partInfop == NULL)		//System Not initialized
+		return 0;
+
+	if(lbaCount == 0)
+		return 0;
+
+	fl.l_type = F_RDLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (lbaPosition * partInfop->blocksize)+ partInfop->blocksize;
+	fl.l_len = lbaCount * partInfop->blocksize;
+
+	//Validate that they stay within the volume
+	if ((lbaPosition + lbaCount) > partInfop->numberOfBlocks)
+		{
+		//The are trying to read too far
+		if (lbaPosition+1 >= partInfop->numberOfBlocks)
+			return 0;	//no read because starting beyond volume
+
+		lbaCount = 	partInfop->numberOfBlocks - lbaPosition;
+		fl.l_len = lbaCount * partInfop->blocksize;
+		}
+
+	if (mapBase != NULL)
+		{
+		int slot = -1;
+		if (!partOptions.exclusive)
+			slot = rangeLock(fl.l_start, fl.l_len, 0);
+
+		memcpy(buffer, mapBase + lbaPosition * partInfop->blocksize, fl.l_len);
+		lbaCount = checksumRun(0, buffer, lbaCount, lbaPosition);
+
+		if (slot != -1)
+			rangeUnlock(slot);
+		return lbaCount;
+		}
+
+	if (partOptions.ioMode == PART_IO_POSITIONAL)
+		{
+		int slot = -1;
+		if (!partOptions.exclusive)
+			slot = rangeLock(fl.l_start, fl.l_len, 0);
+
+		retRead = positionalIO(0, buffer, fl.l_len, fl.l_start);
+		if (retRead > 0)
+			retRead = checksumRun(0, buffer, retRead / partInfop->blocksize, lbaPosition)
+					  * partInfop->blocksize;
+
+		if (slot != -1)
+			rangeUnlock(slot);
+		return retRead / partInfop->blocksize;
+		}
+
+	if (!partOptions.exclusive)
+		fileLock(&fl);
+
+	struct iovec iov = { buffer, fl.l_len };
+	int fd = pickFd(&iov, 1, fl.l_start);
+	if (stripeCount > 0)
+		retRead = positionalIO(0, buffer, fl.l_len, fl.l_start);
+	else
+		{
+		pthread_mutex_lock(&seekMutex);
+		lseek (fd, fl.l_start, SEEK_SET);
+		retRead = read(fd, buffer, fl.l_len);
+		if (retRead < 0 && errno == EINVAL && fd == directFd)
+			{
+			lseek (partInfop->fd, fl.l_start, SEEK_SET);
+			retRead = read(partInfop->fd, buffer, fl.l_len);
+			}
+		pthread_mutex_unlock(&seekMutex);
+		}
+	if (retRead > 0)
+		retRead = checksumRun(0, buffer, retRead / partInfop->blocksize, lbaPosition)
+				  * partInfop->blocksize;
+
+	if (!partOptions.exclusive)
+		{
+		fl.l_type = F_UNLCK;
+		fcntl(partInfop->fd, F_SETLKW, &fl);
+		}
+
+	if (retRead < 0)
+		return 0;
+	return retRead / partInfop->blocksize;
+	}
+
+uint64_t LBAwrite (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
+	{
+	uint64_t start = nsNow();
+	uint64_t done = writeBlocks(buffer, lbaCount, lbaPosition);
+	statRecord(PART_STAT_WRITE, done, start);
+	return done;
+	}
+
+uint64_t LBAread (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
+	{
+	uint64_t start = nsNow();
+	uint64_t done = readBlocks(buffer, lbaCount, lbaPosition);
+	statRecord(PART_STAT_READ, done, start);
+	return done;
+	}
+
+static uint64_t discardBlocks (uint64_t lbaCount, uint64_t lbaPosition)
+	{
+	struct flock fl;
+	int ret;
+
+	if (partInfop == NULL)		//System Not initialized
+		return 0;
+
+	if (lbaCount == 0)
+		return 0;
+
+	//Validate that they stay within the volume
+	if ((lbaPosition + lbaCount) > partInfop->numberOfBlocks)
+		{
+		if (lbaPosition+1 >= partInfop->numberOfBlocks)
+			return 0;	//starting beyond volume
+		lbaCount = partInfop->numberOfBlocks - lbaPosition;
+		}
+
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (lbaPosition * partInfop->blocksize) + partInfop->blocksize;
+	fl.l_len = lbaCount * partInfop->blocksize;
+
+	//Checksums are forgotten first, under the lock: a block that could not be
+	//punched merely goes unverified, while one read back as zeros must not be
+	//checked against what it held before
+	if (partOptions.exclusive)
+		{
+		checksumClear(lbaCount, lbaPosition);
+		ret = punchHole(fl.l_start, fl.l_len);
+		}
+	else if (partOptions.ioMode == PART_IO_POSITIONAL || mapBase != NULL)
+		{
+		int slot = rangeLock(fl.l_start, fl.l_len, 1);
+		checksumClear(lbaCount, lbaPosition);
+		ret = punchHole(fl.l_start, fl.l_len);
+		rangeUnlock(slot);
+		}
+	else
+		{
+		fileLock(&fl);
+		checksumClear(lbaCount, lbaPosition);
+		ret = punchHole(fl.l_start, fl.l_len);
+		fl.l_type = F_UNLCK;
+		fcntl(partInfop->fd, F_SETLKW, &fl);
+		}
+
+	if (ret == -1)
+		return 0;
+
+	writeCompleted(lbaCount);
+	return lbaCount;
+	}
+
+uint64_t LBAdiscard (uint64_t lbaCount, uint64_t lbaPosition)
+	{
+	uint64_t start = nsNow();
+	uint64_t done = discardBlocks(lbaCount, lbaPosition);
+	statRecord(PART_STAT_DISCARD, done, start);
+	return done;
+	}
+
+void * LBAallocBuffer (uint64_t lbaCount)
+	{
+	void * buffer = NULL;
+
+	if (partInfop == NULL)		//System Not initialized
+		return NULL;
+
+	if (lbaCount == 0)
+		lbaCount = 1;
+
+	if (lbaCount <= POOLMAXBLOCKS)
+		{
+		pthread_mutex_lock(&poolMutex);
+		if (poolFree[lbaCount] != NULL)
+			{
+			buffer = poolFree[lbaCount];
+			poolFree[lbaCount] = poolFree[lbaCount]->next;
+			poolFreeCount[lbaCount]--;
+			}
+		pthread_mutex_unlock(&poolMutex);
+		if (buffer != NULL)
+			return buffer;
+		}
+
+	uint64_t align = partInfop->blocksize;
+	if (bufferAlign > align)
+		align = bufferAlign;
+	if (posix_memalign(&buffer, align, lbaCount * partInfop->blocksize) != 0)
+		return NULL;
+	return buffer;
+	}
+
+void LBAfreeBuffer (void * buffer, uint64_t lbaCount)
+	{
+	if (buffer == NULL)
+		return;
+
+	if (lbaCount == 0)
+		lbaCount = 1;
+
+	if (lbaCount <= POOLMAXBLOCKS)
+		{
+		pthread_mutex_lock(&poolMutex);
+		if (poolFreeCount[lbaCount] < POOLMAXFREE)
+			{
+			poolBuffer_t * pooled = buffer;
+			pooled->next = poolFree[lbaCount];
+			poolFree[lbaCount] = pooled;
+			poolFreeCount[lbaCount]++;
+			buffer = NULL;
+			}
+		pthread_mutex_unlock(&poolMutex);
+		}
+
+	free (buffer);
+	}
+
+//Pooled buffers are sized for this volume, so they go when it closes
+static void poolDrain ()
+	{
+	pthread_mutex_lock(&poolMutex);
+	for (int i = 0; i <= POOLMAXBLOCKS; i++)
+		{
+		while (poolFree[i] != NULL)
+			{
+			poolBuffer_t * next = poolFree[i]->next;
+			free (poolFree[i]);
+			poolFree[i] = next;
+			}
+		poolFreeCount[i] = 0;
+		}
+	pthread_mutex_unlock(&poolMutex);
+	}
+
+void * LBAborrow (uint64_t lbaPosition, uint64_t lbaCount)
+	{
+	if (partInfop == NULL || mapBase == NULL)
+		return NULL;
+
+	if (lbaPosition + lbaCount > partInfop->numberOfBlocks)
+		return NULL;
+
+	char * blocks = mapBase + lbaPosition * partInfop->blocksize;
+	if (checksumRun(0, blocks, lbaCount, lbaPosition) < lbaCount)
+		return NULL;
+	return blocks;
+	}
+
+void LBAreturn (uint64_t lbaPosition, uint64_t lbaCount, int modified)
+	{
+	if (partInfop == NULL || mapBase == NULL || !modified)
+		return;
+
+	checksumRun(1, mapBase + lbaPosition * partInfop->blocksize, lbaCount, lbaPosition);
+	writeCompleted(lbaCount);
+	}
+
+int LBAisMapped ()
 	{
-	ssize_t writeRet;
-	partitionInfo_p buf = malloc (blockSize);
+	return mapBase != NULL;
+	}
 
-	if (buf == NULL)
+//
+// Asynchronous LBA calls, backed by an io_uring ring that is driven through
+// the raw system calls.  Each queued transfer owns a request slot whose index
+// is the user_data of its submission entry; the number of slots equals the
+// submission queue size, so the completion queue (twice as large) can never
+// overflow.
+//
+// Any thread may drive the ring.  ringMutex covers the ring and its slots,
+// and completion callbacks run with it held.  Only one thread at a time
+// sleeps in the kernel for completions (ringWaiter), without the mutex, and
+// nobody else reaps meanwhile, so the completion it is waiting for can not
+// be taken from under it; the others wait on ringCond until it has reaped.
+//
+typedef struct asyncRequest {
+	LBAcallback_t	callback;
+	void *			context;
+	struct iovec	single;			//the buffer of a non-vectored request
+	struct iovec *	iov;
+	int				iovcnt;
+	uint64_t		offset;
+	uint64_t		length;
+	uint64_t		queuedNs;		//nsNow when queued, for the statistics
+	char *			checkBuffer;	//read to verify against the checksums, or NULL
+	int				write;
+	int				nextFree;
+	} asyncRequest_t;
+
+typedef struct asyncRing {
+	int			fd;
+	unsigned	entries;
+	unsigned *	sqHead;
+	unsigned *	sqTail;
+	unsigned *	sqMask;
+	unsigned *	sqArray;
+	unsigned *	cqHead;
+	unsigned *	cqTail;
+	unsigned *	cqMask;
+	struct io_uring_sqe *	sqes;
+	struct io_uring_cqe *	cqes;
+	void *		sqRing;
+	size_t		sqRingSize;
+	void *		cqRing;
+	size_t		cqRingSize;
+	size_t		sqesSize;
+	unsigned	queued;			//prepared but not handed to the kernel yet
+	unsigned	inFlight;		//handed to the kernel, not reaped yet
+	int			freeSlot;
+	int			failures;		//short or failed transfers since the last wait
+	asyncRequest_t *	requests;
+	} asyncRing_t;
+
+static asyncRing_t * ring = NULL;
+static int syncFailures = 0;		//failed transfers done without a ring
+static pthread_mutex_t ringMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ringCond = PTHREAD_COND_INITIALIZER;
+static int ringWaiter = 0;			//a thread is in the kernel waiting for completions
+
+static int asyncSetup (unsigned depth)
+	{
+	struct io_uring_params params;
+	asyncRing_t * r = calloc(1, sizeof(asyncRing_t));
+
+	if (r == NULL)
+		return -1;
+
+	memset(&params, 0, sizeof(params));
+	r->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (r->fd < 0)
 		{
-		//abort
+		free (r);
+		return -1;
 		}
 
-	strcpy(buf->volumePrefix, PART_CAPTION);
-	buf->signature = PART_SIGNATURE;
-	buf->volumesize = volSize;
-	buf->blocksize = blockSize;
-	buf->numberOfBlocks = volSize / blockSize;
-	buf->signature2 = PART_SIGNATURE2;
-	strcpy(buf->volumeName, "Untitled");
+	r->entries = params.sq_entries;
+	r->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	r->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+		if (r->cqRingSize > r->sqRingSize)
+			r->sqRingSize = r->cqRingSize;
+		r->cqRingSize = r->sqRingSize;
+		}
 
-	lseek(fd, 0 , SEEK_SET);
-	writeRet = write(fd, buf, blockSize);
+	r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		r->cqRing = r->sqRing;
+	else
+		r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	r->requests = calloc(r->entries, sizeof(asyncRequest_t));
 
-	if (writeRet != blockSize)
+	if (r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED ||
+			r->sqes == MAP_FAILED || r->requests == NULL)
 		{
-		//process error
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqesSize);
+		if (r->cqRing != MAP_FAILED && r->cqRing != r->sqRing)
+			munmap(r->cqRing, r->cqRingSize);
+		if (r->sqRing != MAP_FAILED)
+			munmap(r->sqRing, r->sqRingSize);
+		close (r->fd);
+		free (r->requests);
+		free (r);
+		return -1;
 		}
 
-	fsync(fd);
-	uint64_t blkCount = buf->numberOfBlocks;
-	memset (buf, 0, blockSize);
+	r->sqHead = (unsigned *)((char *)r->sqRing + params.sq_off.head);
+	r->sqTail = (unsigned *)((char *)r->sqRing + params.sq_off.tail);
+	r->sqMask = (unsigned *)((char *)r->sqRing + params.sq_off.ring_mask);
+	r->sqArray = (unsigned *)((char *)r->sqRing + params.sq_off.array);
+	r->cqHead = (unsigned *)((char *)r->cqRing + params.cq_off.head);
+	r->cqTail = (unsigned *)((char *)r->cqRing + params.cq_off.tail);
+	r->cqMask = (unsigned *)((char *)r->cqRing + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cqRing + params.cq_off.cqes);
 
-	//Write one block at the end of the volume to allocate the space
-	lseek (fd, volSize, SEEK_SET);
-	writeRet = write(fd, buf, blockSize);
-	fsync(fd);
-	printf("Created a volume with %llu bytes, broken into %llu blocks of %llu bytes.\n",
-				 (ull_t)volSize, (ull_t)blkCount, (ull_t)blockSize);
-	free (buf);
-	buf = NULL;
-	return PART_NOERROR;
+	for (unsigned i = 0; i < r->entries; i++)
+		r->requests[i].nextFree = i + 1 < r->entries ? (int)i + 1 : -1;
+	r->freeSlot = 0;
+
+	ring = r;
+	return 0;
 	}
-//
-// Start Partition System
-//
-// This is the first function to call before your filesystem starts
-// If the filename already exists, then the input values stored in
-// volSize and blockSize are ignored.  If the file does not exist, it will
-// be created to the specified volume size in units of the block size
-// (must be power of 2) plus one for the partition header.
-//
-// On return
-// 		return value 0 = success;
-//		return value -1 = file exists but can not open for write
-//		return value -2 = insufficient space for the volume
-//		volSize will be filled with the volume size
-//		blockSize will be filled with the block size
-int startPartitionSystem (char * filename, uint64_t * volSize, uint64_t * blockSize)
+
+//Hands queued entries to the kernel, optionally waiting for completions
+static int asyncEnter (unsigned minComplete)
 	{
-	int fd;
-	int retVal = PART_NOERROR;
-	int accessRet = access(filename, F_OK);
-	printf ("File %s does %sexist, errno = %d\n", filename, accessRet==-1?"not ":"",errno);
+	unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
 
-	accessRet = access(filename, R_OK | W_OK);
-	printf ("File %s %sgood to go, errno = %d\n", filename, accessRet==-1?"not ":"",errno);
+	do
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, minComplete, flags, NULL, 0);
+	while (ret < 0 && errno == EINTR);
 
-	//Some issue -
-	if (accessRet == -1)
-		{
-		if (errno == ENOENT)
-			{
-			//File does not exist, create it and initialize
-			fd = open(filename, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			if (fd == -1)
-				{
-				//Error
-				return -1;
-				}
+	if (ret < 0)
+		return -1;
 
-			//insure that blocksize is a power of 2 (min 512);
-			uint64_t blksz = *blockSize;
-			printf("Block size is : %llu\n", (ull_t)blksz);
-			if (blksz < MINBLOCKSIZE) //too small
-				blksz = MINBLOCKSIZE;
+	ring->inFlight += ret;
+	ring->queued -= ret;
+	return ret;
+	}
 
-			// example 1000 0111 anded = 0 1010 1001 = 1000 when anded i.e. not power of 2
-			if ((blksz & (blksz - 1)) != 0) //not a power of 2
-				{
-				printf("%llu is not a power of 2\n", (ull_t)blksz);
+//Runs the callback of every completed request and frees its slot, unless
+//another thread is waiting for completions in the kernel
+static unsigned asyncReap ()
+	{
+	unsigned reaped = 0;
+	unsigned head = *ring->cqHead;
 
-				blksz = 1 << (uint64_t)(ceil(log2(blksz)));
-				printf("Block size is now: %llu\n", (ull_t)blksz);
-				*blockSize = blksz;
-				}
-			// insure the volume size is a multiple of blockSize
-			uint64_t blockCount = *volSize / blksz;
-			*volSize = blockCount * blksz;
+	if (ringWaiter)
+		return 0;
 
-			int initRet = initializePartition (fd, *volSize, *blockSize);
-			close (fd);
-			}
-		else
+	while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+		{
+		struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cqMask];
+		int slot = (int)cqe->user_data;
+		asyncRequest_t * req = &ring->requests[slot];
+		uint64_t done = cqe->res > 0 ? (uint64_t)cqe->res : 0;
+
+		head++;
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+		ring->inFlight--;
+		reaped++;
+
+		//Finish a short transfer in place rather than queueing the remainder,
+		//and redo one that O_DIRECT refused (vectorIO falls back to buffered)
+		if ((cqe->res >= 0 || cqe->res == -EINVAL) && done < req->length)
 			{
-			// Exists but can not read/write
+			advanceIov(&req->iov, &req->iovcnt, done);
+			done += vectorIO(req->write, req->iov, req->iovcnt, req->offset + done);
 			}
-		}
+		if (!req->write && req->checkBuffer != NULL)
+			done = checksumRun(0, req->checkBuffer, done / partInfop->blocksize,
+							   req->offset / partInfop->blocksize - 1) * partInfop->blocksize;
+		if (done < req->length)
+			ring->failures++;
+		if (req->write)
+			writeCompleted(done / partInfop->blocksize);
+		statRecord(req->write ? PART_STAT_ASYNC_WRITE : PART_STAT_ASYNC_READ,
+				   done / partInfop->blocksize, req->queuedNs);
 
-	// If there is no access issue or we fall through the if because we
-	// have initialized the
-	fd = open(filename, O_RDWR);
-	partitionInfo_p buf = malloc (MINBLOCKSIZE);
-	uint64_t readCount = read (fd, buf, MINBLOCKSIZE);
-	if ((buf->signature == PART_SIGNATURE) && (buf->signature2 == PART_SIGNATURE2))
-		{
-		*volSize = buf->volumesize;
-		*blockSize = buf->blocksize;
-		partInfop = malloc (sizeof(partitionInfo_t)+strlen(buf->volumeName)+4);
-		memcpy(partInfop, buf, sizeof(partitionInfo_t)+strlen(buf->volumeName)+4);
-		partInfop->filename = malloc (strlen(filename)+4);
-		strcpy(partInfop->filename, filename);
-		partInfop->fd = fd;
-		retVal = PART_NOERROR;
+		LBAcallback_t callback = req->callback;
+		void * context = req->context;
+		req->nextFree = ring->freeSlot;
+		ring->freeSlot = slot;
+
+		if (callback != NULL)
+			callback(context, done / partInfop->blocksize);
 		}
-	else
+	return reaped;
+	}
+
+//Submits whatever is queued and waits for at least one completion, which
+//is reaped before returning.  Called with ringMutex held; a thread that
+//finds another already waiting in the kernel waits for it to reap instead.
+static int asyncAwait ()
+	{
+	if (ring->queued > 0 && asyncEnter(0) < 0)
+		return -1;
+	if (ringWaiter)
 		{
-		*volSize = 0;
-		*blockSize = 0;
-		retVal = PART_ERR_INVALID;
+		pthread_cond_wait(&ringCond, &ringMutex);
+		return 0;
 		}
+	if (ring->inFlight == 0)
+		return asyncReap() > 0 || ring->queued == 0 ? 0 : -1;
 
-	free (buf);
-	if (retVal != PART_NOERROR)
-		close (fd);
-	return retVal;
+	int ret;
+	ringWaiter = 1;
+	pthread_mutex_unlock(&ringMutex);
+	do
+		ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	while (ret < 0 && errno == EINTR);
+	pthread_mutex_lock(&ringMutex);
+	ringWaiter = 0;
+	asyncReap();
+	pthread_cond_broadcast(&ringCond);
+	return ret < 0 ? -1 : 0;
 	}
 
-int closePartitionSystem ()
+static void asyncTeardown ()
 	{
-	fsync(partInfop->fd);
-	close (partInfop->fd);
-	free (partInfop->filename);
-	free (partInfop);
+	if (ring == NULL)
+		return;
 
-	partInfop = NULL;
-	return 0;
+	LBAasyncWait();
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing)
+		munmap(ring->cqRing, ring->cqRingSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close (ring->fd);
+	free (ring->requests);
+	free (ring);
+	ring = NULL;
 	}
 
-
-//Check to see if Write or read is beyond the capacity of the volume
-uint64_t LBAwrite (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
+//Queues one transfer of length bytes at offset into a free request slot,
+//with ringMutex held.  A read with a checkBuffer (the contiguous buffer it
+//fills) is verified against the block checksums once it completes.
+static int asyncQueue (int write, struct iovec * iov, int iovcnt, uint64_t offset,
+					   uint64_t length, char * checkBuffer, LBAcallback_t callback, void * context)
 	{
-	struct flock fl;
+	//Make room by pushing out what is queued and collecting a completion
+	while (ring->freeSlot == -1)
+		{
+		if (asyncAwait() < 0)
+			return -1;
+		}
+
+	int slot = ring->freeSlot;
+	asyncRequest_t * req = &ring->requests[slot];
+	ring->freeSlot = req->nextFree;
+
+	req->callback = callback;
+	req->context = context;
+	if (iovcnt == 1)
+		{
+		req->single = iov[0];
+		iov = &req->single;
+		}
+	req->iov = iov;
+	req->iovcnt = iovcnt;
+	req->offset = offset;
+	req->length = length;
+	req->queuedNs = nsNow();
+	req->checkBuffer = checkBuffer;
+	req->write = write;
+
+	unsigned tail = *ring->sqTail;
+	unsigned index = tail & *ring->sqMask;
+	struct io_uring_sqe * sqe = &ring->sqes[index];
 
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = pickFd(iov, iovcnt, offset);
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = slot;
+
+	ring->sqArray[index] = index;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+	return 0;
+	}
+
+static int asyncTransfer (int write, void * buffer, uint64_t lbaCount, uint64_t lbaPosition,
+						  LBAcallback_t callback, void * context)
+	{
 	if (partInfop == NULL)		//System Not initialized
-		return 0;
+		return -1;
 
-	if(lbaCount == 0)
+	if (ring == NULL)
+		{
+		uint64_t done;
+		if (write)
+			done = LBAwrite(buffer, lbaCount, lbaPosition);
+		else
+			done = LBAread(buffer, lbaCount, lbaPosition);
+		if (done < lbaCount)
+			syncFailures++;
+		if (callback != NULL)
+			callback(context, done);
 		return 0;
+		}
 
-	fl.l_type = F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = (lbaPosition * partInfop->blocksize)+ partInfop->blocksize;
-	fl.l_len = lbaCount * partInfop->blocksize;
+	if (lbaCount == 0)
+		return -1;
 
 	//Validate that they stay within the volume
 	if ((lbaPosition + lbaCount) > partInfop->numberOfBlocks)
 		{
-		//The are trying to write too far
 		if (lbaPosition+1 >= partInfop->numberOfBlocks)
-			return 0;	//no write because starting beyond volume
+			return -1;	//starting beyond volume
+		lbaCount = partInfop->numberOfBlocks - lbaPosition;
+		}
 
-		lbaCount = 	partInfop->numberOfBlocks - lbaPosition;
-		fl.l_len = lbaCount * partInfop->blocksize;
+	if (write)
+		checksumRun(1, buffer, lbaCount, lbaPosition);
+
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = lbaCount * partInfop->blocksize;
+	pthread_mutex_lock(&ringMutex);
+	int ret = asyncQueue(write, &iov, 1, (lbaPosition * partInfop->blocksize) + partInfop->blocksize,
+						 iov.iov_len, write ? NULL : buffer, callback, context);
+	pthread_mutex_unlock(&ringMutex);
+	return ret;
+	}
+
+int LBAreadAsync (void * buffer, uint64_t lbaCount, uint64_t lbaPosition,
+				  LBAcallback_t callback, void * context)
+	{
+	return asyncTransfer(0, buffer, lbaCount, lbaPosition, callback, context);
+	}
+
+int LBAwriteAsync (void * buffer, uint64_t lbaCount, uint64_t lbaPosition,
+				   LBAcallback_t callback, void * context)
+	{
+	return asyncTransfer(1, buffer, lbaCount, lbaPosition, callback, context);
+	}
+
+int LBAasyncSubmit ()
+	{
+	if (ring == NULL)
+		return 0;
+
+	int submitted = 0;
+	pthread_mutex_lock(&ringMutex);
+	if (ring->queued > 0)
+		{
+		submitted = asyncEnter(0);
+		asyncReap();
 		}
+	pthread_mutex_unlock(&ringMutex);
+	return submitted < 0 ? 0 : submitted;
+	}
 
-	fcntl(partInfop->fd, F_SETLKW, &fl);
+int LBAasyncWait ()
+	{
+	if (ring == NULL)
+		{
+		int ret = syncFailures > 0 ? -1 : 0;
+		syncFailures = 0;
+		return ret;
+		}
 
-	lseek (partInfop->fd, fl.l_start, SEEK_SET);
-	uint64_t retWrite = write(partInfop->fd, buffer, fl.l_len);
+	pthread_mutex_lock(&ringMutex);
+	while (ring->queued > 0 || ring->inFlight > 0)
+		{
+		if (asyncAwait() < 0)
+			{
+			ring->failures++;
+			break;
+			}
+		}
 
-	fsync(partInfop->fd);
+	int ret = ring->failures > 0 ? -1 : 0;
+	ring->failures = 0;
+	pthread_mutex_unlock(&ringMutex);
+	return ret;
+	}
 
-	fl.l_type = F_UNLCK;
-	fcntl(partInfop->fd, F_SETLKW, &fl);
+//
+// Vectored LBA calls
+//
+//What the ring has done of one LBAreadv/LBAwritev, so the call waits for
+//its own requests rather than for everything other threads have in flight
+typedef struct ringTotal {
+	uint64_t	blocks;			//blocks transferred by the completed requests
+	int			pending;		//requests queued and not completed yet
+	} ringTotal_t;
 
-	return retWrite / partInfop->blocksize;
+//Counts blocks for the completion callbacks of LBAreadv/LBAwritev
+static void countBlocks (void * context, uint64_t blocksTransferred)
+	{
+	ringTotal_t * total = context;
+	total->blocks += blocksTransferred;
+	total->pending--;
 	}
 
-uint64_t LBAread (void * buffer, uint64_t lbaCount, uint64_t lbaPosition)
+//checksumRun over the first blocks of a group of adjacent segments starting
+//at lbaPosition.  Returns the blocks that passed: a failed block costs the
+//rest of its own segment, as on the ring (see vectoredLBA).
+static uint64_t groupChecksums (int write, lbaSegment_p group, int count,
+								uint64_t lbaPosition, uint64_t blocks)
+	{
+	uint64_t seen = 0;
+	uint64_t good = 0;
+	for (int i = 0; i < count && seen < blocks; i++)
+		{
+		uint64_t n = group[i].lbaCount;
+		if (n > blocks - seen)
+			n = blocks - seen;
+		good += checksumRun(write, group[i].buffer, n, lbaPosition + seen);
+		seen += n;
+		}
+	return good;
+	}
+
+//Transfers one merged group of adjacent segments starting at lbaPosition;
+//iov holds the buffers of the segments in group
+static uint64_t transferGroup (int write, lbaSegment_p group, struct iovec * iov, int iovcnt,
+							   uint64_t lbaPosition, uint64_t lbaCount, ringTotal_t * ringTotal)
 	{
 	struct flock fl;
+	uint64_t done;
 
-	if (partInfop == NULL)		//System Not initialized
-		return 0;
+	fl.l_type = write ? F_WRLCK : F_RDLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (lbaPosition * partInfop->blocksize) + partInfop->blocksize;
+	fl.l_len = lbaCount * partInfop->blocksize;
 
-	if(lbaCount == 0)
+	if (ring != NULL)
+		{
+		//Counted by the callback once LBAasyncWait reaps it, reads are
+		//verified by vectoredLBA after that
+		if (write)
+			groupChecksums(1, group, iovcnt, lbaPosition, lbaCount);
+		pthread_mutex_lock(&ringMutex);
+		int queued = asyncQueue(write, iov, iovcnt, fl.l_start, fl.l_len, NULL, countBlocks, ringTotal);
+		if (queued == 0)
+			ringTotal->pending++;
+		pthread_mutex_unlock(&ringMutex);
+		if (queued == 0)
+			return 0;
+		}
+
+	if (mapBase != NULL)
+		{
+		int slot = -1;
+		if (!partOptions.exclusive)
+			slot = rangeLock(fl.l_start, fl.l_len, write);
+
+		if (write)
+			groupChecksums(1, group, iovcnt, lbaPosition, lbaCount);
+		char * block = mapBase + lbaPosition * partInfop->blocksize;
+		for (int i = 0; i < iovcnt; i++)
+			{
+			if (write)
+				memcpy(block, iov[i].iov_base, iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, block, iov[i].iov_len);
+			block += iov[i].iov_len;
+			}
+		done = fl.l_len;
+		if (!write)
+			done = groupChecksums(0, group, iovcnt, lbaPosition, lbaCount) * partInfop->blocksize;
+
+		if (slot != -1)
+			rangeUnlock(slot);
+		}
+	else if (partOptions.ioMode == PART_IO_POSITIONAL)
+		{
+		int slot = -1;
+		if (!partOptions.exclusive)
+			slot = rangeLock(fl.l_start, fl.l_len, write);
+
+		if (write)
+			groupChecksums(1, group, iovcnt, lbaPosition, lbaCount);
+		done = vectorIO(write, iov, iovcnt, fl.l_start);
+		if (!write)
+			done = groupChecksums(0, group, iovcnt, lbaPosition, done / partInfop->blocksize)
+				   * partInfop->blocksize;
+
+		if (slot != -1)
+			rangeUnlock(slot);
+		}
+	else
+		{
+		if (!partOptions.exclusive)
+			fileLock(&fl);
+
+		if (write)
+			groupChecksums(1, group, iovcnt, lbaPosition, lbaCount);
+		done = vectorIO(write, iov, iovcnt, fl.l_start);
+		if (!write)
+			done = groupChecksums(0, group, iovcnt, lbaPosition, done / partInfop->blocksize)
+				   * partInfop->blocksize;
+
+		if (!partOptions.exclusive)
+			{
+			fl.l_type = F_UNLCK;
+			fcntl(partInfop->fd, F_SETLKW, &fl);
+			}
+		}
+
+	if (write)
+		writeCompleted(done / partInfop->blocksize);
+	return done / partInfop->blocksize;
+	}
+
+static uint64_t vectoredLBA (int write, lbaSegment_p segments, int segmentCount)
+	{
+	if (partInfop == NULL || segmentCount <= 0)		//System Not initialized
 		return 0;
 
-	fl.l_type = F_RDLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = (lbaPosition * partInfop->blocksize)+ partInfop->blocksize;
-	fl.l_len = lbaCount * partInfop->blocksize;
+	struct iovec * iov = malloc(segmentCount * sizeof(struct iovec));
+	if (iov == NULL)
+		return 0;
 
-	//Validate that they stay within the volume
-	if ((lbaPosition + lbaCount) > partInfop->numberOfBlocks)
+	uint64_t total = 0;
+	ringTotal_t ringTotal = { 0, 0 };
+	int i = 0;
+	while (i < segmentCount)
 		{
-		//The are trying to read too far
-		if (lbaPosition+1 >= partInfop->numberOfBlocks)
-			return 0;	//no read because starting beyond volume
+		if (segments[i].lbaCount == 0)
+			{
+			i++;
+			continue;
+			}
+		if (segments[i].lbaPosition+1 >= partInfop->numberOfBlocks)
+			break;	//starting beyond volume
 
-		lbaCount = 	partInfop->numberOfBlocks - lbaPosition;
-		fl.l_len = lbaCount * partInfop->blocksize;
+		//Gather the run of segments that continue where the previous one ended
+		int first = i;
+		uint64_t lbaPosition = segments[i].lbaPosition;
+		uint64_t lbaCount = 0;
+		while (i < segmentCount && i - first < IOV_MAX &&
+				segments[i].lbaPosition == lbaPosition + lbaCount && segments[i].lbaCount > 0)
+			{
+			uint64_t count = segments[i].lbaCount;
+			int clamped = 0;
+			if (lbaPosition + lbaCount + count > partInfop->numberOfBlocks)
+				{
+				count = partInfop->numberOfBlocks - (lbaPosition + lbaCount);
+				clamped = 1;
+				}
+
+			iov[i].iov_base = segments[i].buffer;
+			iov[i].iov_len = count * partInfop->blocksize;
+			lbaCount += count;
+			i++;
+			if (clamped)
+				{
+				segmentCount = i;	//nothing after this fits on the volume
+				break;
+				}
+			}
+
+		total += transferGroup(write, &segments[first], &iov[first], i - first,
+							   lbaPosition, lbaCount, &ringTotal);
 		}
 
-	fcntl(partInfop->fd, F_SETLKW, &fl);
+	if (ring != NULL)
+		{
+		pthread_mutex_lock(&ringMutex);
+		while (ringTotal.pending > 0 && asyncAwait() == 0)
+			;
+		pthread_mutex_unlock(&ringMutex);
+
+		//Verify what the ring read, dropping every block from a failed one
+		//to the end of its segment
+		for (int s = 0; !write && checksums != NULL && s < i; s++)
+			{
+			uint64_t count = segments[s].lbaCount;
+			if (count == 0)
+				continue;
+			if (segments[s].lbaPosition + count > partInfop->numberOfBlocks)
+				count = partInfop->numberOfBlocks - segments[s].lbaPosition;
+			uint64_t good = checksumRun(0, segments[s].buffer, count, segments[s].lbaPosition);
+			ringTotal.blocks -= ringTotal.blocks < count - good ? ringTotal.blocks : count - good;
+			}
+		}
 
-	lseek (partInfop->fd, fl.l_start, SEEK_SET);
-	read(partInfop->fd, buffer, fl.l_len);
+	free (iov);
+	return total + ringTotal.blocks;
+	}
 
-	fl.l_type = F_UNLCK;
-	fcntl(partInfop->fd, F_SETLKW, &fl);
+uint64_t LBAreadv (lbaSegment_p segments, int segmentCount)
+	{
+	uint64_t start = nsNow();
+	uint64_t done = vectoredLBA(0, segments, segmentCount);
+	statRecord(PART_STAT_READV, done, start);
+	return done;
+	}
 
-	return 0;
+uint64_t LBAwritev (lbaSegment_p segments, int segmentCount)
+	{
+	uint64_t start = nsNow();
+	uint64_t done = vectoredLBA(1, segments, segmentCount);
+	statRecord(PART_STAT_WRITEV, done, start);
+	return done;
 	}
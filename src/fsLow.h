@@ -21,15 +21,325 @@ typedef unsigned long long ull_t;
 
 int startPartitionSystem (char * filename, uint64_t * volSize, uint64_t * blockSize);
 
+//
+// Partition Options
+//
+// startPartitionSystemEx takes the same arguments as startPartitionSystem
+// plus a set of options that select how the LBA calls reach the file.
+// Passing NULL, or calling startPartitionSystem, uses the defaults filled
+// in by defaultPartitionOptions.
+//
+// ioMode
+//		PART_IO_LOCKED = fcntl byte range lock, lseek, read/write, unlock on
+//			every call.  Safe against other processes using the same file;
+//			threads of this process take turns at the seek and transfer.
+//		PART_IO_POSITIONAL = a single pread/pwrite per call, serialized only
+//			against overlapping calls from this process through an in-process
+//			range lock table, so several threads can be in the layer at once.
+// exclusive
+//		Takes a write lock on the whole file for as long as the partition is
+//		open.  In PART_IO_POSITIONAL mode no range locks are taken at all.
+// durability
+//		PART_SYNC_ALWAYS = fsync after every LBAwrite (the original behavior).
+//		PART_SYNC_GROUP = group commit: fsync once groupCommitBlocks blocks
+//			have been written since the last sync, or groupCommitMs
+//			milliseconds after the first unsynced write, whichever is first.
+//			A background thread covers writes followed by an idle volume.
+//		PART_SYNC_ON_CLOSE = only LBAbarrier and closePartitionSystem sync.
+// asyncDepth
+//		Queue depth of the io_uring ring behind LBAreadAsync/LBAwriteAsync.
+//		The ring is only set up for exclusive PART_IO_POSITIONAL volumes;
+//		otherwise (or with 0) the async calls complete synchronously.
+// mapped
+//		Maps the whole volume into memory.  LBAread and LBAwrite become
+//		copies to and from the mapping, whatever the ioMode, and
+//		LBAborrow can hand out pointers straight into it.
+// direct
+//		Bypasses the host page cache with O_DIRECT for every transfer whose
+//		buffer, length and offset are suitably aligned (buffers from
+//		LBAallocBuffer always are).  Anything else, or a file system that
+//		refuses O_DIRECT, falls back to buffered I/O.  Ignored when mapped.
+// preallocate
+//		Only used when the file is created.  By default a new volume is a
+//		sparse file that takes host space only as blocks are written; with
+//		preallocate the whole volume is reserved with fallocate, and
+//		startPartitionSystemEx returns -2 if the host does not have room.
+// stripeFiles
+//		NULL terminated list of further backing files to stripe the volume
+//		across (RAID-0), NULL for a volume in a single file.  The file given
+//		to startPartitionSystemEx is member 0 and stripe unit u lives on
+//		member u % members.  Each member starts with its own header block,
+//		so the same list must be given, in the same order, every time the
+//		volume is opened.  Transfers that span several members run on all
+//		of them at once.  Striped volumes are never mapped and have no
+//		io_uring ring (the async calls complete synchronously).
+// stripeBlocks
+//		Size of a stripe unit in blocks, only used when the volume is
+//		created; an existing volume keeps the unit it was created with.
+//
+// On return (in addition to the startPartitionSystem values)
+//		return value -4 = a member of a striped volume is missing, or does
+//			not belong to this volume at this position
+//		return value -5 = exclusive access requested but the file is in use
+#define PART_IO_LOCKED		0
+#define PART_IO_POSITIONAL	1
+
+#define PART_SYNC_ALWAYS	0
+#define PART_SYNC_GROUP		1
+#define PART_SYNC_ON_CLOSE	2
+
+#define PART_GROUP_COMMIT_MS		50
+#define PART_GROUP_COMMIT_BLOCKS	1024
+
+#define PART_ASYNC_DEPTH	64
+
+#define PART_STRIPE_BLOCKS	64
+#define PART_MAX_STRIPES	16
+
+typedef struct partitionOptions {
+	int			ioMode;
+	int			exclusive;
+	int			durability;
+	uint64_t	groupCommitMs;
+	uint64_t	groupCommitBlocks;
+	unsigned	asyncDepth;
+	int			mapped;
+	int			direct;
+	int			preallocate;
+	char **		stripeFiles;
+	uint64_t	stripeBlocks;
+	} partitionOptions_t, * partitionOptions_p;
+
+void defaultPartitionOptions (partitionOptions_p options);
+
+int startPartitionSystemEx (char * filename, uint64_t * volSize, uint64_t * blockSize,
+							partitionOptions_p options);
+
 int closePartitionSystem ();
 
+//
+// Close hooks
+//
+// Layers that hold blocks above the LBA calls (such as a buffer cache)
+// register a hook here so closePartitionSystem can flush them before the
+// volume is closed.  Hooks run most recently registered first.
+//
+// On return
+//		return value 0 = success;
+//		return value -1 = no room for another hook
+typedef int (*partitionCloseHook_t) ();
+
+#define MAXCLOSEHOOKS 8
+
+int registerCloseHook (partitionCloseHook_t hook);
+
 uint64_t LBAwrite (void * buffer, uint64_t lbaCount, uint64_t lbaPosition);
 
 uint64_t LBAread (void * buffer, uint64_t lbaCount, uint64_t lbaPosition);
 
+//
+// Vectored LBA calls
+//
+// LBAreadv and LBAwritev transfer a list of segments, each a buffer with its
+// own lbaCount and lbaPosition.  Consecutive segments whose blocks are
+// adjacent on the volume are merged into a single preadv/pwritev (up to
+// IOV_MAX segments at a time); with an io_uring ring every merged group is
+// in flight at once.  Segments should be given in ascending LBA order to
+// get the most merging, and a segment that starts beyond the volume ends
+// the transfer.
+//
+// On return
+//		the total number of blocks transferred
+typedef struct lbaSegment {
+	void *		buffer;
+	uint64_t	lbaCount;
+	uint64_t	lbaPosition;
+	} lbaSegment_t, * lbaSegment_p;
+
+uint64_t LBAreadv (lbaSegment_p segments, int segmentCount);
+
+uint64_t LBAwritev (lbaSegment_p segments, int segmentCount);
+
+//
+// Discard
+//
+// Punches a hole over lbaCount blocks, handing their space back to the host.
+// The blocks read back as zeros afterwards.
+//
+// On return
+//		the number of blocks discarded; 0 when the host file system can not
+//		punch holes, in which case the blocks are unchanged
+uint64_t LBAdiscard (uint64_t lbaCount, uint64_t lbaPosition);
+
+//
+// Barrier
+//
+// Returns once every block written before the call is on stable storage,
+// whatever the durability mode.
+//
+// On return
+//		return value 0 = success;
+//		return value -1 = the sync failed
+int LBAbarrier ();
+
+//
+// Block checksums
+//
+// LBAchecksumStart keeps a CRC32C of every block of the volume, 4 bytes a
+// block in block order, in the regionBlocks blocks at regionStart, which the
+// caller sets aside and zeroes before the first start.  From then on every
+// write records the checksums of the blocks it writes and every read
+// verifies the blocks it reads.  A read that meets a block whose checksum
+// does not match stops there: it returns the blocks before that one, sets
+// errno to EBADMSG and counts the failure in checksumErrors of the I/O
+// statistics (LBAreadv, which has no such prefix, drops the rest of the
+// segment holding the failed block).  A stored checksum of 0 means unknown (never written since
+// the region was zeroed, or discarded) and is not verified.  The checksums
+// are kept in memory and written to the region before every sync of the
+// volume, so they reach stable storage with the blocks they describe.
+// Blocks of the region itself are not checksummed.  Another process writing
+// the same volume does not update this process' copy, so checksums are meant
+// for volumes opened exclusive.  LBAchecksumStop writes the checksums out
+// and turns verification off; closePartitionSystem does the same.  Neither
+// call may race with other LBA calls.
+//
+// On return
+//		LBAchecksumStart 0 = success; -1 = the region is too small, past the
+//			end of the volume, or could not be read
+//		LBAchecksumStop 0 = success; -1 = the checksums could not be written
+//		LBAchecksumBlocks = the region blocks a volume of numberOfBlocks
+//			blocks of blockSize bytes needs
+int LBAchecksumStart (uint64_t regionStart, uint64_t regionBlocks);
+
+int LBAchecksumStop ();
+
+uint64_t LBAchecksumBlocks (uint64_t numberOfBlocks, uint64_t blockSize);
+
+//
+// Aligned buffers
+//
+// LBAallocBuffer returns an uninitialized buffer of lbaCount blocks aligned
+// for the volume (block size, and the O_DIRECT alignment in direct mode).
+// Small buffers are recycled through a pool, so they are cheap to get and
+// give back.  LBAfreeBuffer must be given the same lbaCount.
+//
+// On return
+//		LBAallocBuffer NULL = out of memory or no partition open
+void * LBAallocBuffer (uint64_t lbaCount);
+
+void LBAfreeBuffer (void * buffer, uint64_t lbaCount);
+
+//
+// Borrowed blocks
+//
+// On a mapped volume LBAborrow returns a pointer to lbaCount blocks in
+// place, with no copy and no allocation; on any other volume (or past the
+// end of the volume) it returns NULL and the caller falls back to LBAread.
+// The blocks may be read and modified through the pointer until the
+// partition is closed.  Borrowed blocks are not covered by the range locks,
+// so a caller that modified them must call LBAreturn with modified set,
+// which applies the durability mode just as LBAwrite would.  With block
+// checksums on, LBAborrow also returns NULL when a block fails verification,
+// and LBAreturn with modified records the new checksums.
+//
+// LBAisMapped returns 1 when the volume is mapped, 0 otherwise.
+void * LBAborrow (uint64_t lbaPosition, uint64_t lbaCount);
+
+void LBAreturn (uint64_t lbaPosition, uint64_t lbaCount, int modified);
+
+int LBAisMapped ();
+
+//
+// Asynchronous LBA calls
+//
+// LBAreadAsync and LBAwriteAsync queue a transfer and return at once; the
+// buffer must stay valid until the callback has run.  Queued requests go
+// to the kernel in one batch on LBAasyncSubmit (or when the queue fills),
+// and LBAasyncWait submits whatever is queued and waits for everything in
+// flight.  Callbacks run on whichever thread collects the completion (any
+// caller of LBAasyncSubmit, LBAasyncWait, LBAreadv or LBAwritev), with the
+// number of blocks transferred (0 on error) and the ring locked, so they
+// must not start or wait for transfers themselves.  When the volume has no
+// io_uring ring the transfer is done synchronously and the callback runs
+// before the call returns.  Any number of threads may use the async calls.
+//
+// On return
+//		LBAreadAsync/LBAwriteAsync 0 = queued (or done); -1 = not queued
+//		LBAasyncSubmit = the number of requests handed to the kernel
+//		LBAasyncWait 0 = every request completed in full; -1 = some failed
+typedef void (*LBAcallback_t) (void * context, uint64_t blocksTransferred);
+
+int LBAreadAsync (void * buffer, uint64_t lbaCount, uint64_t lbaPosition,
+				  LBAcallback_t callback, void * context);
+
+int LBAwriteAsync (void * buffer, uint64_t lbaCount, uint64_t lbaPosition,
+				   LBAcallback_t callback, void * context);
+
+int LBAasyncSubmit ();
+
+int LBAasyncWait ();
+
+//
+// I/O statistics
+//
+// Every LBA call is counted and timed, per operation, with atomic counters
+// so threads in the layer never serialize on them.  For each operation the
+// layer keeps the number of calls, the blocks they transferred, the total
+// and worst latency and a histogram of latencies in power of two buckets:
+// latency[i] counts calls that took at least 2^i and less than 2^(i+1)
+// microseconds (bucket 0 also holds anything under a microsecond, and the
+// last bucket anything longer).
+//
+// PART_STAT_READ/WRITE		LBAread and LBAwrite (including any sync done by
+//							PART_SYNC_ALWAYS)
+// PART_STAT_READV/WRITEV	LBAreadv and LBAwritev
+// PART_STAT_ASYNC_READ/WRITE	io_uring transfers, queued to reaped (the
+//							vectored calls use these too when there is a ring)
+// PART_STAT_SYNC			fsync/fdatasync of the volume, from any cause
+// PART_STAT_LOCK			waits for a byte range lock (fcntl or in-process),
+//							blocks being the length of the range
+// PART_STAT_DISCARD		LBAdiscard
+//
+// checksumErrors counts blocks that failed checksum verification.
+//
+// LBAgetStats copies the counters, LBAresetStats zeroes them; neither needs
+// the partition to be open.  LBAstatName gives a short name for printing.
+#define PART_STAT_READ			0
+#define PART_STAT_WRITE			1
+#define PART_STAT_READV			2
+#define PART_STAT_WRITEV		3
+#define PART_STAT_ASYNC_READ	4
+#define PART_STAT_ASYNC_WRITE	5
+#define PART_STAT_SYNC			6
+#define PART_STAT_LOCK			7
+#define PART_STAT_DISCARD		8
+#define PART_STAT_OPS			9
+
+#define PART_STAT_BUCKETS		24
+
+typedef struct partitionOpStats {
+	uint64_t	calls;
+	uint64_t	blocks;
+	uint64_t	totalNs;
+	uint64_t	maxNs;
+	uint64_t	latency[PART_STAT_BUCKETS];
+	} partitionOpStats_t, * partitionOpStats_p;
+
+typedef struct partitionStats {
+	partitionOpStats_t	op[PART_STAT_OPS];
+	uint64_t			checksumErrors;
+	} partitionStats_t, * partitionStats_p;
+
+void LBAgetStats (partitionStats_p stats);
+
+void LBAresetStats ();
+
+const char * LBAstatName (int op);
+
 #define MINBLOCKSIZE 512
 #define PART_SIGNATURE	0x526F626572742042
 #define PART_SIGNATURE2	0x4220747265626F52
+#define PART_STRIPE_SIGNATURE	0x5374726970653000
 #define PART_CAPTION "CSC-415 - Operating Systems File System Project Header\n\n"
 
 #define	PART_ACTIVE 		1
@@ -37,6 +347,7 @@ uint64_t LBAread (void * buffer, uint64_t lbaCount, uint64_t lbaPosition);
 
 #define	PART_NOERROR 		0
 #define PART_ERR_INVALID	-4
+#define PART_ERR_BUSY		-5
 
 typedef struct partitionInfo {
 	char 		volumePrefix[sizeof(PART_CAPTION)+2];
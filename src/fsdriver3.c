@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "FileSystem.h"
+#include "fsCache.h"
 
 #define MAX_INPUT_BUFFER 512
 #define MAX_ARG MAX_INPUT_BUFFER/2+1
@@ -42,6 +43,8 @@ void run_mv(int, char**);
 void run_del(int, char**);
 void run_cpin(int, char**);
 void run_cpout(int, char**);
+void run_iostat(int, char**);
+void run_snapshot(int, char**);
 void flushInput();
 
 int main(int argc, char **argv) {
@@ -52,17 +55,20 @@ int main(int argc, char **argv) {
     char* filename;
     uint64_t volumeSize;
     uint64_t blockSize;
+    uint64_t cacheBlocks = CACHE_DEFAULT_BLOCKS;
 
     if (argc < 4) {
-		printf("Missing arguments: Filename, Volume Size, Buffer\n");
+		printf("Missing arguments: Filename, Volume Size, Buffer [Cache Blocks [Stripe Files...]]\n");
 		exit(EXIT_FAILURE);
-    } else if (argc > 4) {
+    } else if (argc > 5 + PART_MAX_STRIPES - 1) {
 		printf("Too many arguments\n");
 		exit(EXIT_FAILURE);
     } else {
 		filename = argv[1];
 		volumeSize = atoll(argv[2]);
 		blockSize = atoll(argv[3]);
+		if (argc >= 5)
+			cacheBlocks = atoll(argv[4]);
     }
 
     if (volumeSize < blockSize) {
@@ -70,7 +76,16 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
     }
 
-	int retVal = startPartitionSystem (filename, &volumeSize, &blockSize);
+	partitionOptions_t options;
+	defaultPartitionOptions(&options);
+	options.ioMode = PART_IO_POSITIONAL;
+	options.exclusive = 1;
+	options.durability = PART_SYNC_GROUP;
+	/* Any further arguments are files to stripe the volume across (argv ends in NULL) */
+	if (argc > 5)
+		options.stripeFiles = &argv[5];
+
+	int retVal = startPartitionSystemEx (filename, &volumeSize, &blockSize, &options);
 	if (retVal != 0) {
 		printf("Error: opening partition %s\n", filename);
 		exit(EXIT_FAILURE);
@@ -78,6 +93,9 @@ int main(int argc, char **argv) {
 
 	printf("Opened %s, Volume Size: %llu;  BlockSize: %llu; Return %d\n", filename, (ull_t)volumeSize, (ull_t)blockSize, retVal);
 
+	if (cacheBlocks > 0 && cacheInit(cacheBlocks) != 0)
+		printf("Warning: could not allocate a %llu block cache\n", (ull_t)cacheBlocks);
+
 	/* Check if partition is already formatted, if not then format */
 	if (!check_fs()) {
 		char answer;
@@ -102,8 +120,10 @@ int main(int argc, char **argv) {
         /* retrieve input */
         if (fgets(userInput, MAX_INPUT_BUFFER, stdin) == NULL)
             /* check for EOF */
-            if (feof(stdin))
+            if (feof(stdin)) {
+                closePartitionSystem();
                 exit(EXIT_SUCCESS);
+            }
 
         /* test for empty input */
         if (strlen(userInput) == 1) {
@@ -161,6 +181,10 @@ void processArgs(int numArgs, char** args) {
 		run_cpin(numArgs, args);
 	} else if (strcmp(args[0], "cpout") == 0) {
 		run_cpout(numArgs, args);
+	} else if (strcmp(args[0], "iostat") == 0) {
+		run_iostat(numArgs, args);
+	} else if (strcmp(args[0], "snapshot") == 0) {
+		run_snapshot(numArgs, args);
 	} else {
 		printf("%s: command not found\n", args[0]);
 		printf("Type help for more info\n");
@@ -176,7 +200,7 @@ void run_help(int numArgs, char** args) {
 	} else if (numArgs == 1) {
 		printf("Type help <function> to get more information about a function\n");
 		printf("Commands:\n");
-		printf("format - formats the partition\n");
+		printf("format - formats the partition, optionally with block checksums or dedup\n");
 		printf("lsfs   - lists the information of the current filesystem\n");
 		printf("ls     - lists files in the directory\n");
 		printf("mkdir  - creates a directory\n");
@@ -185,19 +209,29 @@ void run_help(int numArgs, char** args) {
 		printf("mv     - moves a file from source to destination\n");
 		printf("del    - deletes a file\n");
 
-		printf("cpin   - copy a file in from another filesystem\n");
+		printf("cpin   - copy a file in from another filesystem, optionally compressed\n");
 		printf("cpout  - copies a file to another filesystem\n");
+		printf("iostat - shows the block layer call counters and latencies\n");
+		printf("snapshot - takes, lists, restores or deletes volume snapshots\n");
 		printf("exit   - exit shell\n");
 	} else {
 		if (strcmp(args[1], "format") == 0) {
-			printf("Usage: format\n");
+			printf("Usage: format [checksums] [dedup] [nojournal]\n");
 			printf("Formats the partition and installs the filesystem.\n");
 			printf("Will delete any current filesystems that are installed\n");
+			printf("With checksums a CRC32C of every block is kept on the volume and\n");
+			printf("	checked on every read; a block that does not match fails to read.\n");
+			printf("With dedup file blocks already stored on the volume are shared, not\n");
+			printf("	written again, and cp only copies block pointers.\n");
+			printf("Metadata changes are committed to a journal before they are written\n");
+			printf("	in place, and replayed after a crash; nojournal leaves it out, as\n");
+			printf("	does a memory-mapped partition, which the journal cannot see.\n");
 		} else if (strcmp(args[1], "lsfs") == 0) {
 			printf("Usage: lsfs\n");
 			printf("Lists the information about the current filesystem.\n");
 			printf("This includes: Volume name, volume ID, block size, number of blocks,\n");
-			printf("	free blocks, and space used.\n");
+			printf("	free blocks, and space used, plus the block cache hit, miss,\n");
+			printf("	eviction and writeback counters and where the block checksums live.\n");
 		} else if (strcmp(args[1], "ls") == 0) {
 			printf("Usage: ls\n");
 			printf("lists files in the current directory.\n");
@@ -217,11 +251,25 @@ void run_help(int numArgs, char** args) {
 			printf("Usage: del <filename>\n");
 			printf("Deletes the given filename\n");
   	} else if (strcmp(args[1], "cpin") == 0) {
-			printf("Usage: cpin <source> <desintation>\n");
+			printf("Usage: cpin <source> <desintation> [compressed]\n");
 			printf("Copies a file from another filesystem into the destination in this filesystem\n");
+			printf("With compressed the file is stored compressed and decompressed as it is read\n");
 		} else if (strcmp(args[1], "cpout") == 0) {
 			printf("Usage: cpout <source> <destination>\n");
 			printf("Copies a file from the current filesystem to another filesystem\n");
+		} else if (strcmp(args[1], "iostat") == 0) {
+			printf("Usage: iostat [reset]\n");
+			printf("Shows, for each kind of block layer call, the number of calls, blocks\n");
+			printf("	transferred, average and worst latency and a latency histogram\n");
+			printf("	(calls under each power of two microseconds).\n");
+			printf("With reset the counters are zeroed after they are shown.\n");
+		} else if (strcmp(args[1], "snapshot") == 0) {
+			printf("Usage: snapshot [list | restore <n> | delete <n>]\n");
+			printf("Takes a snapshot of the volume. The data blocks it holds are kept as they\n");
+			printf("	are while the files change, and a block of the inodes or the bit vector\n");
+			printf("	is copied aside only when it is first changed after the snapshot.\n");
+			printf("	list shows the snapshots, restore rolls the volume back to one and\n");
+			printf("	delete frees the blocks only it was holding.\n");
 		} else {
 			printf("Unknown command.\n");
 			printf("Type help or help <function> for more information\n");
@@ -230,10 +278,19 @@ void run_help(int numArgs, char** args) {
 }
 
 void run_format(int numArgs, char** args) {
-	if (numArgs > 1) {
-		printf("Unknown arguments\n");
-		printf("Usage: format\n");
-		return;
+	uint32_t flags = LBAisMapped() ? 0 : FORMAT_JOURNAL;
+	for (int i = 1; i < numArgs; i++) {
+		if (strcmp(args[i], "checksums") == 0) {
+			flags |= FORMAT_CHECKSUMS;
+		} else if (strcmp(args[i], "dedup") == 0) {
+			flags |= FORMAT_DEDUP;
+		} else if (strcmp(args[i], "nojournal") == 0) {
+			flags &= ~FORMAT_JOURNAL;
+		} else {
+			printf("Unknown arguments\n");
+			printf("Usage: format [checksums] [dedup] [nojournal]\n");
+			return;
+		}
 	}
 
 	char answer;
@@ -243,7 +300,7 @@ void run_format(int numArgs, char** args) {
 	scanf(" %c", &answer);
 	flushInput();
 	if (answer == 'y' || answer == 'Y') {
-		retvalue = fs_format();
+		retvalue = fs_formatWith(flags);
 	} else {
 		printf("Canceled format\n");
 		return;
@@ -377,17 +434,17 @@ void run_del(int numArgs, char** args) {
 }
 
 void run_cpin(int numArgs, char** args) {
-	if (numArgs > 3) {
+	if (numArgs > 4 || (numArgs == 4 && strcmp(args[3], "compressed") != 0)) {
 		printf("Unknown arguments\n");
-		printf("Usage: cpin <source> <desintation>\n");
+		printf("Usage: cpin <source> <desintation> [compressed]\n");
 		return;
 	} else if (numArgs < 3) {
 		printf("Missing arguments\n");
-		printf("Usage: cpin <source> <desintation>\n");
+		printf("Usage: cpin <source> <desintation> [compressed]\n");
 		return;
 	}
 
-	int retvalue = fs_cpin(args[1], args[2]);
+	int retvalue = fs_cpinWith(args[1], args[2], numArgs == 4 ? INODE_COMPRESSED : 0);
 
 	if (retvalue == -1) {
 		printf("Could not copy file %s to %s\n", args[1], args[2]);
@@ -416,6 +473,71 @@ void run_cpout(int numArgs, char** args) {
 	}
 }
 
+void run_iostat(int numArgs, char** args) {
+	if (numArgs > 2 || (numArgs == 2 && strcmp(args[1], "reset") != 0)) {
+		printf("Unknown arguments\n");
+		printf("Usage: iostat [reset]\n");
+		return;
+	}
+
+	partitionStats_t stats;
+	LBAgetStats(&stats);
+	printf("%-8s %10s %12s %10s %10s  %s\n", "call", "count", "blocks", "avg us", "max us",
+		"latency histogram (<us:count)");
+	for (int op = 0; op < PART_STAT_OPS; op++) {
+		partitionOpStats_p stat = &stats.op[op];
+		if (stat->calls == 0)
+			continue;
+
+		printf("%-8s %10llu %12llu %10.1f %10.1f ", LBAstatName(op), (ull_t)stat->calls,
+			(ull_t)stat->blocks, stat->totalNs / 1000.0 / stat->calls, stat->maxNs / 1000.0);
+		for (int i = 0; i < PART_STAT_BUCKETS; i++) {
+			if (stat->latency[i] == 0)
+				continue;
+			if (i == PART_STAT_BUCKETS - 1)
+				printf(" >=%llu:%llu", 1ULL << i, (ull_t)stat->latency[i]);
+			else
+				printf(" <%llu:%llu", 2ULL << i, (ull_t)stat->latency[i]);
+		}
+		printf("\n");
+	}
+	if (stats.checksumErrors > 0)
+		printf("checksum errors: %llu\n", (ull_t)stats.checksumErrors);
+
+	if (numArgs == 2) {
+		LBAresetStats();
+		printf("Counters reset\n");
+	}
+}
+
+void run_snapshot(int numArgs, char** args) {
+	if (numArgs == 1) {
+		int snapshot = fs_snapshot();
+		if (snapshot == -1)
+			printf("Could not take a snapshot\n");
+		else
+			printf("Took snapshot %d\n", snapshot);
+		return;
+	}
+	if (numArgs == 2 && strcmp(args[1], "list") == 0) {
+		fs_snapshotList();
+		return;
+	}
+	if (numArgs != 3 || (strcmp(args[1], "restore") != 0 && strcmp(args[1], "delete") != 0)) {
+		printf("Unknown arguments\n");
+		printf("Usage: snapshot [list | restore <n> | delete <n>]\n");
+		return;
+	}
+
+	int snapshot = atoi(args[2]);
+	if (strcmp(args[1], "restore") == 0) {
+		if (fs_snapshotRestore(snapshot) == -1)
+			printf("Could not restore snapshot %d\n", snapshot);
+	} else if (fs_snapshotDelete(snapshot) == -1) {
+		printf("There is no snapshot %d\n", snapshot);
+	}
+}
+
 /* flushes the input buffer */
 void flushInput() {
     char c;
@@ -0,0 +1,132 @@
+/*
+ * The free block counts the allocator keeps per chunk of the bit vector,
+ * which let it pass over full chunks without looking at their words. After
+ * blocks are allocated, freed, held by a snapshot, kept back until the
+ * journal commits their release and then settled, every chunk must count
+ * exactly the blocks its words show available, and again after a remount
+ * rebuilds the counts, with and without the journal. The bit vector must
+ * also know which of its blocks changed: flipping bits marks just the
+ * blocks that hold them, writing it back clears the marks, no operation
+ * leaves any behind, and what was written is what the next mount reads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "FileSystem.h"
+#include "fsJournal.h"
+#include "testUtil.h"
+
+#define FIRST_FILE 10
+#define FILES 24
+
+static char* volumePath;
+
+extern uint8_t * bitVector;		//Not in FileSystem.h, only the tests look at it from outside
+
+/** Empties every other file, from the first or the second on */
+static void emptyFiles(uint64_t from) {
+	char none = 0;
+	for (uint64_t inodeID = FIRST_FILE + from; inodeID < FIRST_FILE + FILES; inodeID += 2)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+}
+
+static void testCounts(uint32_t flags) {
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(flags) == 0);
+	CHECK(checkAllocator() == 0);
+
+	/* Allocated, then freed, which the journal keeps back until it commits */
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		CHECK(testWriteVersion(inodeID, 0, false) == 0);
+	CHECK(checkAllocator() == 0);
+	emptyFiles(0);
+	CHECK(checkAllocator() == 0);
+
+	/* Held by a snapshot once the files that had them let go */
+	int snapshot = fs_snapshot();
+	CHECK(snapshot >= 0);
+	CHECK(checkAllocator() == 0);
+	emptyFiles(1);
+	CHECK(checkAllocator() == 0);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		CHECK(testWriteVersion(inodeID, 1, false) == 0);
+	CHECK(checkAllocator() == 0);
+
+	/* Settled once the releases commit, and free again when the snapshot goes */
+	usleep(JOURNAL_COMMIT_MS * 2000);
+	emptyFiles(0);
+	CHECK(checkAllocator() == 0);
+	CHECK(fs_snapshotDelete(snapshot) == 0);
+	CHECK(checkAllocator() == 0);
+	testCheckBlocks(FIRST_FILE, FILES);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(checkAllocator() == 0);
+	emptyFiles(1);
+	CHECK(checkAllocator() == 0);
+	testCloseVolume();
+	unlink(volumePath);
+}
+
+static void testDirty() {
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(0) == 0);
+	CHECK(bitVectorDirtyBlocks() == 0);
+	uint64_t first = 0;
+	while (bitVector[first / 8] & (3 << (first % 8)))
+		first += 2;
+	uint64_t last = sb->totalDataBlocks - 1;
+	CHECK(last / 8 / TEST_BLOCK_SIZE > first / 8 / TEST_BLOCK_SIZE);
+
+	/* Bits in the same block mark it once, a bit in another block marks that one */
+	setBitOn(first);
+	CHECK(bitVectorDirtyBlocks() == 1);
+	setBitOn(first + 1);
+	CHECK(bitVectorDirtyBlocks() == 1);
+	setBitOn(last);
+	CHECK(bitVectorDirtyBlocks() == 2);
+	CHECK(writeBitVector() == 0);
+	CHECK(bitVectorDirtyBlocks() == 0);
+	setBitOff(first + 1);
+	CHECK(bitVectorDirtyBlocks() == 1);
+	CHECK(writeBitVector() == 0);
+	CHECK(bitVectorDirtyBlocks() == 0);
+
+	/* Writing and freeing files leaves nothing unwritten */
+	char none = 0;
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		CHECK(testWriteVersion(inodeID, 0, false) == 0);
+	CHECK(bitVectorDirtyBlocks() == 0);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+	CHECK(bitVectorDirtyBlocks() == 0);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(bitVector[first / 8] & (1 << (first % 8)));
+	CHECK(!(bitVector[first / 8] & (2 << (first % 8))));
+	CHECK(bitVector[last / 8] & (1 << (last % 8)));
+	CHECK(checkAllocator() == 0);
+	testCloseVolume();
+	unlink(volumePath);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: testAllocator <volume file>\n");
+		return EXIT_FAILURE;
+	}
+	volumePath = argv[1];
+	testCounts(0);
+	testCounts(FORMAT_JOURNAL);
+	testDirty();
+
+	printf("testAllocator: %d failed\n", testFailures);
+	return testFailures != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
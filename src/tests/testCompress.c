@@ -0,0 +1,172 @@
+/*
+ * Compressed files. Data that compresses must come back as written while
+ * taking fewer blocks than it would raw, data that does not must come back
+ * stored as it is, and a file ending part way into a cluster, or a block,
+ * must too, whole or read in part, before and after a remount. A cluster
+ * whose stored bytes were damaged on the volume must fail the read rather
+ * than hand back whatever the decoder made of it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "FileSystem.h"
+#include "testUtil.h"
+
+#define COMPRESSIBLE 10
+#define INCOMPRESSIBLE 11
+#define PARTIAL 12
+#define CLUSTER_BYTES (COMPRESS_CLUSTER_BLOCKS * TEST_BLOCK_SIZE)
+#define FILE_BYTES (3 * CLUSTER_BYTES)
+#define PARTIAL_BYTES (2 * CLUSTER_BYTES + 3 * TEST_BLOCK_SIZE + 100)
+
+static char* volumePath;
+
+/** Returns length bytes of data to free, repetitive text if compressible, noise if not */
+static char* fileData(uint64_t inodeID, uint64_t length, bool compressible) {
+	char* data = malloc(length);
+	uint32_t state = inodeID;
+	for (uint64_t i = 0; i < length; i++) {
+		state = state * 1103515245 + 12345;
+		data[i] = compressible ? "log line of a compressible file\n"[i % 32] + (i / 4096) : state >> 16;
+	}
+	return data;
+}
+
+/** Returns the number of blocks the file has stored, checking they are all marked used */
+static uint64_t storedBlocks(uint64_t inodeID) {
+	Inode inode;
+	CHECK(readInode(inodeID, &inode) == 0 && (inode.flags & INODE_COMPRESSED));
+	uint64_t slots = (inode.size + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE;
+	uint64_t* lbas = malloc(slots * sizeof(uint64_t));
+	uint64_t stored = 0;
+	CHECK(mapFileBlocks(&inode, 0, slots, lbas) == 0);
+	for (uint64_t i = 0; i < slots; i++)
+		stored += lbas[i] != NO_BLOCK;
+	free(lbas);
+	testCheckBlocks(inodeID, 1);
+	return stored;
+}
+
+/** Checks the file reads back as data, whole and cut short inside a cluster and a block */
+static void checkFile(uint64_t inodeID, const char* data, uint64_t length) {
+	char* read = malloc(length);
+	CHECK(readFile(read, inodeID, 0) == length);
+	CHECK(memcmp(read, data, length) == 0);
+	uint64_t cut = CLUSTER_BYTES + TEST_BLOCK_SIZE / 2;
+	memset(read, 0, length);
+	CHECK(readFile(read, inodeID, cut) == cut);
+	CHECK(memcmp(read, data, cut) == 0);
+	free(read);
+}
+
+static void testRoundTrip(uint32_t flags) {
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(flags) == 0);
+	uint64_t baseline = sb->usedBlocks;
+	char* compressible = fileData(COMPRESSIBLE, FILE_BYTES, true);
+	char* incompressible = fileData(INCOMPRESSIBLE, FILE_BYTES, false);
+	char* partial = fileData(PARTIAL, PARTIAL_BYTES, true);
+
+	CHECK(setFileCompression(COMPRESSIBLE, true) == 0);
+	CHECK(setFileCompression(INCOMPRESSIBLE, true) == 0);
+	CHECK(setFileCompression(PARTIAL, true) == 0);
+	CHECK(writeFile(COMPRESSIBLE, compressible, FILE_BYTES) == 0);
+	CHECK(writeFile(INCOMPRESSIBLE, incompressible, FILE_BYTES) == 0);
+	CHECK(writeFile(PARTIAL, partial, PARTIAL_BYTES) == 0);
+	checkFile(COMPRESSIBLE, compressible, FILE_BYTES);
+	checkFile(INCOMPRESSIBLE, incompressible, FILE_BYTES);
+	checkFile(PARTIAL, partial, PARTIAL_BYTES);
+	testCloseVolume();
+
+	/* Off the volume, with nothing left in the cache */
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	checkFile(COMPRESSIBLE, compressible, FILE_BYTES);
+	checkFile(INCOMPRESSIBLE, incompressible, FILE_BYTES);
+	checkFile(PARTIAL, partial, PARTIAL_BYTES);
+	uint64_t compressed = storedBlocks(COMPRESSIBLE);
+	CHECK(compressed < FILE_BYTES / TEST_BLOCK_SIZE / 2);
+	CHECK(storedBlocks(INCOMPRESSIBLE) == FILE_BYTES / TEST_BLOCK_SIZE);
+	CHECK(storedBlocks(PARTIAL) < PARTIAL_BYTES / TEST_BLOCK_SIZE);
+
+	/* Turning compression off stores the same data raw */
+	CHECK(setFileCompression(COMPRESSIBLE, false) == 0);
+	checkFile(COMPRESSIBLE, compressible, FILE_BYTES);
+	CHECK(setFileCompression(COMPRESSIBLE, true) == 0);
+	CHECK(storedBlocks(COMPRESSIBLE) == compressed);
+	checkFile(COMPRESSIBLE, compressible, FILE_BYTES);
+
+	char none = 0;
+	CHECK(writeFile(COMPRESSIBLE, &none, 0) == 0);
+	CHECK(writeFile(INCOMPRESSIBLE, &none, 0) == 0);
+	CHECK(writeFile(PARTIAL, &none, 0) == 0);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(sb->usedBlocks == baseline);
+	testCloseVolume();
+	unlink(volumePath);
+	free(compressible);
+	free(incompressible);
+	free(partial);
+}
+
+static void testCorrupt() {
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(0) == 0);
+	char* data = fileData(COMPRESSIBLE, FILE_BYTES, true);
+	CHECK(setFileCompression(COMPRESSIBLE, true) == 0);
+	CHECK(writeFile(COMPRESSIBLE, data, FILE_BYTES) == 0);
+	testCloseVolume();
+
+	/* Damage the compressed stream of the second cluster behind the filesystem's back */
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	Inode inode;
+	uint64_t lbas[COMPRESS_CLUSTER_BLOCKS];
+	CHECK(readInode(COMPRESSIBLE, &inode) == 0);
+	CHECK(mapFileBlocks(&inode, COMPRESS_CLUSTER_BLOCKS, COMPRESS_CLUSTER_BLOCKS, lbas) == 0);
+	CHECK(lbas[0] != NO_BLOCK && lbas[COMPRESS_CLUSTER_BLOCKS - 1] == NO_BLOCK);
+	char* block = LBAallocBuffer(1);
+	CHECK(LBAread(block, 1, lbas[0]) == 1);
+	memset(block + sizeof(uint32_t), 0xFF, TEST_BLOCK_SIZE - sizeof(uint32_t));
+	CHECK(LBAwrite(block, 1, lbas[0]) == 1);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	char* read = malloc(FILE_BYTES);
+	CHECK(readFile(read, COMPRESSIBLE, 0) == 0);
+	CHECK(readFile(read, COMPRESSIBLE, CLUSTER_BYTES) == CLUSTER_BYTES);
+	CHECK(memcmp(read, data, CLUSTER_BYTES) == 0);
+
+	/* Too long a stream for its blocks is caught before it is decoded */
+	CHECK(LBAread(block, 1, lbas[0]) == 1);
+	memset(block, 0xFF, sizeof(uint32_t));
+	CHECK(LBAwrite(block, 1, lbas[0]) == 1);
+	CHECK(readFile(read, COMPRESSIBLE, 0) == 0);
+	testCloseVolume();
+	unlink(volumePath);
+	LBAfreeBuffer(block, 1);
+	free(read);
+	free(data);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: testCompress <volume file>\n");
+		return EXIT_FAILURE;
+	}
+	volumePath = argv[1];
+	testRoundTrip(0);
+	testRoundTrip(FORMAT_JOURNAL);
+	testCorrupt();
+
+	printf("testCompress: %d failed\n", testFailures);
+	return testFailures != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
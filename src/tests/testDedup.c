@@ -0,0 +1,91 @@
+/*
+ * Deduplication with the journal (FORMAT_DEDUP | FORMAT_JOURNAL): a writer
+ * rewriting files made of shared blocks is killed mid-write again and
+ * again. After every crash each file must hold one whole version, however
+ * many other files its blocks were shared with. A file rewritten with its
+ * own contents must keep them past the commit that settles its old blocks,
+ * and once every file is emptied the volume must be back to the blocks it
+ * started with, so no reference count was lost or left behind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "FileSystem.h"
+#include "fsJournal.h"
+#include "testUtil.h"
+
+#define FIRST_FILE 10
+#define FILES 24
+#define ROUNDS 8
+
+static char* volumePath;
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: testDedup <volume file>\n");
+		return EXIT_FAILURE;
+	}
+	volumePath = argv[1];
+	unlink(volumePath);
+
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(FORMAT_DEDUP | FORMAT_JOURNAL) == 0);
+	uint64_t baseline = sb->usedBlocks;
+	uint64_t written = 0;
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++) {
+		uint64_t length;
+		free(testVersion(inodeID, 0, true, &length));
+		written += (length + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE;
+		CHECK(testWriteVersion(inodeID, 0, true) == 0);
+	}
+	/* Between their first and last blocks the files only hold TEST_SHARED_POOL different blocks */
+	CHECK(sb->usedBlocks - baseline <= 2 * FILES + TEST_SHARED_POOL);
+	CHECK(sb->usedBlocks - baseline < written);
+	testCloseVolume();
+
+	for (int round = 0; round < ROUNDS; round++) {
+		testKillVersions(volumePath, FIRST_FILE, FILES, (round + 1) * 1000, true, 50 + round * 50);
+		testOpenVolume(volumePath);
+		CHECK(check_fs() == 1);
+		for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+			CHECK(testReadVersion(-1, inodeID) >= 0);
+		CHECK(sb->usedBlocks + sb->freeBlocks == sb->totalDataBlocks);
+		testCloseVolume();
+	}
+
+	/* Rewriting some owners of a shared block must leave it to the others */
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	int64_t newest = 0;
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++) {
+		int64_t version = testReadVersion(-1, inodeID);
+		newest = version > newest ? version : newest;
+	}
+	CHECK(newest > ROUNDS * 1000);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID += 2)
+		CHECK(testWriteVersion(inodeID, 100000, true) == 0);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		CHECK(testReadVersion(-1, inodeID) >= 0);
+	/* Rewritten with what it held, a file must not get back blocks whose release is not committed */
+	CHECK(testWriteVersion(FIRST_FILE, 7, false) == 0);
+	CHECK(testWriteVersion(FIRST_FILE, 7, false) == 0);
+	usleep(JOURNAL_COMMIT_MS * 2000);
+	CHECK(testWriteVersion(FIRST_FILE + 1, 7, false) == 0);
+	CHECK(testReadVersion(-1, FIRST_FILE) == 7);
+
+	char none = 0;
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+	CHECK(sb->usedBlocks == baseline);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(sb->usedBlocks == baseline);
+	testCloseVolume();
+	unlink(volumePath);
+
+	printf("testDedup: %d failed\n", testFailures);
+	return testFailures != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
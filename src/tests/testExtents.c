@@ -0,0 +1,159 @@
+/*
+ * Extent mapped files, with and without the journal. A file written where
+ * there is room for it is one run of blocks, even past a shorter hole, and
+ * fits its inode. Once small files fill the volume and every other one is
+ * emptied no run is long enough, so a file written into the holes needs
+ * more extents than the inode holds and grows a tree of node blocks. Either
+ * way it must read back as written, map the same blocks whole or in parts,
+ * keep its tree across a remount, and give every block back when emptied.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "FileSystem.h"
+#include "testUtil.h"
+
+#define BIG_FILE 10
+#define BIG_BLOCKS 100
+#define FIRST_SMALL 100
+#define SMALL_BLOCKS 4
+
+static char* volumePath;
+static uint64_t smalls;		//Small files written to fill the volume
+
+/** Returns BIG_BLOCKS blocks of data to free, different for every seed */
+static char* bigData(int seed) {
+	char* data = malloc(BIG_BLOCKS * TEST_BLOCK_SIZE);
+	for (uint64_t i = 0; i < BIG_BLOCKS * TEST_BLOCK_SIZE; i++)
+		data[i] = i * 31 + seed;
+	return data;
+}
+
+/** Writes a file of SMALL_BLOCKS blocks filled with its inode number */
+static int writeSmall(uint64_t inodeID) {
+	char data[SMALL_BLOCKS * TEST_BLOCK_SIZE];
+	memset(data, (char) inodeID, sizeof(data));
+	return writeFile(inodeID, data, sizeof(data));
+}
+
+/** Returns whether the file holds what writeSmall wrote to it */
+static bool readSmall(uint64_t inodeID) {
+	char data[SMALL_BLOCKS * TEST_BLOCK_SIZE];
+	char expected[SMALL_BLOCKS * TEST_BLOCK_SIZE];
+	memset(expected, (char) inodeID, sizeof(expected));
+	return readFile(data, inodeID, 0) == sizeof(data) && memcmp(data, expected, sizeof(data)) == 0;
+}
+
+/** Checks the big file reads back as data and maps the same blocks whole or in parts, returns its runs */
+static uint64_t checkBigFile(const char* data) {
+	char* read = malloc(BIG_BLOCKS * TEST_BLOCK_SIZE);
+	CHECK(readFile(read, BIG_FILE, 0) == BIG_BLOCKS * TEST_BLOCK_SIZE);
+	CHECK(memcmp(read, data, BIG_BLOCKS * TEST_BLOCK_SIZE) == 0);
+	free(read);
+
+	Inode inode;
+	CHECK(readInode(BIG_FILE, &inode) == 0);
+	CHECK(inode.flags & INODE_EXTENTS);
+	uint64_t lbas[BIG_BLOCKS];
+	uint64_t part[BIG_BLOCKS];
+	CHECK(mapFileBlocks(&inode, 0, BIG_BLOCKS, lbas) == 0);
+	for (uint64_t first = 0; first < BIG_BLOCKS; first += 13) {
+		uint64_t count = first + 20 < BIG_BLOCKS ? 20 : BIG_BLOCKS - first;
+		CHECK(mapFileBlocks(&inode, first, count, part) == 0);
+		CHECK(memcmp(part, &lbas[first], count * sizeof(uint64_t)) == 0);
+	}
+	uint64_t runs = 1;
+	for (uint64_t i = 0; i < BIG_BLOCKS; i++) {
+		CHECK(lbas[i] >= sb->rootDataPointer && lbas[i] - sb->rootDataPointer < sb->totalDataBlocks);
+		if (i > 0 && lbas[i] != lbas[i - 1] + 1)
+			runs++;
+	}
+	testCheckBlocks(BIG_FILE, 1);
+	return runs;
+}
+
+static void testExtents(uint32_t flags) {
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(flags) == 0);
+	CHECK(sb->inodeBytes == INODE_BYTES);
+	uint64_t baseline = sb->usedBlocks;
+
+	/* With room for it the file is one run, past a hole too short to hold it */
+	char none = 0;
+	CHECK(writeSmall(FIRST_SMALL) == 0 && writeSmall(FIRST_SMALL + 1) == 0);
+	CHECK(writeFile(FIRST_SMALL, &none, 0) == 0);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	char* data = bigData(1);
+	CHECK(writeFile(BIG_FILE, data, BIG_BLOCKS * TEST_BLOCK_SIZE) == 0);
+	CHECK(checkBigFile(data) == 1);
+	Inode inode;
+	CHECK(readInode(BIG_FILE, &inode) == 0);
+	CHECK(inode.extentHeader.depth == 0 && inode.extentHeader.count == 1);
+	CHECK(inode.extents[0].fileBlock == 0 && inode.extents[0].length == BIG_BLOCKS);
+	CHECK(sb->usedBlocks == baseline + BIG_BLOCKS + SMALL_BLOCKS);
+	CHECK(writeFile(BIG_FILE, &none, 0) == 0);
+	CHECK(writeFile(FIRST_SMALL + 1, &none, 0) == 0);
+	free(data);
+	testCloseVolume();
+
+	/* Fill the volume and empty every other small file, leaving holes too short for the big one */
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(sb->usedBlocks == baseline);
+	for (smalls = 0; sb->freeBlocks >= SMALL_BLOCKS; smalls++)
+		CHECK(writeSmall(FIRST_SMALL + smalls) == 0);
+	CHECK(smalls * SMALL_BLOCKS > 2 * BIG_BLOCKS);
+	for (uint64_t inodeID = FIRST_SMALL; inodeID < FIRST_SMALL + smalls; inodeID += 2)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	data = bigData(2);
+	CHECK(writeFile(BIG_FILE, data, BIG_BLOCKS * TEST_BLOCK_SIZE) == 0);
+	CHECK(checkBigFile(data) >= BIG_BLOCKS / SMALL_BLOCKS);
+	CHECK(readInode(BIG_FILE, &inode) == 0);
+	CHECK(inode.extentHeader.depth >= 1);
+	CHECK(inode.extentHeader.count <= EXTENT_ROOT_ENTRIES);
+	for (uint64_t inodeID = FIRST_SMALL; inodeID < FIRST_SMALL + smalls; inodeID++)
+		CHECK(readSmall(inodeID) == (inodeID % 2 == 1));
+	testCloseVolume();
+
+	/* The tree comes back from the volume as it went */
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(checkBigFile(data) > EXTENT_ROOT_ENTRIES);
+	for (uint64_t inodeID = FIRST_SMALL + 1; inodeID < FIRST_SMALL + smalls; inodeID += 2)
+		CHECK(readSmall(inodeID));
+	testCheckBlocks(FIRST_SMALL, smalls);
+	CHECK(writeFile(BIG_FILE, &none, 0) == 0);
+	for (uint64_t inodeID = FIRST_SMALL; inodeID < FIRST_SMALL + smalls; inodeID++)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+	free(data);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(sb->usedBlocks == baseline);
+	testCloseVolume();
+	unlink(volumePath);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: testExtents <volume file>\n");
+		return EXIT_FAILURE;
+	}
+	volumePath = argv[1];
+	testExtents(0);
+	testExtents(FORMAT_JOURNAL);
+
+	printf("testExtents: %d failed\n", testFailures);
+	return testFailures != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
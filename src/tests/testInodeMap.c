@@ -0,0 +1,145 @@
+/*
+ * The inode bitmap. Every inode findFreeInode hands out must be the first
+ * free one from where the name hashes to on, wrapping past the end and
+ * never inode 0, checked against a plain scan of the inodes claimed so far.
+ * Threads claiming inodes for the same name at once must each get their
+ * own, and a file opened but never written gives its inode back on close.
+ * The bitmap is rebuilt from the inode table on every mount and snapshot
+ * restore and must agree with it, until every inode is used and
+ * findFreeInode has none left to give.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "FileSystem.h"
+#include "testUtil.h"
+
+#define THREADS 4
+#define THREAD_CLAIMS 50
+
+static char* volumePath;
+static bool* claimed;
+static uint64_t threadClaims[THREADS][THREAD_CLAIMS];
+
+/** Returns the inode findFreeInode should give for name, 0 if all are claimed */
+static uint64_t expectedInode(char* name) {
+	uint64_t start = hashInode(name, 0);
+	for (uint64_t i = 0; i < sb->numInodes; i++) {
+		uint64_t inodeID = (start + i) % sb->numInodes;
+		if (inodeID != 0 && !claimed[inodeID])
+			return inodeID;
+	}
+	return 0;
+}
+
+/** Claims inodes with findFreeInode and empty files until count are used, returns the next name */
+static int claimInodes(int next, uint64_t count) {
+	char none = 0;
+	char name[MAX_NAME_SIZE];
+	while (sb->usedInodes < count) {
+		snprintf(name, sizeof(name), "file%d", next++);
+		uint64_t expected = expectedInode(name);
+		uint64_t inodeID = findFreeInode(name, 0);
+		CHECK(inodeID == expected);
+		if (inodeID == 0 || inodeID != expected)
+			break;
+		Inode inode;
+		CHECK(readInode(inodeID, &inode) == 0 && inode.used == UNUSED_FLAG);
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+		claimed[inodeID] = true;
+	}
+	return next;
+}
+
+/** Claims THREAD_CLAIMS inodes for the same name as every other thread, writing a file to each */
+static void* claimMain(void* arg) {
+	uint64_t* claims = arg;
+	char none = 0;
+	for (int i = 0; i < THREAD_CLAIMS; i++) {
+		claims[i] = findFreeInode("same", 0);
+		if (claims[i] != 0)
+			writeFile(claims[i], &none, 0);
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: testInodeMap <volume file>\n");
+		return EXIT_FAILURE;
+	}
+	volumePath = argv[1];
+	unlink(volumePath);
+
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(FORMAT_JOURNAL) == 0);
+	uint64_t numInodes = sb->numInodes;
+	claimed = calloc(numInodes, sizeof(bool));
+	CHECK(sb->usedInodes == 1);
+	pthread_t threads[THREADS];
+	for (int t = 0; t < THREADS; t++)
+		pthread_create(&threads[t], NULL, claimMain, threadClaims[t]);
+	for (int t = 0; t < THREADS; t++)
+		pthread_join(threads[t], NULL);
+	for (int t = 0; t < THREADS; t++) {
+		for (int i = 0; i < THREAD_CLAIMS; i++) {
+			uint64_t inodeID = threadClaims[t][i];
+			CHECK(inodeID != 0 && inodeID < numInodes && !claimed[inodeID]);
+			if (inodeID != 0 && inodeID < numInodes)
+				claimed[inodeID] = true;
+		}
+	}
+	CHECK(sb->usedInodes == 1 + THREADS * THREAD_CLAIMS);
+
+	/* Two opens of a new file must not share an inode, and neither keeps it unwritten */
+	int first = myfsOpen("opened");
+	int second = myfsOpen("opened");
+	CHECK(first >= 0 && second >= 0);
+	CHECK(openFileList[first].inodeId != openFileList[second].inodeId);
+	CHECK(myfsClose(first) == 0 && myfsClose(second) == 0);
+	int next = claimInodes(0, numInodes / 3);
+	CHECK(sb->usedInodes == numInodes / 3);
+	testCloseVolume();
+
+	/* Rebuilt from the table on mount */
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(sb->usedInodes == numInodes / 3);
+	int snapshot = fs_snapshot();
+	CHECK(snapshot >= 0);
+	bool* before = malloc(numInodes * sizeof(bool));
+	memcpy(before, claimed, numInodes * sizeof(bool));
+	next = claimInodes(next, 2 * numInodes / 3);
+
+	/* And on restore, which gives back the inodes claimed since the snapshot */
+	CHECK(fs_snapshotRestore(snapshot) == 0);
+	CHECK(sb->usedInodes == numInodes / 3);
+	memcpy(claimed, before, numInodes * sizeof(bool));
+	CHECK(fs_snapshotDelete(snapshot) == 0);
+	next = claimInodes(next, 2 * numInodes / 3);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(sb->usedInodes == 2 * numInodes / 3);
+	next = claimInodes(next, numInodes);
+	CHECK(sb->usedInodes == numInodes);
+	CHECK(findFreeInode("full", 0) == 0);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	CHECK(sb->usedInodes == numInodes);
+	CHECK(findFreeInode("full", 0) == 0);
+	testCloseVolume();
+	unlink(volumePath);
+	free(before);
+	free(claimed);
+
+	printf("testInodeMap: %d failed\n", testFailures);
+	return testFailures != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,215 @@
+/*
+ * Crash and replay of the metadata journal, with and without checksums.
+ * Operations that completed before a commit must come back after a crash,
+ * from the journal since nothing has been checkpointed yet, and the ones
+ * after it must be either whole or not there at all. Then a writer is
+ * killed mid-write again and again, and every time the volume must mount
+ * with every file holding one whole version on blocks the bit vector has
+ * as used, and the block counters adding up, until emptying every file
+ * leaves the blocks format left. A snapshot restore that rewrites more
+ * inode blocks than the log holds is committed outside it, and must come
+ * back whole from there after a crash. A memory-mapped partition, which the
+ * journal cannot see, must refuse one and run a journaled volume with it
+ * inactive, freeing blocks as it goes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include "FileSystem.h"
+#include "fsJournal.h"
+#include "testUtil.h"
+
+#define FIRST_FILE 10
+#define FILES 24
+#define ROUNDS 6
+#define OVERFLOW_MARGIN 16		//Inode blocks past the size of the log a restore rewrites
+
+static char* volumePath;
+
+/**
+ * Writes version 1 of every file, commits it with version 2 of the first,
+ * then crashes with more uncommitted. Nothing is checkpointed meanwhile, so
+ * whatever was committed is left for the replay.
+ */
+static void commitThenCrash(void* arg) {
+	(void) arg;
+	testOpenVolume(volumePath);
+	if (check_fs() == 0)
+		return;
+	journalHoldCheckpoints(true);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		testWriteVersion(inodeID, 1, false);
+	/* Once the transaction is due, the end of the next operation commits it */
+	usleep(JOURNAL_COMMIT_MS * 2000);
+	testWriteVersion(FIRST_FILE, 2, false);
+	for (uint64_t inodeID = FIRST_FILE + 1; inodeID < FIRST_FILE + FILES; inodeID++)
+		testWriteVersion(inodeID, 3, false);
+	kill(getpid(), SIGKILL);
+}
+
+static void testReplay(uint32_t flags) {
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(flags) == 0);
+	uint64_t baseline = sb->usedBlocks;
+	testCloseVolume();
+
+	testKillWriter(commitThenCrash, NULL, 1000);
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	JournalStats stats;
+	journalGetStats(&stats);
+	CHECK(stats.replayed > 0);
+	CHECK(testReadVersion(-1, FIRST_FILE) == 2);
+	for (uint64_t inodeID = FIRST_FILE + 1; inodeID < FIRST_FILE + FILES; inodeID++) {
+		int64_t version = testReadVersion(-1, inodeID);
+		CHECK(version == 1 || version == 3);
+	}
+	testCheckBlocks(FIRST_FILE, FILES);
+	CHECK(sb->usedBlocks + sb->freeBlocks == sb->totalDataBlocks);
+	testCloseVolume();
+
+	for (int round = 0; round < ROUNDS; round++) {
+		testKillVersions(volumePath, FIRST_FILE, FILES, (round + 1) * 1000, false, 50 + round * 60);
+		testOpenVolume(volumePath);
+		CHECK(check_fs() == 1);
+		for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+			CHECK(testReadVersion(-1, inodeID) >= 0);
+		testCheckBlocks(FIRST_FILE, FILES);
+		CHECK(sb->usedBlocks + sb->freeBlocks == sb->totalDataBlocks);
+		testCloseVolume();
+	}
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	char none = 0;
+	for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+	CHECK(sb->usedBlocks == baseline);
+	testCloseVolume();
+	unlink(volumePath);
+}
+
+/** Restores the snapshot, a transaction too big for the log, and crashes before it is checkpointed */
+static void restoreThenCrash(void* arg) {
+	testOpenVolume(volumePath);
+	if (check_fs() == 0)
+		return;
+	journalHoldCheckpoints(true);
+	if (fs_snapshotRestore(*(int*) arg) == 0)
+		kill(getpid(), SIGKILL);
+}
+
+/** Writes an empty file to one inode in each of more inode blocks than the log has, returns how many */
+static uint64_t spreadFiles() {
+	char none = 0;
+	uint64_t files = 0;
+	for (uint64_t block = 1; block <= sb->journalBlocks + OVERFLOW_MARGIN; block++) {
+		uint64_t inodeID = block * (TEST_BLOCK_SIZE / INODE_BYTES);
+		CHECK(inodeID < sb->numInodes && writeFile(inodeID, &none, 0) == 0);
+		files++;
+	}
+	return files;
+}
+
+/** Returns how many of the files spreadFiles writes are in use */
+static uint64_t spreadFilesUsed(uint64_t files) {
+	uint64_t used = 0;
+	for (uint64_t block = 1; block <= files; block++) {
+		Inode inode;
+		CHECK(readInode(block * (TEST_BLOCK_SIZE / INODE_BYTES), &inode) == 0);
+		if (inode.used != UNUSED_FLAG)
+			used++;
+	}
+	return used;
+}
+
+static void testOverflow() {
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(FORMAT_JOURNAL) == 0);
+	uint64_t usedInodes = sb->usedInodes;
+	int snapshot = fs_snapshot();
+	CHECK(snapshot >= 0);
+	testCloseVolume();
+
+	/* Committed outside the log, the restore comes back from there after a crash */
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	uint64_t files = spreadFiles();
+	testCloseVolume();
+	testKillWriter(restoreThenCrash, &snapshot, 1000);
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	JournalStats stats;
+	journalGetStats(&stats);
+	CHECK(stats.replayed > 0);
+	CHECK(spreadFilesUsed(files) == 0);
+	CHECK(sb->usedInodes == usedInodes);
+
+	/* And without one it is checkpointed before the restore returns */
+	files = spreadFiles();
+	CHECK(fs_snapshotRestore(snapshot) == 0);
+	journalGetStats(&stats);
+	CHECK(stats.overflows > 0);
+	CHECK(stats.replayed > 0);
+	CHECK(sb->usedInodes == usedInodes);
+	testCloseVolume();
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	journalGetStats(&stats);
+	CHECK(stats.replayed == 0);
+	CHECK(spreadFilesUsed(files) == 0);
+	CHECK(sb->usedInodes == usedInodes);
+	CHECK(fs_snapshotDelete(snapshot) == 0);
+	testCloseVolume();
+	unlink(volumePath);
+}
+
+static void testMapped() {
+	unlink(volumePath);
+	testOpenVolumeWith(volumePath, true);
+	CHECK(LBAisMapped() == 1);
+	CHECK(fs_formatWith(FORMAT_JOURNAL) == -1);
+	CHECK(fs_format() == 0);
+	CHECK(sb->journalBlocks == 0);
+	testCloseVolume();
+
+	/* Whatever a journaled volume left in its journal is replayed before it goes inactive */
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(FORMAT_JOURNAL) == 0);
+	uint64_t baseline = sb->usedBlocks;
+	testCloseVolume();
+	testKillWriter(commitThenCrash, NULL, 1000);
+	testOpenVolumeWith(volumePath, true);
+	CHECK(check_fs() == 1);
+	CHECK(!journalEnabled());
+	CHECK(testReadVersion(-1, FIRST_FILE) == 2);
+	char none = 0;
+	for (int round = 0; round < 2; round++) {
+		for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+			CHECK(testWriteVersion(inodeID, 4 + round, false) == 0);
+		for (uint64_t inodeID = FIRST_FILE; inodeID < FIRST_FILE + FILES; inodeID++)
+			CHECK(writeFile(inodeID, &none, 0) == 0);
+		CHECK(sb->usedBlocks == baseline);
+	}
+	testCloseVolume();
+	unlink(volumePath);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: testJournal <volume file>\n");
+		return EXIT_FAILURE;
+	}
+	volumePath = argv[1];
+	testReplay(FORMAT_JOURNAL);
+	testReplay(FORMAT_JOURNAL | FORMAT_CHECKSUMS);
+	testOverflow();
+	testMapped();
+
+	printf("testJournal: %d failed\n", testFailures);
+	return testFailures != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+/*
+ * Snapshot round trip, with and without deduplication: a snapshot costs no
+ * used blocks when taken, keeps showing the files as they were while they
+ * are rewritten, emptied and joined by new ones, across a remount and a
+ * writer killed mid-write, and restoring it brings them all back. Deleting
+ * it and emptying every file leaves the volume with the blocks format left.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "FileSystem.h"
+#include "testUtil.h"
+
+#define FIRST_FILE 10
+#define FILES 16
+#define NEW_FILE (FIRST_FILE + FILES)	//First of the files created after the snapshot
+#define NEW_FILES 4
+
+static char* volumePath;
+
+/** Checks that the snapshot still shows every file at version 0 and none of the new ones */
+static void checkSnapshot(int snapshot) {
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE; inodeID++)
+		CHECK(testReadVersion(snapshot, inodeID) == 0);
+	for (uint64_t inodeID = NEW_FILE; inodeID < NEW_FILE + NEW_FILES; inodeID++)
+		CHECK(testReadVersion(snapshot, inodeID) == TEST_EMPTY);
+}
+
+static void testRoundTrip(uint32_t flags) {
+	bool shared = (flags & FORMAT_DEDUP) != 0;
+	unlink(volumePath);
+	testOpenVolume(volumePath);
+	CHECK(fs_formatWith(flags) == 0);
+	uint64_t baseline = sb->usedBlocks;
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE; inodeID++)
+		CHECK(testWriteVersion(inodeID, 0, shared) == 0);
+	uint64_t used = sb->usedBlocks;
+	int snapshot = fs_snapshot();
+	CHECK(snapshot >= 0);
+	CHECK(sb->usedBlocks == used);
+
+	/* Rewrite half the files, empty a quarter and add new ones */
+	char none = 0;
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE; inodeID += 2)
+		CHECK(testWriteVersion(inodeID, 1, shared) == 0);
+	for (uint64_t inodeID = FIRST_FILE + 1; inodeID < NEW_FILE; inodeID += 4)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+	for (uint64_t inodeID = NEW_FILE; inodeID < NEW_FILE + NEW_FILES; inodeID++)
+		CHECK(testWriteVersion(inodeID, 1, shared) == 0);
+	checkSnapshot(snapshot);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE; inodeID++)
+		CHECK(testReadVersion(-1, inodeID) == (inodeID % 2 == 0 ? 1 : (inodeID - FIRST_FILE) % 4 == 1 ? TEST_EMPTY : 0));
+	testCloseVolume();
+
+	/* Copies made before a crash must be as safe as the writes they were made for */
+	testKillVersions(volumePath, FIRST_FILE, FILES + NEW_FILES, 1000, shared, 300);
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	checkSnapshot(snapshot);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE + NEW_FILES; inodeID++)
+		CHECK(testReadVersion(-1, inodeID) != TEST_TORN);
+	CHECK(fs_snapshotRestore(snapshot) == 0);
+	checkSnapshot(snapshot);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE; inodeID++)
+		CHECK(testReadVersion(-1, inodeID) == 0);
+	for (uint64_t inodeID = NEW_FILE; inodeID < NEW_FILE + NEW_FILES; inodeID++)
+		CHECK(testReadVersion(-1, inodeID) == TEST_EMPTY);
+	CHECK(sb->usedBlocks == used);
+	testCloseVolume();
+
+	testOpenVolume(volumePath);
+	CHECK(check_fs() == 1);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE; inodeID++)
+		CHECK(testReadVersion(-1, inodeID) == 0);
+	CHECK(fs_snapshotDelete(snapshot) == 0);
+	CHECK(fs_snapshotDelete(snapshot) == -1);
+	for (uint64_t inodeID = FIRST_FILE; inodeID < NEW_FILE; inodeID++)
+		CHECK(writeFile(inodeID, &none, 0) == 0);
+	CHECK(sb->usedBlocks == baseline);
+	testCloseVolume();
+	unlink(volumePath);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: testSnapshot <volume file>\n");
+		return EXIT_FAILURE;
+	}
+	volumePath = argv[1];
+	testRoundTrip(FORMAT_JOURNAL);
+	testRoundTrip(FORMAT_JOURNAL | FORMAT_DEDUP);
+	testRoundTrip(FORMAT_JOURNAL | FORMAT_CHECKSUMS);
+
+	printf("testSnapshot: %d failed\n", testFailures);
+	return testFailures != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
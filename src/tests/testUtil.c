@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "FileSystem.h"
+#include "fsCache.h"
+#include "testUtil.h"
+
+int testFailures = 0;
+
+extern uint8_t * bitVector;		//Not in FileSystem.h, only the tests look at it from outside
+
+/* What testVersion puts at the front of every version */
+typedef struct VersionHeader {
+	uint64_t inodeID;
+	int64_t version;
+	uint64_t shared;
+} VersionHeader;
+
+/* What testKillVersions hands the writer it kills */
+typedef struct VersionWriter {
+	const char* path;
+	uint64_t firstID;
+	uint64_t files;
+	int64_t first;
+	bool shared;
+} VersionWriter;
+
+void testCheck(bool passed, const char* condition, const char* file, int line) {
+	if (passed)
+		return;
+	printf("FAILED %s:%d: %s\n", file, line, condition);
+	testFailures++;
+}
+
+void testOpenVolume(const char* path) {
+	testOpenVolumeWith(path, false);
+}
+
+void testOpenVolumeWith(const char* path, bool mapped) {
+	uint64_t volumeSize = (uint64_t) TEST_VOLUME_BLOCKS * TEST_BLOCK_SIZE;
+	uint64_t blockSize = TEST_BLOCK_SIZE;
+	partitionOptions_t options;
+	defaultPartitionOptions(&options);
+	options.mapped = mapped;
+	if (startPartitionSystemEx((char*) path, &volumeSize, &blockSize, &options) != 0 ||
+			cacheInit(TEST_CACHE_BLOCKS) != 0) {
+		printf("Error: opening partition %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void testCloseVolume() {
+	closePartitionSystem();
+}
+
+/** Returns the next number of a linear congruential sequence */
+static uint32_t nextRandom(uint32_t* state) {
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+char* testVersion(uint64_t inodeID, int64_t version, bool shared, uint64_t* length) {
+	uint32_t state = inodeID * 7919 + version * 104729 + shared;
+	*length = sizeof(VersionHeader) + nextRandom(&state) % (TEST_MAX_BLOCKS * TEST_BLOCK_SIZE - sizeof(VersionHeader));
+	char* data = malloc(*length);
+	VersionHeader header = { inodeID, version, shared };
+	memcpy(data, &header, sizeof(VersionHeader));
+	for (uint64_t i = sizeof(VersionHeader); i < *length; i++) {
+		/* A shared block is the same wherever it is used */
+		if (shared && i % TEST_BLOCK_SIZE == 0)
+			state = nextRandom(&state) % TEST_SHARED_POOL;
+		data[i] = nextRandom(&state);
+	}
+	return data;
+}
+
+int testWriteVersion(uint64_t inodeID, int64_t version, bool shared) {
+	uint64_t length;
+	char* data = testVersion(inodeID, version, shared, &length);
+	int retVal = writeFile(inodeID, data, length);
+	free(data);
+	return retVal;
+}
+
+int64_t testReadVersion(int snapshot, uint64_t inodeID) {
+	char* data = malloc((TEST_MAX_BLOCKS + 1) * TEST_BLOCK_SIZE);
+	uint64_t length = snapshot < 0 ? readFile(data, inodeID, 0) : readSnapshotFile(snapshot, data, inodeID, 0);
+	if (length == 0 || length > TEST_MAX_BLOCKS * TEST_BLOCK_SIZE) {
+		free(data);
+		return length == 0 ? TEST_EMPTY : TEST_TORN;
+	}
+
+	int64_t version = TEST_TORN;
+	VersionHeader header;
+	memcpy(&header, data, sizeof(VersionHeader));
+	if (length >= sizeof(VersionHeader) && header.inodeID == inodeID && header.version >= 0) {
+		uint64_t expectedLength;
+		char* expected = testVersion(inodeID, header.version, header.shared != 0, &expectedLength);
+		if (length == expectedLength && memcmp(data, expected, length) == 0)
+			version = header.version;
+		free(expected);
+	}
+	free(data);
+	return version;
+}
+
+void testCheckBlocks(uint64_t firstID, uint64_t count) {
+	for (uint64_t inodeID = firstID; inodeID < firstID + count; inodeID++) {
+		Inode inode;
+		if (readInode(inodeID, &inode) != 0 || inode.used == UNUSED_FLAG || inode.size == 0)
+			continue;
+		uint64_t blocks = (inode.size + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE;
+		uint64_t* lbas = malloc(blocks * sizeof(uint64_t));
+		CHECK(mapFileBlocks(&inode, 0, blocks, lbas) == 0);
+		for (uint64_t i = 0; i < blocks; i++) {
+			if (lbas[i] == NO_BLOCK)
+				continue;
+			uint64_t block = lbas[i] - sb->rootDataPointer;
+			CHECK(block < sb->totalDataBlocks && (bitVector[block / 8] & (1 << (block % 8))));
+		}
+		free(lbas);
+	}
+}
+
+void testKillWriter(void (*writer)(void* arg), void* arg, int delayMs) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		writer(arg);
+		_exit(0);
+	}
+	usleep(delayMs * 1000);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/** Rewrites the files from the first version on, until it is killed */
+static void writeVersions(void* arg) {
+	VersionWriter* writer = arg;
+	testOpenVolume(writer->path);
+	if (check_fs() == 0)
+		return;
+	for (int64_t version = writer->first; ; version++) {
+		testWriteVersion(writer->firstID + version % writer->files, version, writer->shared);
+		/* Let commits fall due now and then, so the kill lands on both sides of one */
+		if (version % 8 == 0)
+			usleep(20000);
+	}
+}
+
+void testKillVersions(const char* path, uint64_t firstID, uint64_t files, int64_t first, bool shared, int delayMs) {
+	VersionWriter writer = { path, firstID, files, first, shared };
+	testKillWriter(writeVersions, &writer, delayMs);
+}
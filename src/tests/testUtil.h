@@ -0,0 +1,85 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Helpers shared by the test programs 'make test' runs. Each program is
+ * given the path of a scratch volume it may create, format and delete, and
+ * exits with a nonzero status if any CHECK failed. Files are written in
+ * numbered versions that say in their first bytes which file and version
+ * they are, so a test can tell a whole version from a torn one after a
+ * crash without knowing which version was last written.
+ */
+
+#define TEST_VOLUME_BLOCKS 12000
+#define TEST_BLOCK_SIZE 512
+#define TEST_CACHE_BLOCKS 64
+#define TEST_MAX_BLOCKS 40			//Largest version testVersion writes, in blocks
+#define TEST_SHARED_POOL 8			//Distinct blocks the shared versions are made of
+#define TEST_EMPTY -1				//testReadVersion of an empty or unused file
+#define TEST_TORN -2				//testReadVersion of a file that holds no whole version
+
+extern int testFailures;
+
+/** Counts and reports a failed check, with where it was */
+#define CHECK(condition) testCheck((condition), #condition, __FILE__, __LINE__)
+
+void testCheck(bool passed, const char* condition, const char* file, int line);
+
+/** Opens the volume at path, creating it if needed, with a block cache. Exits if it cannot. */
+void testOpenVolume(const char* path);
+
+/** Same as testOpenVolume, memory-mapping the volume if mapped is set, which leaves out the cache */
+void testOpenVolumeWith(const char* path, bool mapped);
+
+/** Closes the volume opened by testOpenVolume, writing everything back */
+void testCloseVolume();
+
+/**
+ * Returns the contents of a version of a file in a buffer to free, and sets
+ * length to its size. With shared set every block but the first is drawn
+ * from TEST_SHARED_POOL blocks, so files and versions have whole blocks in
+ * common for deduplication to find.
+ */
+char* testVersion(uint64_t inodeID, int64_t version, bool shared, uint64_t* length);
+
+/**
+ * Writes a version of a file with writeFile.
+ * Returns 0 if successful
+ * Returns -1 if unsuccessful
+ */
+int testWriteVersion(uint64_t inodeID, int64_t version, bool shared);
+
+/**
+ * Reads a file, live or as snapshot saw it (snapshot -1 for live), and
+ * checks that it holds one whole version written by testVersion.
+ * Returns the version
+ * Returns TEST_EMPTY if the file is empty or unused
+ * Returns TEST_TORN if it holds anything else
+ */
+int64_t testReadVersion(int snapshot, uint64_t inodeID);
+
+/**
+ * Checks that every data block files firstID to firstID + count - 1 map is
+ * marked used in the bit vector, so none can be handed out from under them.
+ */
+void testCheckBlocks(uint64_t firstID, uint64_t count);
+
+/**
+ * Runs writer in a child process and kills it with SIGKILL delayMs
+ * milliseconds later, the way a crash would stop it: nothing is written
+ * back or closed. Called with no volume open.
+ */
+void testKillWriter(void (*writer)(void* arg), void* arg, int delayMs);
+
+/**
+ * Kills a writer with testKillWriter after delayMs milliseconds that opens
+ * the volume at path and rewrites files firstID to firstID + files - 1 in
+ * turn with testWriteVersion, from version first on, pausing now and then
+ * so the kill lands on both sides of a commit.
+ */
+void testKillVersions(const char* path, uint64_t firstID, uint64_t files, int64_t first, bool shared, int delayMs);
+
+#endif